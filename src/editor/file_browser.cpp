@@ -3,12 +3,17 @@
 #include <imgui.h>
 #include <imgui/misc/cpp/imgui_stdlib.h>
 
+#include "extension/fmt.hpp"
 #include "general/umap.hpp"
 #include "extension/imgui_extra.hpp"
 #include "extension/icons/font_awesome4.h"
 #include "renderer/assets/model.hpp"
 #include "renderer/assets/texture.hpp"
 #include "renderer/assets/material.hpp"
+#include "renderer/assets/mesh.hpp"
+#include "renderer/assets/asset_pack.hpp"
+#include "renderer/asset_streamer.hpp"
+#include "renderer/worker_pool.hpp"
 
 namespace spellbook {
 
@@ -32,6 +37,21 @@ void file_browser(const string& window_name, bool* p_open, FilePath* out) {
                 popup_open = true;
             }
         }
+        if (Directory::path_filter()(path)) {
+            if (ImGui::Selectable("Build Pack")) {
+                vector<FilePath> asset_paths;
+                for (auto& entry : fs::recursive_directory_iterator(path.abs_path())) {
+                    FilePath entry_path = FilePath(entry.path());
+                    if (entry_path.extension() == MeshCPU::extension() || entry_path.extension() == TextureCPU::extension())
+                        asset_paths.push_back(entry_path);
+                }
+                write_pack(asset_paths, FilePath(path.abs_string() + string(pack_extension)));
+            }
+        }
+        if (path.extension() == pack_extension) {
+            if (ImGui::Selectable("Benchmark Pack"))
+                benchmark_pack(path);
+        }
     };
 
     // Header
@@ -61,11 +81,17 @@ void file_browser(const string& window_name, bool* p_open, FilePath* out) {
     }
 
     if (ImGui::BeginPopupModal("Convert Model Asset")) {
+        // Shared with the conversion running on the worker pool
+        struct ConvertTask {
+            ConvertProgress   progress;
+            std::atomic<bool> done = false;
+        };
         struct ModelConvertInfo {
             FilePath input;
             FilePath folder_path;
             string name;
             bool y_up = true;
+            std::shared_ptr<ConvertTask> task;
         };
         static umap<string, ModelConvertInfo> model_convert_map;
 
@@ -82,10 +108,25 @@ void file_browser(const string& window_name, bool* p_open, FilePath* out) {
         ImGui::PathSelect<Directory>("Output folder", &model_convert_map[window_name].folder_path);
         ImGui::InputText("Output name", &model_convert_map[window_name].name);
         ImGui::Checkbox("Y-Up", &model_convert_map[window_name].y_up);
-        if (ImGui::Button("Convert")) {
-            auto& convert_info = model_convert_map[window_name];
-            save_resource(convert_to_model(convert_info.input, convert_info.folder_path, convert_info.name, convert_info.y_up));
-            ImGui::CloseCurrentPopup();
+        auto& convert_info = model_convert_map[window_name];
+        if (convert_info.task) {
+            uint32 completed = convert_info.task->progress.completed;
+            uint32 total     = convert_info.task->progress.total;
+            ImGui::ProgressBar(total == 0 ? 0.0f : float(completed) / float(total), ImVec2(-FLT_MIN, 0), fmt_("{} / {}", completed, total).c_str());
+            if (convert_info.task->done) {
+                convert_info.task = {};
+                ImGui::CloseCurrentPopup();
+            }
+        } else if (ImGui::Button("Convert")) {
+            convert_info.task = std::make_shared<ConvertTask>();
+            get_worker_pool().enqueue([info = convert_info]() {
+                ModelCPU model_cpu = convert_to_model(info.input, info.folder_path, info.name, info.y_up, &info.task->progress);
+                {
+                    std::scoped_lock lock(get_asset_io_mutex());
+                    save_resource(model_cpu);
+                }
+                info.task->done = true;
+            });
         }
         ImGui::EndPopup();
     }
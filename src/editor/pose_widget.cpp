@@ -58,8 +58,7 @@ void _translation_widget(const WidgetSystem::Mouse3DInfo& mouse, PoseWidgetState
 
         }
     
-        auto line_mesh = generate_formatted_line(viewport.camera, std::move(vertices));
-        settings.render_scene.quick_mesh(line_mesh, true, settings.widget);
+        settings.render_scene.debug_draw.line(vertices);
     }
 
     // Planes
@@ -119,8 +118,7 @@ void _translation_widget(const WidgetSystem::Mouse3DInfo& mouse, PoseWidgetState
         vertices.emplace_back(math::apply_transform(state->model, p3), color, settings.line_radius);
         vertices.emplace_back(math::apply_transform(state->model, p4), color, settings.line_radius);
         vertices.emplace_back(math::apply_transform(state->model, p1), color, settings.line_radius);
-        auto line_mesh = generate_formatted_line(viewport.camera, std::move(vertices));
-        settings.render_scene.quick_mesh(line_mesh, true, settings.widget);
+        settings.render_scene.debug_draw.line(vertices);
     }
 }
 void _rotation_widget(const WidgetSystem::Mouse3DInfo& mouse, PoseWidgetState* state, const PoseWidgetSettings& settings) {
@@ -171,8 +169,7 @@ void _rotation_widget(const WidgetSystem::Mouse3DInfo& mouse, PoseWidgetState* s
             vertices.emplace_back(math::apply_transform(state->model, pos), color, i == 0 || i == 48 ? 0.0f : dot_cutoff_warning * settings.line_radius);
         }
     
-        auto line_mesh = generate_formatted_line(viewport.camera, std::move(vertices));
-        settings.render_scene.quick_mesh(line_mesh, true, settings.widget);
+        settings.render_scene.debug_draw.line(vertices);
     }
 
     if (state->enabled & (0b1 << Operation_RotateCamera) && dot_aligned_warning > 0.0f) {
@@ -188,8 +185,7 @@ void _rotation_widget(const WidgetSystem::Mouse3DInfo& mouse, PoseWidgetState* s
             vertices.emplace_back(math::apply_transform(state->model, pos), color, dot_aligned_warning * settings.line_radius);
         }
         
-        auto line_mesh = generate_formatted_line(viewport.camera, std::move(vertices));
-        settings.render_scene.quick_mesh(line_mesh, true, settings.widget);
+        settings.render_scene.debug_draw.line(vertices);
     }
 }
 
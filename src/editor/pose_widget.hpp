@@ -62,7 +62,6 @@ struct PoseWidgetSettings {
     float color_axis = 1.0f;
 
     uint32 disabled = 0;
-    bool widget = true;
 };
 
 bool pose_widget(uint64 id, v3* location, quat* rotation, const PoseWidgetSettings& settings, m44* model = nullptr, PoseWidgetState* widget_state = nullptr);
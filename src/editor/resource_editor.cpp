@@ -3,6 +3,8 @@
 #include <imgui/imgui.h>
 #include <imgui/misc/cpp/imgui_stdlib.h>
 
+#include "extension/fmt.hpp"
+#include "extension/fmt_geometry.hpp"
 #include "extension/imgui_extra.hpp"
 #include "extension/icons/font_awesome4.h"
 #include "general/input.hpp"
@@ -50,8 +52,8 @@ void ResourceEditor::shutdown() {
 }
 
 void ResourceEditor::update() {
-    if (Input::mouse_click[GLFW_MOUSE_BUTTON_LEFT]) {
-        scene->render_scene.query = v2i(Input::mouse_pos) - scene->render_scene.viewport.start;
+    if (Input::mouse_click[GLFW_MOUSE_BUTTON_LEFT] && scene->render_scene.viewport.hovered) {
+        picked = scene->render_scene.pick(v2i(Input::mouse_pos));
     }
 
     scene->update();
@@ -61,6 +63,7 @@ void ResourceEditor::update() {
 void ResourceEditor::switch_tab(Tab new_tab) {
     auto& render_scene = scene->render_scene;
     scene->registry.clear();
+    picked = {};
     
     switch (current_tab) {
         case (Tab_Model): {
@@ -119,6 +122,9 @@ void ResourceEditor::info_window(bool* p_open) {
             ImGui::EndTabBar();
         }
 
+        if (picked.renderable != nullptr)
+            ImGui::Text(fmt_("Picked: id {}, triangle {}, at {}", picked.selection_id, picked.triangle, picked.position).c_str());
+
         ImGui::SetNextItemOpen(true, ImGuiCond_Once);
         if (ImGui::TreeNode("Scene")) {
             if (ImGui::TreeNode("Camera")) {
@@ -5,6 +5,7 @@
 #include "renderer/assets/model.hpp"
 #include "renderer/assets/material.hpp"
 #include "renderer/assets/mesh.hpp"
+#include "renderer/render_scene.hpp"
 
 
 namespace spellbook {
@@ -27,6 +28,7 @@ struct ResourceEditor : EditorScene {
     string current_exe;
 
     CameraController controller;
+    PickResult       picked;
 
     void setup() override;
     void update() override;
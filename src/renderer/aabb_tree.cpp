@@ -0,0 +1,350 @@
+#include "aabb_tree.hpp"
+
+#include <chrono>
+#include <random>
+#include <tracy/Tracy.hpp>
+
+#include "extension/fmt.hpp"
+#include "general/logger.hpp"
+#include "general/math/math.hpp"
+
+namespace spellbook {
+
+static BVHBounds merged(const BVHBounds& lhs, const BVHBounds& rhs) {
+    BVHBounds bounds = lhs;
+    bounds.extend(rhs);
+    return bounds;
+}
+
+static bool contains(const BVHBounds& outer, const BVHBounds& inner) {
+    for (int axis = 0; axis < 3; axis++) {
+        if (inner.low[axis] < outer.low[axis] || inner.high[axis] > outer.high[axis])
+            return false;
+    }
+    return true;
+}
+
+bool box_overlaps(const BVHBounds& lhs, const BVHBounds& rhs) {
+    for (int axis = 0; axis < 3; axis++) {
+        if (lhs.high[axis] < rhs.low[axis] || rhs.high[axis] < lhs.low[axis])
+            return false;
+    }
+    return true;
+}
+
+bool sphere_overlaps(const v4& sphere, const BVHBounds& box) {
+    float distance_squared = 0.0f;
+    for (int axis = 0; axis < 3; axis++) {
+        float closest = math::clamp(sphere[axis], box.low[axis], box.high[axis]);
+        distance_squared += (sphere[axis] - closest) * (sphere[axis] - closest);
+    }
+    return distance_squared <= sphere.w * sphere.w;
+}
+
+bool frustum_overlaps(const Frustum& frustum, const BVHBounds& box) {
+    for (uint32 i = 0; i < frustum.plane_count; i++) {
+        const v4& plane = frustum.planes[i];
+        // The corner furthest along the plane's normal, if that's outside the whole box is
+        v3 corner = v3(
+            plane.x >= 0.0f ? box.high.x : box.low.x,
+            plane.y >= 0.0f ? box.high.y : box.low.y,
+            plane.z >= 0.0f ? box.high.z : box.low.z
+        );
+        if (plane.x * corner.x + plane.y * corner.y + plane.z * corner.z + plane.w < 0.0f)
+            return false;
+    }
+    return true;
+}
+
+uint32 AABBTree::allocate_node() {
+    if (free_node == null_node) {
+        nodes.push_back({});
+        return nodes.size() - 1;
+    }
+    uint32 node = free_node;
+    free_node   = nodes[node].parent;
+    nodes[node] = {};
+    return node;
+}
+
+void AABBTree::free_node_at(uint32 node) {
+    nodes[node]        = {};
+    nodes[node].parent = free_node;
+    nodes[node].height = -1;
+    free_node          = node;
+}
+
+uint32 AABBTree::insert(const BVHBounds& bounds, void* user_data) {
+    uint32 leaf = allocate_node();
+    nodes[leaf].bounds.low  = bounds.low - v3(margin);
+    nodes[leaf].bounds.high = bounds.high + v3(margin);
+    nodes[leaf].user_data   = user_data;
+    insert_leaf(leaf);
+    leaf_count++;
+    return leaf;
+}
+
+void AABBTree::remove(uint32 proxy) {
+    assert_else(proxy < nodes.size() && nodes[proxy].leaf() && nodes[proxy].height == 0)
+        return;
+    remove_leaf(proxy);
+    free_node_at(proxy);
+    leaf_count--;
+}
+
+bool AABBTree::move(uint32 proxy, const BVHBounds& bounds) {
+    if (contains(nodes[proxy].bounds, bounds))
+        return false;
+    remove_leaf(proxy);
+    nodes[proxy].bounds.low  = bounds.low - v3(margin);
+    nodes[proxy].bounds.high = bounds.high + v3(margin);
+    insert_leaf(proxy);
+    return true;
+}
+
+void AABBTree::clear() {
+    nodes.clear();
+    root       = null_node;
+    free_node  = null_node;
+    leaf_count = 0;
+}
+
+float AABBTree::area_ratio() const {
+    if (root == null_node)
+        return 0.0f;
+    float total = 0.0f;
+    for (const Node& node : nodes) {
+        if (node.height > 0)
+            total += node.bounds.area();
+    }
+    float root_area = nodes[root].bounds.area();
+    return root_area > 0.0f ? total / root_area : 0.0f;
+}
+
+void AABBTree::insert_leaf(uint32 leaf) {
+    if (root == null_node) {
+        root                = leaf;
+        nodes[root].parent  = null_node;
+        return;
+    }
+
+    // Walk down towards the sibling that costs the least surface area, counting what every ancestor grows by
+    const BVHBounds& leaf_bounds = nodes[leaf].bounds;
+    uint32 index = root;
+    while (!nodes[index].leaf()) {
+        const Node& node     = nodes[index];
+        float       area     = node.bounds.area();
+        float       combined = merged(node.bounds, leaf_bounds).area();
+        // Making a new parent for this node and the leaf
+        float cost_here = 2.0f * combined;
+        // What descending adds to every node above
+        float inherited = 2.0f * (combined - area);
+
+        auto descend_cost = [&](uint32 child) {
+            const BVHBounds& child_bounds = nodes[child].bounds;
+            float grown = merged(child_bounds, leaf_bounds).area();
+            return nodes[child].leaf() ? grown + inherited : grown - child_bounds.area() + inherited;
+        };
+        float cost_left  = descend_cost(node.left);
+        float cost_right = descend_cost(node.right);
+        if (cost_here < cost_left && cost_here < cost_right)
+            break;
+        index = cost_left < cost_right ? node.left : node.right;
+    }
+
+    uint32 sibling    = index;
+    uint32 old_parent = nodes[sibling].parent;
+    uint32 new_parent = allocate_node();
+    nodes[new_parent].parent = old_parent;
+    nodes[new_parent].bounds = merged(nodes[sibling].bounds, nodes[leaf].bounds);
+    nodes[new_parent].height = nodes[sibling].height + 1;
+    nodes[new_parent].left   = sibling;
+    nodes[new_parent].right  = leaf;
+    nodes[sibling].parent    = new_parent;
+    nodes[leaf].parent       = new_parent;
+    if (old_parent == null_node) {
+        root = new_parent;
+    } else if (nodes[old_parent].left == sibling) {
+        nodes[old_parent].left = new_parent;
+    } else {
+        nodes[old_parent].right = new_parent;
+    }
+
+    refit_from(nodes[leaf].parent);
+}
+
+void AABBTree::remove_leaf(uint32 leaf) {
+    if (leaf == root) {
+        root = null_node;
+        return;
+    }
+
+    uint32 parent       = nodes[leaf].parent;
+    uint32 grand_parent = nodes[parent].parent;
+    uint32 sibling      = nodes[parent].left == leaf ? nodes[parent].right : nodes[parent].left;
+    if (grand_parent == null_node) {
+        root                  = sibling;
+        nodes[sibling].parent = null_node;
+        free_node_at(parent);
+        return;
+    }
+
+    // The sibling takes the parent's place
+    if (nodes[grand_parent].left == parent)
+        nodes[grand_parent].left = sibling;
+    else
+        nodes[grand_parent].right = sibling;
+    nodes[sibling].parent = grand_parent;
+    free_node_at(parent);
+    refit_from(grand_parent);
+}
+
+void AABBTree::refit_from(uint32 index) {
+    while (index != null_node) {
+        index = balance(index);
+        Node& node   = nodes[index];
+        node.height  = 1 + math::max(nodes[node.left].height, nodes[node.right].height);
+        node.bounds  = merged(nodes[node.left].bounds, nodes[node.right].bounds);
+        index        = node.parent;
+    }
+}
+
+// Rotates the taller grandchild up when the children's heights differ by more than one, returns the node now in
+// index's place
+uint32 AABBTree::balance(uint32 a) {
+    if (nodes[a].leaf() || nodes[a].height < 2)
+        return a;
+
+    uint32 b = nodes[a].left;
+    uint32 c = nodes[a].right;
+    int32  difference = nodes[c].height - nodes[b].height;
+    if (difference >= -1 && difference <= 1)
+        return a;
+
+    // The taller child moves up into a's place
+    bool   right_taller = difference > 0;
+    uint32 up           = right_taller ? c : b;
+    uint32 other        = right_taller ? b : c;
+    uint32 f            = nodes[up].left;
+    uint32 g            = nodes[up].right;
+
+    nodes[up].left   = a;
+    nodes[up].parent = nodes[a].parent;
+    nodes[a].parent  = up;
+    if (nodes[up].parent == null_node)
+        root = up;
+    else if (nodes[nodes[up].parent].left == a)
+        nodes[nodes[up].parent].left = up;
+    else
+        nodes[nodes[up].parent].right = up;
+
+    // The taller of up's children stays with it, the shorter goes down to a
+    uint32 kept    = nodes[f].height > nodes[g].height ? f : g;
+    uint32 handed  = kept == f ? g : f;
+    nodes[up].right = kept;
+    if (right_taller)
+        nodes[a].right = handed;
+    else
+        nodes[a].left = handed;
+    nodes[handed].parent = a;
+
+    nodes[a].bounds  = merged(nodes[other].bounds, nodes[handed].bounds);
+    nodes[a].height  = 1 + math::max(nodes[other].height, nodes[handed].height);
+    nodes[up].bounds = merged(nodes[a].bounds, nodes[kept].bounds);
+    nodes[up].height = 1 + math::max(nodes[a].height, nodes[kept].height);
+    return up;
+}
+
+void benchmark_aabb_tree(uint32 instance_count) {
+    ZoneScoped;
+    using clock = std::chrono::high_resolution_clock;
+    auto ms_since = [](clock::time_point start) { return std::chrono::duration<float, std::milli>(clock::now() - start).count(); };
+
+    // A world a kilometer across with instances between half a meter and four meters
+    std::mt19937                          rng(1234);
+    std::uniform_real_distribution<float> position(-500.0f, 500.0f);
+    std::uniform_real_distribution<float> size(0.25f, 2.0f);
+    std::uniform_real_distribution<float> jitter(-0.05f, 0.05f);
+
+    vector<BVHBounds> boxes;
+    boxes.resize(instance_count);
+    for (BVHBounds& box : boxes) {
+        v3 center = v3(position(rng), position(rng), position(rng));
+        v3 extent = v3(size(rng), size(rng), size(rng));
+        box.low   = center - extent;
+        box.high  = center + extent;
+    }
+
+    AABBTree         tree;
+    vector<uint32>   proxies;
+    proxies.resize(instance_count);
+    clock::time_point insert_start = clock::now();
+    for (uint32 i = 0; i < instance_count; i++)
+        proxies[i] = tree.insert(boxes[i], (void*) uintptr_t(i + 1));
+    float insert_ms = ms_since(insert_start);
+
+    // Small moves stay inside the fat bounds, every tenth instance teleports
+    uint32            reinserted = 0;
+    clock::time_point move_start = clock::now();
+    for (uint32 i = 0; i < instance_count; i++) {
+        v3 offset = i % 10 == 0 ? v3(position(rng), position(rng), position(rng)) * 0.1f : v3(jitter(rng), jitter(rng), jitter(rng));
+        boxes[i].low  += offset;
+        boxes[i].high += offset;
+        reinserted += tree.move(proxies[i], boxes[i]);
+    }
+    float move_ms = ms_since(move_start);
+
+    constexpr uint32 query_count = 1000;
+    vector<BVHBounds> query_boxes;
+    vector<ray3>      rays;
+    query_boxes.resize(query_count);
+    rays.resize(query_count);
+    for (uint32 i = 0; i < query_count; i++) {
+        v3 center = v3(position(rng), position(rng), position(rng));
+        query_boxes[i].low  = center - v3(10.0f);
+        query_boxes[i].high = center + v3(10.0f);
+        rays[i].origin = v3(position(rng), position(rng), position(rng));
+        rays[i].dir    = math::normalize(v3(position(rng), position(rng), position(rng)));
+    }
+
+    uint64 tree_found = 0;
+    clock::time_point box_start = clock::now();
+    for (const BVHBounds& query_box : query_boxes)
+        tree.query_box(query_box, [&tree_found](void*) { tree_found++; });
+    float box_ms = ms_since(box_start);
+
+    uint64 scan_found = 0;
+    clock::time_point scan_start = clock::now();
+    for (const BVHBounds& query_box : query_boxes) {
+        for (const BVHBounds& box : boxes)
+            scan_found += box_overlaps(query_box, box);
+    }
+    float scan_ms = ms_since(scan_start);
+
+    uint32 ray_hits = 0;
+    clock::time_point ray_start = clock::now();
+    for (const ray3& ray : rays) {
+        float t = 1000.0f;
+        ray_hits += tree.ray_cast(ray, t, [&boxes, &ray](void* user_data, float& closest) {
+            const BVHBounds& box = boxes[uintptr_t(user_data) - 1];
+            v3    inverse_dir    = v3(1.0f / ray.dir.x, 1.0f / ray.dir.y, 1.0f / ray.dir.z);
+            float entry;
+            if (!ray_box(ray.origin, inverse_dir, box.low, box.high, closest, entry) || entry >= closest)
+                return false;
+            closest = entry;
+            return true;
+        });
+    }
+    float ray_ms = ms_since(ray_start);
+
+    // Fat bounds find a superset, the scan is the exact count
+    log(BasicMessage{
+        .str = fmt_("AABB tree benchmark, {} instances: insert {:.2f}ms, move {:.2f}ms ({} reinserted), height {}, "
+                    "{} box queries {:.2f}ms vs {:.2f}ms scanning ({} vs {} found), {} rays {:.2f}ms ({} hit)",
+            instance_count, insert_ms, move_ms, reinserted, tree.height(),
+            query_count, box_ms, scan_ms, tree_found, scan_found, query_count, ray_ms, ray_hits),
+        .group = "renderer.spatial"
+    });
+}
+
+}
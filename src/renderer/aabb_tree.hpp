@@ -0,0 +1,155 @@
+#pragma once
+
+#include "general/vector.hpp"
+#include "general/math/geometry.hpp"
+
+#include "renderer/bvh.hpp"
+#include "renderer/culling.hpp"
+
+namespace spellbook {
+
+// Incrementally updated bounding volume tree. Leaves store fat bounds grown by margin, so an object that moves a
+// little stays inside its leaf and needs no update. Inserts pick the sibling that grows the tree's surface area the
+// least and rotations keep it balanced, so it never needs a full rebuild.
+struct AABBTree {
+    constexpr static uint32 null_node = ~0u;
+    constexpr static uint32 max_stack = 128;
+
+    struct Node {
+        BVHBounds bounds;
+        void*     user_data = nullptr;
+        uint32    parent    = null_node; // Next free node when freed
+        uint32    left      = null_node; // null_node for leaves
+        uint32    right     = null_node;
+        int32     height    = 0;         // 0 for leaves, -1 when freed
+
+        bool leaf() const { return left == null_node; }
+    };
+
+    vector<Node> nodes;
+    uint32       root       = null_node;
+    uint32       free_node  = null_node;
+    uint32       leaf_count = 0;
+    float        margin     = 0.1f;
+
+    // Returns the proxy, which is stable until it's removed
+    uint32 insert(const BVHBounds& bounds, void* user_data);
+    void   remove(uint32 proxy);
+    // Reinserts only when bounds left the fat bounds, returns whether it did
+    bool   move(uint32 proxy, const BVHBounds& bounds);
+    void   clear();
+
+    void*            user_data(uint32 proxy) const { return nodes[proxy].user_data; }
+    const BVHBounds& fat_bounds(uint32 proxy) const { return nodes[proxy].bounds; }
+    int32            height() const { return root == null_node ? 0 : nodes[root].height; }
+    // Total area of the interior nodes over the root's, lower is a tighter tree
+    float            area_ratio() const;
+
+    // visit(user_data) is called for every leaf whose fat bounds pass the test
+    template <typename T> void query_box(const BVHBounds& box, T&& visit) const;
+    template <typename T> void query_sphere(const v4& sphere, T&& visit) const;
+    template <typename T> void query_frustum(const Frustum& frustum, T&& visit) const;
+    // test(user_data, t) returns true and lowers t on a closer hit, leaves are visited nearest first
+    template <typename T> bool ray_cast(const ray3& ray, float& t, T&& test) const;
+
+private:
+    template <typename T, typename V> void query(T&& overlaps, V&& visit) const;
+
+    uint32 allocate_node();
+    void   free_node_at(uint32 node);
+    void   insert_leaf(uint32 leaf);
+    void   remove_leaf(uint32 leaf);
+    uint32 balance(uint32 node);
+    void   refit_from(uint32 node);
+};
+
+bool box_overlaps(const BVHBounds& lhs, const BVHBounds& rhs);
+bool sphere_overlaps(const v4& sphere, const BVHBounds& box);
+bool frustum_overlaps(const Frustum& frustum, const BVHBounds& box);
+
+// Times inserts, moves and queries on instance_count random boxes against scanning them all, and logs the result
+void benchmark_aabb_tree(uint32 instance_count = 100000);
+
+template <typename T, typename V>
+void AABBTree::query(T&& overlaps, V&& visit) const {
+    if (root == null_node)
+        return;
+    uint32 stack[max_stack];
+    uint32 stack_size = 0;
+    stack[stack_size++] = root;
+    while (stack_size > 0) {
+        const Node& node = nodes[stack[--stack_size]];
+        if (!overlaps(node.bounds))
+            continue;
+        if (node.leaf()) {
+            visit(node.user_data);
+        } else {
+            stack[stack_size++] = node.left;
+            stack[stack_size++] = node.right;
+        }
+    }
+}
+
+template <typename T>
+void AABBTree::query_box(const BVHBounds& box, T&& visit) const {
+    query([&box](const BVHBounds& bounds) { return box_overlaps(box, bounds); }, visit);
+}
+
+template <typename T>
+void AABBTree::query_sphere(const v4& sphere, T&& visit) const {
+    query([&sphere](const BVHBounds& bounds) { return sphere_overlaps(sphere, bounds); }, visit);
+}
+
+template <typename T>
+void AABBTree::query_frustum(const Frustum& frustum, T&& visit) const {
+    query([&frustum](const BVHBounds& bounds) { return frustum_overlaps(frustum, bounds); }, visit);
+}
+
+template <typename T>
+bool AABBTree::ray_cast(const ray3& ray, float& t, T&& test) const {
+    if (root == null_node)
+        return false;
+
+    struct Entry {
+        uint32 node;
+        float  t;
+    };
+    v3     inverse_dir = v3(1.0f / ray.dir.x, 1.0f / ray.dir.y, 1.0f / ray.dir.z);
+    Entry  stack[max_stack];
+    uint32 stack_size = 0;
+    bool   hit        = false;
+
+    float root_t;
+    if (!ray_box(ray.origin, inverse_dir, nodes[root].bounds.low, nodes[root].bounds.high, t, root_t))
+        return false;
+    stack[stack_size++] = {root, root_t};
+    while (stack_size > 0) {
+        Entry entry = stack[--stack_size];
+        if (entry.t > t)
+            continue;
+        const Node& node = nodes[entry.node];
+        if (node.leaf()) {
+            hit |= test(node.user_data, t);
+            continue;
+        }
+
+        Entry closer      = {node.left, 0.0f};
+        Entry further     = {node.right, 0.0f};
+        bool  closer_hit  = ray_box(ray.origin, inverse_dir, nodes[closer.node].bounds.low, nodes[closer.node].bounds.high, t, closer.t);
+        bool  further_hit = ray_box(ray.origin, inverse_dir, nodes[further.node].bounds.low, nodes[further.node].bounds.high, t, further.t);
+        if (closer_hit && further_hit && further.t < closer.t) {
+            std::swap(closer, further);
+        } else if (!closer_hit) {
+            std::swap(closer, further);
+            std::swap(closer_hit, further_hit);
+        }
+        // Further is pushed first so closer is popped next
+        if (further_hit)
+            stack[stack_size++] = further;
+        if (closer_hit)
+            stack[stack_size++] = closer;
+    }
+    return hit;
+}
+
+}
@@ -0,0 +1,148 @@
+#include "asset_streamer.hpp"
+
+#include <algorithm>
+#include <tracy/Tracy.hpp>
+
+#include "general/file/resource.hpp"
+
+namespace spellbook {
+
+static bool request_order(const AssetStreamer::Request& lhs, const AssetStreamer::Request& rhs) {
+    if (lhs.priority != rhs.priority)
+        return lhs.priority < rhs.priority;
+    return lhs.sequence > rhs.sequence;
+}
+
+std::mutex& get_asset_io_mutex() {
+    static std::mutex asset_io_mutex;
+    return asset_io_mutex;
+}
+
+void AssetStreamer::request(AssetType type, uint64 id, const FilePath& path, StreamPriority priority, uint32 max_resolution) {
+    {
+        std::scoped_lock lock(mutex);
+        if (threads.empty()) {
+            stopping = false;
+            for (uint32 i = 0; i < thread_count; i++)
+                threads.emplace_back([this] { worker_loop(); });
+        }
+
+        auto pending_it = pending.find(id);
+        if (pending_it != pending.end()) {
+            // Already queued or loading, only a raise in priority matters
+            if (priority <= pending_it->second)
+                return;
+            pending_it->second = priority;
+            for (Request& queued : requests) {
+                if (queued.id == id)
+                    queued.priority = priority;
+            }
+            std::make_heap(requests.begin(), requests.end(), request_order);
+            return;
+        }
+
+        pending[id] = priority;
+        requests.push_back({type, id, path, priority, sequence++, max_resolution});
+        std::push_heap(requests.begin(), requests.end(), request_order);
+    }
+    condition.notify_one();
+}
+
+bool AssetStreamer::is_pending(uint64 id) {
+    std::scoped_lock lock(mutex);
+    return pending.contains(id);
+}
+
+vector<AssetStreamer::Completed> AssetStreamer::take_completed() {
+    std::scoped_lock lock(mutex);
+    vector<Completed> taken = std::move(completed);
+    completed = {};
+    for (const Completed& asset : taken)
+        pending.erase(asset.id);
+    return taken;
+}
+
+void AssetStreamer::shutdown() {
+    {
+        std::scoped_lock lock(mutex);
+        stopping = true;
+    }
+    condition.notify_all();
+    for (std::thread& thread : threads)
+        thread.join();
+
+    threads.clear();
+    requests.clear();
+    completed.clear();
+    pending.clear();
+    packs.clear();
+}
+
+bool AssetStreamer::mount_pack(const FilePath& pack_path) {
+    auto pack = std::make_unique<AssetPack>();
+    if (!pack->open(pack_path))
+        return false;
+    std::scoped_lock lock(mutex);
+    packs.push_back(std::move(pack));
+    return true;
+}
+
+const PackEntry* AssetStreamer::find_packed(uint64 id, const AssetPack** out_pack) {
+    std::scoped_lock lock(mutex);
+    // Later mounts override earlier ones
+    for (auto it = packs.rbegin(); it != packs.rend(); ++it) {
+        if (const PackEntry* entry = (*it)->find(id)) {
+            if (out_pack)
+                *out_pack = it->get();
+            return entry;
+        }
+    }
+    return nullptr;
+}
+
+void AssetStreamer::worker_loop() {
+    while (true) {
+        Request request;
+        {
+            std::unique_lock lock(mutex);
+            condition.wait(lock, [this] { return stopping || !requests.empty(); });
+            if (stopping)
+                return;
+            std::pop_heap(requests.begin(), requests.end(), request_order);
+            request = std::move(requests.back());
+            requests.pop_back();
+        }
+
+        ZoneScopedN("stream_asset");
+        Completed loaded = {.id = request.id};
+        const AssetPack* pack = nullptr;
+        if (const PackEntry* entry = find_packed(request.id, &pack)) {
+            if (entry->codec == PackCodec_None)
+                loaded.asset = PackedAsset{pack, entry};
+            else if (entry->type == PackAssetType_Mesh)
+                loaded.asset = load_packed_mesh(*pack, *entry);
+            else
+                loaded.asset = load_packed_texture(*pack, *entry);
+        } else switch (request.type) {
+            case AssetType_Mesh: {
+                MeshCPU mesh_cpu = load_mesh(request.path);
+                // Meshes saved before BVHs were baked get theirs here rather than on the main thread in upload_mesh
+                if (mesh_cpu.file_path.is_file() && mesh_cpu.bvh.empty())
+                    mesh_cpu.bvh = bake_mesh_bvh(mesh_cpu);
+                loaded.asset = std::move(mesh_cpu);
+            } break;
+            case AssetType_Material: {
+                std::scoped_lock io_lock(get_asset_io_mutex());
+                loaded.asset = load_resource<MaterialCPU>(request.path);
+            } break;
+            case AssetType_Texture: {
+                loaded.asset = load_texture(request.path, request.max_resolution);
+            } break;
+        }
+
+        std::scoped_lock lock(mutex);
+        completed.push_back(std::move(loaded));
+    }
+}
+
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <memory>
+#include <variant>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "general/umap.hpp"
+#include "general/vector.hpp"
+#include "general/file/file_path.hpp"
+
+#include "assets/mesh.hpp"
+#include "assets/material.hpp"
+#include "assets/texture.hpp"
+#include "assets/asset_pack.hpp"
+
+namespace spellbook {
+
+enum StreamPriority {
+    StreamPriority_Low,
+    StreamPriority_Normal,
+    StreamPriority_High
+};
+
+// Loads and decompresses assets on background threads. Finished assets wait until the main thread uploads them in
+// GPUAssetCache::upload_streamed, so their transfers go through Renderer::enqueue_setup like any other upload.
+struct AssetStreamer {
+    constexpr static uint32 thread_count = 2;
+
+    enum AssetType {
+        AssetType_Mesh,
+        AssetType_Material,
+        AssetType_Texture
+    };
+
+    struct Request {
+        AssetType      type;
+        uint64         id;
+        FilePath       path;
+        StreamPriority priority;
+        uint64         sequence;           // Keeps requests of the same priority in order
+        uint32         max_resolution = 0; // Textures skip larger mips, 0 loads all of them
+    };
+
+    // Uncompressed pack chunk, uploaded straight out of the mapping
+    struct PackedAsset {
+        const AssetPack* pack;
+        const PackEntry* entry;
+    };
+
+    struct Completed {
+        uint64                                                    id;
+        std::variant<MeshCPU, MaterialCPU, TextureCPU, PackedAsset> asset;
+    };
+
+    vector<std::unique_ptr<AssetPack>> packs;
+    vector<std::thread>          threads;
+    vector<Request>              requests; // Heap, highest priority first
+    vector<Completed>            completed;
+    umap<uint64, StreamPriority> pending;  // Requested and not yet handed back
+    uint64                       sequence = 0;
+    bool                         stopping = false;
+    std::mutex                   mutex;
+    std::condition_variable      condition;
+
+    void request(AssetType type, uint64 id, const FilePath& path, StreamPriority priority, uint32 max_resolution = 0);
+    bool is_pending(uint64 id);
+    vector<Completed> take_completed();
+    void shutdown();
+
+    // Packed assets are served from the pack instead of their own files
+    bool             mount_pack(const FilePath& pack_path);
+    const PackEntry* find_packed(uint64 id, const AssetPack** out_pack = nullptr);
+
+private:
+    void worker_loop();
+};
+
+// FileCache isn't thread safe, anything reading assets off the main thread goes through this
+std::mutex& get_asset_io_mutex();
+
+}
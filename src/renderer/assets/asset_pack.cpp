@@ -0,0 +1,397 @@
+#include "asset_pack.hpp"
+
+#include <chrono>
+#include <fstream>
+#include <lz4/lz4.h>
+#include <tracy/Tracy.hpp>
+
+#if defined(_WIN32)
+    #define WIN32_LEAN_AND_MEAN
+    #define NOMINMAX
+    #include <windows.h>
+#else
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+#include "extension/fmt.hpp"
+#include "general/logger.hpp"
+#include "general/math/math.hpp"
+#include "general/file/file_cache.hpp"
+
+#include "renderer/assets/mesh.hpp"
+#include "renderer/assets/texture.hpp"
+#include "renderer/assets/chunked_lz4.hpp"
+
+namespace spellbook {
+
+AssetPack::~AssetPack() {
+    close();
+}
+
+bool AssetPack::open(const FilePath& pack_path) {
+    ZoneScoped;
+    close();
+    file_path = pack_path;
+
+#if defined(_WIN32)
+    file_handle = CreateFileA(pack_path.abs_string().c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file_handle == INVALID_HANDLE_VALUE) {
+        file_handle = nullptr;
+        return false;
+    }
+    LARGE_INTEGER file_size;
+    GetFileSizeEx(file_handle, &file_size);
+    bsize          = file_size.QuadPart;
+    mapping_handle = CreateFileMappingA(file_handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping_handle != nullptr)
+        data = (const uint8*) MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0);
+#else
+    file_descriptor = ::open(pack_path.abs_string().c_str(), O_RDONLY);
+    if (file_descriptor == -1)
+        return false;
+    struct stat file_stat;
+    fstat(file_descriptor, &file_stat);
+    bsize = file_stat.st_size;
+    void* mapping = mmap(nullptr, bsize, PROT_READ, MAP_PRIVATE, file_descriptor, 0);
+    if (mapping != MAP_FAILED)
+        data = (const uint8*) mapping;
+#endif
+
+    assert_else(data != nullptr && bsize >= sizeof(PackHeader)) {
+        close();
+        return false;
+    }
+    const PackHeader& header = *(const PackHeader*) data;
+    PackHeader expected;
+    assert_else(memcmp(header.magic, expected.magic, 4) == 0 && header.version == expected.version &&
+                header.entries_offset <= bsize && header.entry_count <= (bsize - header.entries_offset) / sizeof(PackEntry) &&
+                header.strings_offset <= bsize) {
+        log_error(fmt_("Invalid asset pack \"{}\"", pack_path.abs_string()), "asset.pack");
+        close();
+        return false;
+    }
+
+    // Everything after this trusts the entries, so one that points outside the file rejects the whole pack
+    entries = std::span((const PackEntry*) (data + header.entries_offset), header.entry_count);
+    for (uint32 i = 0; i < entries.size(); i++) {
+        assert_else(valid_entry(entries[i])) {
+            log_error(fmt_("Invalid entry {} in asset pack \"{}\"", i, pack_path.abs_string()), "asset.pack");
+            close();
+            return false;
+        }
+        entry_lookup[entries[i].id] = i;
+    }
+    return true;
+}
+
+bool AssetPack::valid_entry(const PackEntry& entry) const {
+    const PackHeader& header = *(const PackHeader*) data;
+    uint64 strings_bsize = bsize - header.strings_offset;
+    if (entry.offset > bsize || entry.bsize > bsize - entry.offset)
+        return false;
+    if (entry.path_offset > strings_bsize || entry.path_bsize > strings_bsize - entry.path_offset)
+        return false;
+    if (entry.codec > PackCodec_Chunked || (entry.codec == PackCodec_None && entry.raw_bsize != entry.bsize))
+        return false;
+    if (entry.type == PackAssetType_Mesh) {
+        uint64 vertex_bsize = entry.vertex_encoding == VertexEncoding_Packed ? sizeof(PackedVertex) : sizeof(Vertex);
+        uint64 sections[]   = {entry.vertices_bsize, entry.indices_bsize, entry.bvh_nodes_bsize, entry.bvh_primitives_bsize};
+        uint64 total        = 0;
+        for (uint64 section : sections) {
+            if (section > entry.raw_bsize - total)
+                return false;
+            total += section;
+        }
+        return entry.vertex_encoding <= VertexEncoding_Packed && entry.lod_count <= max_mesh_lods && total == entry.raw_bsize &&
+               entry.vertices_bsize % vertex_bsize == 0 && entry.indices_bsize % sizeof(uint32) == 0 &&
+               entry.bvh_nodes_bsize % sizeof(BVHNode) == 0 && entry.bvh_primitives_bsize % sizeof(uint32) == 0;
+    }
+    return entry.type == PackAssetType_Texture;
+}
+
+void AssetPack::close() {
+#if defined(_WIN32)
+    if (data != nullptr)
+        UnmapViewOfFile(data);
+    if (mapping_handle != nullptr)
+        CloseHandle(mapping_handle);
+    if (file_handle != nullptr)
+        CloseHandle(file_handle);
+    file_handle    = nullptr;
+    mapping_handle = nullptr;
+#else
+    if (data != nullptr)
+        munmap((void*) data, bsize);
+    if (file_descriptor != -1)
+        ::close(file_descriptor);
+    file_descriptor = -1;
+#endif
+    data    = nullptr;
+    bsize   = 0;
+    entries = {};
+    entry_lookup.clear();
+}
+
+const PackEntry* AssetPack::find(uint64 id) const {
+    auto it = entry_lookup.find(id);
+    return it != entry_lookup.end() ? &entries[it->second] : nullptr;
+}
+
+std::span<const uint8> AssetPack::chunk(const PackEntry& entry) const {
+    return std::span(data + entry.offset, entry.bsize);
+}
+
+string_view AssetPack::path(const PackEntry& entry) const {
+    const PackHeader& header = *(const PackHeader*) data;
+    return string_view((const char*) data + header.strings_offset + entry.path_offset, entry.path_bsize);
+}
+
+// Returns false if the chunk doesn't decompress to exactly raw_bsize bytes or fails its checksums
+static bool unpack_chunk(const AssetPack& pack, const PackEntry& entry, vector<uint8>& raw) {
+    std::span<const uint8> stored = pack.chunk(entry);
+    raw.resize(entry.raw_bsize);
+    switch (entry.codec) {
+        case PackCodec_None: {
+            memcpy(raw.data(), stored.data(), raw.size());
+        } break;
+        case PackCodec_LZ4: {
+            assert_else(stored.size() <= INT32_MAX && raw.size() <= INT32_MAX &&
+                        LZ4_decompress_safe((const char*) stored.data(), (char*) raw.data(), int32(stored.size()), int32(raw.size())) == int32(raw.size()))
+                return false;
+        } break;
+        case PackCodec_Chunked: {
+            assert_else(chunked_raw_bsize(stored) == raw.size() && chunked_decompress(stored, raw))
+                return false;
+        } break;
+    }
+    return true;
+}
+
+BVH packed_mesh_bvh(const PackEntry& entry, const uint8* raw) {
+    BVH bvh;
+    const uint8* bvh_data = raw + entry.vertices_bsize + entry.indices_bsize;
+    bvh.nodes.rebsize(entry.bvh_nodes_bsize);
+    memcpy(bvh.nodes.data(), bvh_data, entry.bvh_nodes_bsize);
+    bvh.primitives.rebsize(entry.bvh_primitives_bsize);
+    memcpy(bvh.primitives.data(), bvh_data + entry.bvh_nodes_bsize, entry.bvh_primitives_bsize);
+    return bvh;
+}
+
+MeshCPU load_packed_mesh(const AssetPack& pack, const PackEntry& entry) {
+    ZoneScoped;
+    vector<uint8> raw;
+    if (!unpack_chunk(pack, entry, raw)) {
+        log_error(fmt_("Corrupt mesh \"{}\" in asset pack \"{}\"", pack.path(entry), pack.file_path.rel_string()), "asset.pack");
+        return {};
+    }
+
+    MeshCPU mesh_cpu;
+    mesh_cpu.file_path = FilePath(string(pack.path(entry)));
+    mesh_cpu.bounds = {
+        .valid   = entry.bounds_valid != 0,
+        .extents = entry.bounds_extents,
+        .origin  = entry.bounds_origin,
+        .radius  = entry.bounds_radius
+    };
+    mesh_cpu.encoding = entry.vertex_encoding;
+    if (mesh_cpu.encoding == VertexEncoding_Packed) {
+        VertexQuantization  quantization = vertex_quantization(mesh_cpu.bounds);
+        const PackedVertex* packed       = (const PackedVertex*) raw.data();
+        mesh_cpu.vertices.resize(entry.vertices_bsize / sizeof(PackedVertex));
+        for (uint32 i = 0; i < mesh_cpu.vertices.size(); i++)
+            mesh_cpu.vertices[i] = unpack_vertex(packed[i], quantization);
+    } else {
+        mesh_cpu.vertices.rebsize(entry.vertices_bsize);
+        memcpy(mesh_cpu.vertices.data(), raw.data(), entry.vertices_bsize);
+    }
+    mesh_cpu.indices.rebsize(entry.indices_bsize);
+    memcpy(mesh_cpu.indices.data(), raw.data() + entry.vertices_bsize, entry.indices_bsize);
+    for (uint32 i = 0; i < entry.lod_count; i++)
+        mesh_cpu.lods.push_back(entry.lods[i]);
+    mesh_cpu.bvh = packed_mesh_bvh(entry, raw.data());
+    return mesh_cpu;
+}
+
+TextureCPU load_packed_texture(const AssetPack& pack, const PackEntry& entry) {
+    ZoneScoped;
+    TextureCPU texture_cpu;
+    texture_cpu.file_path = FilePath(string(pack.path(entry)));
+    texture_cpu.size      = entry.size;
+    texture_cpu.format    = vuk::Format(entry.format);
+    texture_cpu.mip_count = entry.mip_count;
+    if (!unpack_chunk(pack, entry, texture_cpu.pixels)) {
+        log_error(fmt_("Corrupt texture \"{}\" in asset pack \"{}\"", pack.path(entry), pack.file_path.rel_string()), "asset.pack");
+        return {};
+    }
+    return texture_cpu;
+}
+
+bool write_pack(const vector<FilePath>& asset_paths, const FilePath& output_path, PackCodec codec) {
+    ZoneScoped;
+    std::ofstream file(output_path.abs_string(), std::ios::binary | std::ios::trunc);
+    assert_else(file.is_open())
+        return false;
+
+    PackHeader        header;
+    vector<PackEntry> entries;
+    string            strings;
+
+    auto write_aligned = [&file](const void* data, uint64 bsize) {
+        uint64 offset = uint64(file.tellp());
+        uint64 padding = (pack_alignment - offset % pack_alignment) % pack_alignment;
+        static constexpr char zeroes[pack_alignment] = {};
+        file.write(zeroes, padding);
+        file.write((const char*) data, bsize);
+        return offset + padding;
+    };
+
+    file.write((const char*) &header, sizeof(PackHeader));
+    uint32 skipped = 0;
+    for (const FilePath& asset_path : asset_paths) {
+        PackEntry entry = {};
+        vector<uint8> raw;
+        if (asset_path.extension() == MeshCPU::extension()) {
+            MeshCPU mesh_cpu = load_mesh(asset_path);
+            if (!mesh_cpu.file_path.is_file()) {
+                log_error(fmt_("Couldn't load mesh \"{}\", left out of the pack", asset_path.rel_string()), "asset.pack");
+                skipped++;
+                continue;
+            }
+            if (!mesh_cpu.bounds.valid)
+                mesh_cpu.calculate_bounds();
+            vector<PackedVertex> packed;
+            if (mesh_cpu.encoding == VertexEncoding_Packed)
+                packed = pack_vertices(mesh_cpu.vertices, mesh_cpu.bounds);
+            const void* vertex_data  = mesh_cpu.encoding == VertexEncoding_Packed ? (const void*) packed.data() : (const void*) mesh_cpu.vertices.data();
+            uint64      vertex_bsize = mesh_cpu.encoding == VertexEncoding_Packed ? packed.bsize() : mesh_cpu.vertices.bsize();
+            // Meshes saved before BVHs were baked get theirs here, so streaming one in never builds it
+            if (mesh_cpu.bvh.empty())
+                mesh_cpu.bvh = bake_mesh_bvh(mesh_cpu, packed);
+
+            entry.id              = hash_view(asset_path.rel_string_view());
+            entry.type            = PackAssetType_Mesh;
+            entry.vertices_bsize       = vertex_bsize;
+            entry.indices_bsize        = mesh_cpu.indices.bsize();
+            entry.bvh_nodes_bsize      = mesh_cpu.bvh.nodes.bsize();
+            entry.bvh_primitives_bsize = mesh_cpu.bvh.primitives.bsize();
+            entry.bounds_origin   = mesh_cpu.bounds.origin;
+            entry.bounds_extents  = mesh_cpu.bounds.extents;
+            entry.bounds_radius   = mesh_cpu.bounds.radius;
+            entry.bounds_valid    = mesh_cpu.bounds.valid;
+            entry.vertex_encoding = mesh_cpu.encoding;
+            entry.lod_count       = math::min(uint32(mesh_cpu.lods.size()), max_mesh_lods);
+            for (uint32 i = 0; i < entry.lod_count; i++)
+                entry.lods[i] = mesh_cpu.lods[i];
+            raw.resize(vertex_bsize + entry.indices_bsize + entry.bvh_nodes_bsize + entry.bvh_primitives_bsize);
+            uint8* write = raw.data();
+            memcpy(write, vertex_data, vertex_bsize);
+            write += vertex_bsize;
+            memcpy(write, mesh_cpu.indices.data(), entry.indices_bsize);
+            write += entry.indices_bsize;
+            memcpy(write, mesh_cpu.bvh.nodes.data(), entry.bvh_nodes_bsize);
+            write += entry.bvh_nodes_bsize;
+            memcpy(write, mesh_cpu.bvh.primitives.data(), entry.bvh_primitives_bsize);
+        } else if (asset_path.extension() == TextureCPU::extension()) {
+            TextureCPU texture_cpu = load_texture(asset_path);
+            if (!texture_cpu.file_path.is_file()) {
+                log_error(fmt_("Couldn't load texture \"{}\", left out of the pack", asset_path.rel_string()), "asset.pack");
+                skipped++;
+                continue;
+            }
+            entry.id        = hash_path(asset_path);
+            entry.type      = PackAssetType_Texture;
+            entry.size      = texture_cpu.size;
+            entry.format    = uint32(texture_cpu.format);
+            entry.mip_count = texture_cpu.mip_count;
+            raw             = std::move(texture_cpu.pixels);
+        } else {
+            continue;
+        }
+
+        entry.codec     = codec;
+        entry.raw_bsize = raw.size();
+        if (codec == PackCodec_LZ4) {
+            vector<uint8> compressed;
+            compressed.resize(LZ4_compressBound(int32(raw.size())));
+            compressed.resize(LZ4_compress_default((const char*) raw.data(), (char*) compressed.data(), int32(raw.size()), int32(compressed.size())));
+            entry.bsize  = compressed.size();
+            entry.offset = write_aligned(compressed.data(), compressed.size());
+        } else if (codec == PackCodec_Chunked) {
+            vector<uint8> compressed = chunked_compress(raw);
+            entry.bsize  = compressed.size();
+            entry.offset = write_aligned(compressed.data(), compressed.size());
+        } else {
+            entry.bsize  = raw.size();
+            entry.offset = write_aligned(raw.data(), raw.size());
+        }
+
+        string rel_path   = asset_path.rel_string();
+        entry.path_offset = strings.size();
+        entry.path_bsize  = rel_path.size();
+        strings += rel_path;
+        entries.push_back(entry);
+    }
+
+    header.entry_count    = entries.size();
+    header.entries_offset = write_aligned(entries.data(), entries.bsize());
+    header.strings_offset = write_aligned(strings.data(), strings.size());
+    file.seekp(0);
+    file.write((const char*) &header, sizeof(PackHeader));
+    if (skipped > 0)
+        log_error(fmt_("Pack \"{}\" is missing {} of {} assets", output_path.rel_string(), skipped, entries.size() + skipped), "asset.pack");
+    return file.good();
+}
+
+void benchmark_pack(const FilePath& pack_path) {
+    using clock = std::chrono::high_resolution_clock;
+    auto seconds_since = [](clock::time_point start) { return std::chrono::duration<float>(clock::now() - start).count(); };
+
+    clock::time_point open_start = clock::now();
+    AssetPack pack;
+    if (!pack.open(pack_path))
+        return;
+    float open_time = seconds_since(open_start);
+
+    float  file_time = 0.0f;
+    float  pack_time = 0.0f;
+    uint32 compared  = 0;
+    uint64 checksum  = 0; // Keeps the pack reads from being optimized out
+    for (const PackEntry& entry : pack.entries) {
+        FilePath original = FilePath(string(pack.path(entry)));
+        if (!original.is_file())
+            continue;
+
+        clock::time_point file_start = clock::now();
+        if (entry.type == PackAssetType_Mesh)
+            checksum += load_mesh(original).vertices.size();
+        else
+            checksum += load_texture(original).pixels.size();
+        file_time += seconds_since(file_start);
+
+        // Uncompressed chunks are uploaded in place, so the pack's cost is a single copy into staging
+        clock::time_point pack_start = clock::now();
+        if (entry.codec == PackCodec_None) {
+            vector<uint8> staging;
+            staging.resize(entry.bsize);
+            memcpy(staging.data(), pack.chunk(entry).data(), entry.bsize);
+            checksum += staging.empty() ? 0 : staging.back();
+        } else if (entry.type == PackAssetType_Mesh) {
+            checksum += load_packed_mesh(pack, entry).vertices.size();
+        } else {
+            checksum += load_packed_texture(pack, entry).pixels.size();
+        }
+        pack_time += seconds_since(pack_start);
+        compared++;
+    }
+
+    log(BasicMessage{
+        .str = fmt_("Pack benchmark \"{}\": {} assets, files {:.2f}ms, pack {:.2f}ms (+{:.2f}ms to map), checksum {}",
+            pack_path.rel_string(), compared, file_time * 1000.0f, pack_time * 1000.0f, open_time * 1000.0f, checksum),
+        .group = "asset.pack"
+    });
+}
+
+}
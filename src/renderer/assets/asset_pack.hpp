@@ -0,0 +1,115 @@
+#pragma once
+
+#include <span>
+#include <type_traits>
+
+#include "general/umap.hpp"
+#include "general/vector.hpp"
+#include "general/string.hpp"
+#include "general/math/geometry.hpp"
+#include "general/file/file_path.hpp"
+
+#include "renderer/vertex.hpp"
+#include "renderer/assets/mesh.hpp"
+
+namespace spellbook {
+
+struct TextureCPU;
+
+// Single file holding many baked assets, mapped into memory once. Chunks are aligned so uncompressed ones can be
+// handed to the staging upload straight out of the mapping.
+//   PackHeader | chunks... | PackEntry[entry_count] | path strings
+constexpr uint64 pack_alignment = 256;
+
+enum PackCodec : uint32 {
+    PackCodec_None,
+    PackCodec_LZ4,
+    PackCodec_Chunked // LZ4HC blocks with checksums, see chunked_lz4.hpp
+};
+
+enum PackAssetType : uint32 {
+    PackAssetType_Mesh,
+    PackAssetType_Texture
+};
+
+struct PackHeader {
+    char   magic[4]       = {'S', 'B', 'P', 'K'};
+    uint32 version        = 5;
+    uint64 entry_count    = 0;
+    uint64 entries_offset = 0;
+    uint64 strings_offset = 0;
+};
+
+struct PackEntry {
+    uint64        id;
+    uint64        offset;
+    uint64        bsize;
+    uint64        raw_bsize;
+    PackCodec     codec;
+    PackAssetType type;
+    uint32        path_offset;
+    uint32        path_bsize;
+
+    // Mesh, laid out like a .sbamsh blob: vertices | indices | BVH nodes | BVH primitives
+    uint64 vertices_bsize;
+    uint64 indices_bsize;
+    uint64 bvh_nodes_bsize;
+    uint64 bvh_primitives_bsize;
+    v3     bounds_origin;
+    v3     bounds_extents;
+    float  bounds_radius;
+    uint32 bounds_valid;
+    VertexEncoding vertex_encoding; // Vertices are stored in the layout they're uploaded in
+    uint32         lod_count;       // 0 when the indices are a single level
+    MeshLOD        lods[max_mesh_lods];
+
+    // Texture
+    v2i    size;
+    uint32 format;
+    uint32 mip_count;
+};
+static_assert(std::is_trivially_copyable_v<PackEntry>);
+
+struct AssetPack {
+    FilePath                   file_path;
+    const uint8*               data = nullptr;
+    uint64                     bsize = 0;
+    std::span<const PackEntry> entries;
+    umap<uint64, uint32>       entry_lookup;
+
+#if defined(_WIN32)
+    void* file_handle    = nullptr;
+    void* mapping_handle = nullptr;
+#else
+    int file_descriptor = -1;
+#endif
+
+    AssetPack() = default;
+    AssetPack(const AssetPack&) = delete;
+    AssetPack& operator=(const AssetPack&) = delete;
+    ~AssetPack();
+
+    bool open(const FilePath& pack_path);
+    void close();
+
+    const PackEntry*       find(uint64 id) const;
+    std::span<const uint8> chunk(const PackEntry& entry) const;
+    string_view            path(const PackEntry& entry) const;
+    // Chunk and path in bounds, and a mesh's sections adding up to its raw size in whole elements
+    bool                   valid_entry(const PackEntry& entry) const;
+};
+
+// Copies or decompresses a packed asset into CPU memory, for chunks that can't be uploaded in place
+MeshCPU    load_packed_mesh(const AssetPack& pack, const PackEntry& entry);
+// raw is the entry's uncompressed chunk
+BVH        packed_mesh_bvh(const PackEntry& entry, const uint8* raw);
+TextureCPU load_packed_texture(const AssetPack& pack, const PackEntry& entry);
+
+// Bakes .sbamsh/.sbatex files into a pack, returns false if the pack couldn't be written
+bool write_pack(const vector<FilePath>& asset_paths, const FilePath& output_path, PackCodec codec = PackCodec_None);
+// Times loading every asset in the pack through the pack and through its original file, and logs the totals
+void benchmark_pack(const FilePath& pack_path);
+
+constexpr string_view pack_extension = ".sbpack";
+
+}
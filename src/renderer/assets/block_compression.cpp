@@ -0,0 +1,438 @@
+#include "block_compression.hpp"
+
+#include <cfloat>
+#include <cmath>
+#include <utility>
+#include <tracy/Tracy.hpp>
+
+#include "general/math/math.hpp"
+
+#include "renderer/worker_pool.hpp"
+
+namespace spellbook {
+
+vuk::Format choose_block_format(TextureUsage usage, bool has_alpha) {
+    switch (usage) {
+        case TextureUsage_Color:
+            return vuk::Format::eBc7SrgbBlock;
+        case TextureUsage_Emissive:
+            return has_alpha ? vuk::Format::eBc3SrgbBlock : vuk::Format::eBc1RgbSrgbBlock;
+        case TextureUsage_Normal:
+            return vuk::Format::eBc5UnormBlock;
+        case TextureUsage_Data:
+            return vuk::Format::eBc1RgbUnormBlock;
+    }
+    return vuk::Format::eBc7SrgbBlock;
+}
+
+uint32 block_bsize(vuk::Format format) {
+    switch (format) {
+        case vuk::Format::eBc1RgbUnormBlock:
+        case vuk::Format::eBc1RgbSrgbBlock:
+        case vuk::Format::eBc1RgbaUnormBlock:
+        case vuk::Format::eBc1RgbaSrgbBlock:
+        case vuk::Format::eBc4UnormBlock:
+            return 8;
+        case vuk::Format::eBc3UnormBlock:
+        case vuk::Format::eBc3SrgbBlock:
+        case vuk::Format::eBc5UnormBlock:
+        case vuk::Format::eBc7UnormBlock:
+        case vuk::Format::eBc7SrgbBlock:
+            return 16;
+        default:
+            return 0;
+    }
+}
+
+bool is_block_compressed(vuk::Format format) {
+    return block_bsize(format) != 0;
+}
+
+uint64 compressed_bsize(vuk::Format format, v2i size) {
+    return uint64((size.x + 3) / 4) * uint64((size.y + 3) / 4) * block_bsize(format);
+}
+
+static void load_texels(const uint8* rgba, float texels[16][4]) {
+    for (uint32 i = 0; i < 16; i++) {
+        for (uint32 c = 0; c < 4; c++)
+            texels[i][c] = float(rgba[i * 4 + c]);
+    }
+}
+
+// Endpoints at the extremes of the texels' principal axis, found by power iteration on their covariance
+static void principal_endpoints(const float texels[16][4], uint32 channels, float e0[4], float e1[4]) {
+    float mean[4] = {}, low[4], high[4];
+    for (uint32 c = 0; c < 4; c++) {
+        low[c]  = FLT_MAX;
+        high[c] = -FLT_MAX;
+    }
+    for (uint32 i = 0; i < 16; i++) {
+        for (uint32 c = 0; c < channels; c++) {
+            mean[c] += texels[i][c];
+            low[c]  = math::min(low[c], texels[i][c]);
+            high[c] = math::max(high[c], texels[i][c]);
+        }
+    }
+    for (uint32 c = 0; c < 4; c++)
+        mean[c] = c < channels ? mean[c] / 16.0f : 255.0f;
+
+    float covariance[4][4] = {};
+    for (uint32 i = 0; i < 16; i++) {
+        for (uint32 a = 0; a < channels; a++) {
+            for (uint32 b = 0; b < channels; b++)
+                covariance[a][b] += (texels[i][a] - mean[a]) * (texels[i][b] - mean[b]);
+        }
+    }
+
+    // The bounding box diagonal is already close to the principal axis for most blocks
+    float axis[4] = {};
+    for (uint32 c = 0; c < channels; c++)
+        axis[c] = high[c] - low[c];
+    for (uint32 iteration = 0; iteration < 8; iteration++) {
+        float next[4] = {};
+        float length  = 0.0f;
+        for (uint32 a = 0; a < channels; a++) {
+            for (uint32 b = 0; b < channels; b++)
+                next[a] += covariance[a][b] * axis[b];
+            length += next[a] * next[a];
+        }
+        if (length < 0.000001f)
+            break;
+        length = std::sqrt(length);
+        for (uint32 c = 0; c < channels; c++)
+            axis[c] = next[c] / length;
+    }
+
+    float length = 0.0f;
+    for (uint32 c = 0; c < channels; c++)
+        length += axis[c] * axis[c];
+    length = std::sqrt(length);
+    if (length < 0.000001f) {
+        for (uint32 c = 0; c < 4; c++)
+            e0[c] = e1[c] = mean[c];
+        return;
+    }
+    for (uint32 c = 0; c < channels; c++)
+        axis[c] /= length;
+
+    float t_low = FLT_MAX, t_high = -FLT_MAX;
+    for (uint32 i = 0; i < 16; i++) {
+        float t = 0.0f;
+        for (uint32 c = 0; c < channels; c++)
+            t += (texels[i][c] - mean[c]) * axis[c];
+        t_low  = math::min(t_low, t);
+        t_high = math::max(t_high, t);
+    }
+    for (uint32 c = 0; c < 4; c++) {
+        e0[c] = c < channels ? math::clamp(mean[c] + axis[c] * t_low, 0.0f, 255.0f) : 255.0f;
+        e1[c] = c < channels ? math::clamp(mean[c] + axis[c] * t_high, 0.0f, 255.0f) : 255.0f;
+    }
+}
+
+// Least squares endpoints for fixed interpolation weights, false when the weights can't tell the endpoints apart
+static bool fit_endpoints(const float texels[16][4], const float weights[16], uint32 channels, float e0[4], float e1[4]) {
+    float aa = 0.0f, ab = 0.0f, bb = 0.0f;
+    float ax[4] = {}, bx[4] = {};
+    for (uint32 i = 0; i < 16; i++) {
+        float a = 1.0f - weights[i];
+        float b = weights[i];
+        aa += a * a;
+        ab += a * b;
+        bb += b * b;
+        for (uint32 c = 0; c < channels; c++) {
+            ax[c] += a * texels[i][c];
+            bx[c] += b * texels[i][c];
+        }
+    }
+    float determinant = aa * bb - ab * ab;
+    if (math::abs(determinant) < 0.0001f)
+        return false;
+    for (uint32 c = 0; c < channels; c++) {
+        e0[c] = math::clamp((bb * ax[c] - ab * bx[c]) / determinant, 0.0f, 255.0f);
+        e1[c] = math::clamp((aa * bx[c] - ab * ax[c]) / determinant, 0.0f, 255.0f);
+    }
+    return true;
+}
+
+static uint16 to_565(const float color[4]) {
+    uint32 r = uint32(color[0] * 31.0f / 255.0f + 0.5f);
+    uint32 g = uint32(color[1] * 63.0f / 255.0f + 0.5f);
+    uint32 b = uint32(color[2] * 31.0f / 255.0f + 0.5f);
+    return uint16(r << 11 | g << 5 | b);
+}
+
+static void from_565(uint16 packed, float color[4]) {
+    uint32 r = packed >> 11 & 31;
+    uint32 g = packed >> 5 & 63;
+    uint32 b = packed & 31;
+    color[0] = float(r << 3 | r >> 2);
+    color[1] = float(g << 2 | g >> 4);
+    color[2] = float(b << 3 | b >> 2);
+    color[3] = 255.0f;
+}
+
+struct BC1Result {
+    uint16 c0;
+    uint16 c1;
+    uint32 indices;
+    float  error;
+    float  weights[16];
+};
+
+// Always four color mode, BC3 reads its color block that way regardless of endpoint order
+static BC1Result bc1_try(const float texels[16][4], const float e0[4], const float e1[4]) {
+    static constexpr float palette_weights[4] = {0.0f, 1.0f, 1.0f / 3.0f, 2.0f / 3.0f};
+
+    BC1Result result = {.c0 = to_565(e0), .c1 = to_565(e1), .indices = 0, .error = 0.0f};
+    bool swapped = result.c0 < result.c1;
+    if (swapped)
+        std::swap(result.c0, result.c1);
+
+    float palette[4][4];
+    from_565(result.c0, palette[0]);
+    from_565(result.c1, palette[1]);
+    for (uint32 c = 0; c < 3; c++) {
+        palette[2][c] = (2.0f * palette[0][c] + palette[1][c]) / 3.0f;
+        palette[3][c] = (palette[0][c] + 2.0f * palette[1][c]) / 3.0f;
+    }
+    // Equal endpoints would read as three color mode, where index 3 is black
+    uint32 palette_size = result.c0 == result.c1 ? 1 : 4;
+
+    for (uint32 i = 0; i < 16; i++) {
+        uint32 best       = 0;
+        float  best_error = FLT_MAX;
+        for (uint32 k = 0; k < palette_size; k++) {
+            float error = 0.0f;
+            for (uint32 c = 0; c < 3; c++)
+                error += (texels[i][c] - palette[k][c]) * (texels[i][c] - palette[k][c]);
+            if (error < best_error) {
+                best       = k;
+                best_error = error;
+            }
+        }
+        result.indices |= best << (2 * i);
+        result.error += best_error;
+        // Relative to the endpoints passed in, so a refit doesn't have to know about the swap
+        result.weights[i] = swapped ? 1.0f - palette_weights[best] : palette_weights[best];
+    }
+    return result;
+}
+
+void encode_bc1_block(const uint8* rgba, uint8* output) {
+    float texels[16][4];
+    load_texels(rgba, texels);
+
+    float e0[4], e1[4];
+    principal_endpoints(texels, 3, e0, e1);
+    BC1Result best = bc1_try(texels, e0, e1);
+    // One least squares pass over the chosen indices usually pulls the endpoints inside the quantization error
+    if (fit_endpoints(texels, best.weights, 3, e0, e1)) {
+        BC1Result refit = bc1_try(texels, e0, e1);
+        if (refit.error < best.error)
+            best = refit;
+    }
+
+    output[0] = uint8(best.c0);
+    output[1] = uint8(best.c0 >> 8);
+    output[2] = uint8(best.c1);
+    output[3] = uint8(best.c1 >> 8);
+    for (uint32 b = 0; b < 4; b++)
+        output[4 + b] = uint8(best.indices >> (8 * b));
+}
+
+void encode_bc4_block(const uint8* rgba, uint32 channel, uint8* output) {
+    uint8 low = 255, high = 0;
+    for (uint32 i = 0; i < 16; i++) {
+        low  = math::min(low, rgba[i * 4 + channel]);
+        high = math::max(high, rgba[i * 4 + channel]);
+    }
+
+    // a0 > a1 selects the mode with six interpolated values between them
+    uint64 indices = 0;
+    if (high != low) {
+        float range = float(high - low);
+        for (uint32 i = 0; i < 16; i++) {
+            uint32 step = uint32(float(high - rgba[i * 4 + channel]) * 7.0f / range + 0.5f);
+            // Steps run from a0 to a1, indices 0 and 1 are the endpoints themselves
+            uint64 index = step == 0 ? 0 : step == 7 ? 1 : step + 1;
+            indices |= index << (3 * i);
+        }
+    }
+
+    output[0] = high;
+    output[1] = low;
+    for (uint32 b = 0; b < 6; b++)
+        output[2 + b] = uint8(indices >> (8 * b));
+}
+
+void encode_bc3_block(const uint8* rgba, uint8* output) {
+    encode_bc4_block(rgba, 3, output);
+    encode_bc1_block(rgba, output + 8);
+}
+
+void encode_bc5_block(const uint8* rgba, uint8* output) {
+    encode_bc4_block(rgba, 0, output);
+    encode_bc4_block(rgba, 1, output + 8);
+}
+
+struct BC7Result {
+    uint8  q0[4];
+    uint8  q1[4];
+    uint32 p0;
+    uint32 p1;
+    uint8  indices[16];
+    float  error;
+    float  weights[16];
+};
+
+static constexpr uint32 bc7_weights[16] = {0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64};
+
+// 7 bits per channel plus a p-bit shared by the endpoint's channels, picks whichever p-bit lands closer
+static void bc7_quantize(const float endpoint[4], uint8 quantized[4], uint32& pbit, float expanded[4]) {
+    float best_error = FLT_MAX;
+    for (uint32 p = 0; p < 2; p++) {
+        uint8 candidate[4];
+        float error = 0.0f;
+        for (uint32 c = 0; c < 4; c++) {
+            candidate[c] = uint8(math::clamp(int32((endpoint[c] - float(p)) * 0.5f + 0.5f), 0, 127));
+            float value  = float(candidate[c] << 1 | p);
+            error += (value - endpoint[c]) * (value - endpoint[c]);
+        }
+        if (error < best_error) {
+            best_error = error;
+            pbit       = p;
+            for (uint32 c = 0; c < 4; c++) {
+                quantized[c] = candidate[c];
+                expanded[c]  = float(candidate[c] << 1 | p);
+            }
+        }
+    }
+}
+
+static BC7Result bc7_try(const float texels[16][4], const float e0[4], const float e1[4]) {
+    BC7Result result = {};
+    float     x0[4], x1[4];
+    bc7_quantize(e0, result.q0, result.p0, x0);
+    bc7_quantize(e1, result.q1, result.p1, x1);
+
+    float palette[16][4];
+    for (uint32 k = 0; k < 16; k++) {
+        for (uint32 c = 0; c < 4; c++)
+            palette[k][c] = float(((64 - bc7_weights[k]) * uint32(x0[c]) + bc7_weights[k] * uint32(x1[c]) + 32) >> 6);
+    }
+
+    for (uint32 i = 0; i < 16; i++) {
+        uint32 best       = 0;
+        float  best_error = FLT_MAX;
+        for (uint32 k = 0; k < 16; k++) {
+            float error = 0.0f;
+            for (uint32 c = 0; c < 4; c++)
+                error += (texels[i][c] - palette[k][c]) * (texels[i][c] - palette[k][c]);
+            if (error < best_error) {
+                best       = k;
+                best_error = error;
+            }
+        }
+        result.indices[i] = uint8(best);
+        result.weights[i] = float(bc7_weights[best]) / 64.0f;
+        result.error += best_error;
+    }
+    return result;
+}
+
+struct BitWriter {
+    uint8* data;
+    uint32 position = 0;
+
+    void write(uint32 value, uint32 bits) {
+        for (uint32 b = 0; b < bits; b++, position++) {
+            if (value >> b & 1)
+                data[position >> 3] |= uint8(1 << (position & 7));
+        }
+    }
+};
+
+void encode_bc7_block(const uint8* rgba, uint8* output) {
+    float texels[16][4];
+    load_texels(rgba, texels);
+
+    float e0[4], e1[4];
+    principal_endpoints(texels, 4, e0, e1);
+    BC7Result best = bc7_try(texels, e0, e1);
+    if (fit_endpoints(texels, best.weights, 4, e0, e1)) {
+        BC7Result refit = bc7_try(texels, e0, e1);
+        if (refit.error < best.error)
+            best = refit;
+    }
+
+    // The first index is stored without its top bit, so it has to be in the lower half
+    if (best.indices[0] >= 8) {
+        std::swap(best.q0, best.q1);
+        std::swap(best.p0, best.p1);
+        for (uint8& index : best.indices)
+            index = 15 - index;
+    }
+
+    memset(output, 0, 16);
+    BitWriter writer = {.data = output};
+    writer.write(1 << 6, 7);
+    for (uint32 c = 0; c < 4; c++) {
+        writer.write(best.q0[c], 7);
+        writer.write(best.q1[c], 7);
+    }
+    writer.write(best.p0, 1);
+    writer.write(best.p1, 1);
+    writer.write(best.indices[0], 3);
+    for (uint32 i = 1; i < 16; i++)
+        writer.write(best.indices[i], 4);
+}
+
+vector<uint8> compress_blocks(std::span<const uint8> rgba, v2i size, vuk::Format format) {
+    ZoneScoped;
+    uint32 bsize = block_bsize(format);
+    assert_else(bsize != 0 && size.x > 0 && size.y > 0 && rgba.size() >= uint64(size.x) * uint64(size.y) * 4)
+        return {};
+
+    uint32 blocks_x = (size.x + 3) / 4;
+    uint32 blocks_y = (size.y + 3) / 4;
+    vector<uint8> output;
+    output.resize(uint64(blocks_x) * uint64(blocks_y) * bsize);
+    get_worker_pool().parallel_for(blocks_y, [&](uint32 block_y) {
+        uint8 block[64];
+        for (uint32 block_x = 0; block_x < blocks_x; block_x++) {
+            for (uint32 y = 0; y < 4; y++) {
+                uint32 source_y = math::min(block_y * 4 + y, uint32(size.y) - 1);
+                for (uint32 x = 0; x < 4; x++) {
+                    uint32 source_x = math::min(block_x * 4 + x, uint32(size.x) - 1);
+                    memcpy(block + (y * 4 + x) * 4, rgba.data() + (uint64(source_y) * size.x + source_x) * 4, 4);
+                }
+            }
+
+            uint8* destination = output.data() + (uint64(block_y) * blocks_x + block_x) * bsize;
+            switch (format) {
+                case vuk::Format::eBc1RgbUnormBlock:
+                case vuk::Format::eBc1RgbSrgbBlock:
+                case vuk::Format::eBc1RgbaUnormBlock:
+                case vuk::Format::eBc1RgbaSrgbBlock:
+                    encode_bc1_block(block, destination);
+                    break;
+                case vuk::Format::eBc3UnormBlock:
+                case vuk::Format::eBc3SrgbBlock:
+                    encode_bc3_block(block, destination);
+                    break;
+                case vuk::Format::eBc4UnormBlock:
+                    encode_bc4_block(block, 0, destination);
+                    break;
+                case vuk::Format::eBc5UnormBlock:
+                    encode_bc5_block(block, destination);
+                    break;
+                default:
+                    encode_bc7_block(block, destination);
+                    break;
+            }
+        }
+    });
+    return output;
+}
+
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <span>
+#include <vuk/Types.hpp>
+
+#include "general/vector.hpp"
+#include "general/math/geometry.hpp"
+
+namespace spellbook {
+
+// What a texture is sampled as, decides which block format it's baked to
+enum TextureUsage : uint32 {
+    TextureUsage_Color,    // sRGB albedo, BC7
+    TextureUsage_Emissive, // sRGB, BC1 or BC3 when it has alpha
+    TextureUsage_Normal,   // Tangent space xy in BC5, z is rebuilt in the shader
+    TextureUsage_Data      // Linear channels like ORM, BC1
+};
+
+// 4x4 texel blocks, each is 8 bytes for BC1/BC4 and 16 bytes for BC3/BC5/BC7
+vuk::Format choose_block_format(TextureUsage usage, bool has_alpha);
+bool        is_block_compressed(vuk::Format format);
+uint32      block_bsize(vuk::Format format);
+uint64      compressed_bsize(vuk::Format format, v2i size);
+
+// Single blocks from 16 RGBA8 texels in row order
+void encode_bc1_block(const uint8* rgba, uint8* output);
+void encode_bc3_block(const uint8* rgba, uint8* output);
+void encode_bc4_block(const uint8* rgba, uint32 channel, uint8* output);
+void encode_bc5_block(const uint8* rgba, uint8* output);
+// Mode 6 only, one subset with RGBA endpoints and 4 bit indices, which covers most color content well
+void encode_bc7_block(const uint8* rgba, uint8* output);
+
+// Encodes a whole RGBA8 image, rows of blocks are spread over the worker pool. Edges that don't fill a block repeat
+// their last texel.
+vector<uint8> compress_blocks(std::span<const uint8> rgba, v2i size, vuk::Format format);
+
+}
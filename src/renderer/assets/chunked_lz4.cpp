@@ -0,0 +1,103 @@
+#include "chunked_lz4.hpp"
+
+#include <atomic>
+#include <lz4/lz4.h>
+#include <lz4/lz4hc.h>
+#include <lz4/xxhash.h>
+#include <tracy/Tracy.hpp>
+
+#include "extension/fmt.hpp"
+#include "general/logger.hpp"
+#include "general/math/math.hpp"
+
+#include "renderer/worker_pool.hpp"
+
+namespace spellbook {
+
+bool is_chunked(std::span<const uint8> compressed) {
+    ChunkedHeader expected;
+    return compressed.size() >= sizeof(ChunkedHeader) && memcmp(compressed.data(), expected.magic, 4) == 0;
+}
+
+uint64 chunked_raw_bsize(std::span<const uint8> compressed) {
+    if (!is_chunked(compressed))
+        return 0;
+    return ((const ChunkedHeader*) compressed.data())->raw_bsize;
+}
+
+vector<uint8> chunked_compress(std::span<const uint8> raw, int32 compression_level) {
+    ZoneScoped;
+    ChunkedHeader header;
+    header.raw_bsize   = raw.size();
+    header.block_count = (raw.size() + header.block_bsize - 1) / header.block_bsize;
+
+    // Blocks compress in parallel into their own staging, then get packed back to back
+    vector<ChunkedBlock>  blocks;
+    vector<vector<uint8>> staging;
+    blocks.resize(header.block_count);
+    staging.resize(header.block_count);
+    get_worker_pool().parallel_for(header.block_count, [&](uint32 i) {
+        uint64 begin     = uint64(i) * header.block_bsize;
+        uint32 raw_bsize = uint32(math::min(uint64(header.block_bsize), raw.size() - begin));
+        const char* src  = (const char*) raw.data() + begin;
+
+        staging[i].resize(LZ4_compressBound(int32(raw_bsize)));
+        int32 bsize = LZ4_compress_HC(src, (char*) staging[i].data(), int32(raw_bsize), int32(staging[i].size()), compression_level);
+        staging[i].resize(bsize);
+        blocks[i] = {.offset = 0, .bsize = uint32(bsize), .raw_bsize = raw_bsize, .checksum = XXH64(src, raw_bsize, 0)};
+    });
+
+    uint64 offset = sizeof(ChunkedHeader) + blocks.bsize();
+    for (ChunkedBlock& block : blocks) {
+        block.offset = offset;
+        offset += block.bsize;
+    }
+
+    vector<uint8> compressed;
+    compressed.resize(offset);
+    memcpy(compressed.data(), &header, sizeof(ChunkedHeader));
+    memcpy(compressed.data() + sizeof(ChunkedHeader), blocks.data(), blocks.bsize());
+    for (uint64 i = 0; i < blocks.size(); i++)
+        memcpy(compressed.data() + blocks[i].offset, staging[i].data(), blocks[i].bsize);
+    return compressed;
+}
+
+bool chunked_decompress(std::span<const uint8> compressed, std::span<uint8> raw) {
+    ZoneScoped;
+    assert_else(is_chunked(compressed))
+        return false;
+    const ChunkedHeader& header = *(const ChunkedHeader*) compressed.data();
+    assert_else(raw.size() == header.raw_bsize && header.block_bsize != 0 &&
+                header.block_count == (header.raw_bsize + header.block_bsize - 1) / header.block_bsize &&
+                sizeof(ChunkedHeader) + header.block_count * sizeof(ChunkedBlock) <= compressed.size())
+        return false;
+    const ChunkedBlock* blocks = (const ChunkedBlock*) (compressed.data() + sizeof(ChunkedHeader));
+
+    // Blocks have to cover raw exactly, otherwise its tail would be left uninitialized
+    uint64 covered_bsize = 0;
+    for (uint64 i = 0; i < header.block_count; i++)
+        covered_bsize += blocks[i].raw_bsize;
+    assert_else(covered_bsize == header.raw_bsize)
+        return false;
+
+    std::atomic<bool> valid = true;
+    get_worker_pool().parallel_for(header.block_count, [&](uint32 i) {
+        const ChunkedBlock& block = blocks[i];
+        uint64 raw_begin = uint64(i) * header.block_bsize;
+        if (block.raw_bsize > header.block_bsize || block.offset + block.bsize > compressed.size() ||
+            raw_begin + block.raw_bsize > raw.size()) {
+            valid = false;
+            return;
+        }
+        char* dst   = (char*) raw.data() + raw_begin;
+        int32 bsize = LZ4_decompress_safe((const char*) compressed.data() + block.offset, dst, int32(block.bsize), int32(block.raw_bsize));
+        if (bsize != int32(block.raw_bsize) || XXH64(dst, block.raw_bsize, 0) != block.checksum)
+            valid = false;
+    });
+
+    if (!valid)
+        log_error("Chunked blob failed to decompress or its checksum didn't match", "asset.codec");
+    return valid;
+}
+
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <span>
+
+#include "general/vector.hpp"
+
+namespace spellbook {
+
+// Blob split into fixed size blocks that are compressed independently with LZ4HC, so they can be decompressed in
+// parallel and sizes aren't limited to int32. Every block carries an xxHash of its raw bytes.
+//   ChunkedHeader | ChunkedBlock[block_count] | compressed blocks
+constexpr uint32 chunked_block_bsize        = 1u << 20;
+constexpr int32  default_compression_level = 9; // LZ4HC_CLEVEL_DEFAULT, 12 is the slowest and smallest
+
+struct ChunkedHeader {
+    char   magic[4]    = {'S', 'B', 'C', 'K'};
+    uint32 block_bsize = chunked_block_bsize;
+    uint64 raw_bsize   = 0;
+    uint64 block_count = 0;
+};
+
+struct ChunkedBlock {
+    uint64 offset;
+    uint32 bsize;
+    uint32 raw_bsize;
+    uint64 checksum;
+};
+
+bool   is_chunked(std::span<const uint8> compressed);
+uint64 chunked_raw_bsize(std::span<const uint8> compressed);
+
+vector<uint8> chunked_compress(std::span<const uint8> raw, int32 compression_level = default_compression_level);
+// raw must be chunked_raw_bsize bytes, returns false if the blob is malformed or a checksum doesn't match
+bool          chunked_decompress(std::span<const uint8> compressed, std::span<uint8> raw);
+
+}
@@ -0,0 +1,133 @@
+#include "gltf_decode.hpp"
+
+#include <cstring>
+#include <limits>
+#include <type_traits>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #include <emmintrin.h>
+    #define GLTF_DECODE_SSE
+#endif
+
+#include <tracy/Tracy.hpp>
+
+#include "general/logger.hpp"
+#include "general/math/math.hpp"
+
+namespace spellbook {
+
+template <typename T>
+static float normalize_component(T value) {
+    if constexpr (std::is_same_v<T, uint8> || std::is_same_v<T, uint16>)
+        return float(value) / float(std::numeric_limits<T>::max());
+    else
+        return math::max(float(value) / float(std::numeric_limits<T>::max()), -1.0f);
+}
+
+// The component type and normalization are resolved once per accessor instead of per element
+template <typename T, bool normalized>
+static void decode_components(const AccessorView& view, uint32 components, uint64 count, float* output, uint64 output_stride) {
+    const uint8* src = view.data;
+    uint8*       dst = (uint8*) output;
+    for (uint64 i = 0; i < count; i++, src += view.stride, dst += output_stride) {
+        const T* values = (const T*) src;
+        float*   floats = (float*) dst;
+        for (uint32 c = 0; c < components; c++)
+            floats[c] = normalized ? normalize_component(values[c]) : float(values[c]);
+    }
+}
+
+static void decode_float_components(const AccessorView& view, uint32 components, uint64 count, float* output, uint64 output_stride) {
+    const uint8* src = view.data;
+    uint8*       dst = (uint8*) output;
+    uint64       i   = 0;
+#if defined(GLTF_DECODE_SSE)
+    // A 16 byte load can run past the end of the buffer for the last element, which is left to the scalar tail.
+    // Stores are split so they never touch the vertex attribute after the one being written.
+    if (components == 3 && view.stride >= 12) {
+        for (; i + 1 < count; i++, src += view.stride, dst += output_stride) {
+            __m128 value = _mm_loadu_ps((const float*) src);
+            _mm_storel_pi((__m64*) dst, value);
+            _mm_store_ss((float*) dst + 2, _mm_movehl_ps(value, value));
+        }
+    } else if (components == 2 && view.stride >= 8) {
+        for (; i < count; i++, src += view.stride, dst += output_stride)
+            _mm_storel_pi((__m64*) dst, _mm_castpd_ps(_mm_load_sd((const double*) src)));
+    } else if (components == 4 && view.stride >= 16) {
+        for (; i < count; i++, src += view.stride, dst += output_stride)
+            _mm_storeu_ps((float*) dst, _mm_loadu_ps((const float*) src));
+    }
+#endif
+    for (; i < count; i++, src += view.stride, dst += output_stride)
+        memcpy(dst, src, components * sizeof(float));
+}
+
+void decode_accessor_floats(const AccessorView& view, uint32 components, uint64 count, float* output, uint64 output_stride) {
+    ZoneScoped;
+    assert_else(components <= view.components && count <= view.count)
+        return;
+
+    switch (view.component_type) {
+        case GLTFComponent_Float: decode_float_components(view, components, count, output, output_stride); break;
+        case GLTFComponent_Byte: {
+            view.normalized ? decode_components<int8, true>(view, components, count, output, output_stride)
+                            : decode_components<int8, false>(view, components, count, output, output_stride);
+        } break;
+        case GLTFComponent_UnsignedByte: {
+            view.normalized ? decode_components<uint8, true>(view, components, count, output, output_stride)
+                            : decode_components<uint8, false>(view, components, count, output, output_stride);
+        } break;
+        case GLTFComponent_Short: {
+            view.normalized ? decode_components<int16, true>(view, components, count, output, output_stride)
+                            : decode_components<int16, false>(view, components, count, output, output_stride);
+        } break;
+        case GLTFComponent_UnsignedShort: {
+            view.normalized ? decode_components<uint16, true>(view, components, count, output, output_stride)
+                            : decode_components<uint16, false>(view, components, count, output, output_stride);
+        } break;
+        default:
+            log_error("Unsupported component type for vertex attribute in GLTF convert", "asset.import");
+    }
+}
+
+template <typename T>
+static void decode_indices(const AccessorView& view, uint32* output) {
+    const uint8* src = view.data;
+    for (uint64 i = 0; i < view.count; i++, src += view.stride)
+        output[i] = uint32(*(const T*) src);
+}
+
+void decode_accessor_indices(const AccessorView& view, uint32* output) {
+    ZoneScoped;
+    switch (view.component_type) {
+        case GLTFComponent_UnsignedShort: {
+            uint64 i = 0;
+#if defined(GLTF_DECODE_SSE)
+            // Tightly packed, the common case, widens 8 indices at a time
+            if (view.stride == sizeof(uint16)) {
+                __m128i zero = _mm_setzero_si128();
+                for (; i + 8 <= view.count; i += 8) {
+                    __m128i indices = _mm_loadu_si128((const __m128i*) (view.data + i * sizeof(uint16)));
+                    _mm_storeu_si128((__m128i*) (output + i), _mm_unpacklo_epi16(indices, zero));
+                    _mm_storeu_si128((__m128i*) (output + i + 4), _mm_unpackhi_epi16(indices, zero));
+                }
+            }
+#endif
+            for (; i < view.count; i++)
+                output[i] = *(const uint16*) (view.data + i * view.stride);
+        } break;
+        case GLTFComponent_UnsignedInt: {
+            if (view.stride == sizeof(uint32))
+                memcpy(output, view.data, view.count * sizeof(uint32));
+            else
+                decode_indices<uint32>(view, output);
+        } break;
+        case GLTFComponent_UnsignedByte: decode_indices<uint8>(view, output); break;
+        case GLTFComponent_Short: decode_indices<int16>(view, output); break;
+        case GLTFComponent_Byte: decode_indices<int8>(view, output); break;
+        default:
+            log_error("Unsupported component type for index in GLTF convert", "asset.import");
+    }
+}
+
+}
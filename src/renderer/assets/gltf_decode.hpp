@@ -0,0 +1,33 @@
+#pragma once
+
+#include "general/math/geometry.hpp"
+
+namespace spellbook {
+
+// glTF componentType values
+enum GLTFComponent : int32 {
+    GLTFComponent_Byte          = 5120,
+    GLTFComponent_UnsignedByte  = 5121,
+    GLTFComponent_Short         = 5122,
+    GLTFComponent_UnsignedShort = 5123,
+    GLTFComponent_UnsignedInt   = 5125,
+    GLTFComponent_Float         = 5126
+};
+
+// An accessor's elements in place in its buffer, with the buffer view's stride already resolved
+struct AccessorView {
+    const uint8* data           = nullptr;
+    uint64       count          = 0;
+    uint64       stride         = 0;
+    uint32       components     = 0;
+    int32        component_type = GLTFComponent_Float;
+    bool         normalized     = false;
+};
+
+// Writes the first components values of count elements as floats, output advances output_stride bytes per element.
+// Normalized integer attributes are mapped to [0, 1] or [-1, 1].
+void decode_accessor_floats(const AccessorView& view, uint32 components, uint64 count, float* output, uint64 output_stride);
+// Widens any integer index type to uint32, output must hold view.count indices
+void decode_accessor_indices(const AccessorView& view, uint32* output);
+
+}
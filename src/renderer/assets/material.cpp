@@ -31,11 +31,9 @@ uint64 upload_material(const MaterialCPU& material_cpu, bool frame_allocation) {
     MaterialGPU material_gpu;
     material_gpu.material_cpu = material_cpu;
     material_gpu.frame_allocated = frame_allocation;
+    material_gpu.last_used_frame = get_gpu_asset_cache().frame;
     material_gpu.pipeline      = get_renderer().context->get_named_pipeline(vuk::Name(material_cpu.shader_name));
-    material_gpu.color = vuk::make_sampled_image(get_gpu_asset_cache().get_texture_or_upload(material_cpu.color_asset_path).value.view.get(), material_cpu.sampler.get());
-    material_gpu.normal = vuk::make_sampled_image(get_gpu_asset_cache().get_texture_or_upload(material_cpu.normal_asset_path).value.view.get(), material_cpu.sampler.get());
-    material_gpu.orm = vuk::make_sampled_image(get_gpu_asset_cache().get_texture_or_upload(material_cpu.orm_asset_path).value.view.get(), material_cpu.sampler.get());
-    material_gpu.emissive = vuk::make_sampled_image(get_gpu_asset_cache().get_texture_or_upload(material_cpu.emissive_asset_path).value.view.get(), material_cpu.sampler.get());
+    material_gpu.refresh_textures();
 
     material_gpu.tints         = {
         (v4) material_cpu.color_tint,
@@ -71,6 +69,13 @@ void MaterialGPU::update_from_cpu(const MaterialCPU& new_material) {
     material_cpu = new_material;
 }
 
+void MaterialGPU::refresh_textures() {
+    color = vuk::make_sampled_image(get_gpu_asset_cache().get_texture_or_upload(material_cpu.color_asset_path).value.view.get(), material_cpu.sampler.get());
+    normal = vuk::make_sampled_image(get_gpu_asset_cache().get_texture_or_upload(material_cpu.normal_asset_path).value.view.get(), material_cpu.sampler.get());
+    orm = vuk::make_sampled_image(get_gpu_asset_cache().get_texture_or_upload(material_cpu.orm_asset_path).value.view.get(), material_cpu.sampler.get());
+    emissive = vuk::make_sampled_image(get_gpu_asset_cache().get_texture_or_upload(material_cpu.emissive_asset_path).value.view.get(), material_cpu.sampler.get());
+}
+
 
 
 bool inspect(MaterialCPU* material, RenderScene* render_scene) {
@@ -133,6 +138,7 @@ void save_material(MaterialCPU& material_cpu) {
     assert_else(material_cpu.file_path.extension() == MaterialCPU::extension());
     
     file_dump(j, material_cpu.file_path.abs_string());
+    get_gpu_asset_cache().assets_saved = true;
 }
 
 MaterialCPU load_material(const FilePath& file_path) {
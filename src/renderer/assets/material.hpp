@@ -66,12 +66,15 @@ struct MaterialGPU {
 
     vuk::CullModeFlags cull_mode;
 
-    bool frame_allocated = false;
+    bool   frame_allocated = false;
+    uint64 last_used_frame = 0;
     
     void bind_parameters(vuk::CommandBuffer& cbuf);
     void bind_textures(vuk::CommandBuffer& cbuf);
 
     void update_from_cpu(const MaterialCPU& new_material);
+    // Rebinds all textures, placeholders are swapped for textures that finished streaming
+    void refresh_textures();
 };
 
 bool inspect(MaterialCPU* material, RenderScene* render_scene = nullptr);
@@ -8,11 +8,14 @@
 #include "general/file/file_cache.hpp"
 
 #include "renderer/gpu_asset_cache.hpp"
+#include "renderer/assets/chunked_lz4.hpp"
+#include "renderer/asset_streamer.hpp"
 #include "renderer/renderer.hpp"
 
 namespace spellbook {
 
-static v3 get_tangent(Vertex a, Vertex b, Vertex c) {
+// Scaled by the face's area so larger faces weigh more when accumulated into shared vertices
+static v3 get_face_tangent(const Vertex& a, const Vertex& b, const Vertex& c) {
     v3 ab    = b.position - a.position;
     v3 ac    = c.position - a.position;
     v2 ab_uv = b.uv - a.uv;
@@ -21,90 +24,291 @@ static v3 get_tangent(Vertex a, Vertex b, Vertex c) {
         ab_uv = v2(1, 0);
         ac_uv = v2(0, 1);
     }
-    auto f            = 1.0f / math::cross(ab_uv, ac_uv);
-    v3   unnormalized = f * (ac_uv.y * ab - ab_uv.y * ac);
-    if (unnormalized == v3(0))
-        unnormalized = v3(1, 0, 0);
-    return math::normalize(unnormalized);
+    v3    direction = ac_uv.y * ab - ab_uv.y * ac;
+    float length    = math::length(direction);
+    if (length < 0.000001f)
+        return v3(0);
+    // Mirrored uvs flip the tangent
+    float sign = math::cross(ab_uv, ac_uv) < 0.0f ? -1.0f : 1.0f;
+    return direction * (sign * 0.5f * math::length(math::cross(ab, ac)) / length);
 }
 
 void MeshCPU::fix_tangents() {
+    vector<v3> accumulated;
+    accumulated.resize(vertices.size());
     for (int i = 0; (i + 2) < indices.size(); i+=3) {
-        v3 tangent = get_tangent(vertices[indices[i+0]],vertices[indices[i+1]],vertices[indices[i+2]]);
-        vertices[indices[i+0]].tangent = vertices[indices[i+1]].tangent = vertices[indices[i+2]].tangent = tangent;
+        v3 tangent = get_face_tangent(vertices[indices[i+0]],vertices[indices[i+1]],vertices[indices[i+2]]);
+        for (int corner = 0; corner < 3; corner++)
+            accumulated[indices[i + corner]] += tangent;
     }
+
+    for (uint32 i = 0; i < vertices.size(); i++) {
+        // Gram-Schmidt against the normal, falls back to any perpendicular when the uvs are degenerate
+        v3 normal  = vertices[i].normal;
+        v3 tangent = accumulated[i] - normal * math::dot(normal, accumulated[i]);
+        if (math::length(tangent) < 0.000001f) {
+            v3 axis = math::abs(normal.x) < 0.9f ? v3(1, 0, 0) : v3(0, 1, 0);
+            tangent = axis - normal * math::dot(normal, axis);
+        }
+        vertices[i].tangent = math::length(tangent) < 0.000001f ? v3(1, 0, 0) : math::normalize(tangent);
+    }
+}
+
+MeshBounds calculate_bounds(std::span<const Vertex> vertices) {
+    MeshBounds bounds;
+    if (vertices.empty())
+        return bounds;
+
+    v3 low  = vertices[0].position;
+    v3 high = vertices[0].position;
+    for (const Vertex& vertex : vertices) {
+        for (int axis = 0; axis < 3; axis++) {
+            low[axis]  = math::min(low[axis], vertex.position[axis]);
+            high[axis] = math::max(high[axis], vertex.position[axis]);
+        }
+    }
+    bounds.origin  = (low + high) * 0.5f;
+    bounds.extents = (high - low) * 0.5f;
+
+    // Tighter than the box's corner, most meshes don't fill their corners
+    for (const Vertex& vertex : vertices)
+        bounds.radius = math::max(bounds.radius, math::length(vertex.position - bounds.origin));
+    bounds.valid = true;
+    return bounds;
+}
+
+void MeshCPU::calculate_bounds() {
+    bounds = spellbook::calculate_bounds(vertices);
+}
+
+VertexQuantization vertex_quantization(const MeshBounds& bounds) {
+    return {.low = bounds.origin - bounds.extents, .size = bounds.extents * 2.0f};
+}
+
+VertexEncoding choose_vertex_encoding(std::span<const Vertex> vertices, const MeshBounds& bounds) {
+    constexpr float position_tolerance = 0.001f; // World units per 16 bit step
+    constexpr float uv_limit           = 4.0f;   // Half floats are still within 1/512 below this
+    if (!bounds.valid || vertices.empty())
+        return VertexEncoding_Full;
+    float largest_size = math::max(math::max(bounds.extents.x, bounds.extents.y), bounds.extents.z) * 2.0f;
+    if (largest_size / 65535.0f > position_tolerance)
+        return VertexEncoding_Full;
+    for (const Vertex& vertex : vertices) {
+        if (math::abs(vertex.uv.x) > uv_limit || math::abs(vertex.uv.y) > uv_limit)
+            return VertexEncoding_Full;
+    }
+    return VertexEncoding_Packed;
+}
+
+vector<PackedVertex> pack_vertices(std::span<const Vertex> vertices, const MeshBounds& bounds) {
+    VertexQuantization quantization = vertex_quantization(bounds);
+    vector<PackedVertex> packed;
+    packed.resize(vertices.size());
+    for (uint32 i = 0; i < vertices.size(); i++)
+        packed[i] = pack_vertex(vertices[i], quantization);
+    return packed;
+}
+
+GPUVertexDequant vertex_dequant(const MeshGPU* mesh) {
+    if (mesh == nullptr || mesh->encoding == VertexEncoding_Full)
+        return {};
+    return {
+        .low  = v4(mesh->quantization.low, 1.0f),
+        .size = v4(mesh->quantization.size, 0.0f)
+    };
 }
 
 uint64 upload_mesh(const MeshCPU& mesh_cpu, bool frame_allocation) {
-    if (!mesh_cpu.file_path.is_file())
+    MeshBounds bounds = mesh_cpu.bounds.valid ? mesh_cpu.bounds : calculate_bounds(mesh_cpu.vertices);
+    if (mesh_cpu.encoding == VertexEncoding_Packed && bounds.valid) {
+        vector<PackedVertex> packed = pack_vertices(mesh_cpu.vertices, bounds);
+        return upload_mesh(mesh_cpu.file_path, std::span((const uint8*) packed.data(), packed.bsize()), VertexEncoding_Packed, mesh_cpu.indices, bounds, mesh_cpu.lods, frame_allocation, &mesh_cpu.bvh);
+    }
+    return upload_mesh(mesh_cpu.file_path, std::span((const uint8*) mesh_cpu.vertices.data(), mesh_cpu.vertices.bsize()), VertexEncoding_Full, mesh_cpu.indices, bounds, mesh_cpu.lods, frame_allocation, &mesh_cpu.bvh);
+}
+
+std::span<const uint32> lod0_indices(std::span<const uint32> indices, std::span<const MeshLOD> lods) {
+    if (lods.empty())
+        return indices;
+    return indices.subspan(lods[0].first_index, lods[0].index_count);
+}
+
+BVH bake_mesh_bvh(const MeshCPU& mesh_cpu, std::span<const PackedVertex> packed) {
+    vector<v3> positions;
+    positions.resize(mesh_cpu.vertices.size());
+    VertexQuantization quantization = vertex_quantization(mesh_cpu.bounds);
+    for (uint32 i = 0; i < positions.size(); i++)
+        positions[i] = !packed.empty() ? unpack_vertex(packed[i], quantization).position : mesh_cpu.vertices[i].position;
+    return build_triangle_bvh(positions, lod0_indices(mesh_cpu.indices, mesh_cpu.lods));
+}
+
+void MeshGPU::update_arena_views() {
+    const GeometryArena& arena = *allocation.arena;
+    vertex_offset = allocation.vertex_offset / allocation.vertex_stride;
+    first_index   = allocation.first_index;
+    vertex_buffer = arena.vertex_buffer->subrange(allocation.vertex_offset, allocation.vertex_bsize);
+    index_buffer  = arena.index_buffer->subrange(allocation.first_index * sizeof(uint32), allocation.index_count * sizeof(uint32));
+}
+
+uint64 upload_mesh(const FilePath& file_path, std::span<const uint8> vertex_data, VertexEncoding encoding, std::span<const uint32> indices, const MeshBounds& bounds, std::span<const MeshLOD> lods, bool frame_allocation, const BVH* bvh) {
+    if (!file_path.is_file())
         return 0;
-    uint64 mesh_cpu_hash = hash_view(mesh_cpu.file_path.rel_string_view());
+    uint64 mesh_cpu_hash = hash_view(file_path.rel_string_view());
     if (get_gpu_asset_cache().meshes.contains(mesh_cpu_hash))
         return mesh_cpu_hash;
+    assert_else(encoding == VertexEncoding_Full || bounds.valid)
+        return 0;
+
+    uint64 vertex_bsize = encoding == VertexEncoding_Packed ? sizeof(PackedVertex) : sizeof(Vertex);
     MeshGPU         mesh_gpu;
     mesh_gpu.frame_allocated = frame_allocation;
-    vuk::Allocator& alloc                = frame_allocation ? *get_renderer().frame_allocator : *get_renderer().global_allocator;
-    auto            [vert_buf, vert_fut] = vuk::create_buffer(alloc, vuk::MemoryUsage::eGPUonly, vuk::DomainFlagBits::eTransferOnTransfer, std::span(mesh_cpu.vertices));
-    mesh_gpu.vertex_buffer               = std::move(vert_buf);
-    auto [idx_buf, idx_fut]              = vuk::create_buffer(alloc, vuk::MemoryUsage::eGPUonly, vuk::DomainFlagBits::eTransferOnTransfer, std::span(mesh_cpu.indices));
-    mesh_gpu.index_buffer                = std::move(idx_buf);
-    mesh_gpu.index_count                 = mesh_cpu.indices.size();
-    mesh_gpu.vertex_count                = mesh_cpu.vertices.size();
+    mesh_gpu.last_used_frame = get_gpu_asset_cache().frame;
+    mesh_gpu.index_count     = lods.empty() ? indices.size() : lods[0].index_count;
+    mesh_gpu.vertex_count    = vertex_data.size() / vertex_bsize;
+    mesh_gpu.encoding        = encoding;
+    mesh_gpu.bounds          = bounds.valid ? bounds : calculate_bounds(std::span((const Vertex*) vertex_data.data(), mesh_gpu.vertex_count));
+    if (encoding == VertexEncoding_Packed)
+        mesh_gpu.quantization = vertex_quantization(bounds);
+    mesh_gpu.lods[0]   = {.first_index = 0, .index_count = uint32(indices.size())};
+    mesh_gpu.lod_count = 1;
+    if (!lods.empty()) {
+        mesh_gpu.lod_count = math::min(uint32(lods.size()), max_mesh_lods);
+        for (uint32 i = 0; i < mesh_gpu.lod_count; i++)
+            mesh_gpu.lods[i] = lods[i];
+    }
+
+    // Persistent meshes share the arena, packed ones can then also be drawn indirectly
+    GeometryArena& arena = get_gpu_asset_cache().geometry_arena;
+    if (!frame_allocation && arena.allocate(vertex_data.size_bytes(), vertex_bsize, uint32(indices.size()), mesh_gpu.allocation)) {
+        mesh_gpu.in_arena = true;
+        mesh_gpu.update_arena_views();
+        arena.stage(vertex_data, mesh_gpu.vertex_buffer);
+        arena.stage(std::span((const uint8*) indices.data(), indices.size_bytes()), mesh_gpu.index_buffer);
+    } else {
+        vuk::Allocator& alloc                = frame_allocation ? *get_renderer().frame_allocator : *get_renderer().global_allocator;
+        auto            [vert_buf, vert_fut] = vuk::create_buffer(alloc, vuk::MemoryUsage::eGPUonly, vuk::DomainFlagBits::eTransferOnTransfer, vertex_data);
+        mesh_gpu.owned_vertex_buffer         = std::move(vert_buf);
+        mesh_gpu.vertex_buffer               = *mesh_gpu.owned_vertex_buffer;
+        auto [idx_buf, idx_fut]              = vuk::create_buffer(alloc, vuk::MemoryUsage::eGPUonly, vuk::DomainFlagBits::eTransferOnTransfer, indices);
+        mesh_gpu.owned_index_buffer          = std::move(idx_buf);
+        mesh_gpu.index_buffer                = *mesh_gpu.owned_index_buffer;
 
-    get_renderer().enqueue_setup(std::move(vert_fut));
-    get_renderer().enqueue_setup(std::move(idx_fut));
+        get_renderer().enqueue_setup(std::move(vert_fut));
+        get_renderer().enqueue_setup(std::move(idx_fut));
+    }
+
+    if (!frame_allocation) {
+        vector<v3> positions;
+        positions.resize(mesh_gpu.vertex_count);
+        if (encoding == VertexEncoding_Packed) {
+            const PackedVertex* packed = (const PackedVertex*) vertex_data.data();
+            for (uint32 i = 0; i < positions.size(); i++)
+                positions[i] = unpack_vertex(packed[i], mesh_gpu.quantization).position;
+        } else {
+            const Vertex* full = (const Vertex*) vertex_data.data();
+            for (uint32 i = 0; i < positions.size(); i++)
+                positions[i] = full[i].position;
+        }
+        get_gpu_asset_cache().mesh_bvhs[mesh_cpu_hash] = make_mesh_bvh(std::move(positions), lod0_indices(indices, lods), bvh);
+    }
 
     get_gpu_asset_cache().meshes[mesh_cpu_hash] = std::move(mesh_gpu);
-    get_gpu_asset_cache().paths[mesh_cpu_hash] = mesh_cpu.file_path;
+    get_gpu_asset_cache().paths[mesh_cpu_hash] = file_path;
     return mesh_cpu_hash;
 }
 
 MeshCPU load_mesh(const FilePath& file_path) {
     // TODO: CompressionMode
-    AssetFile& asset_file = FileCache::get().load_asset(file_path);
+    AssetFile asset_file;
+    {
+        // Copied out of the cache so decompression doesn't hold the lock
+        std::scoped_lock lock(get_asset_io_mutex());
+        asset_file = FileCache::get().load_asset(file_path);
+    }
 
     MeshInfo mesh_info = from_jv<MeshInfo>(*asset_file.asset_json["mesh_info"]);
     MeshCPU mesh_cpu = from_jv<MeshCPU>(*asset_file.asset_json["mesh_cpu"]);
     mesh_cpu.file_path = file_path;
 
     vector<uint8> decompressed;
-    decompressed.resize(mesh_info.vertices_bsize + mesh_info.indices_bsize);
-    LZ4_decompress_safe((const char*) asset_file.binary_blob.data(), (char*) decompressed.data(), asset_file.binary_blob.size(), (int32) (decompressed.size()));
+    decompressed.resize(mesh_info.vertices_bsize + mesh_info.indices_bsize + mesh_info.bvh_nodes_bsize + mesh_info.bvh_primitives_bsize);
+    // Assets baked before chunking are a single LZ4 block, which LZ4 itself limits to int32 sizes
+    if (is_chunked(asset_file.binary_blob)) {
+        assert_else(chunked_decompress(asset_file.binary_blob, decompressed))
+            return {};
+    } else {
+        assert_else(decompressed.size() <= INT32_MAX && asset_file.binary_blob.size() <= INT32_MAX &&
+                    LZ4_decompress_safe((const char*) asset_file.binary_blob.data(), (char*) decompressed.data(),
+                                        int32(asset_file.binary_blob.size()), int32(decompressed.size())) == int32(decompressed.size()))
+            return {};
+    }
 
-    mesh_cpu.vertices.rebsize(mesh_info.vertices_bsize);
+    mesh_cpu.encoding = VertexEncoding(mesh_info.vertex_encoding);
+    if (mesh_cpu.encoding == VertexEncoding_Packed) {
+        VertexQuantization  quantization = vertex_quantization(mesh_cpu.bounds);
+        const PackedVertex* packed       = (const PackedVertex*) decompressed.data();
+        mesh_cpu.vertices.resize(mesh_info.vertices_bsize / sizeof(PackedVertex));
+        for (uint32 i = 0; i < mesh_cpu.vertices.size(); i++)
+            mesh_cpu.vertices[i] = unpack_vertex(packed[i], quantization);
+    } else {
+        mesh_cpu.vertices.rebsize(mesh_info.vertices_bsize);
+        memcpy(mesh_cpu.vertices.data(), decompressed.data(), mesh_info.vertices_bsize);
+    }
     mesh_cpu.indices.rebsize(mesh_info.indices_bsize);
-
-    memcpy(mesh_cpu.vertices.data(), decompressed.data(), mesh_info.vertices_bsize);
     memcpy(mesh_cpu.indices.data(), decompressed.data() + mesh_info.vertices_bsize, mesh_info.indices_bsize);
+    if (mesh_info.bvh_nodes_bsize > 0) {
+        const uint8* bvh_data = decompressed.data() + mesh_info.vertices_bsize + mesh_info.indices_bsize;
+        mesh_cpu.bvh.nodes.resize(mesh_info.bvh_nodes_bsize / sizeof(BVHNode));
+        memcpy(mesh_cpu.bvh.nodes.data(), bvh_data, mesh_info.bvh_nodes_bsize);
+        mesh_cpu.bvh.primitives.resize(mesh_info.bvh_primitives_bsize / sizeof(uint32));
+        memcpy(mesh_cpu.bvh.primitives.data(), bvh_data + mesh_info.bvh_nodes_bsize, mesh_info.bvh_primitives_bsize);
+    }
 
     return mesh_cpu;
 }
 
-void save_mesh(const MeshCPU& mesh_cpu) {
+void save_mesh(const MeshCPU& mesh_cpu, int32 compression_level) {
     AssetFile file;
     file.file_path = mesh_cpu.file_path;
 
+    // Packed vertices are stored packed, the file shrinks along with the GPU copy
+    VertexEncoding       encoding = choose_vertex_encoding(mesh_cpu.vertices, mesh_cpu.bounds);
+    vector<PackedVertex> packed;
+    if (encoding == VertexEncoding_Packed)
+        packed = pack_vertices(mesh_cpu.vertices, mesh_cpu.bounds);
+    const void* vertex_data = encoding == VertexEncoding_Packed ? (const void*) packed.data() : (const void*) mesh_cpu.vertices.data();
+
     MeshInfo mesh_info;
-    mesh_info.vertices_bsize = mesh_cpu.vertices.bsize();
-    mesh_info.indices_bsize  = mesh_cpu.indices.bsize();
-    mesh_info.index_bsize    = sizeof(uint32);
+    mesh_info.vertices_bsize  = encoding == VertexEncoding_Packed ? packed.bsize() : mesh_cpu.vertices.bsize();
+    mesh_info.indices_bsize   = mesh_cpu.indices.bsize();
+    mesh_info.index_bsize     = sizeof(uint32);
+    mesh_info.vertex_encoding = encoding;
+
+    BVH bvh = bake_mesh_bvh(mesh_cpu, packed);
+    mesh_info.bvh_nodes_bsize      = bvh.nodes.bsize();
+    mesh_info.bvh_primitives_bsize = bvh.primitives.bsize();
 
     vector<uint8> merged_buffer;
-    merged_buffer.resize(uint32(mesh_info.vertices_bsize + mesh_info.indices_bsize));
-    memcpy(merged_buffer.data(), mesh_cpu.vertices.data(), mesh_info.vertices_bsize);
-    memcpy(merged_buffer.data() + mesh_info.vertices_bsize, mesh_cpu.indices.data(), mesh_info.indices_bsize);
+    merged_buffer.resize(mesh_info.vertices_bsize + mesh_info.indices_bsize + mesh_info.bvh_nodes_bsize + mesh_info.bvh_primitives_bsize);
+    uint8* write = merged_buffer.data();
+    memcpy(write, vertex_data, mesh_info.vertices_bsize);
+    write += mesh_info.vertices_bsize;
+    memcpy(write, mesh_cpu.indices.data(), mesh_info.indices_bsize);
+    write += mesh_info.indices_bsize;
+    memcpy(write, bvh.nodes.data(), mesh_info.bvh_nodes_bsize);
+    write += mesh_info.bvh_nodes_bsize;
+    memcpy(write, bvh.primitives.data(), mesh_info.bvh_primitives_bsize);
 
-    int32 compress_staging = LZ4_compressBound(int32(mesh_info.vertices_bsize + mesh_info.indices_bsize));
-    file.binary_blob.resize(compress_staging);
-    int32 compressed_bsize = LZ4_compress_default((char*) merged_buffer.data(), (char*) file.binary_blob.data(), int32(merged_buffer.size()), int32(compress_staging));
-    file.binary_blob.resize(compressed_bsize);
+    file.binary_blob = chunked_compress(merged_buffer, compression_level);
 
     json j;
     j["mesh_cpu"] = make_shared<json_value>(to_jv(mesh_cpu));
     j["mesh_info"] = make_shared<json_value>(to_jv(mesh_info));
     file.asset_json = j;
 
+    std::scoped_lock lock(get_asset_io_mutex());
     save_asset_file(file);
+    get_gpu_asset_cache().assets_saved = true;
 }
 
 }
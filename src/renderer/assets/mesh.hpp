@@ -1,5 +1,7 @@
 #pragma once
 
+#include <array>
+#include <span>
 #include <vuk/Types.hpp>
 #include <vuk/Buffer.hpp>
 
@@ -10,22 +12,38 @@
 #include "general/file/resource.hpp"
 
 #include "renderer/vertex.hpp"
+#include "renderer/bvh.hpp"
+#include "renderer/geometry_arena.hpp"
+#include "renderer/assets/chunked_lz4.hpp"
 
 namespace spellbook {
 
 struct MeshInfo {
-    uint32 vertices_bsize = 0;
-    uint32 indices_bsize  = 0;
-    uint32 index_bsize    = 0;
+    uint64 vertices_bsize  = 0;
+    uint64 indices_bsize   = 0;
+    uint32 index_bsize     = 0;
+    uint32 vertex_encoding = VertexEncoding_Full;
+    // Baked triangle BVH after the indices, 0 for meshes saved before it was baked
+    uint64 bvh_nodes_bsize      = 0;
+    uint64 bvh_primitives_bsize = 0;
 };
 
-JSON_IMPL(MeshInfo, vertices_bsize, indices_bsize, index_bsize);
+JSON_IMPL(MeshInfo, vertices_bsize, indices_bsize, index_bsize, vertex_encoding, bvh_nodes_bsize, bvh_primitives_bsize);
 
 struct MeshBounds {
-    bool valid;
-    v3   extents;
-    v3   origin;
-    float  radius;
+    bool valid = false;
+    v3   extents = {};
+    v3   origin = {};
+    float  radius = 0.0f;
+};
+
+constexpr uint32 max_mesh_lods = 4;
+
+// A range of the mesh's indices drawing it at one level of detail, all levels share the vertices
+struct MeshLOD {
+    uint32 first_index = 0;
+    uint32 index_count = 0;
+    float  error       = 0.0f; // Furthest the surface moved from LOD 0, relative to the bounds radius
 };
 
 struct MeshCPU : Resource {
@@ -33,8 +51,15 @@ struct MeshCPU : Resource {
     vector<uint32> indices;
 
     MeshBounds bounds;
+    // Empty when indices is a single level, otherwise LOD 0 first and each level after it coarser
+    vector<MeshLOD> lods;
+    // Chosen by save_mesh, vertices stay unpacked on the CPU either way
+    VertexEncoding encoding = VertexEncoding_Full;
+    // Over LOD 0's triangles, baked by save_mesh. Empty ones are built on upload.
+    BVH bvh;
 
     void fix_tangents();
+    void calculate_bounds();
 
     static constexpr string_view extension() { return ".sbamsh"; }
     static constexpr string_view dnd_key() { return "DND_MESH"; }
@@ -43,20 +68,58 @@ struct MeshCPU : Resource {
     static std::function<bool(const FilePath&)> path_filter() { return [](const FilePath& path) { return path.extension() == MeshCPU::extension(); }; }
 };
 JSON_IMPL(MeshBounds, valid, extents, origin, radius);
-JSON_IMPL(MeshCPU, bounds);
+JSON_IMPL(MeshLOD, first_index, index_count, error);
+JSON_IMPL(MeshCPU, bounds, lods);
 
 struct MeshGPU {
-    vuk::Unique<vuk::Buffer> vertex_buffer;
-    vuk::Unique<vuk::Buffer> index_buffer;
+    // Views of this mesh's range in the geometry arena, or of owned_*_buffer when it has its own
+    vuk::Buffer vertex_buffer;
+    vuk::Buffer index_buffer;
+    vuk::Unique<vuk::Buffer> owned_vertex_buffer;
+    vuk::Unique<vuk::Buffer> owned_index_buffer;
 
     uint32 vertex_count;
-    uint32 index_count;
+    uint32 index_count; // Of LOD 0, for draws that don't pick a level
+
+    // Relative to first_index, or to the start of index_buffer
+    std::array<MeshLOD, max_mesh_lods> lods;
+    uint32                             lod_count = 1;
+
+    // vertex_offset counts vertices of this mesh's encoding, so it works with that format bound over the whole arena
+    bool               in_arena      = false;
+    uint32             vertex_offset = 0;
+    uint32             first_index   = 0;
+    GeometryAllocation allocation;
 
-    bool frame_allocated;
+    MeshBounds bounds;
+
+    VertexEncoding     encoding = VertexEncoding_Full;
+    VertexQuantization quantization;
+
+    bool   frame_allocated;
+    uint64 last_used_frame = 0;
+
+    uint64 bsize() const { return vertex_buffer.size + index_buffer.size; }
+    // After the allocation moved, like on GeometryArena::defragment
+    void   update_arena_views();
 };
 
+MeshBounds calculate_bounds(std::span<const Vertex> vertices);
+VertexQuantization vertex_quantization(const MeshBounds& bounds);
+// Packed when the bounds are small enough for 16 bit positions and the uvs for half floats to stay within tolerance
+VertexEncoding choose_vertex_encoding(std::span<const Vertex> vertices, const MeshBounds& bounds);
+vector<PackedVertex> pack_vertices(std::span<const Vertex> vertices, const MeshBounds& bounds);
+GPUVertexDequant vertex_dequant(const MeshGPU* mesh);
+
 MeshCPU load_mesh(const FilePath& file_path);
-void    save_mesh(const MeshCPU& mesh_cpu);
+void    save_mesh(const MeshCPU& mesh_cpu, int32 compression_level = default_compression_level);
 uint64 upload_mesh(const MeshCPU&, bool frame_allocation = false);
+// For data that doesn't live in a MeshCPU, like a mapped asset pack. vertex_data holds Vertex or PackedVertex
+// depending on encoding, packed positions are relative to bounds. Empty lods draws all of indices as one level.
+// Persistent meshes also get a MeshBVH for picking, from bvh when it was baked.
+uint64 upload_mesh(const FilePath& file_path, std::span<const uint8> vertex_data, VertexEncoding encoding, std::span<const uint32> indices, const MeshBounds& bounds, std::span<const MeshLOD> lods, bool frame_allocation = false, const BVH* bvh = nullptr);
+std::span<const uint32> lod0_indices(std::span<const uint32> indices, std::span<const MeshLOD> lods);
+// Over the LOD 0 triangles at the positions the mesh loads with, so from packed when the mesh is stored packed
+BVH bake_mesh_bvh(const MeshCPU& mesh_cpu, std::span<const PackedVertex> packed = {});
 
 }
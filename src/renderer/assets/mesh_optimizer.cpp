@@ -0,0 +1,303 @@
+#include "mesh_optimizer.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cfloat>
+#include <numeric>
+#include <lz4/xxhash.h>
+#include <tracy/Tracy.hpp>
+
+#include "general/math/math.hpp"
+
+#include "renderer/assets/mesh.hpp"
+
+namespace spellbook {
+
+float calculate_acmr(std::span<const uint32> indices, uint32 vertex_count, uint32 cache_size) {
+    if (indices.size() < 3)
+        return 0.0f;
+
+    // Timestamps instead of an actual FIFO, a vertex is cached if it was pushed within the last cache_size misses
+    vector<uint32> pushed_at;
+    pushed_at.resize(vertex_count);
+    std::fill(pushed_at.begin(), pushed_at.end(), 0);
+    uint32 misses = 0;
+    for (uint32 index : indices) {
+        if (pushed_at[index] == 0 || misses + 1 - pushed_at[index] > cache_size)
+            pushed_at[index] = ++misses;
+    }
+    return float(misses) / float(indices.size() / 3);
+}
+
+uint32 weld_vertices(vector<Vertex>& vertices, vector<uint32>& indices) {
+    ZoneScoped;
+    // Open addressing over vertex indices, sized to stay at most half full
+    uint32 table_size = std::bit_ceil(math::max(uint32(vertices.size()) * 2, 16u));
+    vector<uint32> table;
+    table.resize(table_size);
+    std::fill(table.begin(), table.end(), UINT32_MAX);
+
+    vector<uint32> remap;
+    remap.resize(vertices.size());
+    uint32 unique_count = 0;
+    for (uint32 i = 0; i < vertices.size(); i++) {
+        uint32 slot = uint32(XXH64(&vertices[i], sizeof(Vertex), 0)) & (table_size - 1);
+        while (table[slot] != UINT32_MAX && memcmp(&vertices[table[slot]], &vertices[i], sizeof(Vertex)) != 0)
+            slot = (slot + 1) & (table_size - 1);
+
+        if (table[slot] == UINT32_MAX) {
+            // Unique vertices are compacted in place, the one at table[slot] is always already written
+            vertices[unique_count] = vertices[i];
+            table[slot] = unique_count++;
+        }
+        remap[i] = table[slot];
+    }
+    vertices.resize(unique_count);
+    for (uint32& index : indices)
+        index = remap[index];
+    return unique_count;
+}
+
+namespace forsyth {
+
+constexpr uint32 cache_size        = 32;
+constexpr float  cache_decay_power = 1.5f;
+constexpr float  last_tri_score    = 0.75f;
+constexpr float  valence_boost     = 2.0f;
+constexpr float  valence_power     = 0.5f;
+
+static float vertex_score(int32 cache_position, uint32 remaining_triangles) {
+    if (remaining_triangles == 0)
+        return -1.0f;
+
+    float score = 0.0f;
+    if (cache_position >= 0) {
+        // The three vertices of the triangle just drawn get a fixed score so they aren't favoured too heavily
+        if (cache_position < 3) {
+            score = last_tri_score;
+        } else {
+            float scaler = 1.0f / float(cache_size - 3);
+            score = math::pow(1.0f - float(cache_position - 3) * scaler, cache_decay_power);
+        }
+    }
+    // Boost vertices with few triangles left so stragglers get finished off
+    return score + valence_boost * math::pow(float(remaining_triangles), -valence_power);
+}
+
+}
+
+void optimize_vertex_cache(vector<uint32>& indices, uint32 vertex_count) {
+    ZoneScoped;
+    uint32 triangle_count = indices.size() / 3;
+    if (triangle_count == 0)
+        return;
+
+    // Triangle adjacency per vertex, as offsets into one flat list
+    vector<uint32> remaining, adjacency_offset, adjacency;
+    remaining.resize(vertex_count);
+    adjacency_offset.resize(vertex_count + 1);
+    std::fill(remaining.begin(), remaining.end(), 0);
+    for (uint32 i = 0; i < triangle_count * 3; i++)
+        remaining[indices[i]]++;
+    adjacency_offset[0] = 0;
+    for (uint32 v = 0; v < vertex_count; v++)
+        adjacency_offset[v + 1] = adjacency_offset[v] + remaining[v];
+    adjacency.resize(triangle_count * 3);
+    {
+        vector<uint32> fill;
+        fill.resize(vertex_count);
+        std::fill(fill.begin(), fill.end(), 0);
+        for (uint32 i = 0; i < triangle_count * 3; i++) {
+            uint32 v = indices[i];
+            adjacency[adjacency_offset[v] + fill[v]++] = i / 3;
+        }
+    }
+
+    vector<int32> cache_position;
+    vector<float> score;
+    cache_position.resize(vertex_count);
+    score.resize(vertex_count);
+    for (uint32 v = 0; v < vertex_count; v++) {
+        cache_position[v] = -1;
+        score[v]          = forsyth::vertex_score(-1, remaining[v]);
+    }
+
+    vector<float> triangle_score;
+    vector<uint8> emitted;
+    triangle_score.resize(triangle_count);
+    emitted.resize(triangle_count);
+    for (uint32 t = 0; t < triangle_count; t++) {
+        triangle_score[t] = score[indices[t * 3 + 0]] + score[indices[t * 3 + 1]] + score[indices[t * 3 + 2]];
+        emitted[t]        = 0;
+    }
+
+    vector<uint32> output;
+    output.reserve(indices.size());
+    vector<uint32> cache, next_cache;
+    uint32 scan_cursor = 0;
+    uint32 best        = UINT32_MAX;
+    for (uint32 emitted_count = 0; emitted_count < triangle_count; emitted_count++) {
+        // Nothing in the cache touches a pending triangle, fall back to the next unemitted one
+        if (best == UINT32_MAX) {
+            while (emitted[scan_cursor])
+                scan_cursor++;
+            best = scan_cursor;
+        }
+
+        emitted[best] = 1;
+        next_cache.clear();
+        for (uint32 corner = 0; corner < 3; corner++) {
+            uint32 v = indices[best * 3 + corner];
+            output.push_back(v);
+            next_cache.push_back(v);
+
+            remaining[v]--;
+            uint32* first = adjacency.data() + adjacency_offset[v];
+            uint32* last  = first + remaining[v] + 1;
+            *std::find(first, last, best) = *(last - 1);
+        }
+        for (uint32 v : cache) {
+            if (std::find(next_cache.begin(), next_cache.end(), v) == next_cache.end())
+                next_cache.push_back(v);
+        }
+        // Vertices pushed out of the cache are rescored too
+        for (uint32 i = 0; i < next_cache.size(); i++)
+            cache_position[next_cache[i]] = i < forsyth::cache_size ? int32(i) : -1;
+        for (uint32 v : next_cache)
+            score[v] = forsyth::vertex_score(cache_position[v], remaining[v]);
+        if (next_cache.size() > forsyth::cache_size)
+            next_cache.resize(forsyth::cache_size);
+        std::swap(cache, next_cache);
+
+        best = UINT32_MAX;
+        float best_score = -1.0f;
+        for (uint32 v : cache) {
+            for (uint32 a = 0; a < remaining[v]; a++) {
+                uint32 t = adjacency[adjacency_offset[v] + a];
+                triangle_score[t] = score[indices[t * 3 + 0]] + score[indices[t * 3 + 1]] + score[indices[t * 3 + 2]];
+                if (triangle_score[t] > best_score) {
+                    best_score = triangle_score[t];
+                    best       = t;
+                }
+            }
+        }
+    }
+    indices = std::move(output);
+}
+
+void optimize_overdraw(vector<uint32>& indices, std::span<const Vertex> vertices) {
+    ZoneScoped;
+    uint32 triangle_count = indices.size() / 3;
+    if (triangle_count == 0)
+        return;
+
+    // A triangle that misses on all three vertices starts a cluster, splitting there doesn't cost cache hits
+    vector<uint32> cluster_starts;
+    {
+        constexpr uint32 cache_size = 16;
+        vector<uint32> pushed_at;
+        pushed_at.resize(vertices.size());
+        std::fill(pushed_at.begin(), pushed_at.end(), 0);
+        uint32 misses = 0;
+        for (uint32 t = 0; t < triangle_count; t++) {
+            uint32 triangle_misses = 0;
+            for (uint32 corner = 0; corner < 3; corner++) {
+                uint32 index = indices[t * 3 + corner];
+                if (pushed_at[index] == 0 || misses + 1 - pushed_at[index] > cache_size) {
+                    pushed_at[index] = ++misses;
+                    triangle_misses++;
+                }
+            }
+            if (t == 0 || triangle_misses == 3)
+                cluster_starts.push_back(t);
+        }
+    }
+    if (cluster_starts.size() < 2)
+        return;
+
+    v3 mesh_center = v3(0);
+    for (const Vertex& vertex : vertices)
+        mesh_center += vertex.position;
+    mesh_center /= float(vertices.size());
+
+    // Clusters facing away from the center with their centroid far along that direction are drawn first
+    uint32 cluster_count = cluster_starts.size();
+    vector<float> sort_key;
+    sort_key.resize(cluster_count);
+    for (uint32 c = 0; c < cluster_count; c++) {
+        uint32 begin = cluster_starts[c];
+        uint32 end   = c + 1 < cluster_count ? cluster_starts[c + 1] : triangle_count;
+
+        v3    centroid = v3(0);
+        v3    normal   = v3(0);
+        float area     = 0.0f;
+        for (uint32 t = begin; t < end; t++) {
+            const v3& p0 = vertices[indices[t * 3 + 0]].position;
+            const v3& p1 = vertices[indices[t * 3 + 1]].position;
+            const v3& p2 = vertices[indices[t * 3 + 2]].position;
+            v3    cross         = math::cross(p1 - p0, p2 - p0);
+            float triangle_area = math::length(cross);
+            centroid += (p0 + p1 + p2) * (triangle_area / 3.0f);
+            normal   += cross;
+            area     += triangle_area;
+        }
+        float normal_length = math::length(normal);
+        if (area < 0.000001f || normal_length < 0.000001f) {
+            sort_key[c] = -FLT_MAX;
+            continue;
+        }
+        sort_key[c] = math::dot(centroid / area - mesh_center, normal / normal_length);
+    }
+
+    vector<uint32> order;
+    order.resize(cluster_count);
+    std::iota(order.begin(), order.end(), 0u);
+    std::stable_sort(order.begin(), order.end(), [&sort_key](uint32 l, uint32 r) { return sort_key[l] > sort_key[r]; });
+
+    vector<uint32> output;
+    output.reserve(indices.size());
+    for (uint32 c : order) {
+        uint32 begin = cluster_starts[c];
+        uint32 end   = c + 1 < cluster_count ? cluster_starts[c + 1] : triangle_count;
+        for (uint32 i = begin * 3; i < end * 3; i++)
+            output.push_back(indices[i]);
+    }
+    indices = std::move(output);
+}
+
+void optimize_vertex_fetch(vector<Vertex>& vertices, vector<uint32>& indices) {
+    ZoneScoped;
+    vector<uint32> remap;
+    remap.resize(vertices.size());
+    std::fill(remap.begin(), remap.end(), UINT32_MAX);
+
+    vector<Vertex> reordered;
+    reordered.reserve(vertices.size());
+    for (uint32& index : indices) {
+        if (remap[index] == UINT32_MAX) {
+            remap[index] = reordered.size();
+            reordered.push_back(vertices[index]);
+        }
+        index = remap[index];
+    }
+    // Unreferenced vertices are dropped
+    vertices = std::move(reordered);
+}
+
+MeshOptimizeStats optimize_mesh(MeshCPU& mesh_cpu) {
+    ZoneScoped;
+    MeshOptimizeStats stats;
+    stats.vertices_before = mesh_cpu.vertices.size();
+    stats.acmr_before     = calculate_acmr(mesh_cpu.indices, mesh_cpu.vertices.size());
+
+    weld_vertices(mesh_cpu.vertices, mesh_cpu.indices);
+    optimize_vertex_cache(mesh_cpu.indices, mesh_cpu.vertices.size());
+    optimize_overdraw(mesh_cpu.indices, mesh_cpu.vertices);
+    optimize_vertex_fetch(mesh_cpu.vertices, mesh_cpu.indices);
+
+    stats.vertices_after = mesh_cpu.vertices.size();
+    stats.acmr_after     = calculate_acmr(mesh_cpu.indices, mesh_cpu.vertices.size());
+    return stats;
+}
+
+}
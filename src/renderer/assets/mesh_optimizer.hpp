@@ -0,0 +1,37 @@
+#pragma once
+
+#include <span>
+
+#include "general/vector.hpp"
+
+#include "renderer/vertex.hpp"
+
+namespace spellbook {
+
+struct MeshCPU;
+
+struct MeshOptimizeStats {
+    uint32 vertices_before = 0;
+    uint32 vertices_after  = 0;
+    float  acmr_before     = 0.0f;
+    float  acmr_after      = 0.0f;
+};
+
+// Average cache miss ratio, transformed vertices per triangle through a FIFO post-transform cache. 0.5 is ideal
+// for a regular grid and 3.0 is the worst case.
+float calculate_acmr(std::span<const uint32> indices, uint32 vertex_count, uint32 cache_size = 16);
+
+// Merges bitwise identical vertices and remaps the indices, returns the new vertex count
+uint32 weld_vertices(vector<Vertex>& vertices, vector<uint32>& indices);
+// Forsyth's linear-speed reordering of triangles for the post-transform cache
+void   optimize_vertex_cache(vector<uint32>& indices, uint32 vertex_count);
+// Sorts cache-optimized clusters of triangles front to back from the outside, so the first clusters drawn occlude
+// the later ones from most directions. Clusters only break where the cache would be cold anyway.
+void   optimize_overdraw(vector<uint32>& indices, std::span<const Vertex> vertices);
+// Reorders vertices by first use so fetches walk the vertex buffer linearly
+void   optimize_vertex_fetch(vector<Vertex>& vertices, vector<uint32>& indices);
+
+// Runs all of the above in order
+MeshOptimizeStats optimize_mesh(MeshCPU& mesh_cpu);
+
+}
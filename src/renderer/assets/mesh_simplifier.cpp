@@ -0,0 +1,306 @@
+#include "mesh_simplifier.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <tracy/Tracy.hpp>
+
+#include "general/math/math.hpp"
+
+#include "renderer/assets/mesh.hpp"
+#include "renderer/assets/mesh_optimizer.hpp"
+
+namespace spellbook {
+
+// Symmetric 4x4 matrix summing squared distances to face planes, weighted by face area
+struct Quadric {
+    double a00 = 0.0, a01 = 0.0, a02 = 0.0, a03 = 0.0;
+    double a11 = 0.0, a12 = 0.0, a13 = 0.0;
+    double a22 = 0.0, a23 = 0.0;
+    double a33 = 0.0;
+    double weight = 0.0;
+
+    void add_plane(const v3& normal, float distance, double area) {
+        double x = normal.x, y = normal.y, z = normal.z, d = distance;
+        a00 += area * x * x; a01 += area * x * y; a02 += area * x * z; a03 += area * x * d;
+        a11 += area * y * y; a12 += area * y * z; a13 += area * y * d;
+        a22 += area * z * z; a23 += area * z * d;
+        a33 += area * d * d;
+        weight += area;
+    }
+
+    Quadric& operator+=(const Quadric& other) {
+        a00 += other.a00; a01 += other.a01; a02 += other.a02; a03 += other.a03;
+        a11 += other.a11; a12 += other.a12; a13 += other.a13;
+        a22 += other.a22; a23 += other.a23;
+        a33 += other.a33;
+        weight += other.weight;
+        return *this;
+    }
+
+    // Area weighted mean squared distance of p to the planes
+    double error(const v3& p) const {
+        if (weight <= 0.0)
+            return 0.0;
+        double x = p.x, y = p.y, z = p.z;
+        double sum = a00 * x * x + a11 * y * y + a22 * z * z + a33 +
+            2.0 * (a01 * x * y + a02 * x * z + a12 * y * z + a03 * x + a13 * y + a23 * z);
+        return math::max(sum, 0.0) / weight;
+    }
+};
+
+struct Collapse {
+    uint32 from;
+    uint32 to;
+    float  cost;
+};
+
+// Gives vertices that share a position the same id, so seams can be found and quadrics can be shared across them
+static uint32 assign_position_ids(std::span<const Vertex> vertices, vector<uint32>& position_ids) {
+    vector<uint32> order;
+    order.resize(vertices.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&vertices](uint32 a, uint32 b) {
+        const v3& pa = vertices[a].position;
+        const v3& pb = vertices[b].position;
+        if (pa.x != pb.x) return pa.x < pb.x;
+        if (pa.y != pb.y) return pa.y < pb.y;
+        return pa.z < pb.z;
+    });
+
+    position_ids.resize(vertices.size());
+    uint32 id_count = 0;
+    for (uint32 i = 0; i < order.size(); i++) {
+        if (i > 0 && vertices[order[i]].position != vertices[order[i - 1]].position)
+            id_count++;
+        position_ids[order[i]] = id_count;
+    }
+    return vertices.empty() ? 0 : id_count + 1;
+}
+
+static void find_locked_vertices(std::span<const uint32> indices, const vector<uint32>& position_ids, uint32 position_count, vector<uint8>& locked) {
+    vector<uint32> vertices_at_position;
+    vector<uint8>  locked_positions;
+    vertices_at_position.resize(position_count);
+    locked_positions.resize(position_count);
+    std::fill(vertices_at_position.begin(), vertices_at_position.end(), 0);
+    std::fill(locked_positions.begin(), locked_positions.end(), 0);
+    for (uint32 position_id : position_ids)
+        vertices_at_position[position_id]++;
+    for (uint32 i = 0; i < position_count; i++)
+        locked_positions[i] = vertices_at_position[i] > 1;
+
+    // Edges between positions rather than vertices, so seam edges still count as shared. Any edge not used by exactly
+    // two triangles is a border or non-manifold.
+    vector<uint64> edges;
+    edges.reserve(indices.size());
+    for (uint32 i = 0; i + 2 < indices.size(); i += 3) {
+        for (uint32 corner = 0; corner < 3; corner++) {
+            uint32 a = position_ids[indices[i + corner]];
+            uint32 b = position_ids[indices[i + (corner + 1) % 3]];
+            edges.push_back(uint64(math::min(a, b)) << 32 | math::max(a, b));
+        }
+    }
+    std::sort(edges.begin(), edges.end());
+    for (uint32 i = 0; i < edges.size();) {
+        uint32 run = 1;
+        while (i + run < edges.size() && edges[i + run] == edges[i])
+            run++;
+        if (run != 2) {
+            locked_positions[uint32(edges[i] >> 32)] = 1;
+            locked_positions[uint32(edges[i])]       = 1;
+        }
+        i += run;
+    }
+
+    locked.resize(position_ids.size());
+    for (uint32 i = 0; i < position_ids.size(); i++)
+        locked[i] = locked_positions[position_ids[i]];
+}
+
+// Rejects collapses that fold a triangle over or squash it to a sliver
+static bool collapse_flips(const Collapse& collapse, std::span<const uint32> triangles, const vector<uint32>& indices, std::span<const Vertex> vertices) {
+    for (uint32 triangle : triangles) {
+        uint32 corners[3] = {indices[triangle * 3 + 0], indices[triangle * 3 + 1], indices[triangle * 3 + 2]};
+        if (corners[0] == collapse.to || corners[1] == collapse.to || corners[2] == collapse.to)
+            continue;
+
+        v3 before = math::cross(vertices[corners[1]].position - vertices[corners[0]].position, vertices[corners[2]].position - vertices[corners[0]].position);
+        for (uint32& corner : corners) {
+            if (corner == collapse.from)
+                corner = collapse.to;
+        }
+        v3 after = math::cross(vertices[corners[1]].position - vertices[corners[0]].position, vertices[corners[2]].position - vertices[corners[0]].position);
+
+        float before_length = math::length(before);
+        float after_length  = math::length(after);
+        if (after_length < 0.000001f || math::dot(before, after) < 0.2f * before_length * after_length)
+            return true;
+    }
+    return false;
+}
+
+float simplify_indices(std::span<const uint32> indices, std::span<const Vertex> vertices, uint32 target_index_count, float max_error, vector<uint32>& output) {
+    ZoneScoped;
+    output.clear();
+    output.reserve(indices.size());
+    for (uint32 index : indices)
+        output.push_back(index);
+    if (output.size() <= target_index_count)
+        return 0.0f;
+
+    uint32 vertex_count = vertices.size();
+    vector<uint32> position_ids;
+    uint32 position_count = assign_position_ids(vertices, position_ids);
+    vector<uint8> locked;
+    find_locked_vertices(output, position_ids, position_count, locked);
+
+    vector<Quadric> quadrics;
+    quadrics.resize(position_count);
+    for (uint32 i = 0; i + 2 < output.size(); i += 3) {
+        const v3& a = vertices[output[i + 0]].position;
+        const v3& b = vertices[output[i + 1]].position;
+        const v3& c = vertices[output[i + 2]].position;
+        v3    normal = math::cross(b - a, c - a);
+        float length = math::length(normal);
+        if (length < 0.000001f)
+            continue;
+        normal /= length;
+        Quadric quadric;
+        quadric.add_plane(normal, -math::dot(normal, a), 0.5 * length);
+        for (uint32 corner = 0; corner < 3; corner++)
+            quadrics[position_ids[output[i + corner]]] += quadric;
+    }
+
+    double max_cost  = double(max_error) * double(max_error);
+    double used_cost = 0.0;
+
+    vector<Collapse> collapses;
+    vector<uint32>   remap;
+    vector<uint8>    touched;
+    vector<uint32>   triangle_offsets;
+    vector<uint32>   vertex_triangles;
+    remap.resize(vertex_count);
+    touched.resize(vertex_count);
+    triangle_offsets.resize(vertex_count + 1);
+
+    // Each pass collapses the cheapest edges that don't share a neighbourhood, then rebuilds the adjacency
+    while (output.size() > target_index_count) {
+        uint32 triangle_count = output.size() / 3;
+
+        std::fill(triangle_offsets.begin(), triangle_offsets.end(), 0);
+        for (uint32 index : output)
+            triangle_offsets[index + 1]++;
+        for (uint32 i = 0; i < vertex_count; i++)
+            triangle_offsets[i + 1] += triangle_offsets[i];
+        vertex_triangles.resize(output.size());
+        {
+            vector<uint32> cursor;
+            cursor.resize(vertex_count);
+            memcpy(cursor.data(), triangle_offsets.data(), vertex_count * sizeof(uint32));
+            for (uint32 i = 0; i < output.size(); i++)
+                vertex_triangles[cursor[output[i]]++] = i / 3;
+        }
+
+        collapses.clear();
+        for (uint32 i = 0; i < output.size(); i++) {
+            uint32 a = output[i];
+            uint32 b = output[i - i % 3 + (i % 3 + 1) % 3];
+            for (auto [from, to] : {std::pair{a, b}, std::pair{b, a}}) {
+                if (locked[from])
+                    continue;
+                Quadric quadric = quadrics[position_ids[from]];
+                quadric += quadrics[position_ids[to]];
+                collapses.push_back({from, to, float(quadric.error(vertices[to].position))});
+            }
+        }
+        if (collapses.empty())
+            break;
+        std::sort(collapses.begin(), collapses.end(), [](const Collapse& a, const Collapse& b) { return a.cost < b.cost; });
+
+        std::iota(remap.begin(), remap.end(), 0);
+        std::fill(touched.begin(), touched.end(), 0);
+        uint32 removable_triangles = (output.size() - target_index_count) / 3;
+        uint32 removed_triangles   = 0;
+        bool   collapsed_any       = false;
+        for (const Collapse& collapse : collapses) {
+            if (collapse.cost > max_cost || removed_triangles >= removable_triangles)
+                break;
+            if (touched[collapse.from] || touched[collapse.to])
+                continue;
+            std::span<const uint32> triangles(vertex_triangles.data() + triangle_offsets[collapse.from], triangle_offsets[collapse.from + 1] - triangle_offsets[collapse.from]);
+            if (collapse_flips(collapse, triangles, output, vertices))
+                continue;
+
+            for (uint32 triangle : triangles) {
+                bool degenerates = false;
+                for (uint32 corner = 0; corner < 3; corner++) {
+                    uint32 index = output[triangle * 3 + corner];
+                    touched[index] = 1;
+                    degenerates |= index == collapse.to;
+                }
+                removed_triangles += degenerates;
+            }
+            touched[collapse.to] = 1;
+            remap[collapse.from] = collapse.to;
+            quadrics[position_ids[collapse.to]] += quadrics[position_ids[collapse.from]];
+            used_cost     = math::max(used_cost, double(collapse.cost));
+            collapsed_any = true;
+        }
+        if (!collapsed_any)
+            break;
+
+        uint32 written = 0;
+        for (uint32 i = 0; i < triangle_count; i++) {
+            uint32 a = remap[output[i * 3 + 0]];
+            uint32 b = remap[output[i * 3 + 1]];
+            uint32 c = remap[output[i * 3 + 2]];
+            if (a == b || b == c || a == c)
+                continue;
+            output[written++] = a;
+            output[written++] = b;
+            output[written++] = c;
+        }
+        output.resize(written);
+    }
+
+    return float(std::sqrt(used_cost));
+}
+
+void generate_lods(MeshCPU& mesh_cpu) {
+    ZoneScoped;
+    constexpr uint32 min_triangles      = 64;    // Below this a level saves less than its extra draw costs
+    constexpr float  base_error         = 0.01f; // Of the bounds radius for LOD 1, doubling with each level
+    constexpr float  required_reduction = 0.8f;  // Levels keeping more of the previous one aren't worth storing
+
+    mesh_cpu.lods.clear();
+    if (!mesh_cpu.bounds.valid || mesh_cpu.bounds.radius <= 0.0f || mesh_cpu.indices.size() < min_triangles * 3 * 2)
+        return;
+
+    vector<MeshLOD> lods;
+    lods.push_back({.first_index = 0, .index_count = uint32(mesh_cpu.indices.size()), .error = 0.0f});
+    vector<uint32> previous = mesh_cpu.indices;
+    float          error    = 0.0f;
+    while (lods.size() < max_mesh_lods && previous.size() >= min_triangles * 3 * 2) {
+        float budget = base_error * float(1 << (lods.size() - 1)) * mesh_cpu.bounds.radius;
+        if (budget <= error)
+            break;
+
+        vector<uint32> simplified;
+        float level_error = simplify_indices(previous, mesh_cpu.vertices, previous.size() / 6 * 3, budget - error, simplified);
+        if (simplified.size() > previous.size() * required_reduction)
+            break;
+
+        optimize_vertex_cache(simplified, mesh_cpu.vertices.size());
+        error += level_error;
+        lods.push_back({.first_index = uint32(mesh_cpu.indices.size()), .index_count = uint32(simplified.size()), .error = error / mesh_cpu.bounds.radius});
+        for (uint32 index : simplified)
+            mesh_cpu.indices.push_back(index);
+        previous = std::move(simplified);
+    }
+
+    if (lods.size() > 1)
+        mesh_cpu.lods = std::move(lods);
+}
+
+}
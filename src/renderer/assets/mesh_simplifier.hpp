@@ -0,0 +1,24 @@
+#pragma once
+
+#include <span>
+
+#include "general/vector.hpp"
+
+#include "renderer/vertex.hpp"
+
+namespace spellbook {
+
+struct MeshCPU;
+
+// Quadric error metric edge collapse onto existing vertices, so every level can share one vertex buffer. Vertices on
+// open borders and on seams (the same position split by another normal or uv) are never moved, which keeps
+// silhouettes and attribute boundaries intact at the cost of a less aggressive result. Stops at target_index_count
+// or once the next collapse would move the surface further than max_error, returns the largest error used.
+float simplify_indices(std::span<const uint32> indices, std::span<const Vertex> vertices, uint32 target_index_count, float max_error, vector<uint32>& output);
+
+// Appends simplified index ranges after LOD 0 into indices and fills lods, each level aiming for half the triangles of
+// the previous one. Stops early when a level can't get meaningfully smaller within the error budget, meshes that
+// don't simplify are left with no lods.
+void generate_lods(MeshCPU& mesh_cpu);
+
+}
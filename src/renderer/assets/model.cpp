@@ -19,6 +19,11 @@
 #include "renderer/assets/texture.hpp"
 #include "renderer/assets/mesh.hpp"
 #include "renderer/assets/material.hpp"
+#include "renderer/assets/gltf_decode.hpp"
+#include "renderer/assets/mesh_optimizer.hpp"
+#include "renderer/assets/mesh_simplifier.hpp"
+#include "renderer/asset_streamer.hpp"
+#include "renderer/worker_pool.hpp"
 
 namespace spellbook {
 
@@ -241,16 +246,28 @@ void ModelCPU::Node::cache_transform() {
 
 constexpr m44 gltf_fixup = m44(0, 0, 1, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 1);
 
-void _unpack_gltf_buffer(tinygltf::Model& model, tinygltf::Accessor& accessor, vector<uint8>& output_buffer);
+AccessorView _gltf_accessor_view(tinygltf::Model& model, const tinygltf::Accessor& accessor);
 void _extract_gltf_vertices(tinygltf::Primitive& primitive, tinygltf::Model& model, vector<Vertex>& vertices);
 void _extract_gltf_indices(tinygltf::Primitive& primitive, tinygltf::Model& model, vector<uint32>& indices);
 string _calculate_gltf_mesh_name(tinygltf::Model& model, int mesh_index, int primitive_index);
 string _calculate_gltf_material_name(tinygltf::Model& model, int material_index);
-bool _convert_gltf_meshes(tinygltf::Model& model, const FilePath& output_folder);
-bool _convert_gltf_materials(tinygltf::Model& model, const FilePath& output_folder);
+struct GLTFMeshJob {
+    FilePath file_path;
+    uint32   mesh;
+    uint32   primitive;
+};
+struct GLTFTextureJob {
+    FilePath     file_path;
+    int          image;
+    TextureUsage usage;
+};
+vector<GLTFMeshJob> _gltf_mesh_jobs(tinygltf::Model& model, const FilePath& output_folder);
+void _gltf_material_jobs(tinygltf::Model& model, const FilePath& output_folder, vector<GLTFTextureJob>& texture_jobs, vector<MaterialCPU>& materials);
+bool _convert_gltf_meshes(tinygltf::Model& model, const FilePath& output_folder, const vector<GLTFMeshJob>& jobs, ConvertProgress* progress);
+bool _convert_gltf_materials(tinygltf::Model& model, const vector<GLTFTextureJob>& texture_jobs, vector<MaterialCPU>& materials, ConvertProgress* progress);
 m44 _calculate_matrix(tinygltf::Node& node);
 
-ModelCPU convert_to_model(const FilePath& input_path, const FilePath& output_folder, const string& output_name, bool y_up) {
+ModelCPU convert_to_model(const FilePath& input_path, const FilePath& output_folder, const string& output_name, bool y_up, ConvertProgress* progress) {
     ZoneScoped;
     // TODO: gltf can't support null materials
     // TODO: create dir
@@ -281,8 +298,15 @@ ModelCPU convert_to_model(const FilePath& input_path, const FilePath& output_fol
     model_cpu.file_path = FilePath(model_fs_path);
 
     fs::create_directories(output_folder.abs_string());
-    _convert_gltf_meshes(gltf_model, output_folder);
-    _convert_gltf_materials(gltf_model, output_folder);
+    // Every job is listed before any runs so the progress total is known up front and never grows
+    vector<GLTFMeshJob>    mesh_jobs = _gltf_mesh_jobs(gltf_model, output_folder);
+    vector<GLTFTextureJob> texture_jobs;
+    vector<MaterialCPU>    materials;
+    _gltf_material_jobs(gltf_model, output_folder, texture_jobs, materials);
+    if (progress)
+        progress->total = mesh_jobs.size() + texture_jobs.size() + materials.size();
+    _convert_gltf_meshes(gltf_model, output_folder, mesh_jobs, progress);
+    _convert_gltf_materials(gltf_model, texture_jobs, materials, progress);
     
 
     // calculate parent hierarchies
@@ -436,200 +460,60 @@ ModelCPU convert_to_model(const FilePath& input_path, const FilePath& output_fol
     return model_cpu;
 }
 
-void _unpack_gltf_buffer(tinygltf::Model& model, tinygltf::Accessor& accessor, vector<uint8>& output_buffer) {
-    ZoneScoped;
-    int                   buffer_id     = accessor.bufferView;
-    uint64                   element_bsize = tinygltf::GetComponentSizeInBytes(accessor.componentType);
-    tinygltf::BufferView& buffer_view   = model.bufferViews[buffer_id];
-    tinygltf::Buffer&     buffer_data   = model.buffers[buffer_view.buffer];
-    uint8*                   dataptr       = buffer_data.data.data() + accessor.byteOffset + buffer_view.byteOffset;
-    int                   components    = tinygltf::GetNumComponentsInType(accessor.type);
-    element_bsize *= components;
-    uint64 stride = buffer_view.byteStride;
-    if (stride == 0) {
-        stride = element_bsize;
-    }
-
-    output_buffer.resize(accessor.count * element_bsize);
-
-    for (uint32 i = 0; i < accessor.count; i++) {
-        uint8* dataindex = dataptr + stride * i;
-        uint8* targetptr = output_buffer.data() + element_bsize * i;
-
-        memcpy(targetptr, dataindex, element_bsize);
-    }
+AccessorView _gltf_accessor_view(tinygltf::Model& model, const tinygltf::Accessor& accessor) {
+    // Sparse accessors without a buffer view aren't supported
+    if (accessor.bufferView < 0)
+        return {};
+    tinygltf::BufferView& buffer_view = model.bufferViews[accessor.bufferView];
+
+    AccessorView view;
+    view.data           = model.buffers[buffer_view.buffer].data.data() + buffer_view.byteOffset + accessor.byteOffset;
+    view.count          = accessor.count;
+    view.components     = tinygltf::GetNumComponentsInType(accessor.type);
+    view.component_type = accessor.componentType;
+    view.normalized     = accessor.normalized;
+    view.stride         = buffer_view.byteStride != 0
+        ? buffer_view.byteStride
+        : tinygltf::GetComponentSizeInBytes(accessor.componentType) * view.components;
+    return view;
 }
 
 void _extract_gltf_vertices(tinygltf::Primitive& primitive, tinygltf::Model& model, vector<Vertex>& vertices) {
     ZoneScoped;
-    tinygltf::Accessor& pos_accessor = model.accessors[primitive.attributes["POSITION"]];
-    vertices.resize(pos_accessor.count);
-    vector<uint8> pos_data;
-    _unpack_gltf_buffer(model, pos_accessor, pos_data);
-
-    for (int i = 0; i < vertices.size(); i++) {
-        if (pos_accessor.type == TINYGLTF_TYPE_VEC3) {
-            if (pos_accessor.componentType == TINYGLTF_COMPONENT_TYPE_FLOAT) {
-                float* dtf = (float*) pos_data.data();
-
-                vertices[i].position.x = *(dtf + (i * 3) + X);
-                vertices[i].position.y = *(dtf + (i * 3) + Y);
-                vertices[i].position.z = *(dtf + (i * 3) + Z);
-            } else {
-                assert_else(false);
-            }
-        } else {
-            assert_else(false);
-        }
-    }
-
-    tinygltf::Accessor& normal_accessor = model.accessors[primitive.attributes["NORMAL"]];
-    vector<uint8>          normal_data;
-    _unpack_gltf_buffer(model, normal_accessor, normal_data);
-    for (int i = 0; i < vertices.size(); i++) {
-        if (normal_accessor.type == TINYGLTF_TYPE_VEC3) {
-            if (normal_accessor.componentType == TINYGLTF_COMPONENT_TYPE_FLOAT) {
-                float* dtf = (float*) normal_data.data();
-
-                vertices[i].normal[X] = *(dtf + (i * 3) + X);
-                vertices[i].normal[Y] = *(dtf + (i * 3) + Y);
-                vertices[i].normal[Z] = *(dtf + (i * 3) + Z);
-            } else {
-                assert_else(false);
-            }
-        } else {
-            assert_else(false);
-        }
-    }
-
-    tinygltf::Accessor& tangent_accessor = model.accessors[primitive.attributes["TANGENT"]];
-    vector<uint8>          tangent_data;
-    _unpack_gltf_buffer(model, tangent_accessor, tangent_data);
-    for (int i = 0; i < vertices.size(); i++) {
-        if (tangent_accessor.type == TINYGLTF_TYPE_VEC3) {
-            if (tangent_accessor.componentType == TINYGLTF_COMPONENT_TYPE_FLOAT) {
-                float* dtf = (float*) tangent_data.data();
-
-                if (tangent_data.size() > sizeof(float) * (i * 3 + Z)) {
-                    vertices[i].tangent[X] = *(dtf + (i * 3) + X);
-                    vertices[i].tangent[Y] = *(dtf + (i * 3) + Y);
-                    vertices[i].tangent[Z] = *(dtf + (i * 3) + Z);
-                }
-            } else {
-                assert_else(false);
-            }
-        } else if (tangent_accessor.type == TINYGLTF_TYPE_VEC4) {
-            if (tangent_accessor.componentType == TINYGLTF_COMPONENT_TYPE_FLOAT) {
-                float* dtf = (float*) tangent_data.data();
-
-                if (tangent_data.size() > sizeof(float) * (i * 4 + Z)) {
-                    vertices[i].tangent[X] = *(dtf + (i * 4) + X);
-                    vertices[i].tangent[Y] = *(dtf + (i * 4) + Y);
-                    vertices[i].tangent[Z] = *(dtf + (i * 4) + Z);
-                }
-            } else {
-                assert_else(false);
-            }
-        } else {
-            assert_else(false);
-        }
-    }
-
-    tinygltf::Accessor& uv_accessor = model.accessors[primitive.attributes["TEXCOORD_0"]];
-    vector<uint8>          uv_data;
-    _unpack_gltf_buffer(model, uv_accessor, uv_data);
-    for (int i = 0; i < vertices.size(); i++) {
-        if (uv_accessor.type == TINYGLTF_TYPE_VEC2) {
-            if (uv_accessor.componentType == TINYGLTF_COMPONENT_TYPE_FLOAT) {
-                float* dtf = (float*) uv_data.data();
-
-                // vec3f
-                vertices[i].uv[0] = *(dtf + (i * 2) + 0);
-                vertices[i].uv[1] = *(dtf + (i * 2) + 1);
-            } else {
-                log_error("Only FLOAT supported for UV coordinate in GLTF convert");
-            }
-        } else if (uv_accessor.type == TINYGLTF_TYPE_VEC3) {
-            if (uv_accessor.componentType == TINYGLTF_COMPONENT_TYPE_FLOAT) {
-                float* dtf = (float*) uv_data.data();
-
-                // vec3f
-                vertices[i].uv[0] = *(dtf + (i * 3) + 0);
-                vertices[i].uv[1] = *(dtf + (i * 3) + 1);
-            } else {
-                log_error("Only FLOAT supported for UV coordinate in GLTF convert");
-            }
-        } else {
-            log_error("Unsupported type for UV coordinate in GLTF convert");
+    auto find_view = [&primitive, &model](const string& attribute) -> AccessorView {
+        auto it = primitive.attributes.find(attribute);
+        return it != primitive.attributes.end() ? _gltf_accessor_view(model, model.accessors[it->second]) : AccessorView{};
+    };
+    // Decodes straight from the gltf buffers into the vertex attributes, skipping any that are missing or too narrow
+    auto decode = [&vertices](const AccessorView& view, uint32 components, float* first_output) {
+        if (view.components < components) {
+            if (view.count > 0)
+                log_error("Unsupported type for vertex attribute in GLTF convert", "asset.import");
+            return;
         }
-    }
+        decode_accessor_floats(view, components, math::min(view.count, uint64(vertices.size())), first_output, sizeof(Vertex));
+    };
 
-    if (primitive.attributes["COLOR"] != 0) {
-        tinygltf::Accessor& color_accessor = model.accessors[primitive.attributes["COLOR"]];
-        vector<uint8>          color_data;
-        _unpack_gltf_buffer(model, color_accessor, color_data);
-        for (int i = 0; i < vertices.size(); i++) {
-            if (color_accessor.type == TINYGLTF_TYPE_VEC3) {
-                if (color_accessor.componentType == TINYGLTF_COMPONENT_TYPE_FLOAT) {
-                    float* dtf = (float*) color_data.data();
-
-                    vertices[i].color[0] = *(dtf + (i * 3) + 0);
-                    vertices[i].color[1] = *(dtf + (i * 3) + 1);
-                    vertices[i].color[2] = *(dtf + (i * 3) + 2);
-                } else {
-                    assert_else(false);
-                }
-            } else {
-                assert_else(false);
-            }
-        }
-    }
+    AccessorView position_view = find_view("POSITION");
+    assert_else(position_view.components == 3)
+        return;
+    vertices.resize(position_view.count);
+    if (vertices.empty())
+        return;
+
+    decode(position_view, 3, &vertices[0].position.x);
+    decode(find_view("NORMAL"), 3, &vertices[0].normal.x);
+    // VEC4 tangents carry handedness in w, which the vertex format doesn't store
+    decode(find_view("TANGENT"), 3, &vertices[0].tangent.x);
+    decode(find_view("TEXCOORD_0"), 2, &vertices[0].uv.x);
+    decode(find_view("COLOR"), 3, &vertices[0].color.x);
 }
 
 void _extract_gltf_indices(tinygltf::Primitive& primitive, tinygltf::Model& model, vector<uint32>& indices) {
     ZoneScoped;
-    int index_accessor = primitive.indices;
-
-    int    index_buffer   = model.accessors[index_accessor].bufferView;
-    int    component_type = model.accessors[index_accessor].componentType;
-    size_t indexsize      = tinygltf::GetComponentSizeInBytes(component_type);
-
-    tinygltf::BufferView& indexview = model.bufferViews[index_buffer];
-    int                   bufferidx = indexview.buffer;
-
-    tinygltf::Buffer& buffindex = (model.buffers[bufferidx]);
-    uint8*               dataptr   = buffindex.data.data() + indexview.byteOffset;
-    vector<uint8>        unpackedIndices;
-    _unpack_gltf_buffer(model, model.accessors[index_accessor], unpackedIndices);
-    for (int i = 0; i < model.accessors[index_accessor].count; i++) {
-        uint32 index;
-        switch (component_type) {
-            case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT: {
-                auto bfr = (uint16*) unpackedIndices.data();
-                index    = *(bfr + i);
-            }
-            break;
-            case TINYGLTF_COMPONENT_TYPE_SHORT: {
-                auto bfr = (int16*) unpackedIndices.data();
-                index    = *(bfr + i);
-            }
-            break;
-            case TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT: {
-                auto bfr = (uint32*) unpackedIndices.data();
-                index    = *(bfr + i);
-            }
-            break;
-            case TINYGLTF_COMPONENT_TYPE_INT: {
-                int32* bfr = (int32*) unpackedIndices.data();
-                index    = *(bfr + i);
-            }
-            break;
-            default:
-                log_error("Only SHORT/USHORT supported for index in GLTF convert");
-        }
-
-        indices.push_back(index);
-    }
+    AccessorView index_view = _gltf_accessor_view(model, model.accessors[primitive.indices]);
+    indices.resize(index_view.count);
+    decode_accessor_indices(index_view, indices.data());
 
     for (uint32 i = 0; i < indices.size() / 3; i++) {
         // flip the triangle
@@ -656,34 +540,86 @@ string _calculate_gltf_material_name(tinygltf::Model& model, int material_index)
     return matname;
 }
 
-bool _convert_gltf_meshes(tinygltf::Model& model, const FilePath& output_folder) {
-    ZoneScoped;
-    for (uint32 i_mesh = 0; i_mesh < model.meshes.size(); i_mesh++) {
-        auto& gltf_mesh = model.meshes[i_mesh];
-
-        for (auto i_primitive = 0; i_primitive < gltf_mesh.primitives.size(); i_primitive++) {
-            MeshCPU mesh_cpu;
+// Several jobs can target the same file when names collide, only the last one is kept so the result matches
+// converting them one after another
+template <typename T>
+static vector<T> _dedupe_by_path(vector<T>&& jobs) {
+    umap<string, uint32> last_job;
+    for (uint32 i = 0; i < jobs.size(); i++)
+        last_job[jobs[i].file_path.abs_string()] = i;
+
+    vector<T> deduped;
+    for (uint32 i = 0; i < jobs.size(); i++) {
+        if (last_job[jobs[i].file_path.abs_string()] == i)
+            deduped.push_back(std::move(jobs[i]));
+    }
+    return deduped;
+}
 
+vector<GLTFMeshJob> _gltf_mesh_jobs(tinygltf::Model& model, const FilePath& output_folder) {
+    vector<GLTFMeshJob> jobs;
+    for (uint32 i_mesh = 0; i_mesh < model.meshes.size(); i_mesh++) {
+        for (uint32 i_primitive = 0; i_primitive < model.meshes[i_mesh].primitives.size(); i_primitive++) {
             string name = _calculate_gltf_mesh_name(model, i_mesh, i_primitive);
-            mesh_cpu.file_path = FilePath(output_folder.abs_path() / (name + string(MeshCPU::extension())));
-
-            auto& primitive = gltf_mesh.primitives[i_primitive];
-            _extract_gltf_indices(primitive, model, mesh_cpu.indices);
-            _extract_gltf_vertices(primitive, model, mesh_cpu.vertices);
+            jobs.push_back({FilePath(output_folder.abs_path() / (name + string(MeshCPU::extension()))), i_mesh, i_primitive});
+        }
+    }
+    return _dedupe_by_path(std::move(jobs));
+}
 
-            if (math::length(mesh_cpu.vertices.back().tangent) < 0.1f) {
-                mesh_cpu.fix_tangents();
-            }
-            
-            save_mesh(mesh_cpu);
+bool _convert_gltf_meshes(tinygltf::Model& model, const FilePath& output_folder, const vector<GLTFMeshJob>& jobs, ConvertProgress* progress) {
+    ZoneScoped;
+    vector<MeshOptimizeStats> stats;
+    stats.resize(jobs.size());
+
+    // Every job only touches its own primitive, the rest of the gltf model is read-only here
+    get_worker_pool().parallel_for(jobs.size(), [&model, &jobs, &stats, progress](uint32 i) {
+        ZoneScopedN("Convert primitive");
+        MeshCPU mesh_cpu;
+        mesh_cpu.file_path = jobs[i].file_path;
+
+        auto& primitive = model.meshes[jobs[i].mesh].primitives[jobs[i].primitive];
+        _extract_gltf_indices(primitive, model, mesh_cpu.indices);
+        _extract_gltf_vertices(primitive, model, mesh_cpu.vertices);
+        stats[i] = optimize_mesh(mesh_cpu);
+
+        if (math::length(mesh_cpu.vertices.back().tangent) < 0.1f) {
+            mesh_cpu.fix_tangents();
         }
+        mesh_cpu.calculate_bounds();
+        generate_lods(mesh_cpu);
+
+        save_mesh(mesh_cpu);
+        if (progress)
+            progress->completed++;
+    });
+
+    // Weighted by triangle count through the totals, so big meshes dominate like they do when rendering
+    MeshOptimizeStats total;
+    float triangles = 0.0f;
+    for (uint32 i = 0; i < jobs.size(); i++) {
+        float mesh_triangles = float(model.accessors[model.meshes[jobs[i].mesh].primitives[jobs[i].primitive].indices].count / 3);
+        total.vertices_before += stats[i].vertices_before;
+        total.vertices_after  += stats[i].vertices_after;
+        total.acmr_before     += stats[i].acmr_before * mesh_triangles;
+        total.acmr_after      += stats[i].acmr_after * mesh_triangles;
+        triangles += mesh_triangles;
+    }
+    if (triangles > 0.0f) {
+        log(BasicMessage{
+            .str = fmt_("Optimized {} meshes in \"{}\": {} -> {} vertices, ACMR {:.3f} -> {:.3f}",
+                jobs.size(), output_folder.rel_string(), total.vertices_before, total.vertices_after,
+                total.acmr_before / triangles, total.acmr_after / triangles),
+            .group = "asset.import"
+        });
     }
     return true;
 }
 
-bool _convert_gltf_materials(tinygltf::Model& model, const FilePath& output_folder) {
-    ZoneScoped;
+void _gltf_material_jobs(tinygltf::Model& model, const FilePath& output_folder, vector<GLTFTextureJob>& texture_jobs, vector<MaterialCPU>& materials) {
     fs::path output_folder_path = output_folder.abs_path();
+
+    // Paths only depend on the gltf, so materials can be filled in before their textures are converted
     int material_number = 0;
     for (auto& glmat : model.materials) {
         string matname = _calculate_gltf_material_name(model, material_number++);
@@ -698,29 +634,21 @@ bool _convert_gltf_materials(tinygltf::Model& model, const FilePath& output_fold
                                &material_cpu.emissive_asset_path};
 
         array texture_names = {"baseColor", "metallicRoughness", "normals", "emissive"};
+        array texture_usages = {TextureUsage_Color, TextureUsage_Data, TextureUsage_Normal, TextureUsage_Emissive};
         for (uint32 i = 0; i < 4; i++) {
             int texture_index = texture_indices[i];
             if (texture_index < 0)
                 continue;
-            auto image     = model.textures[texture_index];
-            auto baseImage = model.images[image.source];
+            auto& image     = model.textures[texture_index];
+            auto& baseImage = model.images[image.source];
 
-            if (baseImage.name == "")
-                baseImage.name = texture_names[i];
+            string image_name = baseImage.name == "" ? string(texture_names[i]) : baseImage.name;
 
-            fs::path color_path = (output_folder_path / baseImage.name).string();
+            fs::path color_path = (output_folder_path / image_name).string();
             color_path.replace_extension(TextureCPU::extension());
-            vuk::Format format = vuk::Format::eR8G8B8A8Srgb;
-
-            TextureCPU texture_cpu = {
-                FilePath(color_path),
-                {},
-                v2i{baseImage.width, baseImage.height},
-                format,
-                vector<uint8>(&*baseImage.image.begin(), &*baseImage.image.begin() + baseImage.image.size())
-            };
-            save_texture(texture_cpu);
-            *texture_files[i] = texture_cpu.file_path;
+
+            texture_jobs.push_back({FilePath(color_path), image.source, texture_usages[i]});
+            *texture_files[i] = FilePath(color_path);
         }
 
         material_cpu.color_tint = Color((float) pbr.baseColorFactor[0],
@@ -740,8 +668,39 @@ bool _convert_gltf_materials(tinygltf::Model& model, const FilePath& output_fold
             // new_material.transparency = TransparencyMode_Opaque;
         }
 
-        save_resource(material_cpu);
+        materials.push_back(std::move(material_cpu));
     }
+    texture_jobs = _dedupe_by_path(std::move(texture_jobs));
+    materials    = _dedupe_by_path(std::move(materials));
+}
+
+bool _convert_gltf_materials(tinygltf::Model& model, const vector<GLTFTextureJob>& texture_jobs, vector<MaterialCPU>& materials, ConvertProgress* progress) {
+    ZoneScoped;
+    get_worker_pool().parallel_for(texture_jobs.size(), [&model, &texture_jobs, progress](uint32 i) {
+        ZoneScopedN("Convert texture");
+        const tinygltf::Image& image = model.images[texture_jobs[i].image];
+
+        TextureCPU texture_cpu = {
+            texture_jobs[i].file_path,
+            {},
+            v2i{image.width, image.height},
+            vuk::Format::eR8G8B8A8Srgb,
+            vector<uint8>(image.image.data(), image.image.data() + image.image.size())
+        };
+        compress_texture(texture_cpu, texture_jobs[i].usage);
+        save_texture(texture_cpu);
+        if (progress)
+            progress->completed++;
+    });
+
+    get_worker_pool().parallel_for(materials.size(), [&materials, progress](uint32 i) {
+        {
+            std::scoped_lock lock(get_asset_io_mutex());
+            save_resource(materials[i]);
+        }
+        if (progress)
+            progress->completed++;
+    });
     return true;
 }
 
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <atomic>
 #include <filesystem>
 
 #include "general/string.hpp"
@@ -83,7 +84,13 @@ ModelCPU& load_resource(const FilePath& input_path, bool assert_exist, bool clea
 
 ModelGPU instance_model(RenderScene&, const ModelCPU&, bool frame = false);
 void     deinstance_model(RenderScene&, const ModelGPU&);
-ModelCPU convert_to_model(const FilePath& input_path, const FilePath& output_folder, const string& output_name, bool y_up = true);
+// Counts converted meshes, textures and materials, safe to read from another thread while converting
+struct ConvertProgress {
+    std::atomic<uint32> completed = 0;
+    std::atomic<uint32> total     = 0;
+};
+
+ModelCPU convert_to_model(const FilePath& input_path, const FilePath& output_folder, const string& output_name, bool y_up = true, ConvertProgress* progress = nullptr);
 
 bool inspect(ModelCPU* model, RenderScene* render_scene = nullptr);
 
@@ -1,6 +1,9 @@
 ﻿#include "particles.hpp"
 
+#include <cmath>
+#include <optional>
 #include <vuk/Partials.hpp>
+#include <tracy/Tracy.hpp>
 
 #include "extension/fmt.hpp"
 #include "extension/imgui_extra.hpp"
@@ -10,6 +13,8 @@
 
 #include "renderer/draw_functions.hpp"
 #include "renderer/render_scene.hpp"
+#include "renderer/shader_cache.hpp"
+#include "renderer/assets/material.hpp"
 
 namespace spellbook {
 
@@ -19,13 +24,13 @@ void setup_emitter() {
     if (!setup) {
         {
             vuk::PipelineBaseCreateInfo pci;
-            pci.add_glsl(get_contents(shader_path("particle_emitter.comp")), shader_path("particle_emitter.comp").abs_string());
+            get_shader_cache().add_shader(pci, "particle_emitter.comp");
             get_renderer().context->create_named_pipeline("emitter", pci);
         }
         {
             vuk::PipelineBaseCreateInfo pci;
-            pci.add_glsl(get_contents(shader_path("particle.vert")), shader_path("particle.vert").abs_string());
-            pci.add_glsl(get_contents(shader_path("textured_3d.frag")), shader_path("textured_3d.frag").abs_string());
+            get_shader_cache().add_shader(pci, "particle.vert");
+            get_shader_cache().add_shader(pci, "textured_3d.frag");
             get_renderer().context->create_named_pipeline("particle", pci);
         }
 
@@ -89,25 +94,17 @@ void EmitterGPU::update_from_cpu(const EmitterCPU& new_emitter) {
     get_gpu_asset_cache().paths[mesh] = new_emitter.mesh;
     get_gpu_asset_cache().paths[material] = new_emitter.material;
 
-    bool upload_color = false, upload_size = false;
-    if (emitter_cpu.color1_start != new_emitter.color1_start ||
-        emitter_cpu.color1_end != new_emitter.color1_end ||
-        emitter_cpu.color2_start != new_emitter.color2_start ||
-        emitter_cpu.color2_end != new_emitter.color2_end ||
-        !color.texture.is_file()) {
-        upload_color = true;
-    }
+    bool upload_size = false;
     if (emitter_cpu.particles_per_second != new_emitter.particles_per_second ||
         emitter_cpu.duration != new_emitter.duration ||
         emitter_cpu.duration_random != new_emitter.duration_random ||
-        !particles_buffer) {
+        settings.max_particles == 0) {
         upload_size = true;
     }
 
     emitter_cpu = new_emitter;
+    pool_dirty  = true;
 
-    if (upload_color)
-        update_color();
     if (upload_size)
         update_size();
 
@@ -116,41 +113,9 @@ void EmitterGPU::update_from_cpu(const EmitterCPU& new_emitter) {
 }
 
 
-void EmitterGPU::update_color() {
-    TextureCPU color_texture;
-    color_texture.file_path = FilePath(fmt_("{}_tex", emitter_cpu.file_path.rel_string()), true);
-    color_texture.size = v2i(8, 8);
-    color_texture.format = vuk::Format::eR8G8B8A8Srgb;
-    color_texture.pixels.resize(color_texture.size.x * color_texture.size.y * 4);
-    for (uint32 y = 0; y < color_texture.size.y; ++y) {
-        for (uint32 x = 0; x < color_texture.size.x; ++x) {
-            v2 f = v2(x, y) / v2(color_texture.size - v2i(1));
-            Color color1 = mix(emitter_cpu.color1_start, emitter_cpu.color1_end, f.y);
-            Color color2 = mix(emitter_cpu.color2_start, emitter_cpu.color2_end, f.y);
-            Color color = mix(color1, color2, f.x);
-            color_texture.pixels[(y * color_texture.size.x + x) * 4 + 0] = uint8(color.r * 255.f);
-            color_texture.pixels[(y * color_texture.size.x + x) * 4 + 1] = uint8(color.g * 255.f);
-            color_texture.pixels[(y * color_texture.size.x + x) * 4 + 2] = uint8(color.b * 255.f);
-            color_texture.pixels[(y * color_texture.size.x + x) * 4 + 3] = uint8(color.a * 255.f);
-        }
-    }
-
-    uint64 tex_id = hash_path(color_texture.file_path);
-    get_gpu_asset_cache().paths[tex_id] = color_texture.file_path;
-    if (get_gpu_asset_cache().textures.contains(tex_id))
-        get_gpu_asset_cache().textures.erase(tex_id);
-    upload_texture(color_texture);
-    color = {color_texture.file_path, Sampler().address(Address_Clamp)};
-}
-
+// The pool moves the emitter to a range of the new size on its next update
 void EmitterGPU::update_size() {
     calculate_max();
-
-    vector<uint8> bytes;
-    bytes.resize(settings.max_particles * sizeof(v4)*4 + 4);
-    auto [buf, fut] = create_buffer(*get_renderer().global_allocator, vuk::MemoryUsage::eGPUonly, vuk::DomainFlagBits::eTransferOnTransfer, std::span(bytes));
-    particles_buffer = std::move(buf);
-    get_renderer().enqueue_setup(std::move(fut));
 }
 
 bool inspect(RenderScene* scene, EmitterCPU* emitter) {
@@ -189,48 +154,366 @@ bool inspect(RenderScene* scene, EmitterCPU* emitter) {
     return changed;
 }
 
-void update_emitter(EmitterGPU& emitter, vuk::CommandBuffer& command_buffer) {
+uint32 ParticlePool::allocate_range(uint32 count) {
+    for (auto it = free_ranges.begin(); it != free_ranges.end(); it++) {
+        if (it->count < count)
+            continue;
+        uint32 first = it->first;
+        it->first += count;
+        it->count -= count;
+        if (it->count == 0)
+            free_ranges.erase(it);
+        return first;
+    }
+    uint32 first = slot_count;
+    slot_count += count;
+    return first;
+}
+
+void ParticlePool::free_range(uint32 first, uint32 count) {
+    if (count == 0)
+        return;
+    std::fill_n(slot_emitters.data<uint32>() + first, count, ~0u);
+    slot_emitters.mark_dirty(first, first + count);
+
+    auto it = std::lower_bound(free_ranges.begin(), free_ranges.end(), first, [](const Range& range, uint32 value) { return range.first < value; });
+    it = free_ranges.insert(it, {first, count});
+    if (it + 1 != free_ranges.end() && it->first + it->count == (it + 1)->first) {
+        it->count += (it + 1)->count;
+        free_ranges.erase(it + 1);
+    }
+    if (it != free_ranges.begin() && (it - 1)->first + (it - 1)->count == it->first) {
+        (it - 1)->count += it->count;
+        it = free_ranges.erase(it) - 1;
+    }
+    // Freed space at the end shortens the dispatch instead
+    if (it->first + it->count == slot_count) {
+        slot_count = it->first;
+        free_ranges.erase(it);
+    }
+}
+
+void ParticlePool::update(plf::colony<EmitterGPU>& emitters, float time) {
+    ZoneScoped;
+    draws.clear();
+    draw_lookup.clear();
+    dispatches.clear();
+    live_emitters = 0;
+
+    for (EmitterGPU& emitter : emitters) {
+        if (emitter.pool_index == ~0u) {
+            if (free_emitters.empty()) {
+                emitter.pool_index = emitter_count++;
+            } else {
+                emitter.pool_index = free_emitters.back();
+                free_emitters.pop_back();
+            }
+            emitter.pool_dirty = true;
+        }
+        if (emitter.pool_capacity != emitter.settings.max_particles) {
+            free_range(emitter.first_particle, emitter.pool_capacity);
+            emitter.pool_capacity  = emitter.settings.max_particles;
+            emitter.first_particle = allocate_range(emitter.pool_capacity);
+            emitter.head           = 0;
+            emitter.pool_reset     = true;
+            emitter.pool_dirty     = true;
+            if (slot_emitters.size() < slot_count) {
+                uint64 old_size = slot_emitters.size();
+                slot_emitters.resize(math::max(uint64(slot_count), old_size * 2));
+                std::fill_n(slot_emitters.data<uint32>() + old_size, slot_emitters.size() - old_size, ~0u);
+                slot_emitters.mark_dirty(old_size, slot_emitters.size());
+            }
+            std::fill_n(slot_emitters.data<uint32>() + emitter.first_particle, emitter.pool_capacity, emitter.pool_index);
+            slot_emitters.mark_dirty(emitter.first_particle, emitter.first_particle + emitter.pool_capacity);
+        }
+        if (emitter.pool_capacity == 0)
+            continue;
+        if (emitter.pool_dirty) {
+            if (emitter_table.size() < emitter_count)
+                emitter_table.resize(math::max(uint64(emitter_count), emitter_table.size() * 2));
+            const EmitterCPU& emitter_cpu = emitter.emitter_cpu;
+            GPUEmitter gpu_emitter = {
+                .settings       = emitter.settings,
+                .colors         = {v4(emitter_cpu.color1_start), v4(emitter_cpu.color1_end), v4(emitter_cpu.color2_start), v4(emitter_cpu.color2_end)},
+                .first_particle = emitter.first_particle
+            };
+            emitter_table.write(emitter.pool_index, &gpu_emitter);
+            emitter.pool_dirty = false;
+        }
+
+        uint32 spawn_count = math::max((time - emitter.next_spawn) / emitter.rate, 0.0f);
+        emitter.next_spawn += emitter.rate * spawn_count;
+        if (!emitter.emitting)
+            spawn_count = 0;
+        spawn_count = math::min(spawn_count, emitter.pool_capacity);
+
+        uint32 draw = uint32(draws.size());
+        if (pooled) {
+            umap<uint64, uint32>& meshes = draw_lookup[emitter.material];
+            auto draw_it = meshes.find(emitter.mesh);
+            if (draw_it == meshes.end())
+                meshes[emitter.mesh] = draw;
+            else
+                draw = draw_it->second;
+        } else {
+            dispatches.push_back({emitter.first_particle, emitter.pool_capacity});
+        }
+        if (draw == draws.size())
+            draws.push_back({.mesh = emitter.mesh, .material = emitter.material});
+        draws[draw].capacity += emitter.pool_capacity;
+
+        if (frames.size() < emitter_count)
+            frames.resize(emitter_count);
+        frames[emitter.pool_index] = {emitter.head, spawn_count, draw, emitter.pool_reset};
+        emitter.head       = (emitter.head + spawn_count) % emitter.pool_capacity;
+        emitter.pool_reset = false;
+        live_emitters++;
+    }
+
+    if (pooled && slot_count > 0)
+        dispatches.push_back({0, slot_count});
+
+    // Each draw's live particles are listed in its own segment of the visible list
+    uint32 first_instance = 0;
+    for (Draw& draw : draws) {
+        draw.first_instance = first_instance;
+        first_instance += draw.capacity;
+    }
+    capacity = math::max(capacity, slot_count);
+}
+
+void ParticlePool::upload(vuk::Allocator& allocator) {
+    ZoneScoped;
+    grown_from  = {};
+    grown_bsize = 0;
+    if (draws.empty())
+        return;
+
+    // Grows with headroom, the simulation copies what the old buffer held first
+    uint64 required_bsize = uint64(capacity) * sizeof(v4) * 4;
+    if (!buffer_particles || buffer_particles->size < required_bsize) {
+        grown_bsize        = buffer_particles ? buffer_particles->size : 0;
+        grown_from         = std::move(buffer_particles);
+        grown_from_written = particles_written;
+        particles_written  = false;
+        buffer_particles   = *vuk::allocate_buffer(*get_renderer().global_allocator, {vuk::MemoryUsage::eGPUonly, required_bsize + required_bsize / 2, 1});
+    }
+
+    buffer_emitters      = emitter_table.flush();
+    buffer_slot_emitters = slot_emitters.flush();
+
+    buffer_frames = **vuk::allocate_buffer(allocator, {vuk::MemoryUsage::eCPUtoGPU, sizeof(GPUEmitterFrame) * frames.size(), 1});
+    memcpy(buffer_frames.mapped_ptr, frames.data(), sizeof(GPUEmitterFrame) * frames.size());
+
+    // Instance counts start at 0 and are counted up by the simulation
+    buffer_draws = **vuk::allocate_buffer(allocator, {vuk::MemoryUsage::eCPUtoGPU, sizeof(vuk::DrawIndexedIndirectCommand) * draws.size(), 1});
+    vuk::DrawIndexedIndirectCommand* commands = (vuk::DrawIndexedIndirectCommand*) buffer_draws.mapped_ptr;
+    uint32 visible_count = 0;
+    for (uint32 i = 0; i < draws.size(); i++) {
+        MeshGPU* mesh = get_gpu_asset_cache().get_mesh_or_placeholder(draws[i].mesh);
+        commands[i] = vuk::DrawIndexedIndirectCommand{
+            .indexCount    = mesh != nullptr ? mesh->index_count : 0,
+            .instanceCount = 0,
+            .firstIndex    = 0,
+            .vertexOffset  = 0,
+            .firstInstance = draws[i].first_instance
+        };
+        visible_count += draws[i].capacity;
+    }
+    buffer_visible = **vuk::allocate_buffer(allocator, {vuk::MemoryUsage::eGPUonly, sizeof(uint32) * math::max(visible_count, 1u), 1});
+}
+
+void ParticlePool::release(EmitterGPU& emitter) {
+    if (emitter.pool_index == ~0u)
+        return;
+    free_range(emitter.first_particle, emitter.pool_capacity);
+    free_emitters.push_back(emitter.pool_index);
+    emitter.pool_index    = ~0u;
+    emitter.pool_capacity = 0;
+}
+
+void ParticlePool::cleanup() {
+    emitter_table.cleanup();
+    slot_emitters.cleanup();
+    buffer_particles   = {};
+    grown_from         = {};
+    particles_written  = false;
+    grown_from_written = false;
+    free_ranges.clear();
+    free_emitters.clear();
+    frames.clear();
+    draws.clear();
+    draw_lookup.clear();
+    capacity      = 0;
+    slot_count    = 0;
+    emitter_count = 0;
+}
+
+void simulate_particles(ParticlePool& pool, vuk::CommandBuffer& command_buffer) {
     struct PC {
-        uint32 spawn_count = 0;
-        float dt;
-    } pc;
-    pc.spawn_count = math::max((Input::time - emitter.next_spawn) / emitter.rate, 0.0f);
-    emitter.next_spawn += emitter.rate * pc.spawn_count;
-    if (!emitter.emitting)
-        pc.spawn_count = 0;
-                
-    pc.dt = Input::delta_time;
+        uint32 first_slot;
+        uint32 slot_end;
+        float  dt;
+        uint32 seed;
+    };
     command_buffer
         .bind_compute_pipeline("emitter")
-        .push_constants(vuk::ShaderStageFlagBits::eCompute, 0, pc)
-        .bind_buffer(0, 0, *emitter.particles_buffer);
-    *command_buffer.map_scratch_buffer<EmitterSettings>(0, 1) = emitter.settings;
-    command_buffer.dispatch(emitter.settings.max_particles); 
+        .bind_buffer(0, 0, *pool.buffer_particles)
+        .bind_buffer(0, 1, pool.buffer_emitters)
+        .bind_buffer(0, 2, pool.buffer_frames)
+        .bind_buffer(0, 3, pool.buffer_slot_emitters)
+        .bind_buffer(0, 4, pool.buffer_draws)
+        .bind_buffer(0, 5, pool.buffer_visible);
+    for (const ParticlePool::Range& range : pool.dispatches) {
+        PC pc = {range.first, range.first + range.count, Input::delta_time, uint32(get_renderer().context->get_frame_count())};
+        command_buffer
+            .push_constants(vuk::ShaderStageFlagBits::eCompute, 0, pc)
+            .dispatch_invocations(range.count);
+    }
 }
 
-void render_particles(EmitterGPU& emitter, vuk::CommandBuffer& command_buffer) {
-    MeshGPU* mesh = get_gpu_asset_cache().get_mesh(emitter.mesh);
-    MaterialGPU* material = get_gpu_asset_cache().get_material(emitter.material);
+void render_particles(ParticlePool& pool, vuk::CommandBuffer& command_buffer) {
+    command_buffer
+        .bind_buffer(0, PARTICLES_BINDING, *pool.buffer_particles)
+        .bind_buffer(0, INSTANCE_BINDING, pool.buffer_visible)
+        .bind_buffer(0, ID_BINDING, pool.buffer_slot_emitters)
+        .bind_buffer(0, SPARE_BINDING_1, pool.buffer_emitters);
+    for (uint32 i = 0; i < pool.draws.size(); i++) {
+        MeshGPU* mesh = get_gpu_asset_cache().get_mesh_or_placeholder(pool.draws[i].mesh);
+        MaterialGPU* material = get_gpu_asset_cache().get_material_or_placeholder(pool.draws[i].material);
+        if (mesh == nullptr || material == nullptr)
+            continue;
+
+        command_buffer // Mesh
+            .bind_vertex_buffer(0, mesh->vertex_buffer, 0, Vertex::get_format(mesh->encoding))
+            .bind_index_buffer(mesh->index_buffer, vuk::IndexType::eUint32)
+            .push_constants(vuk::ShaderStageFlagBits::eVertex, 0, vertex_dequant(mesh));
+        command_buffer // Material
+            .set_rasterization({.cullMode = material->cull_mode})
+            .bind_graphics_pipeline(material->pipeline);
+        material->bind_parameters(command_buffer);
+        material->bind_textures(command_buffer);
+        command_buffer.draw_indexed_indirect(1, pool.buffer_draws.subrange(i * sizeof(vuk::DrawIndexedIndirectCommand), sizeof(vuk::DrawIndexedIndirectCommand)));
+    }
+}
 
-    if (mesh == nullptr || material == nullptr) {
+void ParticleBenchmark::start(RenderScene& scene) {
+    if (running || reporting)
         return;
+    setup_emitter();
+    MaterialCPU material_cpu = {.shader_name = "particle"};
+    material_cpu.file_path = FilePath("particle_benchmark", true);
+    upload_material(material_cpu);
+
+    for (Result& result : results)
+        result = {};
+    was_pooled = scene.particles.pooled;
+    running    = true;
+    step       = 0;
+}
+
+void ParticleBenchmark::update(RenderScene& scene) {
+    ZoneScoped;
+    // Recorded while last frame was submitted
+    uint64 recorded_ns = cpu_ns.exchange(0);
+    if (measuring)
+        results[current.step].cpu_ms += float(recorded_ns) / 1000000.0f;
+    measuring = false;
+
+    // Results show up once the frames that wrote them are done on the GPU
+    vuk::Context& context = *get_renderer().context;
+    for (auto it = pending.begin(); it != pending.end();) {
+        std::optional<double> simulate = context.retrieve_duration(it->simulate_start, it->simulate_end);
+        std::optional<double> draw     = context.retrieve_duration(it->draw_start, it->draw_end);
+        if (simulate && draw) {
+            results[it->step].gpu_ms += (*simulate + *draw) * 1000.0;
+            results[it->step].gpu_frames++;
+            it = pending.erase(it);
+        } else if (++it->age > 16) {
+            // The frame's passes never ran
+            it = pending.erase(it);
+        } else {
+            it++;
+        }
+    }
+    if (reporting && pending.empty()) {
+        report();
+        reporting = false;
+    }
+    if (!running)
+        return;
+
+    if (spawned.empty()) {
+        // Every emitter in a step shares the mesh and material, so pooled they're a single draw
+        uint32 emitter_count = emitter_counts[step / 2];
+        uint32 side          = uint32(std::ceil(std::sqrt(float(emitter_count))));
+        scene.particles.pooled = step % 2 == 0;
+        for (uint32 i = 0; i < emitter_count; i++) {
+            EmitterCPU emitter_cpu;
+            emitter_cpu.position             = v3(float(i % side), float(i / side), 0.0f) * 0.5f;
+            emitter_cpu.velocity             = v3(0.0f, 0.0f, 1.0f);
+            emitter_cpu.velocity_random      = v3(0.5f);
+            emitter_cpu.scale                = 0.05f;
+            emitter_cpu.duration             = 1.0f + float(i % 4) * 0.5f;
+            emitter_cpu.particles_per_second = 30.0f;
+            emitter_cpu.mesh                 = FilePath(EmitterGPU::cube_mesh, true);
+            emitter_cpu.material             = FilePath("particle_benchmark", true);
+            spawned.push_back(&instance_emitter(scene, emitter_cpu));
+        }
+        step_start = Input::time;
+        frame      = 0;
+    }
+    if (Input::time - step_start < warmup_seconds)
+        return;
+    if (frame == measured_frames) {
+        despawn(scene);
+        if (++step == step_count) {
+            scene.particles.pooled = was_pooled;
+            running   = false;
+            reporting = true;
+        }
+        return;
+    }
+    frame++;
+
+    // Full pools don't change size, last frame's counts are this frame's
+    Result& result    = results[step];
+    result.dispatches = scene.particles.dispatches.size();
+    result.draws      = scene.particles.draws.size();
+    result.particles  = scene.particles.slot_count;
+    current = {
+        .simulate_start = context.create_timestamp_query(),
+        .simulate_end   = context.create_timestamp_query(),
+        .draw_start     = context.create_timestamp_query(),
+        .draw_end       = context.create_timestamp_query(),
+        .step           = step
+    };
+    pending.push_back(current);
+    measuring = true;
+}
+
+void ParticleBenchmark::despawn(RenderScene& scene) {
+    for (EmitterGPU* emitter : spawned) {
+        scene.particles.release(*emitter);
+        scene.emitters.erase(scene.emitters.get_iterator(emitter));
+    }
+    spawned.clear();
+}
+
+void ParticleBenchmark::report() {
+    auto gpu_ms = [](const Result& result) { return result.gpu_frames == 0 ? 0.0 : result.gpu_ms / result.gpu_frames; };
+    for (uint32 i = 0; i < std::size(emitter_counts); i++) {
+        const Result& pooled   = results[i * 2];
+        const Result& unpooled = results[i * 2 + 1];
+        log(BasicMessage{
+            .str = fmt_("Particle benchmark, {} emitters, {} particles: pooled {:.3f}ms GPU {:.3f}ms CPU over {} dispatches and {} draws, "
+                        "per emitter {:.3f}ms GPU {:.3f}ms CPU over {} dispatches and {} draws",
+                emitter_counts[i], pooled.particles,
+                gpu_ms(pooled), pooled.cpu_ms / measured_frames, pooled.dispatches, pooled.draws,
+                gpu_ms(unpooled), unpooled.cpu_ms / measured_frames, unpooled.dispatches, unpooled.draws),
+            .group = "renderer.particles"
+        });
     }
-    
-    command_buffer // Mesh
-        .bind_vertex_buffer(0, mesh->vertex_buffer.get(), 0, Vertex::get_format())
-        .bind_index_buffer(mesh->index_buffer.get(), vuk::IndexType::eUint32);
-    command_buffer // Material
-        .set_rasterization({.cullMode = material->cull_mode})
-        .bind_buffer(0, PARTICLES_BINDING, *emitter.particles_buffer)
-        .bind_graphics_pipeline(material->pipeline);
-
-    uint64 tex_id = hash_path(emitter.color.texture);
-    get_gpu_asset_cache().paths[tex_id] = emitter.color.texture;
-    TextureGPU& tex = get_gpu_asset_cache().textures[tex_id];
-    command_buffer.bind_image(0, SPARE_BINDING_1, tex.value.view.get()).bind_sampler(0, SPARE_BINDING_1, emitter.color.sampler.get());
-    material->bind_parameters(command_buffer);
-    material->bind_textures(command_buffer);
-    command_buffer.draw_indexed(mesh->index_count, emitter.settings.max_particles, 0, 0, 0);
 }
 
 void upload_dependencies(EmitterGPU& renderable) {
@@ -1,11 +1,17 @@
 ﻿#pragma once
 
+#include <atomic>
+#include <iterator>
+#include <plf_colony.h>
 #include <vuk/Types.hpp>
 #include <vuk/Buffer.hpp>
+#include <vuk/Query.hpp>
 #include <vuk/SampledImage.hpp>
 
 #include "general/color.hpp"
 #include "general/string.hpp"
+#include "general/umap.hpp"
+#include "general/vector.hpp"
 #include "general/math/matrix.hpp"
 #include "general/math/quaternion.hpp"
 #include "general/file/json.hpp"
@@ -14,6 +20,7 @@
 
 #include "renderer/vertex.hpp"
 #include "renderer/image.hpp"
+#include "renderer/persistent_buffer.hpp"
 
 namespace spellbook {
 struct RenderScene;
@@ -72,7 +79,23 @@ struct EmitterSettings {
     float life_random;
     float falloff;
     
-    uint32 max_particles;
+    uint32 max_particles = 0;
+};
+
+// Matches Emitter in include.glsli
+struct GPUEmitter {
+    EmitterSettings settings;
+    v4     colors[4]; // Color 1 start and end, color 2 start and end
+    uint32 first_particle;
+    uint32 pad[3];
+};
+
+// Matches EmitterFrame in particle_emitter.comp
+struct GPUEmitterFrame {
+    uint32 head;
+    uint32 spawn_count;
+    uint32 draw;
+    uint32 reset; // The emitter's range was just allocated, whatever it held isn't its particles
 };
 
 struct EmitterGPU {
@@ -85,30 +108,144 @@ struct EmitterGPU {
     float rate;
     float next_spawn;
     
-    Image color;
-    vuk::Unique<vuk::Buffer> particles_buffer;
     uint64 mesh;
     uint64 material;
 
     bool emitting = true;
     float deinstance_at = FLT_MAX;
 
+    // Where the emitter lives in its scene's ParticlePool
+    uint32 pool_index     = ~0u;
+    uint32 first_particle = 0;
+    uint32 pool_capacity  = 0;
+    uint32 head           = 0;
+    bool   pool_dirty     = true;
+    bool   pool_reset     = false;
+
     void calculate_max() {
         settings.max_particles = (settings.life + settings.life_random) / rate + 1;
     }
 
     void update_from_cpu(const EmitterCPU& new_emitter);
-    void update_color();
     void update_size();
 };
 
+// Every emitter's particles live in one buffer, each emitter in its own range of it. One dispatch simulates the whole
+// pool and compacts the live particles into one list per mesh and material, each drawn with one indirect draw.
+// update is CPU only, upload sizes and fills the buffers the frame's passes use.
+// Unpooled, every emitter gets its own dispatch and draw instead, which is kept as the baseline the pool is measured
+// against.
+struct ParticlePool {
+    struct Range {
+        uint32 first;
+        uint32 count;
+    };
+    struct Draw {
+        uint64 mesh;
+        uint64 material;
+        uint32 first_instance;
+        uint32 capacity; // Particles of all its emitters
+    };
+
+    bool   pooled     = true;
+    uint32 capacity   = 0;
+    uint32 slot_count = 0; // End of the last range in use, what the simulation dispatches over
+    vector<Range>  free_ranges; // Sorted, never adjacent
+    vector<uint32> free_emitters;
+    uint32         emitter_count = 0; // Entries in the emitter table, used or free
+
+    PersistentBuffer emitter_table = {.element_bsize = sizeof(GPUEmitter)};
+    PersistentBuffer slot_emitters = {.element_bsize = sizeof(uint32)}; // ~0u for free slots
+
+    // Rebuilt every frame
+    vector<GPUEmitterFrame>            frames;
+    vector<Draw>                       draws;
+    vector<Range>                      dispatches;
+    umap<uint64, umap<uint64, uint32>> draw_lookup; // Material, mesh to draw
+    uint32                             live_emitters = 0;
+
+    vuk::Unique<vuk::Buffer> buffer_particles;
+    vuk::Unique<vuk::Buffer> grown_from; // Copied into buffer_particles before this frame's simulation
+    uint64                   grown_bsize = 0;
+    // Last drawn from by a previous frame, so the next frame's writes wait on those reads
+    bool                     particles_written  = false;
+    bool                     grown_from_written = false;
+    vuk::Buffer              buffer_emitters;
+    vuk::Buffer              buffer_slot_emitters;
+    vuk::Buffer              buffer_frames;
+    vuk::Buffer              buffer_draws;
+    vuk::Buffer              buffer_visible;
+
+    void update(plf::colony<EmitterGPU>& emitters, float time);
+    void upload(vuk::Allocator& allocator);
+    // The emitter is about to be erased
+    void release(EmitterGPU& emitter);
+    void cleanup();
+
+private:
+    uint32 allocate_range(uint32 count);
+    void   free_range(uint32 first, uint32 count);
+};
+
 EmitterGPU& instance_emitter(RenderScene& scene, const EmitterCPU& emitter_cpu);
 void deinstance_emitter(EmitterGPU& emitter, bool wait_despawn = true);
 
 bool inspect(RenderScene* scene, EmitterCPU* emitter);
 
-void update_emitter(EmitterGPU& emitter, vuk::CommandBuffer& command_buffer);
-void render_particles(EmitterGPU& emitter, vuk::CommandBuffer& command_buffer);
+void simulate_particles(ParticlePool& pool, vuk::CommandBuffer& command_buffer);
+void render_particles(ParticlePool& pool, vuk::CommandBuffer& command_buffer);
+
+// Runs 1 to 10k emitters in the scene, pooled and unpooled, for a few seconds each and logs what their frames cost.
+// GPU time is the emitter_update pass and the forward pass's particle draws between timestamps, CPU time is the pool's
+// update and upload plus recording those two.
+struct ParticleBenchmark {
+    static constexpr uint32 emitter_counts[] = {1, 10, 100, 1000, 10000};
+    static constexpr uint32 step_count       = std::size(emitter_counts) * 2; // Pooled on even steps
+    static constexpr float  warmup_seconds   = 3.0f; // Past the longest lifetime so the pools are full
+    static constexpr uint32 measured_frames  = 60;
+
+    struct Timing {
+        vuk::Query simulate_start;
+        vuk::Query simulate_end;
+        vuk::Query draw_start;
+        vuk::Query draw_end;
+        uint32     step;
+        uint32     age = 0;
+    };
+    struct Result {
+        float  cpu_ms     = 0.0f;
+        double gpu_ms     = 0.0;
+        uint32 gpu_frames = 0;
+        uint32 dispatches = 0;
+        uint32 draws      = 0;
+        uint32 particles  = 0;
+    };
+
+    bool   running    = false;
+    bool   reporting  = false; // Done, waiting on the last GPU results
+    uint32 step       = 0;
+    uint32 frame      = 0;
+    float  step_start = 0.0f;
+    bool   was_pooled = true;
+
+    vector<EmitterGPU*> spawned;
+    // Queries of measured frames still waiting on their results
+    vector<Timing>      pending;
+    Result              results[step_count];
+    // Whether this frame is measured, its passes write current's queries
+    bool                measuring = false;
+    Timing              current;
+    std::atomic<uint64> cpu_ns = 0;
+
+    void start(RenderScene& scene);
+    // Before the scene's emitters are pruned and pooled each frame
+    void update(RenderScene& scene);
+    void add_cpu(uint64 ns) { cpu_ns += ns; }
+
+private:
+    void despawn(RenderScene& scene);
+    void report();
+};
 
 void upload_dependencies(EmitterGPU& emitter);
 
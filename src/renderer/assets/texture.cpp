@@ -1,67 +1,312 @@
 ﻿#include "texture.hpp"
 
+#include <array>
+#include <cmath>
 #include <vuk/Partials.hpp>
+#include <vuk/RenderGraph.hpp>
 #include <lz4/lz4.h>
 #include <stb_image.h>
+#include <tracy/Tracy.hpp>
 
 #include "general/logger.hpp"
+#include "general/math/math.hpp"
 #include "general/file/file_cache.hpp"
 
 #include "renderer/renderer.hpp"
+#include "renderer/asset_streamer.hpp"
+#include "renderer/assets/chunked_lz4.hpp"
 
 namespace spellbook {
 
 FilePath upload_texture(const TextureCPU& tex_cpu, bool frame_allocation) {
-    assert_else(tex_cpu.file_path.is_file());
-    uint64 tex_cpu_hash = hash_path(tex_cpu.file_path);
+    return upload_texture(tex_cpu.file_path, tex_cpu.size, tex_cpu.format, tex_cpu.pixels.data(), tex_cpu.mip_count, frame_allocation,
+        tex_cpu.first_mip, tex_cpu.streamable && !frame_allocation);
+}
+
+v2i mip_size(v2i size, uint32 mip) {
+    return v2i(math::max(size.x >> mip, 1), math::max(size.y >> mip, 1));
+}
+
+uint64 mip_bsize(vuk::Format format, v2i size) {
+    if (is_block_compressed(format))
+        return compressed_bsize(format, size);
+    return uint64(size.x) * uint64(size.y) * vuk::format_to_texel_block_size(format);
+}
+
+uint32 first_mip_for(v2i size, uint32 mip_count, uint32 max_resolution) {
+    if (max_resolution == 0)
+        return 0;
+    uint32 mip = 0;
+    while (mip + 1 < mip_count && uint32(math::max(mip_size(size, mip).x, mip_size(size, mip).y)) > max_resolution)
+        mip++;
+    return mip;
+}
+
+uint64 TextureGPU::resident_bsize() const {
+    uint64 bsize = 0;
+    for (uint32 mip = first_mip; mip < mip_count; mip++)
+        bsize += mip_bsize(format, mip_size(size, mip));
+    // Uncompressed textures get a blitted chain on upload, about a third more
+    if (!is_block_compressed(format))
+        bsize += bsize / 3;
+    return bsize;
+}
+
+// Blocks can't be blitted, so compressed textures bring their mips and every level is copied from one staging buffer
+static vuk::Texture upload_compressed_texture(vuk::Allocator& alloc, v2i size, vuk::Format format, const void* pixels, uint32 mip_count) {
+    vuk::ImageCreateInfo ici;
+    ici.format    = format;
+    ici.extent    = vuk::Extent3D(size);
+    ici.mipLevels = mip_count;
+    ici.usage     = vuk::ImageUsageFlagBits::eSampled | vuk::ImageUsageFlagBits::eTransferDst;
+    vuk::Texture tex = get_renderer().context->allocate_texture(alloc, ici);
+
+    vector<vuk::BufferImageCopy> copies;
+    uint64 total_bsize = 0;
+    for (uint32 mip = 0; mip < mip_count; mip++) {
+        v2i level_size = mip_size(size, mip);
+        vuk::BufferImageCopy copy;
+        copy.bufferOffset                = total_bsize;
+        copy.imageSubresource.aspectMask = vuk::ImageAspectFlagBits::eColor;
+        copy.imageSubresource.mipLevel   = mip;
+        copy.imageExtent                 = vuk::Extent3D(level_size);
+        copies.push_back(copy);
+        total_bsize += compressed_bsize(format, level_size);
+    }
+    auto staging = *vuk::allocate_buffer(alloc, {vuk::MemoryUsage::eCPUonly, total_bsize, block_bsize(format)});
+    memcpy(staging->mapped_ptr, pixels, total_bsize);
+
+    auto rg = make_shared<vuk::RenderGraph>("upload_compressed_texture");
+    rg->attach_image("texture", vuk::ImageAttachment::from_texture(tex), vuk::Access::eNone);
+    rg->add_pass({
+        .name       = "copy_mips",
+        .execute_on = vuk::DomainFlagBits::eTransferOnTransfer,
+        .resources  = {"texture"_image >> vuk::eTransferWrite},
+        .execute    = [staging = *staging, copies](vuk::CommandBuffer& command_buffer) {
+            for (const vuk::BufferImageCopy& copy : copies)
+                command_buffer.copy_buffer_to_image(staging, "texture", copy);
+        }
+    });
+    rg->add_pass({
+        .name       = "transition",
+        .execute_on = vuk::DomainFlagBits::eGraphicsQueue,
+        .resources  = {"texture+"_image >> vuk::eFragmentSampled >> "texture_sampled"}
+    });
+    get_renderer().enqueue_setup(vuk::Future{rg, "texture_sampled"});
+    return tex;
+}
+
+FilePath upload_texture(const FilePath& file_path, v2i size, vuk::Format format, const void* pixels, uint32 mip_count, bool frame_allocation, uint32 first_mip, bool streamed) {
+    assert_else(file_path.is_file());
+    assert_else(first_mip < mip_count)
+        first_mip = 0;
+    uint64 tex_cpu_hash = hash_path(file_path);
     vuk::Allocator& alloc = frame_allocation ? *get_renderer().frame_allocator : *get_renderer().global_allocator;
-    auto [tex, tex_fut] = vuk::create_texture(alloc, tex_cpu.format, vuk::Extent3D(tex_cpu.size), (void*) tex_cpu.pixels.data(), true);
-    get_renderer().context->set_name(tex, vuk::Name(tex_cpu.file_path.rel_string()));
-    get_renderer().enqueue_setup(std::move(tex_fut));
+    vuk::Texture tex;
+    if (is_block_compressed(format)) {
+        tex = upload_compressed_texture(alloc, mip_size(size, first_mip), format, pixels, mip_count - first_mip);
+    } else {
+        auto [created, tex_fut] = vuk::create_texture(alloc, format, vuk::Extent3D(size), (void*) pixels, true);
+        tex = std::move(created);
+        get_renderer().enqueue_setup(std::move(tex_fut));
+    }
+    get_renderer().context->set_name(tex, vuk::Name(file_path.rel_string()));
     
-    get_gpu_asset_cache().textures[tex_cpu_hash] = {std::move(tex), frame_allocation};
-    return tex_cpu.file_path;
+    // Replacing a streamed texture frees the old levels through the allocator, after frames using them finish
+    get_gpu_asset_cache().textures[tex_cpu_hash] = {
+        .value           = std::move(tex),
+        .frame_allocated = frame_allocation,
+        .streamed        = streamed,
+        .size            = size,
+        .format          = format,
+        .mip_count       = mip_count,
+        .first_mip       = first_mip,
+        .last_used_frame = get_gpu_asset_cache().frame
+    };
+    if (streamed)
+        get_gpu_asset_cache().paths[tex_cpu_hash] = file_path;
+    return file_path;
 }
 
-TextureCPU load_texture(const FilePath& file_path) {
+TextureCPU load_texture(const FilePath& file_path, uint32 max_resolution) {
     // TODO: CompressionMode
-    AssetFile& asset_file = FileCache::get().load_asset(file_path);
+    AssetFile asset_file;
+    {
+        // Copied out of the cache so decompression doesn't hold the lock
+        std::scoped_lock lock(get_asset_io_mutex());
+        asset_file = FileCache::get().load_asset(file_path);
+    }
 
     TextureInfo texture_info = from_jv<TextureInfo>(*asset_file.asset_json["texture_info"]);
     TextureCPU  texture_cpu  = from_jv<TextureCPU>(*asset_file.asset_json["texture_cpu"]);
     texture_cpu.file_path = file_path;
 
+    if (!texture_info.mips.empty()) {
+        assert_else(texture_info.mips.size() == texture_cpu.mip_count)
+            return {};
+        texture_cpu.streamable = true;
+        texture_cpu.first_mip  = first_mip_for(texture_cpu.size, texture_cpu.mip_count, max_resolution);
+        uint64 pixels_bsize = 0;
+        for (uint32 mip = texture_cpu.first_mip; mip < texture_cpu.mip_count; mip++)
+            pixels_bsize += mip_bsize(texture_cpu.format, mip_size(texture_cpu.size, mip));
+        texture_cpu.pixels.resize(pixels_bsize);
+
+        uint64 offset = 0;
+        for (uint32 mip = texture_cpu.first_mip; mip < texture_cpu.mip_count; mip++) {
+            const TextureMip& chunk = texture_info.mips[mip];
+            uint64 level_bsize = mip_bsize(texture_cpu.format, mip_size(texture_cpu.size, mip));
+            assert_else(chunk.offset + chunk.bsize <= asset_file.binary_blob.size() &&
+                        chunked_decompress(std::span(asset_file.binary_blob).subspan(chunk.offset, chunk.bsize),
+                                           std::span(texture_cpu.pixels).subspan(offset, level_bsize)))
+                return {};
+            offset += level_bsize;
+        }
+        return texture_cpu;
+    }
+
     texture_cpu.pixels.resize(texture_info.pixels_bsize);
-    LZ4_decompress_safe((const char*) asset_file.binary_blob.data(),
-                        (char*) texture_cpu.pixels.data(),
-                        asset_file.binary_blob.size(),
-                        (int32) texture_cpu.pixels.size());
+    // Assets baked before chunking are a single LZ4 block, which LZ4 itself limits to int32 sizes
+    if (is_chunked(asset_file.binary_blob)) {
+        assert_else(chunked_decompress(asset_file.binary_blob, texture_cpu.pixels))
+            return {};
+    } else {
+        assert_else(texture_cpu.pixels.size() <= INT32_MAX && asset_file.binary_blob.size() <= INT32_MAX &&
+                    LZ4_decompress_safe((const char*) asset_file.binary_blob.data(),
+                                        (char*) texture_cpu.pixels.data(),
+                                        int32(asset_file.binary_blob.size()),
+                                        int32(texture_cpu.pixels.size())) == int32(texture_cpu.pixels.size()))
+            return {};
+    }
 
     return texture_cpu;
 }
 
-void save_texture(const TextureCPU& texture_cpu) {
+void save_texture(const TextureCPU& texture_cpu, int32 compression_level) {
     AssetFile file;
     file.file_path = texture_cpu.file_path;
-    file.version   = 2;
+    file.version   = 3;
 
     TextureInfo texture_info;
     texture_info.pixels_bsize = texture_cpu.pixels.size();
 
-    int32 compress_staging = LZ4_compressBound(int32(texture_info.pixels_bsize));
-    file.binary_blob.resize(compress_staging);
-    int32 compressed_bsize = LZ4_compress_default((char*) texture_cpu.pixels.data(),
-                                                  (char*) file.binary_blob.data(),
-                                                  int32(texture_cpu.pixels.size()),
-                                                  int32(compress_staging));
-    file.binary_blob.resize(compressed_bsize);
+    // Baked chains are stored a level at a time so streaming can start from the small end
+    if (is_block_compressed(texture_cpu.format) && texture_cpu.first_mip == 0) {
+        uint64 offset = 0;
+        for (uint32 mip = 0; mip < texture_cpu.mip_count; mip++) {
+            uint64 level_bsize = mip_bsize(texture_cpu.format, mip_size(texture_cpu.size, mip));
+            vector<uint8> chunk = chunked_compress(std::span(texture_cpu.pixels).subspan(offset, level_bsize), compression_level);
+            texture_info.mips.push_back({file.binary_blob.size(), chunk.size()});
+            file.binary_blob.resize(file.binary_blob.size() + chunk.size());
+            memcpy(file.binary_blob.data() + texture_info.mips.back().offset, chunk.data(), chunk.size());
+            offset += level_bsize;
+        }
+    } else {
+        file.binary_blob = chunked_compress(texture_cpu.pixels, compression_level);
+    }
 
     json j;
     j["texture_cpu"]  = make_shared<json_value>(to_jv(texture_cpu));
     j["texture_info"] = make_shared<json_value>(to_jv(texture_info));
     file.asset_json   = j;
 
+    std::scoped_lock lock(get_asset_io_mutex());
     save_asset_file(file);
+    get_gpu_asset_cache().assets_saved = true;
+}
+
+static float srgb_to_linear(float value) {
+    return value <= 0.04045f ? value / 12.92f : std::pow((value + 0.055f) / 1.055f, 2.4f);
+}
+
+static float linear_to_srgb(float value) {
+    return value <= 0.0031308f ? value * 12.92f : 1.055f * std::pow(value, 1.0f / 2.4f) - 0.055f;
+}
+
+static uint8 unorm8(float value) {
+    return uint8(math::clamp(value, 0.0f, 1.0f) * 255.0f + 0.5f);
+}
+
+// 2x2 box filter, odd edges fold their last row or column in twice. Color is averaged in linear space and normals are
+// renormalized, a plain byte average darkens sRGB and shortens normals toward the surface normal.
+static vector<uint8> downsample(const vector<uint8>& pixels, v2i size, TextureUsage usage) {
+    std::array<float, 256> linear;
+    for (uint32 i = 0; i < 256; i++)
+        linear[i] = srgb_to_linear(i / 255.0f);
+
+    v2i           half = mip_size(size, 1);
+    vector<uint8> output;
+    output.resize(uint64(half.x) * uint64(half.y) * 4);
+    for (int32 y = 0; y < half.y; y++) {
+        int32 y0 = math::min(y * 2, size.y - 1);
+        int32 y1 = math::min(y * 2 + 1, size.y - 1);
+        for (int32 x = 0; x < half.x; x++) {
+            int32 x0 = math::min(x * 2, size.x - 1);
+            int32 x1 = math::min(x * 2 + 1, size.x - 1);
+            const uint8* texels[4] = {
+                &pixels[(uint64(y0) * size.x + x0) * 4], &pixels[(uint64(y0) * size.x + x1) * 4],
+                &pixels[(uint64(y1) * size.x + x0) * 4], &pixels[(uint64(y1) * size.x + x1) * 4]
+            };
+            uint8* out = &output[(uint64(y) * half.x + x) * 4];
+            switch (usage) {
+                case TextureUsage_Color:
+                case TextureUsage_Emissive: {
+                    for (int32 c = 0; c < 3; c++) {
+                        float sum = linear[texels[0][c]] + linear[texels[1][c]] + linear[texels[2][c]] + linear[texels[3][c]];
+                        out[c] = unorm8(linear_to_srgb(sum * 0.25f));
+                    }
+                    out[3] = uint8((texels[0][3] + texels[1][3] + texels[2][3] + texels[3][3] + 2) / 4);
+                } break;
+                case TextureUsage_Normal: {
+                    v3 normal = v3(0.0f);
+                    for (const uint8* texel : texels)
+                        normal += math::normalize(v3(texel[0], texel[1], texel[2]) / 127.5f - v3(1.0f));
+                    // Opposing normals cancel out, keep the surface normal rather than a zero vector
+                    normal = math::length(normal) > 0.0001f ? math::normalize(normal) : v3(0.0f, 0.0f, 1.0f);
+                    out[0] = unorm8(normal.x * 0.5f + 0.5f);
+                    out[1] = unorm8(normal.y * 0.5f + 0.5f);
+                    out[2] = unorm8(normal.z * 0.5f + 0.5f);
+                    out[3] = uint8((texels[0][3] + texels[1][3] + texels[2][3] + texels[3][3] + 2) / 4);
+                } break;
+                case TextureUsage_Data: {
+                    for (int32 c = 0; c < 4; c++)
+                        out[c] = uint8((texels[0][c] + texels[1][c] + texels[2][c] + texels[3][c] + 2) / 4);
+                } break;
+            }
+        }
+    }
+    return output;
+}
+
+void compress_texture(TextureCPU& texture_cpu, TextureUsage usage) {
+    ZoneScoped;
+    assert_else(!is_block_compressed(texture_cpu.format) && texture_cpu.mip_count == 1 &&
+                texture_cpu.pixels.size() == uint64(texture_cpu.size.x) * uint64(texture_cpu.size.y) * 4)
+        return;
+
+    bool has_alpha = false;
+    for (uint64 i = 3; i < texture_cpu.pixels.size() && !has_alpha; i += 4)
+        has_alpha = texture_cpu.pixels[i] != 255;
+    vuk::Format format = choose_block_format(usage, has_alpha);
+
+    vector<uint8> compressed;
+    vector<uint8> level      = std::move(texture_cpu.pixels);
+    v2i           level_size = texture_cpu.size;
+    uint32        mip_count  = 0;
+    while (true) {
+        vector<uint8> blocks = compress_blocks(level, level_size, format);
+        uint64 offset = compressed.size();
+        compressed.resize(offset + blocks.size());
+        memcpy(compressed.data() + offset, blocks.data(), blocks.size());
+        mip_count++;
+        if (level_size.x == 1 && level_size.y == 1)
+            break;
+        level      = downsample(level, level_size, usage);
+        level_size = mip_size(level_size, 1);
+    }
+
+    texture_cpu.pixels    = std::move(compressed);
+    texture_cpu.format    = format;
+    texture_cpu.mip_count = mip_count;
 }
 
 TextureCPU convert_to_texture(const FilePath& input_file_path, const FilePath& output_folder, const string& output_name) {
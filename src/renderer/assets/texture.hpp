@@ -8,6 +8,9 @@
 #include "general/file/resource.hpp"
 #include "general/file/file_path.hpp"
 
+#include "renderer/assets/chunked_lz4.hpp"
+#include "renderer/assets/block_compression.hpp"
+
 namespace spellbook {
 
 struct TextureExternal {
@@ -18,16 +21,30 @@ struct TextureExternal {
     static std::function<bool(const FilePath&)> path_filter() { return [](const FilePath& path) { return vector<string>{".png", ".jpg", ".jpeg"}.contains(path.extension()); }; }
 };
 
+// One compressed chunk per level in the binary blob, so a load can skip the levels it doesn't want
+struct TextureMip {
+    uint64 offset = 0;
+    uint64 bsize  = 0;
+};
+
+JSON_IMPL(TextureMip, offset, bsize);
+
 struct TextureInfo {
-    uint32 pixels_bsize = 0;
+    uint64             pixels_bsize = 0;
+    vector<TextureMip> mips         = {};
 };
 
-JSON_IMPL(TextureInfo, pixels_bsize);
+JSON_IMPL(TextureInfo, pixels_bsize, mips);
 
 struct TextureCPU : Resource {
     v2i         size   = {};
     vuk::Format format = {};
     vector<uint8> pixels = {};
+    // Block compressed textures carry their whole chain in pixels, largest first. Others get mips on upload.
+    uint32      mip_count = 1;
+    // Levels above first_mip were skipped on load, pixels starts at first_mip and size is still the full size
+    uint32      first_mip  = 0;
+    bool        streamable = false;
 
     static constexpr string_view extension() { return ".sbatex"; }
     static constexpr string_view dnd_key() { return "DND_TEXTURE"; }
@@ -36,16 +53,38 @@ struct TextureCPU : Resource {
     static std::function<bool(const FilePath&)> path_filter() { return [](const FilePath& path) { return path.extension() == Resource::extension(); }; }
 };
 
-JSON_IMPL(TextureCPU, size, format);
+JSON_IMPL(TextureCPU, size, format, mip_count);
 
 struct TextureGPU {
     vuk::Texture value;
-    bool frame_allocated;
+    bool frame_allocated = false;
+
+    // Streamed textures only hold levels from first_mip down, size and mip_count describe the whole chain
+    bool        streamed  = false;
+    v2i         size      = {};
+    vuk::Format format    = {};
+    uint32      mip_count = 1;
+    uint32      first_mip = 0;
+
+    uint64 last_used_frame = 0;
+
+    uint64 resident_bsize() const;
 };
 
-TextureCPU load_texture(const FilePath& file_name);
-void       save_texture(const TextureCPU& texture_cpu);
+v2i    mip_size(v2i size, uint32 mip);
+uint64 mip_bsize(vuk::Format format, v2i size);
+// Highest detail level that fits in max_resolution texels on its longest side, 0 allows everything
+uint32 first_mip_for(v2i size, uint32 mip_count, uint32 max_resolution);
+
+// max_resolution skips decompressing the larger levels of textures saved with separate mips
+TextureCPU load_texture(const FilePath& file_name, uint32 max_resolution = 0);
+void       save_texture(const TextureCPU& texture_cpu, int32 compression_level = default_compression_level);
 FilePath   upload_texture(const TextureCPU& tex_cpu, bool frame_allocation = false);
+// For pixels that don't live in a TextureCPU, like a mapped asset pack
+FilePath   upload_texture(const FilePath& file_path, v2i size, vuk::Format format, const void* pixels, uint32 mip_count = 1, bool frame_allocation = false, uint32 first_mip = 0, bool streamed = false);
 TextureCPU convert_to_texture(const FilePath& file_name, const FilePath& output_folder, const string& output_name);
+// Filters an RGBA8 texture down to 1x1 and block compresses every level in the format usage calls for. sRGB levels are
+// averaged in linear space and normal maps renormalized, so distant surfaces don't darken or flatten.
+void       compress_texture(TextureCPU& texture_cpu, TextureUsage usage);
 
 }
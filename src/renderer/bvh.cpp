@@ -0,0 +1,259 @@
+#include "bvh.hpp"
+
+#include <algorithm>
+#include <tracy/Tracy.hpp>
+
+#include "general/math/math.hpp"
+
+#include "renderer/assets/mesh.hpp"
+
+namespace spellbook {
+
+void BVHBounds::extend(const v3& point) {
+    for (int axis = 0; axis < 3; axis++) {
+        low[axis]  = math::min(low[axis], point[axis]);
+        high[axis] = math::max(high[axis], point[axis]);
+    }
+}
+
+void BVHBounds::extend(const BVHBounds& other) {
+    for (int axis = 0; axis < 3; axis++) {
+        low[axis]  = math::min(low[axis], other.low[axis]);
+        high[axis] = math::max(high[axis], other.high[axis]);
+    }
+}
+
+float BVHBounds::area() const {
+    if (low.x > high.x)
+        return 0.0f;
+    v3 size = high - low;
+    return 2.0f * (size.x * size.y + size.y * size.z + size.z * size.x);
+}
+
+namespace {
+
+struct BVHBuilder {
+    constexpr static uint32 bin_count = 12;
+
+    BVH&                       bvh;
+    std::span<const BVHBounds> bounds;
+    vector<v3>                 centers;
+    uint32                     max_leaf_size;
+
+    void build(uint32 node_index, uint32 first, uint32 count, uint32 depth);
+};
+
+void BVHBuilder::build(uint32 node_index, uint32 first, uint32 count, uint32 depth) {
+    BVHBounds node_bounds;
+    BVHBounds center_bounds;
+    for (uint32 i = first; i < first + count; i++) {
+        node_bounds.extend(bounds[bvh.primitives[i]]);
+        center_bounds.extend(centers[bvh.primitives[i]]);
+    }
+    bvh.nodes[node_index].low  = node_bounds.low;
+    bvh.nodes[node_index].high = node_bounds.high;
+
+    if (count <= max_leaf_size || depth >= BVH::max_depth) {
+        bvh.nodes[node_index].first = first;
+        bvh.nodes[node_index].count = count;
+        return;
+    }
+
+    // Cheapest split of the centers into bins along any axis, by surface area times primitive count
+    float  best_cost  = FLT_MAX;
+    int    best_axis  = -1;
+    uint32 best_split = 0;
+    for (int axis = 0; axis < 3; axis++) {
+        float extent = center_bounds.high[axis] - center_bounds.low[axis];
+        if (extent <= 0.0f)
+            continue;
+        float     scale = bin_count / extent;
+        BVHBounds bins[bin_count];
+        uint32    bin_counts[bin_count] = {};
+        for (uint32 i = first; i < first + count; i++) {
+            uint32 primitive = bvh.primitives[i];
+            uint32 bin       = math::min(bin_count - 1, uint32((centers[primitive][axis] - center_bounds.low[axis]) * scale));
+            bins[bin].extend(bounds[primitive]);
+            bin_counts[bin]++;
+        }
+
+        float     left_cost[bin_count - 1];
+        uint32    left_counts[bin_count - 1];
+        BVHBounds left;
+        uint32    left_count = 0;
+        for (uint32 i = 0; i < bin_count - 1; i++) {
+            left.extend(bins[i]);
+            left_count += bin_counts[i];
+            left_counts[i] = left_count;
+            left_cost[i]   = left.area() * left_count;
+        }
+        BVHBounds right;
+        uint32    right_count = 0;
+        for (uint32 i = bin_count - 1; i > 0; i--) {
+            right.extend(bins[i]);
+            right_count += bin_counts[i];
+            float cost = left_cost[i - 1] + right.area() * right_count;
+            if (left_counts[i - 1] > 0 && right_count > 0 && cost < best_cost) {
+                best_cost  = cost;
+                best_axis  = axis;
+                best_split = i;
+            }
+        }
+    }
+
+    uint32* begin = bvh.primitives.data() + first;
+    uint32* middle;
+    if (best_axis == -1) {
+        // Every center in the same place, any split is as good as another
+        middle = begin + count / 2;
+    } else {
+        float scale = bin_count / (center_bounds.high[best_axis] - center_bounds.low[best_axis]);
+        middle = std::partition(begin, begin + count, [&](uint32 primitive) {
+            return math::min(bin_count - 1, uint32((centers[primitive][best_axis] - center_bounds.low[best_axis]) * scale)) < best_split;
+        });
+    }
+    uint32 left_count = uint32(middle - begin);
+
+    uint32 children = bvh.nodes.size();
+    bvh.nodes.push_back({});
+    bvh.nodes.push_back({});
+    bvh.nodes[node_index].first = children;
+    bvh.nodes[node_index].count = 0;
+    build(children, first, left_count, depth + 1);
+    build(children + 1, first + left_count, count - left_count, depth + 1);
+}
+
+}
+
+void BVH::build(std::span<const BVHBounds> bounds, uint32 max_leaf_size) {
+    ZoneScoped;
+    nodes.clear();
+    primitives.clear();
+    if (bounds.empty())
+        return;
+
+    BVHBuilder builder = {.bvh = *this, .bounds = bounds, .max_leaf_size = math::max(max_leaf_size, 1u)};
+    builder.centers.resize(bounds.size());
+    primitives.resize(bounds.size());
+    for (uint32 i = 0; i < bounds.size(); i++) {
+        primitives[i]       = i;
+        builder.centers[i]  = bounds[i].center();
+    }
+    nodes.push_back({});
+    builder.build(0, 0, bounds.size(), 0);
+}
+
+bool ray_box(const v3& origin, const v3& inverse_dir, const v3& low, const v3& high, float max_t, float& entry) {
+    float t_min = 0.0f;
+    float t_max = max_t;
+    for (int axis = 0; axis < 3; axis++) {
+        float t_low  = (low[axis] - origin[axis]) * inverse_dir[axis];
+        float t_high = (high[axis] - origin[axis]) * inverse_dir[axis];
+        t_min = math::max(t_min, math::min(t_low, t_high));
+        t_max = math::min(t_max, math::max(t_low, t_high));
+    }
+    entry = t_min;
+    return t_min <= t_max;
+}
+
+bool ray_triangle(const ray3& ray, const v3& a, const v3& b, const v3& c, float& t) {
+    v3    edge_1 = b - a;
+    v3    edge_2 = c - a;
+    v3    p      = math::cross(ray.dir, edge_2);
+    float det    = math::dot(edge_1, p);
+    if (math::abs(det) < 1e-12f)
+        return false;
+    float inverse_det = 1.0f / det;
+
+    v3    s = ray.origin - a;
+    float u = math::dot(s, p) * inverse_det;
+    if (u < 0.0f || u > 1.0f)
+        return false;
+    v3    q = math::cross(s, edge_1);
+    float v = math::dot(ray.dir, q) * inverse_det;
+    if (v < 0.0f || u + v > 1.0f)
+        return false;
+
+    float hit_t = math::dot(edge_2, q) * inverse_det;
+    if (hit_t < 0.0f || hit_t >= t)
+        return false;
+    t = hit_t;
+    return true;
+}
+
+ray3 inverse_transform_ray(const m44GPU& transform, const ray3& ray) {
+    // m44GPU is laid out column-major for the shaders, instances are affine so only the 3x3 needs inverting
+    const float* m = (const float*) &transform;
+    v3 x = v3(m[0], m[1], m[2]);
+    v3 y = v3(m[4], m[5], m[6]);
+    v3 z = v3(m[8], m[9], m[10]);
+    v3 translation = v3(m[12], m[13], m[14]);
+
+    v3    yz  = math::cross(y, z);
+    float det = math::dot(x, yz);
+    ray3 mesh_ray = ray;
+    if (math::abs(det) < 1e-20f) {
+        // Flattened instances can't be hit
+        mesh_ray.origin = v3(FLT_MAX);
+        return mesh_ray;
+    }
+    // Rows of the inverse are the cross products of the columns, over the determinant
+    v3 row_0 = yz / det;
+    v3 row_1 = math::cross(z, x) / det;
+    v3 row_2 = math::cross(x, y) / det;
+    auto apply = [&](const v3& v) { return v3(math::dot(row_0, v), math::dot(row_1, v), math::dot(row_2, v)); };
+    mesh_ray.origin = apply(ray.origin - translation);
+    mesh_ray.dir    = apply(ray.dir);
+    return mesh_ray;
+}
+
+BVHBounds world_bounds(const m44GPU& transform, const MeshBounds& bounds) {
+    const float* m = (const float*) &transform;
+    const v3&    o = bounds.origin;
+    const v3&    e = bounds.extents;
+    BVHBounds world;
+    for (int axis = 0; axis < 3; axis++) {
+        float center = m[axis] * o.x + m[4 + axis] * o.y + m[8 + axis] * o.z + m[12 + axis];
+        float extent = math::abs(m[axis]) * e.x + math::abs(m[4 + axis]) * e.y + math::abs(m[8 + axis]) * e.z;
+        world.low[axis]  = center - extent;
+        world.high[axis] = center + extent;
+    }
+    return world;
+}
+
+bool MeshBVH::ray_cast(const ray3& ray, float& t, uint32& triangle) const {
+    return bvh.ray_cast(ray, t, [this, &ray, &triangle](uint32 primitive, float& closest) {
+        const uint32* corners = indices.data() + primitive * 3;
+        if (!ray_triangle(ray, positions[corners[0]], positions[corners[1]], positions[corners[2]], closest))
+            return false;
+        triangle = primitive;
+        return true;
+    });
+}
+
+BVH build_triangle_bvh(std::span<const v3> positions, std::span<const uint32> indices) {
+    ZoneScoped;
+    vector<BVHBounds> bounds;
+    bounds.resize(indices.size() / 3);
+    for (uint32 i = 0; i < bounds.size(); i++) {
+        for (uint32 corner = 0; corner < 3; corner++)
+            bounds[i].extend(positions[indices[i * 3 + corner]]);
+    }
+    BVH bvh;
+    bvh.build(bounds);
+    return bvh;
+}
+
+MeshBVH make_mesh_bvh(vector<v3>&& positions, std::span<const uint32> indices, const BVH* baked) {
+    MeshBVH mesh_bvh;
+    mesh_bvh.positions = std::move(positions);
+    mesh_bvh.indices.resize(indices.size() - indices.size() % 3);
+    memcpy(mesh_bvh.indices.data(), indices.data(), mesh_bvh.indices.bsize());
+    if (baked != nullptr && !baked->empty() && baked->primitives.size() == mesh_bvh.indices.size() / 3)
+        mesh_bvh.bvh = *baked;
+    else
+        mesh_bvh.bvh = build_triangle_bvh(mesh_bvh.positions, mesh_bvh.indices);
+    return mesh_bvh;
+}
+
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <span>
+
+#include "general/vector.hpp"
+#include "general/math/geometry.hpp"
+#include "general/math/matrix.hpp"
+
+namespace spellbook {
+
+struct MeshBounds;
+
+struct BVHBounds {
+    v3 low  = v3(FLT_MAX);
+    v3 high = v3(-FLT_MAX);
+
+    void  extend(const v3& point);
+    void  extend(const BVHBounds& other);
+    v3    center() const { return (low + high) * 0.5f; }
+    float area() const;
+};
+
+// Interior nodes have count 0 and their two children next to each other at first, leaves own count primitives
+// from first in BVH::primitives
+struct BVHNode {
+    v3     low;
+    uint32 first = 0;
+    v3     high;
+    uint32 count = 0;
+};
+static_assert(sizeof(BVHNode) == 32);
+
+// Binned SAH over the bounds of whatever primitives the caller has, the primitives are referenced by index
+struct BVH {
+    constexpr static uint32 max_depth = 48;
+
+    vector<BVHNode> nodes;
+    vector<uint32>  primitives; // Leaf order
+
+    void build(std::span<const BVHBounds> bounds, uint32 max_leaf_size = 4);
+    bool empty() const { return nodes.empty(); }
+
+    // test(primitive, t) returns true and lowers t on a closer hit. Nearer children are visited first and anything
+    // starting past t is skipped, so t only has to start at the furthest distance wanted.
+    template <typename T>
+    bool ray_cast(const ray3& ray, float& t, T&& test) const;
+};
+
+bool ray_box(const v3& origin, const v3& inverse_dir, const v3& low, const v3& high, float max_t, float& entry);
+// Two sided, t is along ray.dir as given and only written when the hit is closer
+bool ray_triangle(const ray3& ray, const v3& a, const v3& b, const v3& c, float& t);
+
+// For going between an instance and its mesh. The ray's direction isn't normalized, so t stays the same in both.
+ray3      inverse_transform_ray(const m44GPU& transform, const ray3& ray);
+BVHBounds world_bounds(const m44GPU& transform, const MeshBounds& bounds);
+
+// LOD 0 triangles of an uploaded mesh, kept on the CPU for picking. Only the node hierarchy is baked with the mesh
+// asset, positions and indices come from the mesh itself.
+struct MeshBVH {
+    BVH            bvh;
+    vector<v3>     positions;
+    vector<uint32> indices; // Three per triangle
+
+    bool   ray_cast(const ray3& ray, float& t, uint32& triangle) const;
+    uint64 bsize() const { return nodes_bsize() + positions.bsize() + indices.bsize(); }
+    uint64 nodes_bsize() const { return bvh.nodes.bsize() + bvh.primitives.bsize(); }
+};
+
+BVH     build_triangle_bvh(std::span<const v3> positions, std::span<const uint32> indices);
+// Uses baked when it was built for this many triangles, otherwise builds it
+MeshBVH make_mesh_bvh(vector<v3>&& positions, std::span<const uint32> indices, const BVH* baked = nullptr);
+
+template <typename T>
+bool BVH::ray_cast(const ray3& ray, float& t, T&& test) const {
+    if (nodes.empty())
+        return false;
+
+    struct Entry {
+        uint32 node;
+        float  t;
+    };
+    v3     inverse_dir = v3(1.0f / ray.dir.x, 1.0f / ray.dir.y, 1.0f / ray.dir.z);
+    Entry  stack[max_depth + 2];
+    uint32 stack_size = 0;
+    bool   hit        = false;
+
+    float root_t;
+    if (!ray_box(ray.origin, inverse_dir, nodes[0].low, nodes[0].high, t, root_t))
+        return false;
+    stack[stack_size++] = {0, root_t};
+    while (stack_size > 0) {
+        Entry entry = stack[--stack_size];
+        if (entry.t > t)
+            continue;
+        const BVHNode& node = nodes[entry.node];
+        if (node.count > 0) {
+            for (uint32 i = 0; i < node.count; i++)
+                hit |= test(primitives[node.first + i], t);
+            continue;
+        }
+
+        Entry closer      = {node.first, 0.0f};
+        Entry further     = {node.first + 1, 0.0f};
+        bool  closer_hit  = ray_box(ray.origin, inverse_dir, nodes[closer.node].low, nodes[closer.node].high, t, closer.t);
+        bool  further_hit = ray_box(ray.origin, inverse_dir, nodes[further.node].low, nodes[further.node].high, t, further.t);
+        if (closer_hit && further_hit && further.t < closer.t) {
+            std::swap(closer, further);
+        } else if (!closer_hit) {
+            std::swap(closer, further);
+            std::swap(closer_hit, further_hit);
+        }
+        // Further is pushed first so closer is popped next
+        if (further_hit)
+            stack[stack_size++] = further;
+        if (closer_hit)
+            stack[stack_size++] = closer;
+    }
+    return hit;
+}
+
+}
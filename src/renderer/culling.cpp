@@ -0,0 +1,171 @@
+#include "culling.hpp"
+
+#include <bit>
+#include <cmath>
+
+#if defined(__AVX__)
+    #include <immintrin.h>
+    #define CULLING_AVX
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #include <emmintrin.h>
+    #define CULLING_SSE
+#endif
+
+#include "general/math/math.hpp"
+
+#include "renderer/assets/mesh.hpp"
+
+namespace spellbook {
+
+Frustum frustum_from_vp(const m44& vp) {
+    // Read the rows through the columns so this doesn't depend on the storage order of m44
+    v4 columns[4] = {vp * v4(1, 0, 0, 0), vp * v4(0, 1, 0, 0), vp * v4(0, 0, 1, 0), vp * v4(0, 0, 0, 1)};
+    auto row = [&columns](int i) { return v4(columns[0][i], columns[1][i], columns[2][i], columns[3][i]); };
+    v4 r0 = row(0), r1 = row(1), r2 = row(2), r3 = row(3);
+
+    // Vulkan clip space, -w <= x <= w, -w <= y <= w, 0 <= z <= w
+    v4 candidates[6] = {r3 + r0, r3 - r0, r3 + r1, r3 - r1, r2, r3 - r2};
+
+    Frustum frustum;
+    for (const v4& plane : candidates) {
+        float length = math::length(v3(plane.x, plane.y, plane.z));
+        // The far plane of an infinite reverse-z projection degenerates and never culls anything
+        if (length < 0.0001f)
+            continue;
+        frustum.planes[frustum.plane_count++] = plane / length;
+    }
+    return frustum;
+}
+
+void CullSpheres::resize(uint32 count) {
+    x.resize(count);
+    y.resize(count);
+    z.resize(count);
+    radius.resize(count);
+}
+
+void CullSpheres::set(uint32 index, const v4& sphere) {
+    x[index]      = sphere.x;
+    y[index]      = sphere.y;
+    z[index]      = sphere.z;
+    radius[index] = sphere.w;
+}
+
+v4 world_sphere(const m44GPU& transform, const MeshBounds& bounds) {
+    if (!bounds.valid)
+        return v4(0.0f, 0.0f, 0.0f, FLT_MAX);
+
+    // m44GPU is laid out column-major for the shaders
+    const float* m = (const float*) &transform;
+    const v3&    o = bounds.origin;
+    v3 center = v3(
+        m[0] * o.x + m[4] * o.y + m[8] * o.z + m[12],
+        m[1] * o.x + m[5] * o.y + m[9] * o.z + m[13],
+        m[2] * o.x + m[6] * o.y + m[10] * o.z + m[14]
+    );
+    float scale = math::max(math::max(
+        math::length(v3(m[0], m[1], m[2])),
+        math::length(v3(m[4], m[5], m[6]))),
+        math::length(v3(m[8], m[9], m[10]))
+    );
+    return v4(center, bounds.radius * scale);
+}
+
+LODSelector lod_selector(const v3& camera_position, float fov, float base_size, float bias) {
+    if (base_size <= 0.0f || bias <= 0.0f)
+        return {.position = camera_position, .factor = 0.0f};
+    // A sphere of radius r at distance d covers r / (d * tan(fov / 2)) of the viewport height
+    return {.position = camera_position, .factor = base_size * std::tan(fov * 0.5f) / bias};
+}
+
+uint32 select_lod(const LODSelector& selector, const v4& sphere, uint32 lod_count) {
+    if (selector.factor <= 0.0f || lod_count <= 1)
+        return 0;
+    // The same loop as cull_instances.comp, which clamps to max_mesh_lods and repeats the coarsest level instead
+    float  ratio = math::length(v3(sphere.x, sphere.y, sphere.z) - selector.position) * selector.factor / sphere.w;
+    uint32 lod   = 0;
+    while (ratio >= 2.0f && lod + 1 < lod_count) {
+        ratio *= 0.5f;
+        lod++;
+    }
+    return lod;
+}
+
+uint32 cull_spheres(const Frustum& frustum, const CullSpheres& spheres, const uint32* slots, uint32 begin, uint32 end, uint32* output) {
+    uint32 count = 0;
+    uint32 i     = begin;
+
+#if defined(CULLING_AVX)
+    __m256 plane_x[6], plane_y[6], plane_z[6], plane_w[6];
+    for (uint32 p = 0; p < frustum.plane_count; p++) {
+        plane_x[p] = _mm256_set1_ps(frustum.planes[p].x);
+        plane_y[p] = _mm256_set1_ps(frustum.planes[p].y);
+        plane_z[p] = _mm256_set1_ps(frustum.planes[p].z);
+        plane_w[p] = _mm256_set1_ps(frustum.planes[p].w);
+    }
+    for (; i + 8 <= end; i += 8) {
+        __m256 x     = _mm256_loadu_ps(spheres.x.data() + i);
+        __m256 y     = _mm256_loadu_ps(spheres.y.data() + i);
+        __m256 z     = _mm256_loadu_ps(spheres.z.data() + i);
+        __m256 neg_r = _mm256_sub_ps(_mm256_setzero_ps(), _mm256_loadu_ps(spheres.radius.data() + i));
+
+        __m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+        for (uint32 p = 0; p < frustum.plane_count; p++) {
+            __m256 distance = _mm256_add_ps(
+                _mm256_add_ps(_mm256_mul_ps(x, plane_x[p]), _mm256_mul_ps(y, plane_y[p])),
+                _mm256_add_ps(_mm256_mul_ps(z, plane_z[p]), plane_w[p])
+            );
+            inside = _mm256_and_ps(inside, _mm256_cmp_ps(distance, neg_r, _CMP_GE_OQ));
+        }
+
+        uint32 mask = _mm256_movemask_ps(inside);
+        while (mask != 0) {
+            output[count++] = slots[i + std::countr_zero(mask)];
+            mask &= mask - 1;
+        }
+    }
+#elif defined(CULLING_SSE)
+    __m128 plane_x[6], plane_y[6], plane_z[6], plane_w[6];
+    for (uint32 p = 0; p < frustum.plane_count; p++) {
+        plane_x[p] = _mm_set1_ps(frustum.planes[p].x);
+        plane_y[p] = _mm_set1_ps(frustum.planes[p].y);
+        plane_z[p] = _mm_set1_ps(frustum.planes[p].z);
+        plane_w[p] = _mm_set1_ps(frustum.planes[p].w);
+    }
+    for (; i + 4 <= end; i += 4) {
+        __m128 x     = _mm_loadu_ps(spheres.x.data() + i);
+        __m128 y     = _mm_loadu_ps(spheres.y.data() + i);
+        __m128 z     = _mm_loadu_ps(spheres.z.data() + i);
+        __m128 neg_r = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(spheres.radius.data() + i));
+
+        __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+        for (uint32 p = 0; p < frustum.plane_count; p++) {
+            __m128 distance = _mm_add_ps(
+                _mm_add_ps(_mm_mul_ps(x, plane_x[p]), _mm_mul_ps(y, plane_y[p])),
+                _mm_add_ps(_mm_mul_ps(z, plane_z[p]), plane_w[p])
+            );
+            inside = _mm_and_ps(inside, _mm_cmpge_ps(distance, neg_r));
+        }
+
+        uint32 mask = _mm_movemask_ps(inside);
+        while (mask != 0) {
+            output[count++] = slots[i + std::countr_zero(mask)];
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    for (; i < end; i++) {
+        bool inside = true;
+        for (uint32 p = 0; p < frustum.plane_count && inside; p++) {
+            const v4& plane = frustum.planes[p];
+            inside = plane.x * spheres.x[i] + plane.y * spheres.y[i] + plane.z * spheres.z[i] + plane.w >= -spheres.radius[i];
+        }
+        if (inside)
+            output[count++] = slots[i];
+    }
+
+    return count;
+}
+
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <vuk/Buffer.hpp>
+
+#include "general/vector.hpp"
+#include "general/math/geometry.hpp"
+#include "general/math/matrix.hpp"
+
+namespace spellbook {
+
+struct MeshBounds;
+
+// Normalized planes facing inwards, a point p is inside when dot(plane.xyz, p) + plane.w >= 0
+struct Frustum {
+    v4     planes[6];
+    uint32 plane_count = 0;
+};
+
+Frustum frustum_from_vp(const m44& vp);
+
+// World-space bounding spheres in SoA layout so the kernels can test 4/8 spheres per plane at once
+struct CullSpheres {
+    vector<float> x;
+    vector<float> y;
+    vector<float> z;
+    vector<float> radius;
+
+    void resize(uint32 count);
+    void set(uint32 index, const v4& sphere);
+};
+
+struct CullStats {
+    uint32 tested = 0;
+    uint32 drawn  = 0;
+    uint32 coarse = 0; // Of drawn, how many used a LOD past 0
+    uint32 gpu    = 0; // Handed to cull_instances.comp, survivors aren't read back
+};
+
+// Picks levels of detail from how much of the viewport height an instance's bounding sphere covers. LOD 0 is used
+// down to base_size and each level after it covers half the size of the one before. A bias below 1 drops a pass to
+// coarser levels sooner, for passes where detail matters less than in the camera's view.
+struct LODSelector {
+    v3    position;
+    float factor = 0.0f; // base_size / (bias * projected radius at distance 1), 0 always picks LOD 0
+};
+
+LODSelector lod_selector(const v3& camera_position, float fov, float base_size, float bias);
+uint32      select_lod(const LODSelector& selector, const v4& sphere, uint32 lod_count);
+
+// Matches CullInstance in cull_instances.comp, one per batched instance
+struct GPUCullInstance {
+    v4     sphere;
+    uint32 slot;
+    uint32 draw;
+    uint32 pad[2];
+};
+
+// Per-pass result. CPU culled batches are packed by batch index into the front of buffer, GPU culled batches
+// own the range after it and get their survivors and instance counts written by cull_instances.comp. Draws and
+// batch ranges have max_mesh_lods entries per batch, one per level.
+struct CulledInstances {
+    vuk::Buffer    buffer;
+    vuk::Buffer    draws;
+    vector<uint32> batch_first;
+    vector<uint32> batch_count;
+    Frustum        frustum;
+    LODSelector    lod_selector;
+    CullStats      stats;
+};
+
+v4 world_sphere(const m44GPU& transform, const MeshBounds& bounds);
+
+// Writes the slots of the spheres in [begin, end) that touch the frustum to output, returns how many were written
+uint32 cull_spheres(const Frustum& frustum, const CullSpheres& spheres, const uint32* slots, uint32 begin, uint32 end, uint32* output);
+
+}
@@ -0,0 +1,76 @@
+#include "debug_draw.hpp"
+
+#include <vuk/Partials.hpp>
+#include <vuk/CommandBuffer.hpp>
+#include <tracy/Tracy.hpp>
+
+#include "general/math/math.hpp"
+
+#include "renderer/renderer.hpp"
+#include "renderer/draw_functions.hpp"
+
+namespace spellbook {
+
+static uint32 pack_color(const Color& color) {
+    auto channel = [](float value) { return uint32(math::clamp(value, 0.0f, 1.0f) * 255.0f + 0.5f); };
+    return channel(color.r) | channel(color.g) << 8 | channel(color.b) << 16 | channel(color.a) << 24;
+}
+
+void DebugDraw::line(std::span<const FormattedVertex> line_vertices) {
+    if (line_vertices.size() < 2)
+        return;
+    for (const FormattedVertex& vertex : line_vertices)
+        vertices.push_back({vertex.position, vertex.width, pack_color(vertex.color)});
+    vertices.push_back({v3(0.0f), 0.0f, 0});
+}
+
+void DebugDraw::line(const v3& start, const v3& end, const Color& color, float width) {
+    uint32 packed = pack_color(color);
+    vertices.push_back({start, width, packed});
+    vertices.push_back({end, width, packed});
+    vertices.push_back({v3(0.0f), 0.0f, 0});
+}
+
+void DebugDraw::upload() {
+    ZoneScoped;
+    vertex_count = vertices.size();
+    if (vertex_count < 2)
+        return;
+    if (!ring || vertex_count > region_capacity) {
+        // Frames in flight keep reading the old ring until it's released
+        region_capacity = math::max(initial_capacity, vertex_count + vertex_count / 2);
+        ring = *vuk::allocate_buffer(*get_renderer().global_allocator,
+            {vuk::MemoryUsage::eCPUtoGPU, uint64(region_capacity) * Renderer::inflight_count * sizeof(DebugLineVertex), 4});
+    }
+    first_vertex = (get_renderer().context->get_frame_count() % Renderer::inflight_count) * region_capacity;
+    memcpy((DebugLineVertex*) ring->mapped_ptr + first_vertex, vertices.data(), vertices.bsize());
+}
+
+void DebugDraw::draw(vuk::CommandBuffer& command_buffer, const v3& camera_position) {
+    if (vertex_count < 2)
+        return;
+    struct PC {
+        v4     camera_position;
+        uint32 first_vertex;
+        uint32 vertex_count;
+    } pc = {v4(camera_position, 1.0f), first_vertex, vertex_count};
+    command_buffer
+        .set_rasterization({.cullMode = vuk::CullModeFlagBits::eNone})
+        .bind_graphics_pipeline("debug_line")
+        .bind_buffer(0, SPARE_BINDING_1, *ring)
+        .push_constants(vuk::ShaderStageFlagBits::eVertex, 0, pc)
+        .draw(6 * (vertex_count - 1), 1, 0, 0);
+}
+
+void DebugDraw::clear() {
+    vertices.clear();
+    vertex_count = 0;
+}
+
+void DebugDraw::cleanup() {
+    clear();
+    ring            = {};
+    region_capacity = 0;
+}
+
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <span>
+#include <vuk/Buffer.hpp>
+#include <vuk/vuk_fwd.hpp>
+
+#include "general/vector.hpp"
+#include "general/color.hpp"
+#include "general/math/geometry.hpp"
+
+namespace spellbook {
+
+struct FormattedVertex;
+
+// What debug_line.vert reads, 20 bytes a vertex. Alpha 0 breaks the line like FormattedVertex::separate.
+struct DebugLineVertex {
+    v3     position;
+    float  width;
+    uint32 color; // RGBA8
+};
+
+// Immediate mode lines for gizmos and debug shapes, gathered during the frame and drawn in the widget pass with one
+// call. Each frame copies its vertices into its own region of a persistently mapped ring, and debug_line.vert turns
+// every segment into a camera facing quad, so nothing here goes through the GPU asset cache.
+struct DebugDraw {
+    constexpr static uint32 initial_capacity = 1u << 14; // Vertices per frame region
+
+    vector<DebugLineVertex>  vertices;
+    vuk::Unique<vuk::Buffer> ring;
+    uint32                   region_capacity = 0;
+    // Where this frame's vertices landed in the ring
+    uint32                   first_vertex = 0;
+    uint32                   vertex_count = 0;
+
+    // One connected line, later calls don't join onto it
+    void line(std::span<const FormattedVertex> line_vertices);
+    void line(const v3& start, const v3& end, const Color& color, float width);
+
+    // Copies this frame's vertices into the ring, called while building the frame's graph
+    void upload();
+    void draw(vuk::CommandBuffer& command_buffer, const v3& camera_position);
+    // After the frame is submitted
+    void clear();
+    void cleanup();
+};
+
+}
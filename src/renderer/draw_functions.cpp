@@ -287,9 +287,7 @@ void add_formatted_square(vector<FormattedVertex>& vertices, v3 center, v3 axis_
     vertices.emplace_back(center - axis_2, palette::clear);
 }
 
-MeshCPU generate_formatted_3d_bitmask(Camera* camera, const Bitmask3D& bitmask) {
-    vector<FormattedVertex> vertices;
-
+void add_formatted_3d_bitmask(vector<FormattedVertex>& vertices, const Bitmask3D& bitmask) {
     v3i rough_min = bitmask.rough_min();
     v3i rough_max = bitmask.rough_max();
 
@@ -361,13 +359,15 @@ MeshCPU generate_formatted_3d_bitmask(Camera* camera, const Bitmask3D& bitmask)
             vertices.emplace_back(v3(), palette::clear, 0.0f);
         }
     } while (math::iterate(v, rough_min, rough_max));
-
-    return generate_formatted_line(camera, vertices);
 }
 
-MeshCPU generate_outline(Camera* camera, const Bitmask3D& bitmask, const vector<v3i>& places, const Color& color, float thickness) {
+MeshCPU generate_formatted_3d_bitmask(Camera* camera, const Bitmask3D& bitmask) {
     vector<FormattedVertex> vertices;
+    add_formatted_3d_bitmask(vertices, bitmask);
+    return generate_formatted_line(camera, vertices);
+}
 
+void add_outline(vector<FormattedVertex>& vertices, const Bitmask3D& bitmask, const vector<v3i>& places, const Color& color, float thickness) {
     Bitmask3D new_bitmask;
     for (const v3i& place : places) {
         // blocked
@@ -409,10 +409,26 @@ MeshCPU generate_outline(Camera* camera, const Bitmask3D& bitmask, const vector<
             vertices.emplace_back(v3(), palette::clear, 0.0f);
         }
     } while (math::iterate(v, rough_min, rough_max));
+}
 
+MeshCPU generate_outline(Camera* camera, const Bitmask3D& bitmask, const vector<v3i>& places, const Color& color, float thickness) {
+    vector<FormattedVertex> vertices;
+    add_outline(vertices, bitmask, places, color, thickness);
     return generate_formatted_line(camera, vertices);
 }
 
+void draw_3d_bitmask(RenderScene& render_scene, const Bitmask3D& bitmask) {
+    vector<FormattedVertex> vertices;
+    add_formatted_3d_bitmask(vertices, bitmask);
+    render_scene.debug_draw.line(vertices);
+}
+
+void draw_outline(RenderScene& render_scene, const Bitmask3D& bitmask, const vector<v3i>& places, const Color& color, float thickness) {
+    vector<FormattedVertex> vertices;
+    add_outline(vertices, bitmask, places, color, thickness);
+    render_scene.debug_draw.line(vertices);
+}
+
 void draw_path(RenderScene& render_scene, Path& path, const v3& pos) {
     vector<FormattedVertex> path_waypoints_vertices;
     for (const v3& waypoint : path.waypoints) {
@@ -426,13 +442,8 @@ void draw_path(RenderScene& render_scene, Path& path, const v3& pos) {
         {path.get_real_target(pos), palette::spellbook_1, 0.05f}
     };
 
-    auto line_mesh1 = generate_formatted_line(render_scene.viewport.camera, std::move(path_waypoints_vertices));
-    if (!line_mesh1.vertices.empty())
-        render_scene.quick_mesh(line_mesh1, true, true);
-
-    auto line_mesh2 = generate_formatted_line(render_scene.viewport.camera, std::move(target_vec_vertices));
-    if (!line_mesh2.vertices.empty())
-        render_scene.quick_mesh(line_mesh2, true, true);
+    render_scene.debug_draw.line(path_waypoints_vertices);
+    render_scene.debug_draw.line(target_vec_vertices);
 }
 
 
@@ -29,8 +29,13 @@ namespace spellbook {
     MeshCPU generate_outline(Camera* camera, const Bitmask3D& bitmask, const vector<v3i>& places, const Color& color, float thickness);
 
     void add_formatted_square(vector<FormattedVertex>& vertices, v3 center, v3 axis_1, v3 axis_2, Color color, float width);
+    void add_formatted_3d_bitmask(vector<FormattedVertex>& vertices, const Bitmask3D& bitmask);
+    void add_outline(vector<FormattedVertex>& vertices, const Bitmask3D& bitmask, const vector<v3i>& places, const Color& color, float thickness);
 
+    // Through RenderScene::debug_draw, for lines that change every frame
     void draw_path(RenderScene& render_scene, Path& path, const v3& pos);
+    void draw_3d_bitmask(RenderScene& render_scene, const Bitmask3D& bitmask);
+    void draw_outline(RenderScene& render_scene, const Bitmask3D& bitmask, const vector<v3i>& places, const Color& color, float thickness);
 
 }
 
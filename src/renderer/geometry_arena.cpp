@@ -0,0 +1,295 @@
+#include "geometry_arena.hpp"
+
+#include <tracy/Tracy.hpp>
+#include <vuk/Partials.hpp>
+#include <vuk/RenderGraph.hpp>
+
+#include "extension/fmt.hpp"
+#include "general/logger.hpp"
+#include "general/math/math.hpp"
+
+#include "renderer/renderer.hpp"
+
+namespace spellbook {
+
+void RangeAllocator::reset(uint64 new_capacity) {
+    capacity = new_capacity;
+    used     = 0;
+    free_ranges.clear();
+    if (capacity > 0)
+        free_ranges[0] = capacity;
+}
+
+bool RangeAllocator::allocate(uint64 size, uint64 alignment, uint64& offset) {
+    if (size == 0) {
+        offset = 0;
+        return true;
+    }
+    for (auto it = free_ranges.begin(); it != free_ranges.end(); ++it) {
+        uint64 range_offset = it->first;
+        uint64 range_size   = it->second;
+        // Strides like 24 aren't powers of two
+        uint64 aligned = (range_offset + alignment - 1) / alignment * alignment;
+        if (aligned + size > range_offset + range_size)
+            continue;
+
+        free_ranges.erase(it);
+        if (aligned > range_offset)
+            free_ranges[range_offset] = aligned - range_offset;
+        if (aligned + size < range_offset + range_size)
+            free_ranges[aligned + size] = range_offset + range_size - (aligned + size);
+        offset = aligned;
+        used += size;
+        return true;
+    }
+    return false;
+}
+
+void RangeAllocator::free(uint64 offset, uint64 size) {
+    if (size == 0)
+        return;
+    used -= size;
+    auto next = free_ranges.lower_bound(offset);
+    if (next != free_ranges.end() && offset + size == next->first) {
+        size += next->second;
+        next = free_ranges.erase(next);
+    }
+    if (next != free_ranges.begin()) {
+        auto prev = std::prev(next);
+        if (prev->first + prev->second == offset) {
+            prev->second += size;
+            return;
+        }
+    }
+    free_ranges[offset] = size;
+}
+
+uint64 RangeAllocator::largest_free() const {
+    uint64 largest = 0;
+    for (const auto& [offset, size] : free_ranges)
+        largest = math::max(largest, size);
+    return largest;
+}
+
+GeometryAllocation::GeometryAllocation(GeometryAllocation&& other) noexcept {
+    *this = std::move(other);
+}
+
+GeometryAllocation& GeometryAllocation::operator=(GeometryAllocation&& other) noexcept {
+    if (this == &other)
+        return *this;
+    if (arena)
+        arena->free(*this);
+    arena         = other.arena;
+    vertex_offset = other.vertex_offset;
+    vertex_bsize  = other.vertex_bsize;
+    vertex_stride = other.vertex_stride;
+    first_index   = other.first_index;
+    index_count   = other.index_count;
+    other.arena   = nullptr;
+    return *this;
+}
+
+GeometryAllocation::~GeometryAllocation() {
+    if (arena)
+        arena->free(*this);
+}
+
+void GeometryArena::setup() {
+    vuk::Allocator& alloc = *get_renderer().global_allocator;
+    vertex_buffer = *vuk::allocate_buffer(alloc, {vuk::MemoryUsage::eGPUonly, vertex_capacity_bsize, 1});
+    index_buffer  = *vuk::allocate_buffer(alloc, {vuk::MemoryUsage::eGPUonly, sizeof(uint32) * index_capacity, 1});
+    vertices.reset(vertex_capacity_bsize);
+    indices.reset(index_capacity);
+    pending_frees.clear();
+}
+
+bool GeometryArena::allocate(uint64 vertex_bsize, uint64 vertex_stride, uint32 index_count, GeometryAllocation& allocation) {
+    if (!vertex_buffer)
+        setup();
+    uint64 vertex_offset, first_index;
+    if (!vertices.allocate(vertex_bsize, vertex_stride, vertex_offset))
+        return false;
+    if (!indices.allocate(index_count, 1, first_index)) {
+        vertices.free(vertex_offset, vertex_bsize);
+        return false;
+    }
+    allocation               = {};
+    allocation.arena         = this;
+    allocation.vertex_offset = vertex_offset;
+    allocation.vertex_bsize  = vertex_bsize;
+    allocation.vertex_stride = vertex_stride;
+    allocation.first_index   = uint32(first_index);
+    allocation.index_count   = index_count;
+    return true;
+}
+
+void GeometryArena::free(const GeometryAllocation& allocation) {
+    // Draws recorded for frames still in flight read from these ranges
+    pending_frees.push_back({
+        get_renderer().context->get_frame_count(),
+        allocation.vertex_offset,
+        allocation.vertex_bsize,
+        allocation.first_index,
+        allocation.index_count
+    });
+}
+
+void GeometryArena::stage(std::span<const uint8> data, const vuk::Buffer& destination) {
+    if (data.empty())
+        return;
+    uint64 offset = staged_data.size();
+    staged_data.resize(offset + data.size());
+    memcpy(staged_data.data() + offset, data.data(), data.size());
+    staged_copies.push_back({offset, destination});
+}
+
+void GeometryArena::flush_uploads() {
+    ZoneScoped;
+    if (staged_copies.empty())
+        return;
+    vuk::Allocator& alloc = *get_renderer().global_allocator;
+    auto staging = *vuk::allocate_buffer(alloc, {vuk::MemoryUsage::eCPUonly, staged_data.size(), 1});
+    memcpy(staging->mapped_ptr, staged_data.data(), staged_data.size());
+
+    auto rg = make_shared<vuk::RenderGraph>("upload_geometry");
+    rg->attach_buffer("arena_vertices", *vertex_buffer, vuk::eNone);
+    rg->attach_buffer("arena_indices", *index_buffer, vuk::eNone);
+    rg->add_pass({
+        .name       = "copy_geometry",
+        .execute_on = vuk::DomainFlagBits::eTransferOnTransfer,
+        .resources  = {
+            "arena_vertices"_buffer >> vuk::eTransferWrite >> "arena_vertices+",
+            "arena_indices"_buffer >> vuk::eTransferWrite >> "arena_indices+"
+        },
+        .execute = [staging = *staging, copies = std::move(staged_copies)](vuk::CommandBuffer& command_buffer) {
+            for (const StagedCopy& copy : copies)
+                command_buffer.copy_buffer(staging.subrange(copy.source_offset, copy.destination.size), copy.destination, copy.destination.size);
+        }
+    });
+    get_renderer().enqueue_setup(vuk::Future{rg, "arena_indices+"});
+    staged_data   = {};
+    staged_copies = {};
+}
+
+void GeometryArena::release_freed() {
+    uint64 frame = get_renderer().context->get_frame_count();
+    uint32 kept  = 0;
+    for (uint32 i = 0; i < pending_frees.size(); i++) {
+        const PendingFree& pending = pending_frees[i];
+        if (pending.frame + Renderer::inflight_count < frame) {
+            vertices.free(pending.vertex_offset, pending.vertex_bsize);
+            indices.free(pending.first_index, pending.index_count);
+        } else {
+            pending_frees[kept++] = pending;
+        }
+    }
+    pending_frees.resize(kept);
+}
+
+float GeometryArena::fragmentation() const {
+    auto range_fragmentation = [](const RangeAllocator& allocator) {
+        uint64 free_size = allocator.capacity - allocator.used;
+        return free_size == 0 ? 0.0f : 1.0f - float(allocator.largest_free()) / float(free_size);
+    };
+    return math::max(range_fragmentation(vertices), range_fragmentation(indices));
+}
+
+bool GeometryArena::needs_defragment() const {
+    auto split = [](const RangeAllocator& allocator) {
+        uint64 free_size = allocator.capacity - allocator.used;
+        return free_size * 4 >= allocator.capacity && allocator.largest_free() * 2 < free_size;
+    };
+    return vertex_buffer && (split(vertices) || split(indices));
+}
+
+void GeometryArena::defragment(const vector<GeometryAllocation*>& allocations) {
+    ZoneScoped;
+    // Staged copies point into the current buffers
+    assert_else(vertex_buffer && staged_copies.empty())
+        return;
+
+    // Laid out on copies first, so a range that doesn't fit leaves the arena as it was
+    struct Placement {
+        uint64 vertex_offset;
+        uint64 first_index;
+    };
+    RangeAllocator    packed_vertices;
+    RangeAllocator    packed_indices;
+    vector<Placement> placements;
+    packed_vertices.reset(vertex_capacity_bsize);
+    packed_indices.reset(index_capacity);
+    placements.reserve(allocations.size());
+    for (GeometryAllocation* allocation : allocations) {
+        Placement placement;
+        assert_else(packed_vertices.allocate(allocation->vertex_bsize, allocation->vertex_stride, placement.vertex_offset) &&
+                    packed_indices.allocate(allocation->index_count, 1, placement.first_index)) {
+            log_error(fmt_("Geometry arena couldn't be repacked, {} allocations kept in place", allocations.size()), "asset.mesh");
+            return;
+        }
+        placements.push_back(placement);
+    }
+
+    vuk::Allocator& alloc = *get_renderer().global_allocator;
+    vuk::Unique<vuk::Buffer> new_vertex_buffer = *vuk::allocate_buffer(alloc, {vuk::MemoryUsage::eGPUonly, vertex_capacity_bsize, 1});
+    vuk::Unique<vuk::Buffer> new_index_buffer  = *vuk::allocate_buffer(alloc, {vuk::MemoryUsage::eGPUonly, sizeof(uint32) * index_capacity, 1});
+
+    struct Move {
+        vuk::Buffer source;
+        vuk::Buffer destination;
+    };
+    vector<Move> moves;
+    for (uint32 i = 0; i < allocations.size(); i++) {
+        GeometryAllocation* allocation = allocations[i];
+        const Placement&    placement  = placements[i];
+        if (allocation->vertex_bsize > 0)
+            moves.push_back({vertex_buffer->subrange(allocation->vertex_offset, allocation->vertex_bsize),
+                             new_vertex_buffer->subrange(placement.vertex_offset, allocation->vertex_bsize)});
+        if (allocation->index_count > 0)
+            moves.push_back({index_buffer->subrange(allocation->first_index * sizeof(uint32), allocation->index_count * sizeof(uint32)),
+                             new_index_buffer->subrange(placement.first_index * sizeof(uint32), allocation->index_count * sizeof(uint32))});
+        allocation->vertex_offset = placement.vertex_offset;
+        allocation->first_index   = uint32(placement.first_index);
+    }
+    vertices = std::move(packed_vertices);
+    indices  = std::move(packed_indices);
+
+    auto rg = make_shared<vuk::RenderGraph>("defragment_geometry");
+    rg->attach_buffer("old_vertices", *vertex_buffer, vuk::eNone);
+    rg->attach_buffer("old_indices", *index_buffer, vuk::eNone);
+    rg->attach_buffer("new_vertices", *new_vertex_buffer, vuk::eNone);
+    rg->attach_buffer("new_indices", *new_index_buffer, vuk::eNone);
+    rg->add_pass({
+        .name       = "move_geometry",
+        .execute_on = vuk::DomainFlagBits::eTransferOnTransfer,
+        .resources  = {
+            "old_vertices"_buffer >> vuk::eTransferRead,
+            "old_indices"_buffer >> vuk::eTransferRead,
+            "new_vertices"_buffer >> vuk::eTransferWrite >> "new_vertices+",
+            "new_indices"_buffer >> vuk::eTransferWrite >> "new_indices+"
+        },
+        .execute = [moves](vuk::CommandBuffer& command_buffer) {
+            for (const Move& move : moves)
+                command_buffer.copy_buffer(move.source, move.destination, move.source.size);
+        }
+    });
+    get_renderer().enqueue_setup(vuk::Future{rg, "new_indices+"});
+
+    // Old ranges go with the old buffers
+    pending_frees.clear();
+    vertex_buffer = std::move(new_vertex_buffer);
+    index_buffer  = std::move(new_index_buffer);
+    log(BasicMessage{.str = fmt_("Defragmented geometry arena, {} allocations", allocations.size()), .group = "asset.mesh"});
+}
+
+void GeometryArena::cleanup() {
+    vertex_buffer = {};
+    index_buffer  = {};
+    vertices.reset(0);
+    indices.reset(0);
+    pending_frees.clear();
+    staged_data   = {};
+    staged_copies = {};
+}
+
+}
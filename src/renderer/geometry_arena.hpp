@@ -0,0 +1,92 @@
+#pragma once
+
+#include <map>
+#include <span>
+#include <vuk/Buffer.hpp>
+
+#include "general/vector.hpp"
+
+namespace spellbook {
+
+// First fit over free ranges keyed by offset, neighbours merge back together when freed
+struct RangeAllocator {
+    std::map<uint64, uint64> free_ranges; // Offset to size
+    uint64 capacity = 0;
+    uint64 used     = 0;
+
+    void   reset(uint64 new_capacity);
+    bool   allocate(uint64 size, uint64 alignment, uint64& offset);
+    void   free(uint64 offset, uint64 size);
+    uint64 largest_free() const;
+};
+
+struct GeometryArena;
+
+// A mesh's ranges in the arena, given back when it's destroyed
+struct GeometryAllocation {
+    GeometryArena* arena         = nullptr;
+    uint64         vertex_offset = 0; // Bytes, a multiple of the mesh's vertex stride
+    uint64         vertex_bsize  = 0;
+    uint64         vertex_stride = 1;
+    uint32         first_index   = 0;
+    uint32         index_count   = 0;
+
+    GeometryAllocation() = default;
+    GeometryAllocation(GeometryAllocation&& other) noexcept;
+    GeometryAllocation& operator=(GeometryAllocation&& other) noexcept;
+    GeometryAllocation(const GeometryAllocation&) = delete;
+    GeometryAllocation& operator=(const GeometryAllocation&) = delete;
+    ~GeometryAllocation();
+
+    explicit operator bool() const { return arena != nullptr; }
+};
+
+// Shared device-local vertex and index storage, so every mesh in it can be drawn with one binding and
+// vertexOffset/firstIndex. Vertex ranges are aligned to their own stride, so either encoding can be bound over the
+// whole buffer. Freed ranges wait out the frames in flight before they're reused.
+struct GeometryArena {
+    constexpr static uint64 vertex_capacity_bsize = 64ull << 20;
+    constexpr static uint32 index_capacity        = 1u << 23;
+
+    struct PendingFree {
+        uint64 frame;
+        uint64 vertex_offset;
+        uint64 vertex_bsize;
+        uint32 first_index;
+        uint32 index_count;
+    };
+
+    struct StagedCopy {
+        uint64      source_offset;
+        vuk::Buffer destination;
+    };
+
+    vuk::Unique<vuk::Buffer> vertex_buffer;
+    vuk::Unique<vuk::Buffer> index_buffer;
+    RangeAllocator           vertices;
+    RangeAllocator           indices;
+    vector<PendingFree>      pending_frees;
+    // Uploads wait here so a frame's worth goes through one staging buffer and one copy pass
+    vector<uint8>            staged_data;
+    vector<StagedCopy>       staged_copies;
+
+    void setup();
+    // Returns false when no range is big enough, the mesh should get its own buffers then
+    bool allocate(uint64 vertex_bsize, uint64 vertex_stride, uint32 index_count, GeometryAllocation& allocation);
+    void free(const GeometryAllocation& allocation);
+    // destination is a view into one of the arena buffers
+    void stage(std::span<const uint8> data, const vuk::Buffer& destination);
+    void flush_uploads();
+    // Once a frame, ranges freed before every frame in flight started can be handed out again
+    void release_freed();
+    // Share of the free space outside the largest hole of either buffer
+    float fragmentation() const;
+    // A good part of the arena is free but split into holes too small to use
+    bool  needs_defragment() const;
+    // Copies every live allocation to the front of new buffers in one pass and rewrites their offsets. The old
+    // buffers are released after the frames still reading them.
+    void defragment(const vector<GeometryAllocation*>& allocations);
+    void cleanup();
+};
+
+}
@@ -1,6 +1,12 @@
 #include "gpu_asset_cache.hpp"
 
+#include <algorithm>
+#include <cmath>
+#include <tracy/Tracy.hpp>
+
+#include "extension/fmt.hpp"
 #include "general/logger.hpp"
+#include "general/math/math.hpp"
 
 #include "renderer/draw_functions.hpp"
 #include "renderer/assets/material.hpp"
@@ -13,6 +19,12 @@ MeshGPU* GPUAssetCache::get_mesh(uint64 id) {
     return nullptr;
 }
 
+MeshBVH* GPUAssetCache::get_mesh_bvh(uint64 id) {
+    if (mesh_bvhs.contains(id))
+        return &mesh_bvhs[id];
+    return nullptr;
+}
+
 MaterialGPU* GPUAssetCache::get_material(uint64 id) {
     if (materials.contains(id))
         return &materials[id];
@@ -25,31 +37,324 @@ TextureGPU* GPUAssetCache::get_texture(uint64 id) {
     return nullptr;
 }
 
-MeshGPU& GPUAssetCache::get_mesh_or_upload(uint64 id) {
-    if (meshes.contains(id))
-        return meshes[id];
-    assert_else(paths.contains(id));
-    upload_mesh(load_mesh(paths[id]));
-    return meshes[id];
+MeshGPU& GPUAssetCache::get_mesh_or_upload(uint64 id, StreamPriority priority) {
+    if (auto it = meshes.find(id); it != meshes.end()) {
+        it->second.last_used_frame = frame;
+        return it->second;
+    }
+    assert_else(paths.contains(id))
+        return meshes[default_mesh_id];
+    if (failed.contains(id))
+        return meshes[default_mesh_id];
+    streamer.request(AssetStreamer::AssetType_Mesh, id, paths[id], priority);
+    return meshes[default_mesh_id];
 }
 
-MaterialGPU& GPUAssetCache::get_material_or_upload(uint64 id) {
-    if (materials.contains(id))
-        return materials[id];
-    assert_else(paths.contains(id));
-    upload_material(load_resource<MaterialCPU>(paths[id]));
-    return materials[id];
+MaterialGPU& GPUAssetCache::get_material_or_upload(uint64 id, StreamPriority priority) {
+    if (auto it = materials.find(id); it != materials.end()) {
+        // Textures are only reached through materials, so they're never colder than a material using them
+        const MaterialCPU& material_cpu = it->second.material_cpu;
+        for (const FilePath* path : {&material_cpu.color_asset_path, &material_cpu.orm_asset_path, &material_cpu.normal_asset_path, &material_cpu.emissive_asset_path}) {
+            if (auto texture_it = textures.find(hash_path(*path)); texture_it != textures.end())
+                texture_it->second.last_used_frame = frame;
+        }
+        it->second.last_used_frame = frame;
+        return it->second;
+    }
+    assert_else(paths.contains(id))
+        return materials[default_material_id];
+    if (failed.contains(id))
+        return materials[default_material_id];
+    streamer.request(AssetStreamer::AssetType_Material, id, paths[id], priority);
+    return materials[default_material_id];
 }
 
-TextureGPU& GPUAssetCache::get_texture_or_upload(const FilePath& asset_path) {
-    assert_else(asset_path.is_file());
+TextureGPU& GPUAssetCache::get_texture_or_upload(const FilePath& asset_path, StreamPriority priority) {
     uint64 hash = hash_path(asset_path);
     if (textures.contains(hash))
         return textures[hash];
-    upload_texture(load_texture(asset_path));
-    return textures[hash];
+    if (failed.contains(hash))
+        return textures[default_texture_id];
+    assert_else(asset_path.is_file() || streamer.find_packed(hash) != nullptr)
+        return textures[default_texture_id];
+    streamer.request(AssetStreamer::AssetType_Texture, hash, asset_path, priority, texture_tail_resolution);
+    return textures[default_texture_id];
+}
+
+MeshGPU* GPUAssetCache::get_mesh_or_placeholder(uint64 id) {
+    if (MeshGPU* mesh = get_mesh(id))
+        return mesh;
+    return streamer.is_pending(id) || failed.contains(id) ? get_mesh(default_mesh_id) : nullptr;
+}
+
+MaterialGPU* GPUAssetCache::get_material_or_placeholder(uint64 id) {
+    if (MaterialGPU* material = get_material(id))
+        return material;
+    return streamer.is_pending(id) || failed.contains(id) ? get_material(default_material_id) : nullptr;
+}
+
+bool GPUAssetCache::mount_pack(const FilePath& pack_path) {
+    if (!streamer.mount_pack(pack_path))
+        return false;
+    // Packed meshes can be requested by id without their original files around
+    const AssetPack& pack = *streamer.packs.back();
+    for (const PackEntry& entry : pack.entries) {
+        if (entry.type == PackAssetType_Mesh && !paths.contains(entry.id))
+            paths[entry.id] = FilePath(string(pack.path(entry)));
+    }
+    retry_failed();
+    return true;
+}
+
+void GPUAssetCache::retry_failed() {
+    if (!failed.empty())
+        log(BasicMessage{.str = fmt_("Retrying {} assets that failed to load", failed.size()), .group = "asset"});
+    failed.clear();
 }
 
+void GPUAssetCache::upload_streamed() {
+    ZoneScoped;
+    if (assets_saved.exchange(false))
+        retry_failed();
+    bool textures_arrived = false;
+    // Loads that fail come back without a file path, they already logged why
+    auto mark_failed = [this](uint64 id) {
+        failed[id] = frame;
+    };
+    for (AssetStreamer::Completed& completed : streamer.take_completed()) {
+        if (MeshCPU* mesh_cpu = std::get_if<MeshCPU>(&completed.asset)) {
+            if (!mesh_cpu->file_path.is_file()) {
+                mark_failed(completed.id);
+                continue;
+            }
+            upload_mesh(*mesh_cpu);
+        } else if (MaterialCPU* material_cpu = std::get_if<MaterialCPU>(&completed.asset)) {
+            if (!material_cpu->file_path.is_file()) {
+                mark_failed(completed.id);
+                continue;
+            }
+            upload_material(*material_cpu);
+        } else if (TextureCPU* texture_cpu = std::get_if<TextureCPU>(&completed.asset)) {
+            if (!texture_cpu->file_path.is_file()) {
+                mark_failed(completed.id);
+                continue;
+            }
+            upload_texture(*texture_cpu);
+            textures_arrived = true;
+        } else if (AssetStreamer::PackedAsset* packed = std::get_if<AssetStreamer::PackedAsset>(&completed.asset)) {
+            const PackEntry&       entry = *packed->entry;
+            std::span<const uint8> chunk = packed->pack->chunk(entry);
+            FilePath               path  = FilePath(string(packed->pack->path(entry)));
+            if (entry.type == PackAssetType_Mesh) {
+                MeshBounds bounds = {
+                    .valid   = entry.bounds_valid != 0,
+                    .extents = entry.bounds_extents,
+                    .origin  = entry.bounds_origin,
+                    .radius  = entry.bounds_radius
+                };
+                // Baked into the pack, copied out since the mapping only guarantees the chunk's alignment
+                BVH bvh = packed_mesh_bvh(entry, chunk.data());
+                upload_mesh(path,
+                    chunk.subspan(0, entry.vertices_bsize),
+                    entry.vertex_encoding,
+                    std::span((const uint32*) (chunk.data() + entry.vertices_bsize), entry.indices_bsize / sizeof(uint32)),
+                    bounds,
+                    std::span(entry.lods, entry.lod_count),
+                    false,
+                    &bvh);
+            } else {
+                upload_texture(path, entry.size, vuk::Format(entry.format), chunk.data(), entry.mip_count);
+                textures_arrived = true;
+            }
+        }
+    }
+
+    // Materials were bound to the placeholder until their textures arrived
+    if (textures_arrived) {
+        for (auto& [id, material] : materials)
+            material.refresh_textures();
+    }
+}
+
+void GPUAssetCache::want_texture_resolution(const FilePath& asset_path, float pixel_size) {
+    if (!asset_path.is_file())
+        return;
+    float& wanted = wanted_texture_resolutions[hash_path(asset_path)];
+    wanted = math::max(wanted, pixel_size);
+}
+
+void GPUAssetCache::update_texture_residency() {
+    ZoneScoped;
+    struct Change {
+        uint64 id;
+        uint32 first_mip;
+        uint64 bsize; // Resident size after the change
+        uint32 levels;
+    };
+    vector<Change> refinements;
+    vector<Change> coarsenings;
+    texture_streaming_report = {};
+    for (auto& [id, texture] : textures) {
+        if (!texture.streamed)
+            continue;
+        texture_streaming_report.streamed++;
+        texture_streaming_report.resident_bsize += texture.resident_bsize();
+        // A level that failed to load keeps the texture at what it has
+        if (streamer.is_pending(id) || failed.contains(id))
+            continue;
+
+        // Nothing drops below the tail it was first loaded with
+        uint32 tail_mip  = first_mip_for(texture.size, texture.mip_count, texture_tail_resolution);
+        uint32 wanted    = tail_mip;
+        auto   wanted_it = wanted_texture_resolutions.find(id);
+        if (wanted_it != wanted_texture_resolutions.end())
+            wanted = math::min(tail_mip, first_mip_for(texture.size, texture.mip_count, math::max(uint32(std::ceil(wanted_it->second)), 1u)));
+        if (wanted == texture.first_mip)
+            continue;
+
+        TextureGPU changed = {.size = texture.size, .format = texture.format, .mip_count = texture.mip_count, .first_mip = wanted};
+        if (wanted < texture.first_mip)
+            refinements.push_back({id, wanted, changed.resident_bsize(), texture.first_mip - wanted});
+        else
+            coarsenings.push_back({id, wanted, changed.resident_bsize(), wanted - texture.first_mip});
+    }
+    wanted_texture_resolutions.clear();
+    texture_streaming_report.refining = refinements.size();
+
+    // Textures furthest from what they need go first, the most detail to give up last
+    std::sort(refinements.begin(), refinements.end(), [](const Change& lhs, const Change& rhs) { return lhs.levels > rhs.levels; });
+    std::sort(coarsenings.begin(), coarsenings.end(), [](const Change& lhs, const Change& rhs) { return lhs.levels < rhs.levels; });
+
+    auto request_mips = [this](const Change& change) {
+        v2i top_size = mip_size(textures[change.id].size, change.first_mip);
+        streamer.request(AssetStreamer::AssetType_Texture, change.id, paths[change.id], StreamPriority_Low, uint32(math::max(top_size.x, top_size.y)));
+    };
+
+    // Coarsening only happens to make room, otherwise detail stays around in case it's looked at again
+    uint64 budgeted_bsize = texture_streaming_report.resident_bsize;
+    for (const Change& refinement : refinements) {
+        uint64 growth = refinement.bsize - textures[refinement.id].resident_bsize();
+        while (budgeted_bsize + growth > texture_budget_bsize && !coarsenings.empty()) {
+            const Change& coarsening = coarsenings.back();
+            budgeted_bsize -= textures[coarsening.id].resident_bsize() - coarsening.bsize;
+            request_mips(coarsening);
+            coarsenings.pop_back();
+        }
+        if (budgeted_bsize + growth > texture_budget_bsize)
+            break;
+        budgeted_bsize += growth;
+        request_mips(refinement);
+    }
+}
+
+static bool uses_texture(const MaterialCPU& material_cpu, uint64 texture_id) {
+    for (const FilePath* path : {&material_cpu.color_asset_path, &material_cpu.orm_asset_path, &material_cpu.normal_asset_path, &material_cpu.emissive_asset_path}) {
+        if (hash_path(*path) == texture_id)
+            return true;
+    }
+    return false;
+}
+
+void GPUAssetCache::evict_cold_assets() {
+    ZoneScoped;
+    frame++;
+
+    memory_report.meshes        = meshes.size();
+    memory_report.materials     = materials.size();
+    memory_report.textures      = textures.size();
+    memory_report.mesh_bsize    = 0;
+    memory_report.texture_bsize = 0;
+    for (const auto& [id, mesh] : meshes)
+        memory_report.mesh_bsize += mesh.bsize();
+    for (const auto& [id, texture] : textures)
+        memory_report.texture_bsize += texture.resident_bsize();
+
+    if (memory_report.total_bsize() <= vram_budget_bsize)
+        return;
+
+    // Only assets that exist on disk or in a pack can come back, anything built at runtime stays
+    auto reloadable = [this](uint64 id) {
+        auto path_it = paths.find(id);
+        if (path_it == paths.end())
+            return false;
+        return fs::exists(path_it->second.abs_path()) || streamer.find_packed(id) != nullptr;
+    };
+
+    struct Candidate {
+        uint64 id;
+        uint64 last_used_frame;
+        uint64 bsize;
+        bool   texture;
+    };
+    vector<Candidate> candidates;
+    auto cold = [this](uint64 last_used_frame) { return last_used_frame + eviction_grace_frames < frame; };
+    for (const auto& [id, mesh] : meshes) {
+        if (id != default_mesh_id && !mesh.frame_allocated && cold(mesh.last_used_frame))
+            candidates.push_back({id, mesh.last_used_frame, mesh.bsize(), false});
+    }
+    for (const auto& [id, texture] : textures) {
+        if (id != default_texture_id && !texture.frame_allocated && cold(texture.last_used_frame))
+            candidates.push_back({id, texture.last_used_frame, texture.resident_bsize(), true});
+    }
+    std::sort(candidates.begin(), candidates.end(), [](const Candidate& lhs, const Candidate& rhs) { return lhs.last_used_frame < rhs.last_used_frame; });
+
+    for (const Candidate& candidate : candidates) {
+        if (memory_report.total_bsize() <= vram_budget_bsize)
+            break;
+        if (streamer.is_pending(candidate.id) || !reloadable(candidate.id))
+            continue;
+        if (!candidate.texture) {
+            meshes.erase(candidate.id);
+            mesh_bvhs.erase(candidate.id);
+            memory_report.evicted_meshes++;
+            memory_report.mesh_bsize -= candidate.bsize;
+            continue;
+        }
+
+        // Materials sample the texture's view directly, so they go with it and rebind when they're streamed back
+        vector<uint64> users;
+        bool           users_reloadable = true;
+        for (const auto& [id, material] : materials) {
+            if (!uses_texture(material.material_cpu, candidate.id))
+                continue;
+            users.push_back(id);
+            users_reloadable &= id != default_material_id && !material.frame_allocated && reloadable(id);
+        }
+        if (!users_reloadable)
+            continue;
+        for (uint64 id : users)
+            materials.erase(id);
+        textures.erase(candidate.id);
+        memory_report.evicted_materials += users.size();
+        memory_report.evicted_textures++;
+        memory_report.texture_bsize -= candidate.bsize;
+    }
+    memory_report.meshes    = meshes.size();
+    memory_report.materials = materials.size();
+    memory_report.textures  = textures.size();
+}
+
+void GPUAssetCache::maintain_geometry() {
+    geometry_arena.release_freed();
+    if (geometry_arena.needs_defragment())
+        defragment_geometry();
+}
+
+void GPUAssetCache::defragment_geometry() {
+    ZoneScoped;
+    geometry_arena.release_freed();
+    vector<GeometryAllocation*> allocations;
+    vector<MeshGPU*>            arena_meshes;
+    for (auto& [id, mesh] : meshes) {
+        if (!mesh.in_arena)
+            continue;
+        allocations.push_back(&mesh.allocation);
+        arena_meshes.push_back(&mesh);
+    }
+    geometry_arena.defragment(allocations);
+    for (MeshGPU* mesh : arena_meshes)
+        mesh->update_arena_views();
+}
 
 void GPUAssetCache::upload_defaults() {
     TextureCPU tex_white_upload {
@@ -84,18 +389,41 @@ void GPUAssetCache::upload_defaults() {
         .pixels = {255, 0, 0, 255, 0, 255, 0, 255, 0, 0, 255, 255, 255, 255, 255, 255}
     };
     default_tex.file_path = FilePath("default", true);
-    upload_texture(default_tex);
+    default_texture_id = hash_path(upload_texture(default_tex));
 
     MaterialCPU default_mat = {
         .color_tint = palette::black,
     };
     default_mat.file_path = FilePath("default", true);
-    upload_material(default_mat);
+    default_material_id = upload_material(default_mat);
 
 
     MeshCPU default_mesh   = generate_cube(v3(0), v3(1));
     default_mesh.file_path = FilePath("default", true);
-    upload_mesh(default_mesh);
+    default_mesh_id = upload_mesh(default_mesh);
+}
+
+VertexMemoryReport GPUAssetCache::vertex_memory_report() const {
+    VertexMemoryReport report;
+    for (const auto& [id, mesh] : meshes) {
+        report.meshes[mesh.encoding]++;
+        report.vertices[mesh.encoding] += mesh.vertex_count;
+        report.bsize[mesh.encoding] += uint64(mesh.vertex_count) * (mesh.encoding == VertexEncoding_Packed ? sizeof(PackedVertex) : sizeof(Vertex));
+    }
+    return report;
+}
+
+void GPUAssetCache::log_vertex_memory_report() const {
+    VertexMemoryReport report = vertex_memory_report();
+    // Every drawn vertex is fetched once per pass, so the byte ratio is also the vertex fetch bandwidth ratio
+    log(BasicMessage{
+        .str = fmt_("Vertex memory: {} packed meshes ({} vertices, {:.2f}MB), {} full meshes ({} vertices, {:.2f}MB), {:.2f}MB total vs {:.2f}MB unpacked, {:.1f}% of the fetch bandwidth",
+            report.meshes[VertexEncoding_Packed], report.vertices[VertexEncoding_Packed], report.bsize[VertexEncoding_Packed] / (1024.0f * 1024.0f),
+            report.meshes[VertexEncoding_Full], report.vertices[VertexEncoding_Full], report.bsize[VertexEncoding_Full] / (1024.0f * 1024.0f),
+            report.total_bsize() / (1024.0f * 1024.0f), report.full_bsize() / (1024.0f * 1024.0f),
+            report.full_bsize() == 0 ? 100.0f : 100.0f * float(report.total_bsize()) / float(report.full_bsize())),
+        .group = "asset.mesh"
+    });
 }
 
 void GPUAssetCache::clear_frame_allocated_assets() {
@@ -125,10 +453,14 @@ void GPUAssetCache::clear_frame_allocated_assets() {
 
 
 void GPUAssetCache::clear() {
+    streamer.shutdown();
     meshes.clear();
+    mesh_bvhs.clear();
+    geometry_arena.cleanup();
     materials.clear();
     textures.clear();
     paths.clear();
+    failed.clear();
 }
 
 }
\ No newline at end of file
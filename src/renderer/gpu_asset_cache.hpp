@@ -1,27 +1,110 @@
 #pragma once
 
+#include <atomic>
+
 #include "general/umap.hpp"
 #include "general/string.hpp"
 
 #include "assets/mesh.hpp"
 #include "assets/material.hpp"
 #include "assets/texture.hpp"
+#include "geometry_arena.hpp"
+#include "asset_streamer.hpp"
 
 namespace spellbook {
 
+// Resident vertex data per VertexEncoding, compared against storing everything as full Vertex
+struct VertexMemoryReport {
+    uint32 meshes[2]   = {};
+    uint64 vertices[2] = {};
+    uint64 bsize[2]    = {};
+
+    uint64 total_bsize() const { return bsize[VertexEncoding_Full] + bsize[VertexEncoding_Packed]; }
+    uint64 full_bsize() const { return (vertices[VertexEncoding_Full] + vertices[VertexEncoding_Packed]) * sizeof(Vertex); }
+};
+
+// Resident VRAM per asset kind. Materials only reference textures, they're counted but hold no memory of their own.
+struct AssetMemoryReport {
+    uint32 meshes         = 0;
+    uint32 materials      = 0;
+    uint32 textures       = 0;
+    uint64 mesh_bsize     = 0;
+    uint64 texture_bsize  = 0;
+    // Since startup
+    uint64 evicted_meshes    = 0;
+    uint64 evicted_materials = 0;
+    uint64 evicted_textures  = 0;
+
+    uint64 total_bsize() const { return mesh_bsize + texture_bsize; }
+};
+
+// Streamed textures load their small tail first and refine toward the level their on screen size asks for
+struct TextureStreamingReport {
+    uint32 streamed       = 0;
+    uint32 refining       = 0; // Want more detail than they hold
+    uint64 resident_bsize = 0;
+};
+
 struct GPUAssetCache {
+    // Before meshes, so their allocations are handed back before it goes away
+    GeometryArena             geometry_arena;
     umap<uint64, MeshGPU>     meshes;
     umap<uint64, MaterialGPU> materials;
     umap<uint64, TextureGPU>  textures;
+    umap<uint64, MeshBVH>     mesh_bvhs; // LOD 0 triangles of the persistent meshes, for picking on the CPU
     umap<uint64, FilePath>      paths;
+    AssetStreamer               streamer;
+    // Assets that came back from the streamer empty, by the frame they failed on. They stay on the default asset
+    // instead of being requested every frame, until retry_failed.
+    umap<uint64, uint64>        failed;
+    std::atomic<bool>           assets_saved = false; // Set by the save_* functions from any thread
+
+    uint64 default_mesh_id     = 0;
+    uint64 default_material_id = 0;
+    uint64 default_texture_id  = 0;
+
+    uint64                texture_budget_bsize       = 512ull * 1024 * 1024;
+    uint32                texture_tail_resolution    = 64;
+    umap<uint64, float>   wanted_texture_resolutions; // Texels across the largest on screen use this frame
+    TextureStreamingReport texture_streaming_report;
+
+    // Assets unused for eviction_grace_frames can be dropped once the cache is over budget, they come back through
+    // paths and get_*_or_upload the next time something asks for them
+    uint64            frame                 = 0;
+    uint64            vram_budget_bsize     = 1024ull * 1024 * 1024;
+    uint32            eviction_grace_frames = 120;
+    AssetMemoryReport memory_report;
 
     void upload_defaults();
     MeshGPU* get_mesh(uint64 id);
+    MeshBVH* get_mesh_bvh(uint64 id);
     MaterialGPU* get_material(uint64 id);
     TextureGPU* get_texture(uint64 id);
-    MeshGPU& get_mesh_or_upload(uint64 id);
-    MaterialGPU& get_material_or_upload(uint64 id);
-    TextureGPU& get_texture_or_upload(const FilePath& asset_path);
+    // Missing assets are requested from the streamer, the default asset is returned until they arrive
+    MeshGPU& get_mesh_or_upload(uint64 id, StreamPriority priority = StreamPriority_Normal);
+    MaterialGPU& get_material_or_upload(uint64 id, StreamPriority priority = StreamPriority_Normal);
+    TextureGPU& get_texture_or_upload(const FilePath& asset_path, StreamPriority priority = StreamPriority_Normal);
+    // The default asset stands in for assets that are still streaming, nullptr if it isn't known at all
+    MeshGPU* get_mesh_or_placeholder(uint64 id);
+    MaterialGPU* get_material_or_placeholder(uint64 id);
+
+    // Main thread, uploads whatever the streamer finished since last frame
+    void upload_streamed();
+    // Called while preparing a frame, pixel_size is how many pixels the texture spans across its longest use
+    void want_texture_resolution(const FilePath& asset_path, float pixel_size);
+    // Requests finer mips for textures that want them within the budget, coarser ones for idle textures when it's tight
+    void update_texture_residency();
+    // Starts a new frame for last use tracking and evicts the least recently used assets that can be reloaded
+    void evict_cold_assets();
+    // After the frame's uploads have landed, reuses freed arena ranges and compacts the arena when it's too split up
+    void maintain_geometry();
+    void defragment_geometry();
+    bool mount_pack(const FilePath& pack_path);
+    // When assets on disk change, anything that failed to load gets another try
+    void retry_failed();
+
+    VertexMemoryReport vertex_memory_report() const;
+    void               log_vertex_memory_report() const;
 
     void clear_frame_allocated_assets();
     void clear();
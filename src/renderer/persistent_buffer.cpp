@@ -0,0 +1,64 @@
+#include "persistent_buffer.hpp"
+
+#include <vuk/Partials.hpp>
+#include <tracy/Tracy.hpp>
+
+#include "general/math/math.hpp"
+
+#include "renderer/renderer.hpp"
+
+namespace spellbook {
+
+static_assert(persistent_buffer_copies == Renderer::inflight_count);
+
+void PersistentBuffer::resize(uint64 element_count) {
+    mirror.resize(element_count * element_bsize);
+}
+
+uint64 PersistentBuffer::size() const {
+    return element_bsize == 0 ? 0 : mirror.size() / element_bsize;
+}
+
+void PersistentBuffer::write(uint64 index, const void* data, uint64 count) {
+    assert_else((index + count) * element_bsize <= mirror.size())
+        return;
+    memcpy(mirror.data() + index * element_bsize, data, count * element_bsize);
+    mark_dirty(index, index + count);
+}
+
+void PersistentBuffer::mark_dirty(uint64 begin_index, uint64 end_index) {
+    for (FrameCopy& copy : copies) {
+        copy.dirty_begin = math::min(copy.dirty_begin, begin_index * element_bsize);
+        copy.dirty_end   = math::max(copy.dirty_end, end_index * element_bsize);
+    }
+}
+
+vuk::Buffer PersistentBuffer::flush() {
+    ZoneScoped;
+    FrameCopy& copy = copies[get_renderer().context->get_frame_count() % Renderer::inflight_count];
+
+    uint64 required_bsize = math::max(uint64(mirror.size()), element_bsize);
+    if (!copy.buffer || copy.buffer->size < required_bsize) {
+        // Grow with headroom so steady growth doesn't reallocate every frame
+        uint64 capacity_bsize = required_bsize + required_bsize / 2;
+        copy.buffer      = std::move(*vuk::allocate_buffer(*get_renderer().global_allocator, {vuk::MemoryUsage::eCPUtoGPU, capacity_bsize, 1}));
+        copy.dirty_begin = 0;
+        copy.dirty_end   = mirror.size();
+    }
+
+    copy.dirty_end = math::min(copy.dirty_end, uint64(mirror.size()));
+    if (copy.dirty_end > copy.dirty_begin)
+        memcpy((uint8*) copy.buffer->mapped_ptr + copy.dirty_begin, mirror.data() + copy.dirty_begin, copy.dirty_end - copy.dirty_begin);
+    copy.dirty_begin = UINT64_MAX;
+    copy.dirty_end   = 0;
+
+    return *copy.buffer;
+}
+
+void PersistentBuffer::cleanup() {
+    for (FrameCopy& copy : copies)
+        copy = {};
+    mirror.clear();
+}
+
+}
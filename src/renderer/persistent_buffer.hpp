@@ -0,0 +1,39 @@
+#pragma once
+
+#include <array>
+#include <vuk/Buffer.hpp>
+
+#include "general/vector.hpp"
+
+namespace spellbook {
+
+constexpr uint32 persistent_buffer_copies = 3; // Renderer::inflight_count
+
+// CPU mirror with one persistently mapped copy per frame in flight. Writes land in the mirror and are replayed
+// into the current frame's copy as a single dirty range on flush, so a frame only uploads what changed.
+struct PersistentBuffer {
+    struct FrameCopy {
+        vuk::Unique<vuk::Buffer> buffer;
+        uint64 dirty_begin = UINT64_MAX;
+        uint64 dirty_end   = 0;
+    };
+
+    uint64        element_bsize = 0;
+    vector<uint8> mirror;
+    std::array<FrameCopy, persistent_buffer_copies> copies;
+
+    void   resize(uint64 element_count);
+    uint64 size() const;
+
+    void write(uint64 index, const void* data, uint64 count = 1);
+    void mark_dirty(uint64 begin_index, uint64 end_index);
+
+    template <typename T>
+    T* data() { return (T*) mirror.data(); }
+
+    // Uploads pending writes into this frame's copy and returns it for binding
+    vuk::Buffer flush();
+    void        cleanup();
+};
+
+}
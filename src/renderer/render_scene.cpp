@@ -1,5 +1,7 @@
 #include "render_scene.hpp"
 
+#include <chrono>
+#include <cmath>
 #include <functional>
 #include <tracy/Tracy.hpp>
 #include <vuk/Partials.hpp>
@@ -16,6 +18,8 @@
 #include "renderable.hpp"
 #include "draw_functions.hpp"
 #include "fmt_renderer.hpp"
+#include "worker_pool.hpp"
+#include "shader_cache.hpp"
 #include "assets/particles.hpp"
 #include "assets/material.hpp"
 #include "assets/texture.hpp"
@@ -28,8 +32,6 @@ void RenderScene::setup(vuk::Allocator& allocator) {
     scene_data.fog_depth             = -1.0f;
     scene_data.sun_direction         = quat(0.2432103f, 0.3503661f, 0.0885213f, 0.9076734f);
     scene_data.sun_intensity         = 1.0f;
-
-    voxelization_resolution = v3i(128);
 }
 
 void RenderScene::image(v2i size) {
@@ -49,6 +51,88 @@ void RenderScene::settings_gui() {
         ImGui::EnumCombo("Debug Mode", &post_process_data.debug_mode);
         ImGui::TreePop();
     }
+    if (ImGui::TreeNode("Culling")) {
+        ImGui::Checkbox("Frustum Culling", &frustum_culling);
+        ImGui::Checkbox("GPU Driven", &gpu_driven);
+        auto culling_text = [](string_view name, const CullStats& stats) {
+            uint32 cpu_tested = stats.tested - stats.gpu;
+            ImGui::Text(fmt_("{}: {} drawn, {} culled, {} culled on GPU", name, stats.drawn, cpu_tested - stats.drawn, stats.gpu).c_str());
+        };
+        culling_text("Forward", forward_instances.stats);
+        culling_text("Shadows", shadows.stats);
+        culling_text("Voxelization", voxels.stats);
+        ImGui::TreePop();
+    }
+    if (ImGui::TreeNode("LOD")) {
+        ImGui::Checkbox("LOD Selection", &lod_selection);
+        ImGui::DragFloat("Base Size", &lod_base_size, 0.01f, 0.01f, 4.0f);
+        ImGui::DragFloat("Sun Bias", &sun_lod_bias, 0.01f, 0.01f, 1.0f);
+        ImGui::DragFloat("Voxelization Bias", &voxelization_lod_bias, 0.01f, 0.01f, 1.0f);
+        ImGui::DragFloat("Texture Detail", &texture_detail, 0.01f, 0.05f, 4.0f);
+        auto lod_text = [](string_view name, const CullStats& stats) {
+            ImGui::Text(fmt_("{}: {} of {} CPU drawn below LOD 0", name, stats.coarse, stats.drawn).c_str());
+        };
+        lod_text("Forward", forward_instances.stats);
+        lod_text("Shadows", shadows.stats);
+        lod_text("Voxelization", voxels.stats);
+        ImGui::TreePop();
+    }
+    if (ImGui::TreeNode("Shadows")) {
+        ImGui::Checkbox("Cache Cascades", &shadows.caching);
+        int cascade_count = shadows.cascade_count;
+        if (ImGui::SliderInt("Cascades", &cascade_count, 1, max_shadow_cascades))
+            shadows.cascade_count = cascade_count;
+        ImGui::DragFloat("Distance", &shadows.distance, 0.5f, 1.0f, 500.0f);
+        ImGui::DragFloat("Split Blend", &shadows.split_blend, 0.01f, 0.0f, 1.0f);
+        ImGui::DragFloat("Caster Depth", &shadows.caster_depth, 0.5f, 0.0f, 500.0f);
+        ImGui::DragFloat("Bias Texels", &shadows.bias_texels, 0.05f, 0.0f, 8.0f);
+        if (ImGui::Button("Render All"))
+            shadows.invalidate_all();
+        ImGui::Text(fmt_("{} of {} cascades rendered, {} instances drawn", shadows.rendered, shadows.cascade_count, shadows.stats.drawn + shadows.stats.gpu).c_str());
+        for (uint32 i = 0; i < shadows.cascade_count; i++) {
+            const ShadowCascade& cascade = shadows.cascades[i];
+            ImGui::Text(fmt_("Cascade {}: to {:.1f}, {:.4f} per texel, {}", i, cascade.split, 2.0f * cascade.radius / shadows.resolution, cascade.render ? "rendered" : "cached").c_str());
+        }
+        ImGui::TreePop();
+    }
+    if (ImGui::TreeNode("Voxels")) {
+        ImGui::Checkbox("Cache Voxels", &voxels.caching);
+        int level_count = voxels.level_count;
+        if (ImGui::SliderInt("Levels", &level_count, 1, max_voxel_levels))
+            voxels.level_count = level_count;
+        if (ImGui::DragFloat("Voxel Size", &voxels.voxel_size, 0.001f, 0.01f, 1.0f))
+            voxels.invalidate_all();
+        int regions_per_frame = voxels.max_regions_per_frame;
+        if (ImGui::SliderInt("Regions Per Frame", &regions_per_frame, 1, 64))
+            voxels.max_regions_per_frame = regions_per_frame;
+        if (ImGui::Button("Revoxelize All"))
+            voxels.invalidate_all();
+        ImGui::Text(fmt_("{:.1f} across, {} regions revoxelized, {} voxels, {} pending", voxels.extent(), voxels.regions.size(), voxels.revoxelized, voxels.pending.size()).c_str());
+        ImGui::TreePop();
+    }
+    if (ImGui::TreeNode("Global Illumination")) {
+        ImGui::EnumCombo("Quality", &gi_quality);
+        ImGui::DragFloat("Accumulation", &gi_history_weight, 0.01f, 0.0f, 0.98f);
+        GITier tier = gi_tier(gi_quality);
+        ImGui::Text(fmt_("Traced at {}x{}, {} steps per cone", gi_size.x, gi_size.y, tier.cone_steps).c_str());
+        ImGui::TreePop();
+    }
+    if (ImGui::TreeNode("Particles")) {
+        ImGui::Checkbox("Pooled", &particles.pooled);
+        ImGui::Text(fmt_("{} emitters, {} particle slots, {} dispatches, {} draws", particles.live_emitters, particles.slot_count, particles.dispatches.size(), particles.draws.size()).c_str());
+        if (particle_benchmark.running || particle_benchmark.reporting)
+            ImGui::Text(fmt_("Benchmarking, step {} of {}", particle_benchmark.step + 1, ParticleBenchmark::step_count).c_str());
+        else if (ImGui::Button("Benchmark 1 to 10k Emitters"))
+            particle_benchmark.start(*this);
+        ImGui::TreePop();
+    }
+    if (ImGui::TreeNode("Spatial Index")) {
+        ImGui::DragFloat("Margin", &spatial_index.margin, 0.01f, 0.0f, 4.0f);
+        ImGui::Text(fmt_("{} renderables, height {}, area ratio {:.1f}", spatial_index.leaf_count, spatial_index.height(), spatial_index.area_ratio()).c_str());
+        if (ImGui::Button("Benchmark 100k"))
+            benchmark_aabb_tree(100000);
+        ImGui::TreePop();
+    }
     ImGui::Text("Viewport");
     inspect(&viewport);
 }
@@ -59,18 +143,152 @@ void RenderScene::update_size(v2i new_size) {
 }
 
 Renderable* RenderScene::add_renderable(const Renderable& renderable) {
-    return &*renderables.emplace(renderable);
+    Renderable* added = &*renderables.emplace(renderable);
+    batch_renderable(added);
+    if (added->frame_allocated)
+        frame_renderables.push_back(added);
+    return added;
 }
 
 void RenderScene::delete_renderable(Renderable* renderable) {
+    unbatch_renderable(renderable);
+    if (renderable->spatial_proxy != ~0u) {
+        invalidate_bounds(spatial_index.fat_bounds(renderable->spatial_proxy));
+        spatial_index.remove(renderable->spatial_proxy);
+    }
     renderables.erase(renderables.get_iterator(renderable));
 }
 
+void RenderScene::set_transform(Renderable* renderable, const m44GPU& transform) {
+    renderable->transform = transform;
+    update_renderable(renderable);
+}
+
+void RenderScene::update_renderable(Renderable* renderable) {
+    assert_else(renderable->instance_slot != ~0u)
+        return;
+    instance_model_mats.write(renderable->instance_slot, &renderable->transform);
+    instance_ids.write(renderable->instance_slot, &renderable->selection_id);
+    update_instance_sphere(renderable);
+    update_instance_dequant(renderable);
+}
+
+void RenderScene::update_instance_dequant(Renderable* renderable) {
+    // Follows the mesh that's actually drawn, which is the placeholder until the real one streams in
+    GPUVertexDequant dequant = vertex_dequant(get_gpu_asset_cache().get_mesh_or_placeholder(renderable->mesh_id));
+    instance_dequants.write(renderable->instance_slot, &dequant);
+}
+
+void RenderScene::update_instance_sphere(Renderable* renderable) {
+    MeshGPU* mesh = get_gpu_asset_cache().get_mesh(renderable->mesh_id);
+    v4 sphere = mesh != nullptr ? world_sphere(renderable->transform, mesh->bounds) : v4(0.0f, 0.0f, 0.0f, FLT_MAX);
+    instance_spheres[renderable->instance_slot] = sphere;
+
+    BVHBounds bounds;
+    if (mesh != nullptr && mesh->bounds.valid) {
+        bounds = world_bounds(renderable->transform, mesh->bounds);
+    } else {
+        const float* m = (const float*) &renderable->transform;
+        bounds.extend(v3(m[12], m[13], m[14]));
+    }
+    // Both where it was and where it is now need redoing
+    if (renderable->spatial_proxy != ~0u)
+        invalidate_bounds(spatial_index.fat_bounds(renderable->spatial_proxy));
+    invalidate_bounds(bounds);
+    if (renderable->spatial_proxy == ~0u)
+        renderable->spatial_proxy = spatial_index.insert(bounds, renderable);
+    else
+        spatial_index.move(renderable->spatial_proxy, bounds);
+    // When batches are dirty the batch ordered spheres get regathered anyway
+    if (!render_batches_dirty) {
+        uint32 batched_index = slot_to_batched[renderable->instance_slot];
+        batched_spheres.set(batched_index, sphere);
+        gpu_cull_instances.data<GPUCullInstance>()[batched_index].sphere = sphere;
+        gpu_cull_instances.mark_dirty(batched_index, batched_index + 1);
+    }
+}
+
+void RenderScene::invalidate_bounds(const BVHBounds& bounds) {
+    shadows.invalidate(bounds);
+    voxels.invalidate(bounds);
+}
+
+void RenderScene::batch_renderable(Renderable* renderable) {
+    render_batches_dirty = true;
+    if (free_instance_slots.empty()) {
+        renderable->instance_slot = instance_slot_count++;
+        instance_model_mats.resize(instance_slot_count);
+        instance_ids.resize(instance_slot_count);
+        instance_dequants.resize(instance_slot_count);
+        instance_spheres.resize(instance_slot_count);
+    } else {
+        renderable->instance_slot = free_instance_slots.back();
+        free_instance_slots.pop_back();
+    }
+    update_renderable(renderable);
+
+    RenderBatch& batch = render_batches[renderable->material_id][renderable->mesh_id];
+    renderable->batch_position = batch.renderables.size();
+    batch.renderables.push_back(renderable);
+}
+
+void RenderScene::unbatch_renderable(Renderable* renderable) {
+    auto mat_it = render_batches.find(renderable->material_id);
+    assert_else(mat_it != render_batches.end())
+        return;
+    auto mesh_it = mat_it->second.find(renderable->mesh_id);
+    assert_else(mesh_it != mat_it->second.end())
+        return;
+
+    // Swap-remove, the moved renderable keeps its slot so only the batch order changes
+    vector<Renderable*>& batch_renderables = mesh_it->second.renderables;
+    Renderable* moved = batch_renderables.back();
+    batch_renderables[renderable->batch_position] = moved;
+    moved->batch_position = renderable->batch_position;
+    batch_renderables.pop_back();
+
+    if (batch_renderables.empty()) {
+        mat_it->second.erase(mesh_it);
+        if (mat_it->second.empty())
+            render_batches.erase(mat_it);
+    }
+
+    free_instance_slots.push_back(renderable->instance_slot);
+    renderable->instance_slot  = ~0u;
+    renderable->batch_position = ~0u;
+    render_batches_dirty = true;
+}
+
 void RenderScene::upload_buffer_objects(vuk::Allocator& allocator) {
     ZoneScoped;
 
-    constexpr float voxelization_extent = 5.0f;
-    post_process_data.voxel_size = 2.0f * voxelization_extent / voxelization_resolution.x;
+    if (voxel_texture_resolution != voxels.resolution || voxel_texture_levels != voxels.level_count) {
+        vuk::ImageCreateInfo ici;
+        ici.imageType = vuk::ImageType::e3D;
+        ici.format    = vuk::Format::eR16G16B16A16Sfloat;
+        ici.extent    = vuk::Extent3D{voxels.resolution, voxels.resolution, voxels.resolution * voxels.level_count};
+        ici.usage     = vuk::ImageUsageFlagBits::eStorage | vuk::ImageUsageFlagBits::eSampled;
+        voxel_texture            = get_renderer().context->allocate_texture(*get_renderer().global_allocator, ici);
+
+        uint32 face_resolution = voxels.resolution / 2;
+        ici.extent    = vuk::Extent3D{face_resolution, face_resolution, face_resolution * voxels.level_count * 6};
+        ici.mipLevels = VoxelClipmap::mip_count - 1;
+        voxel_faces   = get_renderer().context->allocate_texture(*get_renderer().global_allocator, ici);
+        for (uint32 mip = 0; mip < VoxelClipmap::mip_count - 1; mip++) {
+            vuk::ImageViewCreateInfo ivci;
+            ivci.image    = voxel_faces.image->image;
+            ivci.viewType = vuk::ImageViewType::e3D;
+            ivci.format   = ici.format;
+            ivci.subresourceRange = vuk::ImageSubresourceRange{.aspectMask = vuk::ImageAspectFlagBits::eColor, .baseMipLevel = mip, .levelCount = 1};
+            voxel_face_mip_views[mip] = *vuk::allocate_image_view(*get_renderer().global_allocator, ivci);
+        }
+        voxel_faces_written = false;
+        voxel_texture_resolution = voxels.resolution;
+        voxel_texture_levels     = voxels.level_count;
+        voxel_texture_written    = false;
+        voxels.invalidate_all();
+    }
+    voxels.update(viewport.camera->position);
 
     struct CameraData {
         m44GPU vp;
@@ -80,110 +298,365 @@ void RenderScene::upload_buffer_objects(vuk::Allocator& allocator) {
     camera_data.vp = m44GPU(viewport.camera->vp);
     camera_data.normal = v4(math::euler2vector(viewport.camera->heading), 1.0);
 
-    m44GPU voxel_cam_data[3];
-    voxel_cam_data[0] = m44GPU(
-        math::voxelization_mat(v3{voxelization_extent, voxelization_extent, voxelization_extent}) *
-        math::look(-voxelization_extent * v3::X, v3::X, v3::Z)
-    );
-    voxel_cam_data[1] = m44GPU(
-        math::voxelization_mat(v3{voxelization_extent, voxelization_extent, voxelization_extent}) *
-        math::look(-voxelization_extent * v3::Y, v3::Y, v3::Z)
-    );
-    voxel_cam_data[2] = m44GPU(
-        math::voxelization_mat(v3{voxelization_extent, voxelization_extent, voxelization_extent}) *
-        math::look(-voxelization_extent * v3::Z, v3::Z, v3::X)
-    );
-
-    CameraData sun_camera_data;
+    m44GPU voxel_cam_data[max_voxel_levels * 3];
+    for (uint32 level = 0; level < voxels.level_count; level++) {
+        for (uint32 axis = 0; axis < 3; axis++)
+            voxel_cam_data[level * 3 + axis] = voxels.axis_vp(level, axis);
+    }
+
     v3 sun_vec = math::normalize(math::rotate(scene_data.sun_direction, v3::Z));
-    sun_camera_data.vp     = m44GPU(math::orthographic(v3(10.0f, 10.0f, 30.0f)) * math::look(sun_vec * 15.0f, -sun_vec, v3::Z));
-    sun_camera_data.normal = v4(-sun_vec, 1.0);
+    // Voxels are lit by the sun when they're written
+    if (shadows.fit(*viewport.camera, sun_vec))
+        voxels.invalidate_all();
+
+    // Matches ShadowData in voxelization.frag
+    struct ShadowData {
+        m44GPU cascade_vps[max_shadow_cascades];
+        v4     cascade_biases;
+        v4     light_normal;
+        int32  cascade_count;
+    } shadow_data;
+    for (uint32 i = 0; i < max_shadow_cascades; i++) {
+        shadow_data.cascade_vps[i]    = shadows.cascades[i].vp;
+        shadow_data.cascade_biases[i] = shadows.cascades[i].depth_bias;
+    }
+    shadow_data.light_normal  = v4(-sun_vec, 1.0);
+    shadow_data.cascade_count = shadows.cascade_count;
+
+    camera_frustum       = frustum_from_vp(viewport.camera->vp);
     auto [pubo_camera, fubo_camera] = vuk::create_buffer(allocator, vuk::MemoryUsage::eCPUtoGPU, vuk::DomainFlagBits::eTransferOnTransfer, std::span(&camera_data, 1));
     buffer_camera_data              = *pubo_camera;
 
-    auto [pubo_sun_camera, fubo_sun_camera] = vuk::create_buffer(allocator, vuk::MemoryUsage::eCPUtoGPU, vuk::DomainFlagBits::eTransferOnTransfer, std::span(&sun_camera_data, 1));
-    buffer_sun_camera_data              = *pubo_sun_camera;
+    auto [pubo_shadow, fubo_shadow] = vuk::create_buffer(allocator, vuk::MemoryUsage::eCPUtoGPU, vuk::DomainFlagBits::eTransferOnTransfer, std::span(&shadow_data, 1));
+    buffer_shadow_data              = *pubo_shadow;
+    for (uint32 i = 0; i < shadows.cascade_count; i++) {
+        CameraData cascade_camera = {.vp = shadows.cascades[i].vp, .normal = v4(-sun_vec, 1.0)};
+        auto [pubo_cascade, fubo_cascade] = vuk::create_buffer(allocator, vuk::MemoryUsage::eCPUtoGPU, vuk::DomainFlagBits::eTransferOnTransfer, std::span(&cascade_camera, 1));
+        buffer_cascade_cameras[i]         = *pubo_cascade;
+    }
 
-    auto [pubo_voxelization_camera, fubo_voxelization_camera] = vuk::create_buffer(allocator, vuk::MemoryUsage::eCPUtoGPU, vuk::DomainFlagBits::eTransferOnTransfer, std::span(voxel_cam_data, 3));
+    auto [pubo_voxelization_camera, fubo_voxelization_camera] = vuk::create_buffer(allocator, vuk::MemoryUsage::eCPUtoGPU, vuk::DomainFlagBits::eTransferOnTransfer, std::span(voxel_cam_data, voxels.level_count * 3));
     buffer_voxelization_camera = *pubo_voxelization_camera;
 
     struct CompositeData {
         m44GPU inverse_vp;
         v4 camera_position;
+        m44GPU previous_vp;
+        v4 previous_camera_position;
 
-        m44GPU voxelization_vp;
-        m44GPU light_vp;
+        GPUVoxelClipmap voxel_clipmap;
+        m44GPU cascade_vps[max_shadow_cascades];
+        v4 cascade_biases;
         v4 sun_data;
         v4 ambient;
 
         int32 voxelization_lod = 0;
+        int32 cascade_count = 0;
     } composite_data;
     composite_data.inverse_vp = m44GPU(math::inverse(viewport.camera->vp));
     composite_data.camera_position = v4(viewport.camera->position, 1.0f);
-    composite_data.voxelization_vp = voxel_cam_data[0];
-    composite_data.light_vp = sun_camera_data.vp;
+    // GI history is reprojected through last frame's camera
+    composite_data.previous_vp = m44GPU(gi_history_valid ? gi_previous_vp : viewport.camera->vp);
+    composite_data.previous_camera_position = v4(gi_history_valid ? gi_previous_position : viewport.camera->position, 1.0f);
+    gi_previous_vp       = viewport.camera->vp;
+    gi_previous_position = viewport.camera->position;
+    composite_data.voxel_clipmap = voxels.gpu_data();
+    memcpy(composite_data.cascade_vps, shadow_data.cascade_vps, sizeof(composite_data.cascade_vps));
+    composite_data.cascade_biases = shadow_data.cascade_biases;
     composite_data.sun_data = v4(sun_vec, 1.0f);
     composite_data.ambient = v4(scene_data.ambient);
     composite_data.voxelization_lod = 0;
+    composite_data.cascade_count = shadows.cascade_count;
 
     auto [pubo_composite, fubo_composite] = vuk::create_buffer(allocator, vuk::MemoryUsage::eCPUtoGPU, vuk::DomainFlagBits::eTransferOnTransfer, std::span(&composite_data, 1));
     buffer_composite_data             = *pubo_composite;
+
+    auto particles_start = std::chrono::steady_clock::now();
+    particles.update(emitters, Input::time);
+    particles.upload(allocator);
+    if (particle_benchmark.measuring)
+        particle_benchmark.add_cpu(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - particles_start).count());
 }
 
 void RenderScene::setup_renderables_for_passes(vuk::Allocator& allocator) {
     ZoneScoped;
-    renderables_built.clear();
-
-    uint32 count = 0;
-    
-    for (auto& renderable : renderables) {
-        if (!get_gpu_asset_cache().materials.contains(renderable.material_id))
-            continue;
-        if (!get_gpu_asset_cache().meshes.contains(renderable.mesh_id))
-            continue;
+    // Only the instance order is rebuilt, and only on frames where batches were added to or removed from
+    if (render_batches_dirty) {
+        uint32 instance_count = 0;
+        render_batch_count = 0;
+        material_batches.clear();
+        for (auto& [mat_hash, mat_map] : render_batches) {
+            material_batches[mat_hash] = {.first_batch = render_batch_count, .batch_count = uint32(mat_map.size())};
+            for (auto& [mesh_hash, batch] : mat_map) {
+                batch.first_instance = instance_count;
+                batch.batch_index    = render_batch_count++;
+                instance_count += batch.renderables.size();
+            }
+        }
 
-        auto& mat_map = renderables_built.try_emplace(renderable.material_id).first->second;
-        auto& mesh_list = mat_map.try_emplace(renderable.mesh_id).first->second;
-        mesh_list.emplace_back(renderable.selection_id, &renderable.transform);
-        count++;
+        batched_slots.resize(instance_count);
+        batched_spheres.resize(instance_count);
+        slot_to_batched.resize(instance_slot_count);
+        gpu_cull_instances.resize(instance_count);
+        GPUCullInstance* gpu_instances = gpu_cull_instances.data<GPUCullInstance>();
+        uint32 i = 0;
+        for (const auto& [mat_hash, mat_map] : render_batches) {
+            for (const auto& [mesh_hash, batch] : mat_map) {
+                for (Renderable* renderable : batch.renderables) {
+                    const v4& sphere = instance_spheres[renderable->instance_slot];
+                    batched_slots[i] = renderable->instance_slot;
+                    batched_spheres.set(i, sphere);
+                    slot_to_batched[renderable->instance_slot] = i;
+                    gpu_instances[i] = {.sphere = sphere, .slot = renderable->instance_slot, .draw = batch.batch_index};
+                    i++;
+                }
+            }
+        }
+        gpu_cull_instances.mark_dirty(0, instance_count);
+        render_batches_dirty = false;
     }
 
-    uint32 model_buffer_size = sizeof(m44GPU) * (count + widget_renderables.size());
-    uint32 id_buffer_size = sizeof(uint32) * count;
-    
-    buffer_model_mats = **vuk::allocate_buffer(allocator, {vuk::MemoryUsage::eCPUtoGPU, model_buffer_size, 1});
-    buffer_ids = **vuk::allocate_buffer(allocator, {vuk::MemoryUsage::eCPUtoGPU, id_buffer_size, 1});
-    int i = 0;
-    for (const auto& [mat_hash, mat_map] : renderables_built) {
-        for (const auto& [mesh_hash, mesh_list] : mat_map) {
-            for (auto& [id, transform] : mesh_list) {
-                memcpy((m44GPU*) buffer_model_mats.mapped_ptr + i, transform, sizeof(m44GPU));
-                *((uint32*) buffer_ids.mapped_ptr + i) = id;
-                i++;
+    for (auto& [mat_hash, mat_map] : render_batches) {
+        bool has_material  = get_gpu_asset_cache().get_material_or_placeholder(mat_hash) != nullptr;
+        bool material_real = get_gpu_asset_cache().get_material(mat_hash) != nullptr;
+        for (auto& [mesh_hash, batch] : mat_map) {
+            MeshGPU* drawn_mesh = get_gpu_asset_cache().get_mesh_or_placeholder(mesh_hash);
+            MeshGPU* mesh       = get_gpu_asset_cache().get_mesh(mesh_hash);
+            batch.indirect = gpu_driven && has_material && drawn_mesh != nullptr && drawn_mesh->in_arena &&
+                             drawn_mesh->encoding == VertexEncoding_Packed;
+            if (material_real && !batch.material_ready) {
+                for (Renderable* renderable : batch.renderables) {
+                    if (renderable->spatial_proxy != ~0u)
+                        voxels.invalidate(spatial_index.fat_bounds(renderable->spatial_proxy));
+                }
+                batch.material_ready = true;
+            }
+            // Batches created before their mesh was uploaded couldn't size their spheres yet
+            if (batch.bounds_ready || mesh == nullptr)
+                continue;
+            for (Renderable* renderable : batch.renderables) {
+                update_instance_sphere(renderable);
+                update_instance_dequant(renderable);
             }
+            batch.bounds_ready = true;
         }
     }
-    
+
+    buffer_model_mats     = instance_model_mats.flush();
+    buffer_ids            = instance_ids.flush();
+    buffer_cull_instances = gpu_cull_instances.flush();
+    buffer_dequants       = instance_dequants.flush();
+
+    // Every pass picks levels from the camera's distance, the others are only more forgiving
+    const Camera& camera          = *viewport.camera;
+    float         base_size       = lod_selection ? lod_base_size : 0.0f;
+    LODSelector   forward_lods      = lod_selector(camera.position, camera.fov, base_size, 1.0f);
+    LODSelector   sun_lods          = lod_selector(camera.position, camera.fov, base_size, sun_lod_bias);
+    LODSelector   voxelization_lods = lod_selector(camera.position, camera.fov, base_size, voxelization_lod_bias);
+    if (shadow_atlas_size != shadows.atlas_size()) {
+        vuk::ImageCreateInfo ici;
+        ici.format = vuk::Format::eD16Unorm;
+        ici.extent = vuk::Extent3D{shadows.atlas_size(), shadows.atlas_size(), 1};
+        ici.usage  = vuk::ImageUsageFlagBits::eDepthStencilAttachment | vuk::ImageUsageFlagBits::eSampled;
+        shadow_atlas         = get_renderer().context->allocate_texture(*get_renderer().global_allocator, ici);
+        shadow_atlas_size    = shadows.atlas_size();
+        shadow_atlas_written = false;
+        shadows.invalidate_all();
+    }
+    // Every change this frame has been seen by now, cached cascades and voxels aren't culled or drawn at all
+    shadows.schedule();
+    voxels.schedule();
+
+    struct CullPass {
+        Frustum            frustum;
+        const LODSelector* lods;
+        CulledInstances*   culled;
+    };
+    vector<CullPass> cull_passes = {{camera_frustum, &forward_lods, &forward_instances}};
+    for (uint32 i = 0; i < shadows.cascade_count; i++) {
+        if (shadows.cascades[i].render)
+            cull_passes.push_back({shadows.cascades[i].casters, &sun_lods, &cascade_instances[i]});
+    }
+    voxel_region_instances.resize(voxels.regions.size());
+    for (uint32 i = 0; i < voxels.regions.size(); i++)
+        cull_passes.push_back({voxels.region_frustum(voxels.regions[i]), &voxelization_lods, &voxel_region_instances[i]});
+    get_worker_pool().parallel_for(cull_passes.size(), [&](uint32 i) {
+        cull_instances(allocator, cull_passes[i].frustum, *cull_passes[i].lods, *cull_passes[i].culled);
+    });
+
+    auto add_stats = [](CullStats& total, const CullStats& stats) {
+        total.tested += stats.tested;
+        total.drawn  += stats.drawn;
+        total.coarse += stats.coarse;
+        total.gpu    += stats.gpu;
+    };
+    shadows.stats = {};
+    for (uint32 i = 0; i < shadows.cascade_count; i++) {
+        if (shadows.cascades[i].render)
+            add_stats(shadows.stats, cascade_instances[i].stats);
+    }
+    voxels.stats = {};
+    for (const CulledInstances& culled : voxel_region_instances)
+        add_stats(voxels.stats, culled.stats);
+
+    uint32 widget_buffer_size = sizeof(m44GPU) * math::max(uint32(widget_renderables.size()), 1u);
+    buffer_widget_model_mats = **vuk::allocate_buffer(allocator, {vuk::MemoryUsage::eCPUtoGPU, widget_buffer_size, 1});
+    int i = 0;
     for (const auto& renderable : widget_renderables) {
-        memcpy((m44GPU*) buffer_model_mats.mapped_ptr + i++, &renderable.transform, sizeof(m44GPU));
+        memcpy((m44GPU*) buffer_widget_model_mats.mapped_ptr + i++, &renderable.transform, sizeof(m44GPU));
     }
+}
+
 
+void RenderScene::cull_instances(vuk::Allocator& allocator, const Frustum& frustum, const LODSelector& selector, CulledInstances& culled) {
+    ZoneScoped;
+    uint32 instance_count = batched_slots.size();
+    // GPU culled batches get a region per level, LOD l of a batch starting at begin * max_mesh_lods + l * count
+    culled.buffer  = **vuk::allocate_buffer(allocator, {vuk::MemoryUsage::eCPUtoGPU, sizeof(uint32) * math::max((1 + max_mesh_lods) * instance_count, 1u), 1});
+    culled.draws   = **vuk::allocate_buffer(allocator, {vuk::MemoryUsage::eCPUtoGPU, sizeof(vuk::DrawIndexedIndirectCommand) * math::max(render_batch_count * max_mesh_lods, 1u), 1});
+    culled.frustum = frustum_culling ? frustum : Frustum{};
+    culled.lod_selector = selector;
+    culled.batch_first.resize(render_batch_count * max_mesh_lods);
+    culled.batch_count.resize(render_batch_count * max_mesh_lods);
+    culled.stats = {};
+
+    uint32* output  = (uint32*) culled.buffer.mapped_ptr;
+    auto*   draws   = (vuk::DrawIndexedIndirectCommand*) culled.draws.mapped_ptr;
+    uint32  written = 0;
+    vector<uint32> survivors;
+    vector<uint8>  survivor_lods;
+    for (const auto& [mat_hash, mat_map] : render_batches) {
+        for (const auto& [mesh_hash, batch] : mat_map) {
+            uint32 begin = batch.first_instance;
+            uint32 end   = begin + batch.renderables.size();
+            uint32 count = end - begin;
+            uint32 first_draw = batch.batch_index * max_mesh_lods;
+            MeshGPU* mesh = get_gpu_asset_cache().get_mesh_or_placeholder(mesh_hash);
+
+            culled.stats.tested += count;
+            if (batch.indirect) {
+                // Levels the mesh doesn't have repeat its coarsest, cull_instances.comp doesn't know the count
+                for (uint32 lod = 0; lod < max_mesh_lods; lod++) {
+                    const MeshLOD& mesh_lod = mesh->lods[math::min(lod, mesh->lod_count - 1)];
+                    draws[first_draw + lod] = {
+                        .indexCount    = mesh_lod.index_count,
+                        .instanceCount = 0,
+                        .firstIndex    = mesh->first_index + mesh_lod.first_index,
+                        .vertexOffset  = int32(mesh->vertex_offset),
+                        .firstInstance = instance_count + begin * max_mesh_lods + lod * count
+                    };
+                    culled.batch_first[first_draw + lod] = 0;
+                    culled.batch_count[first_draw + lod] = 0;
+                }
+                culled.stats.gpu += count;
+                continue;
+            }
+
+            for (uint32 lod = 0; lod < max_mesh_lods; lod++) {
+                draws[first_draw + lod] = {};
+                culled.batch_first[first_draw + lod] = written;
+                culled.batch_count[first_draw + lod] = 0;
+            }
+            if (frustum_culling)
+                count = cull_spheres(frustum, batched_spheres, batched_slots.data(), begin, end, output + written);
+            else
+                memcpy(output + written, batched_slots.data() + begin, count * sizeof(uint32));
+
+            uint32 lod_count = mesh != nullptr ? mesh->lod_count : 1;
+            if (lod_count <= 1 || selector.factor <= 0.0f) {
+                culled.batch_count[first_draw] = count;
+                written += count;
+                continue;
+            }
+
+            // Counting sort of the survivors by level, each level is drawn as its own instance range
+            survivors.resize(count);
+            survivor_lods.resize(count);
+            memcpy(survivors.data(), output + written, count * sizeof(uint32));
+            for (uint32 i = 0; i < count; i++) {
+                uint32 batched = slot_to_batched[survivors[i]];
+                v4     sphere  = v4(batched_spheres.x[batched], batched_spheres.y[batched], batched_spheres.z[batched], batched_spheres.radius[batched]);
+                survivor_lods[i] = select_lod(selector, sphere, lod_count);
+                culled.batch_count[first_draw + survivor_lods[i]]++;
+            }
+            for (uint32 lod = 1; lod < lod_count; lod++) {
+                culled.batch_first[first_draw + lod] = culled.batch_first[first_draw + lod - 1] + culled.batch_count[first_draw + lod - 1];
+                culled.stats.coarse += culled.batch_count[first_draw + lod];
+            }
+            uint32 cursors[max_mesh_lods];
+            for (uint32 lod = 0; lod < max_mesh_lods; lod++)
+                cursors[lod] = culled.batch_first[first_draw + lod];
+            for (uint32 i = 0; i < count; i++)
+                output[cursors[survivor_lods[i]]++] = survivors[i];
+            written += count;
+        }
+    }
+    culled.stats.drawn = written;
 }
 
+void RenderScene::draw_batches(vuk::CommandBuffer& command_buffer, mat_id material, const umap<mesh_id, RenderBatch>& mat_map, const CulledInstances& culled) {
+    GeometryArena& arena = get_gpu_asset_cache().geometry_arena;
+    // Arena meshes of one encoding share a binding, only meshes with their own buffers rebind
+    const MeshGPU* bound_mesh     = nullptr;
+    int32          bound_encoding = -1;
+    bool           any_indirect   = false;
+    for (const auto& [mesh_hash, batch] : mat_map) {
+        if (batch.indirect) {
+            any_indirect = true;
+            continue;
+        }
+        MeshGPU* mesh = get_gpu_asset_cache().get_mesh_or_placeholder(mesh_hash);
+        if (mesh == nullptr)
+            continue;
+        for (uint32 lod = 0; lod < mesh->lod_count; lod++) {
+            uint32 draw  = batch.batch_index * max_mesh_lods + lod;
+            uint32 count = culled.batch_count[draw];
+            if (count == 0)
+                continue;
+            if (mesh->in_arena && bound_encoding != int32(mesh->encoding)) {
+                command_buffer
+                    .bind_vertex_buffer(0, *arena.vertex_buffer, 0, Vertex::get_format(mesh->encoding))
+                    .bind_index_buffer(*arena.index_buffer, vuk::IndexType::eUint32);
+                bound_encoding = mesh->encoding;
+                bound_mesh     = nullptr;
+            } else if (!mesh->in_arena && bound_mesh != mesh) {
+                command_buffer
+                    .bind_vertex_buffer(0, mesh->vertex_buffer, 0, Vertex::get_format(mesh->encoding))
+                    .bind_index_buffer(mesh->index_buffer, vuk::IndexType::eUint32);
+                bound_mesh     = mesh;
+                bound_encoding = -1;
+            }
+            command_buffer.draw_indexed(mesh->lods[lod].index_count, count, mesh->first_index + mesh->lods[lod].first_index,
+                int32(mesh->vertex_offset), culled.batch_first[draw]);
+        }
+    }
 
-void RenderScene::clear_frame_allocated_renderables() {
-    for (auto it = renderables.begin(); it != renderables.end();) {
-        if (it->frame_allocated)
-            it = renderables.erase(it);
-        else
-            ++it;
+    if (any_indirect) {
+        // The ones drawn above were left empty
+        const MaterialBatches& range = material_batches[material];
+        uint32 first_draw = range.first_batch * max_mesh_lods;
+        uint32 draw_count = range.batch_count * max_mesh_lods;
+        command_buffer
+            .bind_vertex_buffer(0, *arena.vertex_buffer, 0, Vertex::get_format(VertexEncoding_Packed))
+            .bind_index_buffer(*arena.index_buffer, vuk::IndexType::eUint32);
+        command_buffer.draw_indexed_indirect(draw_count, culled.draws.subrange(
+            first_draw * sizeof(vuk::DrawIndexedIndirectCommand),
+            draw_count * sizeof(vuk::DrawIndexedIndirectCommand)
+        ));
     }
+}
+
+void RenderScene::clear_frame_allocated_renderables() {
+    for (Renderable* renderable : frame_renderables)
+        delete_renderable(renderable);
+    frame_renderables.clear();
     for (auto it = widget_renderables.begin(); it != widget_renderables.end();) {
         if (it->frame_allocated)
             it = widget_renderables.erase(it);
         else
             ++it;
     }
+    debug_draw.clear();
 }
 
 void RenderScene::pre_render() {
@@ -192,8 +665,60 @@ void RenderScene::pre_render() {
         log_error("RenderScene::pre_render without RenderScene::image call", "renderer");
     }
     viewport.pre_render();
+
+    particle_benchmark.update(*this);
+    if (cull_pause || user_pause)
+        return;
+
+    prune_emitters();
+
+    // Every renderable in a batch shares its dependencies
+    for (auto& [mat_hash, mat_map] : render_batches) {
+        for (auto& [mesh_hash, batch] : mat_map) {
+            upload_dependencies(*batch.renderables.front());
+        }
+    }
+    // The editor is unusable without its widgets, they jump the streaming queue
+    for (Renderable& renderable : widget_renderables) {
+        if (renderable.mesh_id == 0 || renderable.material_id == 0)
+            continue;
+        get_gpu_asset_cache().get_mesh_or_upload(renderable.mesh_id, StreamPriority_High);
+        get_gpu_asset_cache().get_material_or_upload(renderable.material_id, StreamPriority_High);
+    }
+    for (EmitterGPU& emitter : emitters) {
+        upload_dependencies(emitter);
+    }
+    want_texture_resolutions();
+
+    log(BasicMessage{.str = "render_scene render", .group = "render_scene", .frame_tags = {"render_scene"}});
 }
 
+void RenderScene::want_texture_resolutions() {
+    ZoneScoped;
+    const Camera& camera = *viewport.camera;
+    // A sphere of radius r at distance d covers r / (d * tan(fov / 2)) of the viewport height
+    float pixels_per_slope = viewport.size.y / std::tan(camera.fov * 0.5f);
+    for (auto& [mat_hash, mat_map] : render_batches) {
+        MaterialGPU* material = get_gpu_asset_cache().get_material(mat_hash);
+        if (material == nullptr)
+            continue;
+        float pixel_size = 0.0f;
+        for (auto& [mesh_hash, batch] : mat_map) {
+            for (Renderable* renderable : batch.renderables) {
+                const v4& sphere   = instance_spheres[renderable->instance_slot];
+                float     distance = math::length(v3(sphere.x, sphere.y, sphere.z) - camera.position);
+                // Inside the sphere it could fill the screen
+                float slope = distance > sphere.w ? sphere.w / distance : 1.0f;
+                pixel_size  = math::max(pixel_size, 2.0f * slope * pixels_per_slope);
+            }
+        }
+        if (pixel_size <= 0.0f)
+            continue;
+        const MaterialCPU& material_cpu = material->material_cpu;
+        for (const FilePath* path : {&material_cpu.color_asset_path, &material_cpu.orm_asset_path, &material_cpu.normal_asset_path, &material_cpu.emissive_asset_path})
+            get_gpu_asset_cache().want_texture_resolution(*path, pixel_size * texture_detail);
+    }
+}
 
 void RenderScene::update() {
 }
@@ -207,35 +732,22 @@ vuk::Future RenderScene::render(vuk::Allocator& frame_allocator, vuk::Future tar
         return vuk::Future {rg, "target_output"};
     }
 
-    prune_emitters();
-    
-    for (Renderable& renderable : renderables) {
-        upload_dependencies(renderable);
-    }
-    for (Renderable& renderable : widget_renderables) {
-        upload_dependencies(renderable);
-    }
-    for (EmitterGPU& emitter : emitters) {
-        upload_dependencies(emitter);
-    }
-
-    get_renderer().wait_for_futures();
-    
-    log(BasicMessage{.str = "render_scene render", .group = "render_scene", .frame_tags = {"render_scene"}});
-
     upload_buffer_objects(frame_allocator);
     setup_renderables_for_passes(frame_allocator);
+    debug_draw.upload();
     
     auto rg = make_shared<vuk::RenderGraph>("graph");
     rg->attach_in("target_input", std::move(target));
     
     post_process_data.time = Input::time;
 
+    add_cull_pass(rg);
     add_sundepth_pass(rg);
     add_voxelization_pass(rg);
     add_emitter_update_pass(rg);
     add_forward_pass(rg);
     add_widget_pass(rg);
+    add_gi_pass(rg);
     add_postprocess_pass(rg);
     add_info_read_pass(rg);
     
@@ -244,74 +756,203 @@ vuk::Future RenderScene::render(vuk::Allocator& frame_allocator, vuk::Future tar
 
 void RenderScene::prune_emitters() {
     for (auto it = emitters.begin(); it != emitters.end();) {
-        if (it->deinstance_at <= (Input::time - Input::delta_time - 0.1f))
+        if (it->deinstance_at <= (Input::time - Input::delta_time - 0.1f)) {
+            particles.release(*it);
             it = emitters.erase(it);
-        else
+        } else {
             it++;
+        }
     }
-    std::erase_if(emitters, [](const EmitterGPU& emitter) {
-        return emitter.deinstance_at <= (Input::time - Input::delta_time - 0.1f);
+}
+
+// Resources of passes that run a varying number of times a frame
+static vuk::Name indexed_name(string_view name, uint32 index, string_view suffix = "") {
+    return vuk::Name(fmt_("{}_{}{}", name, index, suffix));
+}
+
+void RenderScene::add_cull_pass(shared_ptr<vuk::RenderGraph> rg) {
+    rg->attach_buffer("forward_instances", forward_instances.buffer, vuk::eNone);
+    rg->attach_buffer("forward_draws", forward_instances.draws, vuk::eNone);
+    std::vector<vuk::Resource> resources = {
+        "forward_instances"_buffer >> vuk::eComputeRW >> "forward_instances_culled",
+        "forward_draws"_buffer >> vuk::eComputeRW >> "forward_draws_culled"
+    };
+    vector<const CulledInstances*> culled_passes = {&forward_instances};
+    for (uint32 i = 0; i < shadows.cascade_count; i++) {
+        if (!shadows.cascades[i].render)
+            continue;
+        rg->attach_buffer(indexed_name("cascade_instances", i), cascade_instances[i].buffer, vuk::eNone);
+        rg->attach_buffer(indexed_name("cascade_draws", i), cascade_instances[i].draws, vuk::eNone);
+        resources.emplace_back(indexed_name("cascade_instances", i), vuk::Resource::Type::eBuffer, vuk::eComputeRW, indexed_name("cascade_instances", i, "_culled"));
+        resources.emplace_back(indexed_name("cascade_draws", i), vuk::Resource::Type::eBuffer, vuk::eComputeRW, indexed_name("cascade_draws", i, "_culled"));
+        culled_passes.push_back(&cascade_instances[i]);
+    }
+    for (uint32 i = 0; i < voxel_region_instances.size(); i++) {
+        rg->attach_buffer(indexed_name("region_instances", i), voxel_region_instances[i].buffer, vuk::eNone);
+        rg->attach_buffer(indexed_name("region_draws", i), voxel_region_instances[i].draws, vuk::eNone);
+        resources.emplace_back(indexed_name("region_instances", i), vuk::Resource::Type::eBuffer, vuk::eComputeRW, indexed_name("region_instances", i, "_culled"));
+        resources.emplace_back(indexed_name("region_draws", i), vuk::Resource::Type::eBuffer, vuk::eComputeRW, indexed_name("region_draws", i, "_culled"));
+        culled_passes.push_back(&voxel_region_instances[i]);
+    }
+    rg->add_pass({
+        .name = "cull_instances",
+        .resources = std::move(resources),
+        .execute = [this, culled_passes](vuk::CommandBuffer& command_buffer) {
+            ZoneScoped;
+            uint32 instance_count = batched_slots.size();
+            uint32 gpu_count      = 0;
+            for (const CulledInstances* culled : culled_passes)
+                gpu_count += culled->stats.gpu;
+            if (gpu_count == 0)
+                return;
+
+            command_buffer
+                .bind_compute_pipeline("cull_instances")
+                .bind_buffer(0, 0, buffer_cull_instances);
+            for (const CulledInstances* culled : culled_passes) {
+                struct PC {
+                    v4     planes[6];
+                    uint32 plane_count;
+                    uint32 instance_count;
+                    uint32 pad[2];
+                    v4     lod_selector;
+                } pc;
+                static_assert(sizeof(PC) <= 128);
+                memcpy(pc.planes, culled->frustum.planes, sizeof(pc.planes));
+                pc.plane_count    = culled->frustum.plane_count;
+                pc.instance_count = instance_count;
+                pc.lod_selector   = v4(culled->lod_selector.position, culled->lod_selector.factor);
+                command_buffer
+                    .bind_buffer(0, 1, culled->draws)
+                    .bind_buffer(0, 2, culled->buffer)
+                    .push_constants(vuk::ShaderStageFlagBits::eCompute, 0, pc)
+                    .dispatch_invocations(instance_count);
+            }
+        }
     });
 }
 
 void RenderScene::add_sundepth_pass(shared_ptr<vuk::RenderGraph> rg) {
+    // Cached tiles are read from the last frame, which left the atlas sampled by the post process
+    rg->attach_image("sun_depth_input", vuk::ImageAttachment::from_texture(shadow_atlas), shadow_atlas_written ? vuk::eComputeSampled : vuk::eNone);
+    shadow_atlas_written = true;
+
+    std::vector<vuk::Resource> resources = {"sun_depth_input"_image >> vuk::eDepthStencilRW >> "sun_depth_output"};
+    for (uint32 i = 0; i < shadows.cascade_count; i++) {
+        if (!shadows.cascades[i].render)
+            continue;
+        resources.emplace_back(indexed_name("cascade_instances", i, "_culled"), vuk::Resource::Type::eBuffer, vuk::eVertexRead);
+        resources.emplace_back(indexed_name("cascade_draws", i, "_culled"), vuk::Resource::Type::eBuffer, vuk::eIndirectRead);
+    }
     rg->add_pass({
         .name = "sun_depth",
-        .resources = {
-             "sun_depth_input"_image   >> vuk::eDepthStencilRW >> "sun_depth_output"
-        },
+        .resources = std::move(resources),
         .execute = [this](vuk::CommandBuffer& command_buffer) {
             ZoneScoped;
-            // Prepare render
             command_buffer.set_dynamic_state(vuk::DynamicStateFlagBits::eViewport | vuk::DynamicStateFlagBits::eScissor)
-                    .set_viewport(0, vuk::Rect2D{vuk::Sizing::eAbsolute, {}, {2048, 2048}})
-                    .set_scissor(0, vuk::Rect2D{vuk::Sizing::eAbsolute, {}, {2048, 2048}})
+                    .broadcast_color_blend({vuk::BlendPreset::eOff})
+                    .set_rasterization({.cullMode = vuk::CullModeFlagBits::eNone});
+
+            for (uint32 i = 0; i < shadows.cascade_count; i++) {
+                if (!shadows.cascades[i].render)
+                    continue;
+                v2i         offset = shadows.tile_offset(i);
+                vuk::Rect2D tile   = vuk::Rect2D{vuk::Sizing::eAbsolute, {offset.x, offset.y}, {shadows.resolution, shadows.resolution}};
+                command_buffer.set_viewport(0, tile).set_scissor(0, tile);
+
+                // The other tiles are kept, so only this one is cleared, by a triangle at the far plane
+                command_buffer
                     .set_depth_stencil(vuk::PipelineDepthStencilStateCreateInfo{
-                            .depthTestEnable  = true,
-                            .depthWriteEnable = true,
-                            .depthCompareOp   = vuk::CompareOp::eGreaterOrEqual, // EQUAL can be used for multipass things
+                        .depthTestEnable  = true,
+                        .depthWriteEnable = true,
+                        .depthCompareOp   = vuk::CompareOp::eAlways,
                     })
-                    .broadcast_color_blend({vuk::BlendPreset::eOff});
+                    .bind_graphics_pipeline("shadow_clear")
+                    .draw(3, 1, 0, 0);
 
-            command_buffer
-                    .bind_buffer(0, CAMERA_BINDING, buffer_sun_camera_data)
+                command_buffer
+                    .set_depth_stencil(vuk::PipelineDepthStencilStateCreateInfo{
+                        .depthTestEnable  = true,
+                        .depthWriteEnable = true,
+                        .depthCompareOp   = vuk::CompareOp::eGreaterOrEqual,
+                    })
+                    .bind_buffer(0, CAMERA_BINDING, buffer_cascade_cameras[i])
                     .bind_buffer(0, MODEL_BINDING, buffer_model_mats)
-                    .bind_buffer(0, ID_BINDING, buffer_ids);
-
-            command_buffer
-                    .set_rasterization({.cullMode = vuk::CullModeFlagBits::eNone})
+                    .bind_buffer(0, ID_BINDING, buffer_ids)
+                    .bind_buffer(0, INSTANCE_BINDING, cascade_instances[i].buffer)
+                    .bind_buffer(0, DEQUANT_BINDING, buffer_dequants)
                     .bind_graphics_pipeline("directional_depth");
 
-            int item_index = 0;
-            for (const auto &[mat_hash, mat_map]: renderables_built) {
-                for (const auto &[mesh_hash, mesh_list]: mat_map) {
-                    MeshGPU *mesh = get_gpu_asset_cache().meshes.contains(mesh_hash) ? &get_gpu_asset_cache().meshes[mesh_hash] : nullptr;
-                    command_buffer
-                            .bind_vertex_buffer(0, mesh->vertex_buffer.get(), 0, Vertex::get_format())
-                            .bind_index_buffer(mesh->index_buffer.get(), vuk::IndexType::eUint32);
-                    command_buffer.draw_indexed(mesh->index_count, mesh_list.size(), 0, 0, item_index);
-                    item_index += mesh_list.size();
+                for (const auto &[mat_hash, mat_map]: render_batches) {
+                    if (get_gpu_asset_cache().get_material_or_placeholder(mat_hash) == nullptr)
+                        continue;
+                    draw_batches(command_buffer, mat_hash, mat_map, cascade_instances[i]);
                 }
             }
         }
     });
-    rg->attach_and_clear_image("sun_depth_input", {.extent = {.extent = {2048, 2048, 1}}, .format = vuk::Format::eD16Unorm, .sample_count = vuk::Samples::e1}, vuk::ClearDepthStencil{0.0f, 0});
 }
 
 void RenderScene::add_voxelization_pass(shared_ptr<vuk::RenderGraph> rg) {
     ZoneScoped;
+    // Left sampled by the post process last frame, untouched when nothing needs revoxelizing
+    rg->attach_image("voxels_input", vuk::ImageAttachment::from_texture(voxel_texture), voxel_texture_written ? vuk::eComputeSampled : vuk::eNone);
+    voxel_texture_written = true;
+    rg->attach_image("voxel_faces_input", vuk::ImageAttachment::from_texture(voxel_faces), voxel_faces_written ? vuk::eComputeSampled : vuk::eNone);
+    voxel_faces_written = true;
+    if (voxels.regions.empty())
+        return;
+
+    struct PC {
+        v4i    region_low;
+        v4i    region_high;
+        uint32 resolution;
+        uint32 level;
+        uint32 pass;
+        float  voxel_size;
+    };
+    auto region_pc = [this](const VoxelRegion& region) {
+        return PC {
+            .region_low  = v4i(region.low, 0),
+            .region_high = v4i(region.high, 0),
+            .resolution  = voxels.resolution,
+            .level       = region.level,
+            .voxel_size  = voxels.level_voxel_size(region.level)
+        };
+    };
+
+    rg->add_pass({
+        .name = "voxel_clear",
+        .resources = {"voxels_input"_image >> vuk::eComputeRW >> "voxels_cleared"},
+        .execute = [this, region_pc](vuk::CommandBuffer& command_buffer) {
+            command_buffer
+                .bind_compute_pipeline("voxel_clear")
+                .bind_image(0, 0, "voxels_input");
+            for (const VoxelRegion& region : voxels.regions) {
+                PC pc = region_pc(region);
+                command_buffer
+                    .push_constants(vuk::ShaderStageFlagBits::eCompute, 0, pc)
+                    .dispatch_invocations(region.high.x - region.low.x, region.high.y - region.low.y, region.high.z - region.low.z);
+            }
+        }
+    });
 
+    std::vector<vuk::Resource> resources = {
+        "sun_depth_output"_image >> vuk::eFragmentSampled,
+        "voxels_cleared"_image >> vuk::eFragmentRW >> "voxels_written",
+        "fake_input"_image >> vuk::eColorWrite >> "fake_output"
+    };
+    for (uint32 i = 0; i < voxels.regions.size(); i++) {
+        resources.emplace_back(indexed_name("region_instances", i, "_culled"), vuk::Resource::Type::eBuffer, vuk::eVertexRead);
+        resources.emplace_back(indexed_name("region_draws", i, "_culled"), vuk::Resource::Type::eBuffer, vuk::eIndirectRead);
+    }
     rg->add_pass({
         .name = "voxelization",
-        .resources = {
-            "sun_depth_output"_image >> vuk::eFragmentSampled,
-            "voxelization_input"_image >> vuk::eFragmentWrite >> "voxelization",
-            "fake_input"_image >> vuk::eColorWrite >> "fake_output"
-        },
-        .execute = [this](vuk::CommandBuffer& command_buffer) {
+        .resources = std::move(resources),
+        .execute = [this, region_pc](vuk::CommandBuffer& command_buffer) {
             command_buffer.set_dynamic_state(vuk::DynamicStateFlagBits::eViewport | vuk::DynamicStateFlagBits::eScissor)
-                    .set_viewport(0, vuk::Rect2D{.extent={uint32(voxelization_resolution.x), uint32(voxelization_resolution.y)}})
-                    .set_scissor(0, vuk::Rect2D{.extent={uint32(voxelization_resolution.x), uint32(voxelization_resolution.y)}})
+                    .set_viewport(0, vuk::Rect2D{.extent={voxels.resolution, voxels.resolution}})
+                    .set_scissor(0, vuk::Rect2D{.extent={voxels.resolution, voxels.resolution}})
                     .set_depth_stencil(vuk::PipelineDepthStencilStateCreateInfo {
                             .depthTestEnable  = false,
                             .depthWriteEnable = false
@@ -322,55 +963,77 @@ void RenderScene::add_voxelization_pass(shared_ptr<vuk::RenderGraph> rg) {
             command_buffer
                     .bind_buffer(0, CAMERA_BINDING, buffer_voxelization_camera)
                     .bind_buffer(0, MODEL_BINDING, buffer_model_mats)
-                    .bind_buffer(0, ID_BINDING, buffer_sun_camera_data);
+                    .bind_buffer(0, ID_BINDING, buffer_shadow_data)
+                    .bind_buffer(0, DEQUANT_BINDING, buffer_dequants);
 
-            command_buffer.bind_image(0, 8, "voxelization_input");
+            command_buffer.bind_image(0, 8, "voxels_cleared");
             command_buffer.bind_image(0, 9, "sun_depth_output").bind_sampler(0, 9, Sampler().filter(Filter_Nearest).get());
 
-            int item_index = 0;
-            for (const auto& [mat_hash, mat_map] : renderables_built) {
-                MaterialGPU* material = get_gpu_asset_cache().materials.contains(mat_hash) ? &get_gpu_asset_cache().materials[mat_hash] : nullptr;
-                command_buffer.bind_graphics_pipeline(get_renderer().context->get_named_pipeline("voxelization"));
-                material->bind_parameters(command_buffer);
-                material->bind_textures(command_buffer);
-                for (const auto& [mesh_hash, mesh_list] : mat_map) {
-                    MeshGPU* mesh = get_gpu_asset_cache().meshes.contains(mesh_hash) ? &get_gpu_asset_cache().meshes[mesh_hash] : nullptr;
-                    command_buffer
-                            .bind_vertex_buffer(0, mesh->vertex_buffer.get(), 0, Vertex::get_format())
-                            .bind_index_buffer(mesh->index_buffer.get(), vuk::IndexType::eUint32);
-
-
+            for (uint32 r = 0; r < voxels.regions.size(); r++) {
+                const CulledInstances& culled = voxel_region_instances[r];
+                if (culled.stats.drawn + culled.stats.gpu == 0)
+                    continue;
+                command_buffer.bind_buffer(0, INSTANCE_BINDING, culled.buffer);
+                PC pc = region_pc(voxels.regions[r]);
+                for (const auto& [mat_hash, mat_map] : render_batches) {
+                    MaterialGPU* material = get_gpu_asset_cache().get_material_or_placeholder(mat_hash);
+                    if (material == nullptr)
+                        continue;
+                    command_buffer.bind_graphics_pipeline(get_renderer().context->get_named_pipeline("voxelization"));
+                    material->bind_parameters(command_buffer);
+                    material->bind_textures(command_buffer);
                     for (uint32 i = 0; i < 3; i++) {
-                        struct PC { v4i res; uint32 pass; };
-                        PC pc {.res = v4i(voxelization_resolution, 0), .pass = i};
+                        pc.pass = i;
                         command_buffer.push_constants(vuk::ShaderStageFlagBits::eVertex | vuk::ShaderStageFlagBits::eFragment, 0, pc);
-                        command_buffer.draw_indexed(mesh->index_count, mesh_list.size(), 0, 0, item_index);
-
+                        draw_batches(command_buffer, mat_hash, mat_map, culled);
                     }
-                    item_index += mesh_list.size();
                 }
             }
         }
     });
 
-    vuk::ImageAttachment voxelization_format = {
-        .image_type = vuk::ImageType::e3D,
-        .extent = {.extent = {uint32(voxelization_resolution.x), uint32(voxelization_resolution.y), uint32(voxelization_resolution.z)}},
-        .format = vuk::Format::eR16G16B16A16Sfloat,
-        .sample_count = vuk::Samples::e1,
-        .view_type = vuk::ImageViewType::e3D,
-        .level_count = 6,
-        .layer_count = 1
-    };
     vuk::ImageAttachment fake_format = {
-        .extent = {.extent = {uint32(voxelization_resolution.x), uint32(voxelization_resolution.y), 1}},
+        .extent = {.extent = {voxels.resolution, voxels.resolution, 1}},
         .format = vuk::Format::eR8G8B8A8Srgb,
         .sample_count = vuk::Samples::e1
     };
-    rg->attach_and_clear_image("voxelization_input", voxelization_format, vuk::ClearColor(0.0f, 0.0f, 0.0f, 0.0f));
     rg->attach_and_clear_image("fake_input", fake_format, vuk::ClearColor(0.0f, 0.0f, 0.0f, 0.0f));
 
-    generate_mips(rg, "voxelization", "voxelization_mipped", 6);
+
+    // Regions aligned out to whole groups of voxel_mips.comp, spilling past a level only rewrites texels it wraps onto
+    // with what they already hold
+    rg->add_pass({
+        .name = "voxel_mips",
+        .resources = {
+            "voxels_written"_image >> vuk::eComputeSampled,
+            "voxel_faces_input"_image >> vuk::eComputeRW >> "voxel_faces"
+        },
+        .execute = [this](vuk::CommandBuffer& command_buffer) {
+            command_buffer
+                .bind_compute_pipeline("voxel_mips")
+                .bind_image(0, 0, "voxels_written").bind_sampler(0, 0, Sampler().filter(Filter_Nearest).get());
+            for (uint32 mip = 0; mip < VoxelClipmap::mip_count - 1; mip++)
+                command_buffer.bind_image(0, 1 + mip, *voxel_face_mip_views[mip], vuk::ImageLayout::eGeneral);
+
+            struct PC {
+                v4i    region_low;
+                uint32 resolution;
+                uint32 level;
+                uint32 level_count;
+            };
+            for (const VoxelRegion& region : voxels.regions) {
+                v3i low, groups;
+                for (int axis = 0; axis < 3; axis++) {
+                    low[axis]    = int32(std::floor(float(region.low[axis]) / 8.0f)) * 8;
+                    groups[axis] = (region.high[axis] - low[axis] + 7) / 8;
+                }
+                PC pc = {v4i(low, 0), voxels.resolution, region.level, voxels.level_count};
+                command_buffer
+                    .push_constants(vuk::ShaderStageFlagBits::eCompute, 0, pc)
+                    .dispatch(groups.x, groups.y, groups.z);
+            }
+        }
+    });
 }
 
 void RenderScene::add_forward_pass(shared_ptr<vuk::RenderGraph> rg) {
@@ -379,18 +1042,30 @@ void RenderScene::add_forward_pass(shared_ptr<vuk::RenderGraph> rg) {
     rg->attach_and_clear_image("emissive_input", {.format = vuk::Format::eR16G16B16A16Sfloat}, vuk::ClearColor {0.0f, 0.0f, 0.0f, 0.0f});
     rg->attach_and_clear_image("normal_input", {.format = vuk::Format::eR16G16B16A16Sfloat}, vuk::ClearColor {0.0f, 0.0f, 0.0f, 0.0f});
     rg->attach_and_clear_image("depth_input", {.format = vuk::Format::eD32Sfloat}, vuk::ClearDepthStencil{0.0f, 0});
-    rg->attach_and_clear_image("info_input", {.format = vuk::Format::eR32Uint}, vuk::ClearColor {-1u, -1u, -1u, -1u});
     rg->inference_rule("base_color_input", vuk::same_extent_as("target_input"));
+    std::vector<vuk::Resource> resources = {
+        "base_color_input"_image >> vuk::eColorWrite  >> "base_color_output",
+        "emissive_input"_image >> vuk::eColorWrite    >> "emissive_output",
+        "normal_input"_image  >> vuk::eColorWrite     >> "normal_output",
+        "depth_input"_image   >> vuk::eDepthStencilRW >> "depth_output",
+        "forward_instances_culled"_buffer >> vuk::eVertexRead,
+        "forward_draws_culled"_buffer >> vuk::eIndirectRead
+    };
+    if (!particles.draws.empty()) {
+        resources.push_back("particles_simulated"_buffer >> vuk::eVertexRead);
+        resources.push_back("particle_visible_filled"_buffer >> vuk::eVertexRead);
+        resources.push_back("particle_draws_filled"_buffer >> vuk::eIndirectRead);
+    }
+    // Ids are only written out for the GPU readback, picking doesn't need them
+    bool write_info = query_pending();
+    if (write_info) {
+        rg->attach_and_clear_image("info_input", {.format = vuk::Format::eR32Uint}, vuk::ClearColor {-1u, -1u, -1u, -1u});
+        resources.push_back("info_input"_image >> vuk::eColorWrite >> "info_output");
+    }
     rg->add_pass({
         .name = "forward",
-        .resources = {
-            "base_color_input"_image >> vuk::eColorWrite  >> "base_color_output",
-            "emissive_input"_image >> vuk::eColorWrite    >> "emissive_output",
-            "normal_input"_image  >> vuk::eColorWrite     >> "normal_output",
-            "info_input"_image    >> vuk::eColorWrite     >> "info_output",
-            "depth_input"_image   >> vuk::eDepthStencilRW >> "depth_output"
-        },
-        .execute = [this](vuk::CommandBuffer& command_buffer) {
+        .resources = std::move(resources),
+        .execute = [this, write_info, measure_particles = particle_benchmark.measuring, particle_timing = particle_benchmark.current](vuk::CommandBuffer& command_buffer) {
             ZoneScoped;
             // Prepare render
             command_buffer.set_dynamic_state(vuk::DynamicStateFlagBits::eViewport | vuk::DynamicStateFlagBits::eScissor)
@@ -404,34 +1079,38 @@ void RenderScene::add_forward_pass(shared_ptr<vuk::RenderGraph> rg) {
                 .broadcast_color_blend({vuk::BlendPreset::eAlphaBlend})
                 .set_color_blend("base_color_input", vuk::BlendPreset::eAlphaBlend)
                 .set_color_blend("emissive_input", vuk::BlendPreset::eAlphaBlend)
-                .set_color_blend("normal_input", vuk::BlendPreset::eOff)
-                .set_color_blend("info_input", vuk::BlendPreset::eOff);
+                .set_color_blend("normal_input", vuk::BlendPreset::eOff);
+            if (write_info)
+                command_buffer.set_color_blend("info_input", vuk::BlendPreset::eOff);
             
             command_buffer
                 .bind_buffer(0, CAMERA_BINDING, buffer_camera_data)
                 .bind_buffer(0, MODEL_BINDING, buffer_model_mats)
-                .bind_buffer(0, ID_BINDING, buffer_ids);
-
-            int item_index = 0;
-            for (const auto& [mat_hash, mat_map] : renderables_built) {
-                MaterialGPU* material = get_gpu_asset_cache().materials.contains(mat_hash) ?& get_gpu_asset_cache().materials[mat_hash] : nullptr;
+                .bind_buffer(0, ID_BINDING, buffer_ids)
+                .bind_buffer(0, INSTANCE_BINDING, forward_instances.buffer)
+                .bind_buffer(0, DEQUANT_BINDING, buffer_dequants);
+
+            for (const auto& [mat_hash, mat_map] : render_batches) {
+                MaterialGPU* material = get_gpu_asset_cache().get_material_or_placeholder(mat_hash);
+                if (material == nullptr)
+                    continue;
                 command_buffer
                     .set_rasterization({.cullMode = material->cull_mode})
                     .bind_graphics_pipeline(material->pipeline);
                 material->bind_parameters(command_buffer);
                 material->bind_textures(command_buffer);
-                for (const auto& [mesh_hash, mesh_list] : mat_map) {
-                    MeshGPU* mesh = get_gpu_asset_cache().meshes.contains(mesh_hash) ? &get_gpu_asset_cache().meshes[mesh_hash] : nullptr;
-                    command_buffer
-                        .bind_vertex_buffer(0, mesh->vertex_buffer.get(), 0, Vertex::get_format())
-                        .bind_index_buffer(mesh->index_buffer.get(), vuk::IndexType::eUint32);
-                    command_buffer.draw_indexed(mesh->index_count, mesh_list.size(), 0, 0, item_index);
-                    item_index += mesh_list.size();
-                }
+                draw_batches(command_buffer, mat_hash, mat_map, forward_instances);
             }
             
-            for (auto& emitter : emitters) {
-                render_particles(emitter, command_buffer);
+            if (!particles.draws.empty()) {
+                auto particles_start = std::chrono::steady_clock::now();
+                if (measure_particles)
+                    command_buffer.write_timestamp(particle_timing.draw_start, vuk::PipelineStageFlagBits::eTopOfPipe);
+                render_particles(particles, command_buffer);
+                if (measure_particles) {
+                    command_buffer.write_timestamp(particle_timing.draw_end, vuk::PipelineStageFlagBits::eBottomOfPipe);
+                    particle_benchmark.add_cpu(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - particles_start).count());
+                }
             }
         }
     });
@@ -461,12 +1140,13 @@ void RenderScene::add_widget_pass(shared_ptr<vuk::RenderGraph> rg) {
                 
             command_buffer
                 .bind_buffer(0, CAMERA_BINDING, buffer_camera_data)
-                .bind_buffer(0, MODEL_BINDING, buffer_model_mats);
+                .bind_buffer(0, MODEL_BINDING, buffer_widget_model_mats);
             // Render items
-            int item_index = 0 + renderables.size();
+            int item_index = 0;
             for (Renderable& renderable : widget_renderables) {
                 render_widget(renderable, command_buffer, &item_index);
             }
+            debug_draw.draw(command_buffer, viewport.camera->position);
         }
     }});
 
@@ -476,8 +1156,104 @@ void RenderScene::add_widget_pass(shared_ptr<vuk::RenderGraph> rg) {
 }
 
 
+GITier gi_tier(GIQuality quality) {
+    switch (quality) {
+        case GIQuality_Full: return {1, 50};
+        case GIQuality_High: return {2, 50};
+        case GIQuality_Medium: return {2, 32};
+        case GIQuality_Low: return {4, 24};
+    }
+    return {2, 50};
+}
+
+void RenderScene::add_gi_pass(shared_ptr<vuk::RenderGraph> rg) {
+    ZoneScoped;
+    GITier tier = gi_tier(gi_quality);
+    int32  scale = int32(tier.scale);
+    v2i    size  = v2i((viewport.size.x + scale - 1) / scale, (viewport.size.y + scale - 1) / scale);
+    if (gi_scale != tier.scale || gi_size.x != size.x || gi_size.y != size.y) {
+        vuk::ImageCreateInfo ici;
+        ici.format = vuk::Format::eR16G16B16A16Sfloat;
+        ici.extent = vuk::Extent3D{uint32(size.x), uint32(size.y), 1};
+        ici.usage  = vuk::ImageUsageFlagBits::eStorage | vuk::ImageUsageFlagBits::eSampled;
+        for (uint32 i = 0; i < 2; i++) {
+            gi_diffuse[i]  = get_renderer().context->allocate_texture(*get_renderer().global_allocator, ici);
+            gi_specular[i] = get_renderer().context->allocate_texture(*get_renderer().global_allocator, ici);
+            gi_written[i]  = false;
+        }
+        gi_scale         = tier.scale;
+        gi_size          = size;
+        gi_history_valid = false;
+    }
+    post_process_data.gi_scale = gi_scale;
+
+    uint32 current  = gi_frame % 2;
+    uint32 previous = 1 - current;
+    // Both were last sampled, the previous pair by last frame's post process and the current pair by last frame's trace
+    auto access = [this](uint32 i) { return gi_written[i] ? vuk::eComputeSampled : vuk::eNone; };
+    rg->attach_image("gi_previous_diffuse", vuk::ImageAttachment::from_texture(gi_diffuse[previous]), access(previous));
+    rg->attach_image("gi_previous_specular", vuk::ImageAttachment::from_texture(gi_specular[previous]), access(previous));
+    rg->attach_image("gi_diffuse_input", vuk::ImageAttachment::from_texture(gi_diffuse[current]), access(current));
+    rg->attach_image("gi_specular_input", vuk::ImageAttachment::from_texture(gi_specular[current]), access(current));
+
+    struct PC {
+        uint32 scale;
+        uint32 cone_steps;
+        uint32 frame;
+        uint32 history_valid;
+        float  history_weight;
+    } pc = {gi_scale, tier.cone_steps, gi_frame, gi_history_valid, gi_history_weight};
+
+    vuk::Name voxels_name = voxels.regions.empty() ? "voxels_input" : "voxels_written";
+    vuk::Name faces_name  = voxels.regions.empty() ? "voxel_faces_input" : "voxel_faces";
+    rg->add_pass(vuk::Pass {
+        .name = "gi_trace",
+        .resources = {
+            "normal_output"_image >> vuk::eComputeSampled,
+            "depth_output"_image >> vuk::eComputeSampled,
+            vuk::Resource(voxels_name, vuk::Resource::Type::eImage, vuk::eComputeSampled),
+            vuk::Resource(faces_name, vuk::Resource::Type::eImage, vuk::eComputeSampled),
+            "gi_previous_diffuse"_image >> vuk::eComputeSampled,
+            "gi_previous_specular"_image >> vuk::eComputeSampled,
+            "gi_diffuse_input"_image >> vuk::eComputeWrite >> "gi_diffuse_output",
+            "gi_specular_input"_image >> vuk::eComputeWrite >> "gi_specular_output",
+        },
+        .execute = [this, voxels_name, faces_name, pc](vuk::CommandBuffer& cmd) {
+            ZoneScoped;
+            cmd.bind_compute_pipeline("gi_trace");
+
+            vuk::SamplerCreateInfo sampler       = Sampler().filter(Filter_Linear).get();
+            vuk::SamplerCreateInfo voxel_sampler = Sampler().filter(Filter_Linear).get();
+            vuk::SamplerCreateInfo history_sampler = Sampler().address(Address_Clamp).filter(Filter_Linear).get();
+            cmd.bind_image(0, 2, "normal_output").bind_sampler(0, 2, sampler);
+            cmd.bind_image(0, 3, "depth_output").bind_sampler(0, 3, sampler);
+            cmd.bind_image(0, 6, voxels_name).bind_sampler(0, 6, voxel_sampler);
+            cmd.bind_image(0, 14, faces_name).bind_sampler(0, 14, voxel_sampler);
+            cmd.bind_image(0, 10, "gi_previous_diffuse").bind_sampler(0, 10, history_sampler);
+            cmd.bind_image(0, 11, "gi_previous_specular").bind_sampler(0, 11, history_sampler);
+            cmd.bind_image(0, 12, "gi_diffuse_input");
+            cmd.bind_image(0, 13, "gi_specular_input");
+            cmd.bind_buffer(0, 8, buffer_composite_data);
+
+            vuk::ImageAttachment target = *cmd.get_resource_image_attachment("depth_output");
+            cmd.specialize_constants(0, target.extent.extent.width);
+            cmd.specialize_constants(1, target.extent.extent.height);
+
+            cmd.push_constants(vuk::ShaderStageFlagBits::eCompute, 0, pc);
+            cmd.dispatch_invocations(gi_size.x, gi_size.y);
+        },
+    });
+
+    gi_written[current] = true;
+    gi_history_valid    = true;
+    gi_frame++;
+}
+
 void RenderScene::add_postprocess_pass(shared_ptr<vuk::RenderGraph> rg) {
     ZoneScoped;
+    // Frames that revoxelized nothing sample the clipmap as it was attached
+    vuk::Name voxels_name = voxels.regions.empty() ? "voxels_input" : "voxels_written";
+    vuk::Name faces_name  = voxels.regions.empty() ? "voxel_faces_input" : "voxel_faces";
     rg->add_pass(vuk::Pass {
     .name = "postprocess_apply",
     .resources = {
@@ -487,17 +1263,21 @@ void RenderScene::add_postprocess_pass(shared_ptr<vuk::RenderGraph> rg) {
         "depth_output"_image   >> vuk::eComputeSampled,
         "widget_output"_image >> vuk::eComputeSampled,
         "widget_depth_output"_image >> vuk::eComputeSampled,
-        "voxelization_mipped"_image >> vuk::eComputeSampled,
+        vuk::Resource(voxels_name, vuk::Resource::Type::eImage, vuk::eComputeSampled),
+        vuk::Resource(faces_name, vuk::Resource::Type::eImage, vuk::eComputeSampled),
         "sun_depth_output"_image >> vuk::eComputeSampled,
+        "gi_diffuse_output"_image >> vuk::eComputeSampled,
+        "gi_specular_output"_image >> vuk::eComputeSampled,
         "target_input"_image   >> vuk::eComputeWrite >> "target_output",
     },
     .execute =
-        [this](vuk::CommandBuffer& cmd) {
+        [this, voxels_name, faces_name](vuk::CommandBuffer& cmd) {
             ZoneScoped;
             cmd.bind_compute_pipeline("postprocess");
 
             vuk::SamplerCreateInfo sampler = Sampler().filter(Filter_Linear).get();
-            vuk::SamplerCreateInfo voxel_sampler = Sampler().address(Address_Clamp).filter(Filter_Linear).get();
+            // Repeats so the clipmap's toroidal x and y filter across the wrap
+            vuk::SamplerCreateInfo voxel_sampler = Sampler().filter(Filter_Linear).get();
             vuk::SamplerCreateInfo sun_sampler = Sampler().address(Address_Clamp).filter(Filter_Nearest).get();
             cmd.bind_image(0, 0, "base_color_output").bind_sampler(0, 0, sampler);
             cmd.bind_image(0, 1, "emissive_output").bind_sampler(0, 1, sampler);
@@ -505,8 +1285,11 @@ void RenderScene::add_postprocess_pass(shared_ptr<vuk::RenderGraph> rg) {
             cmd.bind_image(0, 3, "depth_output").bind_sampler(0, 3, sampler);
             cmd.bind_image(0, 4, "widget_output").bind_sampler(0, 4, sampler);
             cmd.bind_image(0, 5, "widget_depth_output").bind_sampler(0, 5, sampler);
-            cmd.bind_image(0, 6, "voxelization_mipped").bind_sampler(0, 6, voxel_sampler);
+            cmd.bind_image(0, 6, voxels_name).bind_sampler(0, 6, voxel_sampler);
+            cmd.bind_image(0, 14, faces_name).bind_sampler(0, 14, voxel_sampler);
             cmd.bind_image(0, 9, "sun_depth_output").bind_sampler(0, 9, sun_sampler);
+            cmd.bind_image(0, 10, "gi_diffuse_output").bind_sampler(0, 10, sampler);
+            cmd.bind_image(0, 11, "gi_specular_output").bind_sampler(0, 11, sampler);
             cmd.bind_image(0, 7, "target_input");
 
             cmd.bind_buffer(0, 8, buffer_composite_data);
@@ -523,8 +1306,48 @@ void RenderScene::add_postprocess_pass(shared_ptr<vuk::RenderGraph> rg) {
     });
 }
 
+bool RenderScene::query_pending() const {
+    return math::contains(range2i(v2i(0), v2i(viewport.size)), query);
+}
+
+PickResult RenderScene::pick(const ray3& ray) {
+    ZoneScoped;
+    PickResult result;
+    spatial_index.ray_cast(ray, result.t, [&ray, &result](void* user_data, float& t) {
+        Renderable* renderable = (Renderable*) user_data;
+        ray3        mesh_ray   = inverse_transform_ray(renderable->transform, ray);
+        uint32      triangle   = 0;
+        if (MeshBVH* mesh_bvh = get_gpu_asset_cache().get_mesh_bvh(renderable->mesh_id)) {
+            if (!mesh_bvh->ray_cast(mesh_ray, t, triangle))
+                return false;
+        } else {
+            // Frame allocated meshes don't keep their triangles, their bounds stand in
+            MeshGPU* mesh = get_gpu_asset_cache().get_mesh(renderable->mesh_id);
+            if (mesh == nullptr)
+                return false;
+            const MeshBounds& bounds = mesh->bounds;
+            v3    inverse_dir = v3(1.0f / mesh_ray.dir.x, 1.0f / mesh_ray.dir.y, 1.0f / mesh_ray.dir.z);
+            float entry;
+            if (!ray_box(mesh_ray.origin, inverse_dir, bounds.origin - bounds.extents, bounds.origin + bounds.extents, t, entry) || entry >= t)
+                return false;
+            t = entry;
+        }
+        result.renderable   = renderable;
+        result.selection_id = renderable->selection_id;
+        result.triangle     = triangle;
+        return true;
+    });
+    if (result.renderable != nullptr)
+        result.position = ray.origin + ray.dir * result.t;
+    return result;
+}
+
+PickResult RenderScene::pick(v2i screen_pos) {
+    return pick(viewport.ray(screen_pos));
+}
+
 void RenderScene::add_info_read_pass(shared_ptr<vuk::RenderGraph> rg) {
-    if (math::contains(range2i(v2i(0), v2i(viewport.size)), query)) {
+    if (query_pending()) {
         auto info_storage_buffer = **vuk::allocate_buffer(*get_renderer().global_allocator, { vuk::MemoryUsage::eGPUtoCPU, sizeof(uint32), 1});
         rg->attach_buffer("info_storage", info_storage_buffer);
         rg->add_pass({
@@ -546,12 +1369,45 @@ void RenderScene::add_info_read_pass(shared_ptr<vuk::RenderGraph> rg) {
 }
 
 void RenderScene::add_emitter_update_pass(shared_ptr<vuk::RenderGraph> rg) {
+    if (particles.draws.empty())
+        return;
+    rg->attach_buffer("particles", *particles.buffer_particles, particles.particles_written ? vuk::eVertexRead : vuk::eNone);
+    particles.particles_written = true;
+    rg->attach_buffer("particle_draws", particles.buffer_draws, vuk::eNone);
+    rg->attach_buffer("particle_visible", particles.buffer_visible, vuk::eNone);
+
+    vuk::Name simulated_input = "particles";
+    if (particles.grown_bsize > 0) {
+        rg->attach_buffer("particles_grown_from", *particles.grown_from, particles.grown_from_written ? vuk::eVertexRead : vuk::eNone);
+        rg->add_pass({
+            .name = "particle_grow",
+            .resources = {
+                "particles_grown_from"_buffer >> vuk::eTransferRead,
+                "particles"_buffer >> vuk::eTransferWrite >> "particles_grown"
+            },
+            .execute = [this](vuk::CommandBuffer& command_buffer) {
+                command_buffer.copy_buffer(*particles.grown_from, *particles.buffer_particles, particles.grown_bsize);
+            }
+        });
+        simulated_input = "particles_grown";
+    }
+
     rg->add_pass({
         .name = "emitter_update",
-        .resources = {},
-        .execute = [this](vuk::CommandBuffer& command_buffer) {
-            for (auto& emitter : emitters) {
-                update_emitter(emitter, command_buffer);
+        .resources = {
+            vuk::Resource(simulated_input, vuk::Resource::Type::eBuffer, vuk::eComputeRW, "particles_simulated"),
+            "particle_draws"_buffer >> vuk::eComputeRW >> "particle_draws_filled",
+            "particle_visible"_buffer >> vuk::eComputeWrite >> "particle_visible_filled"
+        },
+        .execute = [this, measure_particles = particle_benchmark.measuring, particle_timing = particle_benchmark.current](vuk::CommandBuffer& command_buffer) {
+            ZoneScoped;
+            auto start = std::chrono::steady_clock::now();
+            if (measure_particles)
+                command_buffer.write_timestamp(particle_timing.simulate_start, vuk::PipelineStageFlagBits::eTopOfPipe);
+            simulate_particles(particles, command_buffer);
+            if (measure_particles) {
+                command_buffer.write_timestamp(particle_timing.simulate_end, vuk::PipelineStageFlagBits::eBottomOfPipe);
+                particle_benchmark.add_cpu(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
             }
         }
     });
@@ -610,6 +1466,25 @@ void RenderScene::generate_mips(shared_ptr<vuk::RenderGraph> rg, string_view inp
 }
 
 void RenderScene::cleanup() {
+    instance_model_mats.cleanup();
+    instance_ids.cleanup();
+    instance_dequants.cleanup();
+    gpu_cull_instances.cleanup();
+    debug_draw.cleanup();
+    spatial_index.clear();
+    particles.cleanup();
+    shadow_atlas      = {};
+    shadow_atlas_size = 0;
+    voxel_texture            = {};
+    voxel_texture_resolution = 0;
+    for (vuk::Unique<vuk::ImageView>& view : voxel_face_mip_views)
+        view = {};
+    voxel_faces = {};
+    for (uint32 i = 0; i < 2; i++) {
+        gi_diffuse[i]  = {};
+        gi_specular[i] = {};
+    }
+    gi_scale = 0;
 }
 
 void widget_setup() {
@@ -618,9 +1493,14 @@ void widget_setup() {
         return;
     initialized = true;
     vuk::PipelineBaseCreateInfo pci;
-    pci.add_glsl(get_contents(shader_path("widget.vert")), shader_path("widget.vert").abs_string());
-    pci.add_glsl(get_contents(shader_path("widget.frag")), shader_path("widget.frag").abs_string());
+    get_shader_cache().add_shader(pci, "widget.vert");
+    get_shader_cache().add_shader(pci, "widget.frag");
     get_renderer().context->create_named_pipeline("widget", pci);
+
+    vuk::PipelineBaseCreateInfo line_pci;
+    get_shader_cache().add_shader(line_pci, "debug_line.vert");
+    get_shader_cache().add_shader(line_pci, "widget.frag");
+    get_renderer().context->create_named_pipeline("debug_line", line_pci);
     
     MaterialCPU widget_mat = {.shader_name = "widget"};
     widget_mat.file_path = FilePath("widget", true);
@@ -636,7 +1516,9 @@ Renderable& RenderScene::quick_mesh(const MeshCPU& mesh_cpu, bool frame_allocate
     r.material_id = hash_view(widget ? "widget" : "default");
     r.frame_allocated = frame_allocated;
 
-    return *(widget ? widget_renderables : renderables).emplace(r);
+    if (widget)
+        return *widget_renderables.emplace(r);
+    return *add_renderable(r);
 }
 
 void material_setup() {
@@ -655,7 +1537,7 @@ Renderable& RenderScene::quick_material(const MaterialCPU& material_cpu, bool fr
     r.material_id = upload_material(material_cpu, frame_allocated);
     r.frame_allocated = frame_allocated;
     
-    return *renderables.emplace(r);
+    return *add_renderable(r);
 }
 
 Renderable& RenderScene::quick_renderable(uint64 mesh_id, uint64 mat_id, bool frame_allocated) {
@@ -666,7 +1548,7 @@ Renderable& RenderScene::quick_renderable(uint64 mesh_id, uint64 mat_id, bool fr
     r.material_id = mat_id;
     r.frame_allocated = frame_allocated;
     
-    return *renderables.emplace(r);
+    return *add_renderable(r);
 }
 
 Renderable& RenderScene::quick_renderable(const MeshCPU& mesh, uint64 mat_id, bool frame_allocated) {
@@ -677,7 +1559,7 @@ Renderable& RenderScene::quick_renderable(const MeshCPU& mesh, uint64 mat_id, bo
     r.material_id = mat_id;
     r.frame_allocated = frame_allocated;
     
-    return *renderables.emplace(r);
+    return *add_renderable(r);
 }
 
 Renderable& RenderScene::quick_renderable(uint64 mesh_id, const MaterialCPU& mat, bool frame_allocated) {
@@ -688,7 +1570,7 @@ Renderable& RenderScene::quick_renderable(uint64 mesh_id, const MaterialCPU& mat
     r.material_id = upload_material(mat);
     r.frame_allocated = frame_allocated;
     
-    return *renderables.emplace(r);
+    return *add_renderable(r);
 }
 
 }
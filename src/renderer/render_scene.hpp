@@ -14,6 +14,13 @@
 
 #include "viewport.hpp"
 #include "renderable.hpp"
+#include "persistent_buffer.hpp"
+#include "vertex.hpp"
+#include "culling.hpp"
+#include "debug_draw.hpp"
+#include "aabb_tree.hpp"
+#include "shadows.hpp"
+#include "voxel_clipmap.hpp"
 #include "assets/particles.hpp"
 
 namespace spellbook {
@@ -44,12 +51,36 @@ struct SceneData {
     float sun_intensity;
 };
 
+// Indirect light is cone traced for one pixel of each scale x scale block, accumulated over frames and upsampled with
+// the depth and normals of the full resolution pixels
+enum GIQuality {
+    GIQuality_Full,   // Every pixel, 50 steps per cone
+    GIQuality_High,   // Half resolution, 50 steps per cone
+    GIQuality_Medium, // Half resolution, 32 steps per cone
+    GIQuality_Low     // Quarter resolution, 24 steps per cone
+};
+
+struct GITier {
+    uint32 scale;
+    uint32 cone_steps;
+};
+
+GITier gi_tier(GIQuality quality);
+
 struct PostProcessData {
     DebugDrawMode debug_mode = DebugDrawMode_Lit;
-    float voxel_size;
+    uint32 gi_scale = 1;
     float time;
 };
 
+struct PickResult {
+    Renderable* renderable   = nullptr;
+    uint32      selection_id = 0;
+    uint32      triangle     = 0;
+    float       t            = FLT_MAX; // Along the ray's direction as given
+    v3          position;
+};
+
 struct RenderScene {
     string name;
     
@@ -57,45 +88,137 @@ struct RenderScene {
     plf::colony<Renderable> renderables;
     plf::colony<Renderable> widget_renderables;
     plf::colony<EmitterGPU> emitters;
+    ParticlePool            particles;
+    ParticleBenchmark       particle_benchmark;
     bool render_widgets = true;
     
     SceneData       scene_data;
     PostProcessData post_process_data;
 
+    // GPU readback of the info attachment, which is only rendered while a query is pending. pick answers on the CPU.
     v2i         query = v2i(-1, -1);
     vuk::Future fut_query_result;
 
+    // World bounds of every renderable, kept in sync by add_renderable/delete_renderable/update_renderable. Renderables
+    // whose mesh hasn't streamed in yet sit at their origin until it does.
+    AABBTree spatial_index;
+
+    // Persistent across frames, cascades and voxels that didn't change are kept
+    CascadedShadows shadows;
+    vuk::Texture    shadow_atlas;
+    uint32          shadow_atlas_size    = 0;
+    bool            shadow_atlas_written = false;
+    VoxelClipmap    voxels;
+    vuk::Texture    voxel_texture;
+    uint32          voxel_texture_resolution = 0;
+    uint32          voxel_texture_levels     = 0;
+    bool            voxel_texture_written    = false;
+    // Mips 1 and up, one per face, see voxel_clipmap.glsli. Views per mip for voxel_mips.comp to write.
+    vuk::Texture                voxel_faces;
+    vuk::Unique<vuk::ImageView> voxel_face_mip_views[VoxelClipmap::mip_count - 1];
+    bool                        voxel_faces_written = false;
+
+    // Traced indirect light, ping-ponged so each frame blends into what the last one accumulated
+    GIQuality    gi_quality        = GIQuality_High;
+    float        gi_history_weight = 0.9f;
+    vuk::Texture gi_diffuse[2];
+    vuk::Texture gi_specular[2];
+    v2i          gi_size;
+    uint32       gi_scale      = 0;
+    uint32       gi_frame      = 0;
+    bool         gi_written[2] = {};
+    bool         gi_history_valid = false;
+    m44          gi_previous_vp;
+    v3           gi_previous_position;
+
     bool user_pause = false;
     bool cull_pause = false;
     vuk::Texture render_target;
 
     vuk::Buffer buffer_camera_data;
     vuk::Buffer buffer_voxelization_camera;
-    vuk::Buffer buffer_sun_camera_data;
+    vuk::Buffer buffer_shadow_data;
+    vuk::Buffer buffer_cascade_cameras[max_shadow_cascades];
     vuk::Buffer buffer_composite_data;
     vuk::Buffer buffer_model_mats;
     vuk::Buffer buffer_ids;
+    vuk::Buffer buffer_widget_model_mats;
+    vuk::Buffer buffer_cull_instances;
+    vuk::Buffer buffer_dequants;
 
-    struct BuiltRenderable {
-        uint32 id;
-        m44GPU* mat;
+    // Batches persist across frames and are kept in sync by add_renderable/delete_renderable. Instances are drawn
+    // through a per-pass list of surviving slots, which maps gl_InstanceIndex to the renderable's stable slot in the
+    // model/id buffers.
+    struct RenderBatch {
+        vector<Renderable*> renderables;
+        uint32 first_instance = 0;
+        uint32 batch_index    = 0;
+        bool   bounds_ready   = false;
+        bool   material_ready = false; // Voxels drawn with the placeholder are redone once the material is in
+        bool   indirect       = false; // Mesh lives in the geometry arena, culled and drawn from the GPU
     };
-    umap<mat_id, umap<mesh_id, vector<BuiltRenderable>>> renderables_built;
+    umap<mat_id, umap<mesh_id, RenderBatch>> render_batches;
+    // A material's batches get consecutive indices, so its indirect draws are one range of the draw buffer
+    struct MaterialBatches {
+        uint32 first_batch = 0;
+        uint32 batch_count = 0;
+    };
+    umap<mat_id, MaterialBatches> material_batches;
+    uint32 render_batch_count   = 0;
+    bool   render_batches_dirty = true;
+
+    DebugDraw           debug_draw;
+    PersistentBuffer    instance_model_mats = {.element_bsize = sizeof(m44GPU)};
+    PersistentBuffer    instance_ids        = {.element_bsize = sizeof(uint32)};
+    PersistentBuffer    gpu_cull_instances  = {.element_bsize = sizeof(GPUCullInstance)};
+    PersistentBuffer    instance_dequants   = {.element_bsize = sizeof(GPUVertexDequant)};
+    vector<v4>          instance_spheres;
+    vector<uint32>      free_instance_slots;
+    uint32              instance_slot_count = 0;
+    vector<Renderable*> frame_renderables;
 
-    v3i voxelization_resolution;
+    // Batch ordered, rebuilt only when batches change
+    vector<uint32> batched_slots;
+    vector<uint32> slot_to_batched;
+    CullSpheres    batched_spheres;
+
+    bool            frustum_culling = true;
+    bool            gpu_driven      = true;
+    Frustum         camera_frustum;
+    CulledInstances forward_instances;
+    CulledInstances cascade_instances[max_shadow_cascades];
+    vector<CulledInstances> voxel_region_instances;
+
+    // Shadows and voxels tolerate coarser meshes than the camera's view, so their passes are biased down
+    bool  lod_selection         = true;
+    float lod_base_size         = 0.5f; // Fraction of the viewport height a bounding sphere drops below to leave LOD 0
+    float sun_lod_bias          = 0.5f;
+    float voxelization_lod_bias = 0.25f;
+    // Texels a material's textures want per pixel of its largest instance's on screen diameter
+    float texture_detail        = 1.0f;
 
     void update_size(v2i new_size);
+    void want_texture_resolutions();
     
     void        setup(vuk::Allocator& allocator);
     void        image(v2i size);
     void        settings_gui();
+    // Main thread only, uploads anything the scene is missing from the asset cache
     void        pre_render();
     void        update();
+    // May run concurrently with other scenes, only reads the asset cache
     vuk::Future render(vuk::Allocator& allocator, vuk::Future target);
     void        cleanup();
 
     Renderable* add_renderable(const Renderable& renderable);
     void        delete_renderable(Renderable* renderable);
+    void        set_transform(Renderable* renderable, const m44GPU& transform);
+    void        update_renderable(Renderable* renderable);
+
+    // Closest renderable along a ray, tested against its mesh's LOD 0 triangles. Answers immediately.
+    PickResult pick(const ray3& ray);
+    PickResult pick(v2i screen_pos);
+    bool       query_pending() const;
 
     Renderable& quick_mesh(const MeshCPU& mesh_cpu, bool frame_allocated, bool widget);
     Renderable& quick_material(const MaterialCPU& material_cpu, bool frame_allocated);
@@ -103,10 +226,12 @@ struct RenderScene {
     Renderable& quick_renderable(uint64 mesh_id, uint64 mat_id, bool frame_allocated);
     Renderable& quick_renderable(uint64 mesh_id, const MaterialCPU& mat_id, bool frame_allocated);
 
+    void add_cull_pass(shared_ptr<vuk::RenderGraph> rg);
     void add_sundepth_pass(shared_ptr<vuk::RenderGraph> rg);
     void add_voxelization_pass(shared_ptr<vuk::RenderGraph> rg);
     void add_forward_pass(shared_ptr<vuk::RenderGraph> rg);
     void add_widget_pass(shared_ptr<vuk::RenderGraph> rg);
+    void add_gi_pass(shared_ptr<vuk::RenderGraph> rg);
     void add_postprocess_pass(shared_ptr<vuk::RenderGraph> rg);
     void add_info_read_pass(shared_ptr<vuk::RenderGraph> rg);
     void add_emitter_update_pass(shared_ptr<vuk::RenderGraph> rg);
@@ -117,6 +242,15 @@ struct RenderScene {
     void setup_renderables_for_passes(vuk::Allocator& allocator);
     void clear_frame_allocated_renderables();
 
+    void batch_renderable(Renderable* renderable);
+    void unbatch_renderable(Renderable* renderable);
+    void update_instance_sphere(Renderable* renderable);
+    // Something drawn inside bounds changed, cached shadows and voxels there are redone
+    void invalidate_bounds(const BVHBounds& bounds);
+    void update_instance_dequant(Renderable* renderable);
+    void cull_instances(vuk::Allocator& allocator, const Frustum& frustum, const LODSelector& selector, CulledInstances& culled);
+    void draw_batches(vuk::CommandBuffer& command_buffer, mat_id material, const umap<mesh_id, RenderBatch>& mat_map, const CulledInstances& culled);
+
     void generate_mips(shared_ptr<vuk::RenderGraph> rg, string_view input_name, string_view output_name, uint32 mip_count);
 };
 
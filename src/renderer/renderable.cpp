@@ -7,18 +7,25 @@
 #include "general/logger.hpp"
 
 #include "renderer/renderer.hpp"
+#include "renderer/render_scene.hpp"
 #include "renderer/gpu_asset_cache.hpp"
 
 namespace spellbook {
 
-void inspect(Renderable* renderable) {
+bool inspect(RenderScene* scene, Renderable* renderable) {
+    bool changed = false;
     ImGui::PushID((void*) renderable);
     if (ImGui::TreeNode("Transform")) {
-        ImGui::DragMat4("Transform", &renderable->transform, 0.01f, "%.3f");
+        m44GPU transform = renderable->transform;
+        if (ImGui::DragMat4("Transform", &transform, 0.01f, "%.3f")) {
+            scene->set_transform(renderable, transform);
+            changed = true;
+        }
         ImGui::TreePop();
     }
     ImGui::Separator();
     ImGui::PopID();
+    return changed;
 }
 
 void upload_dependencies(Renderable& renderable) {
@@ -30,8 +37,8 @@ void upload_dependencies(Renderable& renderable) {
 }
 
 void render_item(Renderable& renderable, vuk::CommandBuffer& command_buffer, int* item_index) {
-    MeshGPU* mesh = get_gpu_asset_cache().get_mesh(renderable.mesh_id);
-    MaterialGPU* material = get_gpu_asset_cache().get_material(renderable.material_id);
+    MeshGPU* mesh = get_gpu_asset_cache().get_mesh_or_placeholder(renderable.mesh_id);
+    MaterialGPU* material = get_gpu_asset_cache().get_material_or_placeholder(renderable.material_id);
     assert_else (mesh != nullptr && material != nullptr) {
         if (item_index)
             (*item_index)++;
@@ -39,8 +46,8 @@ void render_item(Renderable& renderable, vuk::CommandBuffer& command_buffer, int
     }
     // Bind mesh
     command_buffer
-        .bind_vertex_buffer(0, mesh->vertex_buffer.get(), 0, Vertex::get_format())
-        .bind_index_buffer(mesh->index_buffer.get(), vuk::IndexType::eUint32);
+        .bind_vertex_buffer(0, mesh->vertex_buffer, 0, Vertex::get_format(mesh->encoding))
+        .bind_index_buffer(mesh->index_buffer, vuk::IndexType::eUint32);
 
     // Bind Material
     command_buffer
@@ -54,15 +61,15 @@ void render_item(Renderable& renderable, vuk::CommandBuffer& command_buffer, int
 }
 
 void render_widget(Renderable& renderable, vuk::CommandBuffer& command_buffer, int* item_index) {
-    MeshGPU* mesh = get_gpu_asset_cache().get_mesh(renderable.mesh_id);
-    MaterialGPU* material = get_gpu_asset_cache().get_material(renderable.material_id);
+    MeshGPU* mesh = get_gpu_asset_cache().get_mesh_or_placeholder(renderable.mesh_id);
+    MaterialGPU* material = get_gpu_asset_cache().get_material_or_placeholder(renderable.material_id);
     assert_else(mesh != nullptr && material != nullptr)
         return;
 
     // Bind mesh
     command_buffer
-        .bind_vertex_buffer(0, mesh->vertex_buffer.get(), 0, Vertex::get_widget_format())
-        .bind_index_buffer(mesh->index_buffer.get(), vuk::IndexType::eUint32);
+        .bind_vertex_buffer(0, mesh->vertex_buffer, 0, Vertex::get_widget_format())
+        .bind_index_buffer(mesh->index_buffer, vuk::IndexType::eUint32);
 
     // Bind Material
     command_buffer
@@ -74,15 +81,15 @@ void render_widget(Renderable& renderable, vuk::CommandBuffer& command_buffer, i
 }
 
 void render_shadow(Renderable& renderable, vuk::CommandBuffer& command_buffer, int* item_index) {
-    MeshGPU* mesh = get_gpu_asset_cache().get_mesh(renderable.mesh_id);
+    MeshGPU* mesh = get_gpu_asset_cache().get_mesh_or_placeholder(renderable.mesh_id);
     if (mesh == nullptr) {
         (*item_index)++;
         return;
     }
     // Bind mesh
     command_buffer
-        .bind_vertex_buffer(0, mesh->vertex_buffer.get(), 0, Vertex::get_format())
-        .bind_index_buffer(mesh->index_buffer.get(), vuk::IndexType::eUint32);
+        .bind_vertex_buffer(0, mesh->vertex_buffer, 0, Vertex::get_format(mesh->encoding))
+        .bind_index_buffer(mesh->index_buffer, vuk::IndexType::eUint32);
     // Draw call
     command_buffer.draw_indexed(mesh->index_count, 1, 0, 0, (*item_index)++);
 }
@@ -9,6 +9,7 @@ namespace spellbook {
 struct MeshGPU;
 struct MaterialGPU;
 struct SkeletonGPU;
+struct RenderScene;
 
 struct Renderable {
     uint64 mesh_id;
@@ -17,9 +18,15 @@ struct Renderable {
 
     bool   frame_allocated     = false;
     uint32    selection_id        = 0;
+
+    // Managed by RenderScene, edits to transform/selection_id need RenderScene::update_renderable
+    uint32 instance_slot  = ~0u;
+    uint32 batch_position = ~0u;
+    uint32 spatial_proxy  = ~0u;
 };
 
-void inspect(Renderable* renderable);
+// Edits go through RenderScene::set_transform so the instance buffer and spatial index see them
+bool inspect(RenderScene* scene, Renderable* renderable);
 
 void upload_dependencies(Renderable& renderable);
 
@@ -17,7 +17,9 @@
 #include "general/file/file_path.hpp"
 
 #include "render_scene.hpp"
+#include "shader_cache.hpp"
 #include "utils.hpp"
+#include "worker_pool.hpp"
 
 namespace spellbook {
 
@@ -47,6 +49,8 @@ Renderer::Renderer() : imgui_data() {
     vkb::PhysicalDeviceSelector selector{vkbinstance};
     VkPhysicalDeviceFeatures    vkfeatures{
         .independentBlend = VK_TRUE,
+        .multiDrawIndirect = VK_TRUE,
+        .drawIndirectFirstInstance = VK_TRUE,
         .samplerAnisotropy = VK_TRUE,
         .fragmentStoresAndAtomics = VK_TRUE
     };
@@ -111,6 +115,7 @@ Renderer::Renderer() : imgui_data() {
          transfer_queue_family_index,
         fps
     });
+    get_shader_cache().load_pipeline_cache(*context);
 
     super_frame_resource.emplace(*context, inflight_count);
     global_allocator.emplace(*super_frame_resource);
@@ -156,45 +161,75 @@ void Renderer::setup() {
     ImGui::GetIO().ConfigFlags |= ImGuiConfigFlags_DockingEnable;
     ImGui::GetIO().ConfigDockingWithShift = true;
 
+    // Every pipeline below and in scene setup reads its SPIR-V from here
+    get_shader_cache().precompile();
     {
         vuk::PipelineBaseCreateInfo pci;
-        pci.add_glsl(get_contents(shader_path("post_process.comp")), shader_path("post_process.comp").abs_string());
+        get_shader_cache().add_shader(pci, "post_process.comp");
         context->create_named_pipeline("postprocess", pci);
     }
     {
         vuk::PipelineBaseCreateInfo pci;
-        pci.add_glsl(get_contents(shader_path("blur.comp")), shader_path("blur.comp").abs_string());
+        get_shader_cache().add_shader(pci, "gi_trace.comp");
+        context->create_named_pipeline("gi_trace", pci);
+    }
+    {
+        vuk::PipelineBaseCreateInfo pci;
+        get_shader_cache().add_shader(pci, "blur.comp");
         context->create_named_pipeline("blur", pci);
     }
     {
         vuk::PipelineBaseCreateInfo pci;
-        pci.add_glsl(get_contents(shader_path("standard_3d.vert")), shader_path("standard_3d.vert").abs_string());
-        pci.add_glsl(get_contents(shader_path("textured_3d.frag")), shader_path("textured_3d.frag").abs_string());
+        get_shader_cache().add_shader(pci, "cull_instances.comp");
+        context->create_named_pipeline("cull_instances", pci);
+    }
+    {
+        vuk::PipelineBaseCreateInfo pci;
+        get_shader_cache().add_shader(pci, "voxel_clear.comp");
+        context->create_named_pipeline("voxel_clear", pci);
+    }
+    {
+        vuk::PipelineBaseCreateInfo pci;
+        get_shader_cache().add_shader(pci, "voxel_mips.comp");
+        context->create_named_pipeline("voxel_mips", pci);
+    }
+    {
+        vuk::PipelineBaseCreateInfo pci;
+        get_shader_cache().add_shader(pci, "standard_3d.vert");
+        get_shader_cache().add_shader(pci, "textured_3d.frag");
         context->create_named_pipeline("textured_model", pci);
     }
     {
         vuk::PipelineBaseCreateInfo pci;
-        pci.add_glsl(get_contents(shader_path("standard_3d.vert")), shader_path("standard_3d.vert").abs_string());
-        pci.add_glsl(get_contents(shader_path("directional_depth.frag")), shader_path("directional_depth.frag").abs_string());
+        get_shader_cache().add_shader(pci, "standard_3d.vert");
+        get_shader_cache().add_shader(pci, "directional_depth.frag");
         context->create_named_pipeline("directional_depth", pci);
     }
 
     {
         vuk::PipelineBaseCreateInfo pci;
-        pci.add_glsl(get_contents(shader_path("voxelization.vert")), shader_path("voxelization.vert").abs_string());
-        pci.add_glsl(get_contents(shader_path("voxelization.frag")), shader_path("voxelization.frag").abs_string());
+        get_shader_cache().add_shader(pci, "shadow_clear.vert");
+        get_shader_cache().add_shader(pci, "directional_depth.frag");
+        context->create_named_pipeline("shadow_clear", pci);
+    }
+
+    {
+        vuk::PipelineBaseCreateInfo pci;
+        get_shader_cache().add_shader(pci, "voxelization.vert");
+        get_shader_cache().add_shader(pci, "voxelization.frag");
         context->create_named_pipeline("voxelization", pci);
     }
 
     get_gpu_asset_cache().upload_defaults();
-
-    {
-        // OPTIMIZATION: can thread
-        for (auto scene: scenes) {
-            scene->setup(*global_allocator);
-        }
+    for (auto& entry : fs::recursive_directory_iterator(get_resource_folder().abs_path())) {
+        if (entry.path().extension().string() == pack_extension)
+            get_gpu_asset_cache().mount_pack(FilePath(entry.path()));
     }
 
+    get_worker_pool().parallel_for(scenes.size(), [this](uint32 i) {
+        scenes[i]->setup(*global_allocator);
+    });
+
     wait_for_futures();
     stage = RenderStage_Inactive;
 
@@ -232,25 +267,37 @@ void Renderer::render() {
     assert_else(stage == RenderStage_Inactive)
         return;
 
+    get_gpu_asset_cache().upload_streamed();
+    // Resolutions wanted by last frame's pre_render
+    get_gpu_asset_cache().update_texture_residency();
+    get_gpu_asset_cache().evict_cold_assets();
+    get_gpu_asset_cache().geometry_arena.flush_uploads();
     wait_for_futures();
+    get_gpu_asset_cache().maintain_geometry();
 
     stage = RenderStage_BuildingRG;
     
     std::shared_ptr<vuk::RenderGraph> rg = std::make_shared<vuk::RenderGraph>("renderer");
     std::vector resources{"SWAPCHAIN+"_image >> vuk::eColorWrite >> "SWAPCHAIN++"};
     for (auto scene : scenes) {
-        ZoneScoped;
         scene->pre_render();
-
         assert_else(!scene->name.empty());
+    }
+    wait_for_futures();
 
+    // Past pre_render, scenes only touch their own state and the frame allocator, so their graphs build in parallel
+    vector<vuk::Future> scene_futures(scenes.size());
+    get_worker_pool().parallel_for(scenes.size(), [this, &scene_futures](uint32 i) {
+        ZoneScoped;
+        RenderScene* scene = scenes[i];
         std::shared_ptr<vuk::RenderGraph> rgx = std::make_shared<vuk::RenderGraph>(vuk::Name(scene->name));
         rgx->attach_image("input_uncleared", vuk::ImageAttachment::from_texture(scene->render_target));
         rgx->clear_image("input_uncleared", vuk::Name(scene->name + "_input"), vuk::ClearColor{0.1f, 0.1f, 0.1f, 1.0f});
-        auto scene_fut     = scene->render(*frame_allocator, vuk::Future{rgx, vuk::Name(scene->name + "_input")});
-        rg->attach_in(vuk::Name(scene->name + "_final"), std::move(scene_fut));
-
-        resources.emplace_back(vuk::Resource {vuk::Name(scene->name + "_final"), vuk::Resource::Type::eImage, vuk::Access::eFragmentSampled});
+        scene_futures[i] = scene->render(*frame_allocator, vuk::Future{rgx, vuk::Name(scene->name + "_input")});
+    });
+    for (uint32 i = 0; i < scenes.size(); i++) {
+        rg->attach_in(vuk::Name(scenes[i]->name + "_final"), std::move(scene_futures[i]));
+        resources.emplace_back(vuk::Resource {vuk::Name(scenes[i]->name + "_final"), vuk::Resource::Type::eImage, vuk::Access::eFragmentSampled});
     }
 
     ImGui::Render();
@@ -285,6 +332,7 @@ void Renderer::render() {
 void Renderer::shutdown() {
     get_gpu_asset_cache().clear();
     context->wait_idle();
+    get_shader_cache().save_pipeline_cache(*context);
     assert_else(scenes.empty());
     get_gpu_asset_cache().clear();
     ImGui_ImplGlfw_Shutdown();
@@ -334,6 +382,62 @@ void Renderer::debug_window(bool* p_open) {
         ImGui::Text(fmt_("Window Size: {}", window_size).c_str());
 
         frame_timer.inspect();
+
+        if (ImGui::TreeNode("Vertex Memory")) {
+            VertexMemoryReport report = get_gpu_asset_cache().vertex_memory_report();
+            ImGui::Text(fmt_("Packed: {} meshes, {} vertices, {:.2f}MB", report.meshes[VertexEncoding_Packed], report.vertices[VertexEncoding_Packed], report.bsize[VertexEncoding_Packed] / (1024.0f * 1024.0f)).c_str());
+            ImGui::Text(fmt_("Full: {} meshes, {} vertices, {:.2f}MB", report.meshes[VertexEncoding_Full], report.vertices[VertexEncoding_Full], report.bsize[VertexEncoding_Full] / (1024.0f * 1024.0f)).c_str());
+            ImGui::Text(fmt_("Total {:.2f}MB, {:.2f}MB if unpacked", report.total_bsize() / (1024.0f * 1024.0f), report.full_bsize() / (1024.0f * 1024.0f)).c_str());
+            const GeometryArena& arena = get_gpu_asset_cache().geometry_arena;
+            ImGui::Text(fmt_("Arena vertices: {:.2f}MB of {:.2f}MB, largest hole {:.2f}MB", arena.vertices.used / (1024.0f * 1024.0f),
+                arena.vertices.capacity / (1024.0f * 1024.0f), arena.vertices.largest_free() / (1024.0f * 1024.0f)).c_str());
+            ImGui::Text(fmt_("Arena indices: {} of {}, largest hole {}", arena.indices.used, arena.indices.capacity, arena.indices.largest_free()).c_str());
+            ImGui::Text(fmt_("Fragmentation: {:.1f}%, {} ranges waiting on frames in flight", 100.0f * arena.fragmentation(), arena.pending_frees.size()).c_str());
+            if (ImGui::Button("Log Report"))
+                get_gpu_asset_cache().log_vertex_memory_report();
+            ImGui::SameLine();
+            if (ImGui::Button("Defragment") && arena.staged_copies.empty())
+                get_gpu_asset_cache().defragment_geometry();
+            ImGui::TreePop();
+        }
+
+        if (ImGui::TreeNode("Asset Memory")) {
+            GPUAssetCache&           gpu_asset_cache = get_gpu_asset_cache();
+            const AssetMemoryReport& report          = gpu_asset_cache.memory_report;
+            int32 budget_mb = int32(gpu_asset_cache.vram_budget_bsize / (1024 * 1024));
+            if (ImGui::DragInt("Budget (MB)", &budget_mb, 4.0f, 16, 16384))
+                gpu_asset_cache.vram_budget_bsize = uint64(budget_mb) * 1024 * 1024;
+            ImGui::DragScalar("Grace Frames", ImGuiDataType_U32, &gpu_asset_cache.eviction_grace_frames, 1.0f);
+            ImGui::Text(fmt_("Used: {:.2f}MB of {:.2f}MB", report.total_bsize() / (1024.0f * 1024.0f), gpu_asset_cache.vram_budget_bsize / (1024.0f * 1024.0f)).c_str());
+            ImGui::Text(fmt_("Meshes: {}, {:.2f}MB, {} evicted", report.meshes, report.mesh_bsize / (1024.0f * 1024.0f), report.evicted_meshes).c_str());
+            ImGui::Text(fmt_("Textures: {}, {:.2f}MB, {} evicted", report.textures, report.texture_bsize / (1024.0f * 1024.0f), report.evicted_textures).c_str());
+            ImGui::Text(fmt_("Materials: {}, {} evicted", report.materials, report.evicted_materials).c_str());
+            ImGui::TreePop();
+        }
+
+        if (ImGui::TreeNode("Texture Streaming")) {
+            GPUAssetCache&                gpu_asset_cache = get_gpu_asset_cache();
+            const TextureStreamingReport& report          = gpu_asset_cache.texture_streaming_report;
+            int32 budget_mb = int32(gpu_asset_cache.texture_budget_bsize / (1024 * 1024));
+            if (ImGui::DragInt("Budget (MB)", &budget_mb, 4.0f, 16, 8192))
+                gpu_asset_cache.texture_budget_bsize = uint64(budget_mb) * 1024 * 1024;
+            ImGui::DragScalar("Tail Resolution", ImGuiDataType_U32, &gpu_asset_cache.texture_tail_resolution, 1.0f);
+            ImGui::Text(fmt_("Resident: {:.2f}MB across {} streamed textures", report.resident_bsize / (1024.0f * 1024.0f), report.streamed).c_str());
+            ImGui::Text(fmt_("Wanting more detail: {}", report.refining).c_str());
+            ImGui::TreePop();
+        }
+
+        if (ImGui::TreeNode("Shaders")) {
+            const ShaderCacheStats& stats = get_shader_cache().stats;
+            ImGui::Text(fmt_("Startup: {:.2f}ms", stats.precompile_ms).c_str());
+            ImGui::Text(fmt_("From disk: {}, compiled: {}, failed: {}, reused: {}", stats.disk_hits, stats.compiled, stats.failed, stats.memory_hits).c_str());
+            if (ImGui::Button("Benchmark"))
+                get_shader_cache().benchmark();
+            ImGui::SameLine();
+            if (ImGui::Button("Save Pipeline Cache"))
+                get_shader_cache().save_pipeline_cache(*context);
+            ImGui::TreePop();
+        }
     }
     ImGui::End();
 }
@@ -32,6 +32,8 @@ namespace spellbook {
 #define NORMAL_BINDING 6
 #define EMISSIVE_BINDING 7
 #define SPARE_BINDING_1 8
+#define INSTANCE_BINDING 10
+#define DEQUANT_BINDING 11
 #define PARTICLES_BINDING MODEL_BINDING
 
 struct RenderScene;
@@ -0,0 +1,276 @@
+#include "shader_cache.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <shaderc/shaderc.hpp>
+#include <vuk/Context.hpp>
+#include <tracy/Tracy.hpp>
+
+#include "extension/fmt.hpp"
+#include "general/logger.hpp"
+#include "general/hash.hpp"
+
+#include "renderer/renderer.hpp"
+#include "renderer/worker_pool.hpp"
+
+namespace spellbook {
+
+static string read_text(const fs::path& path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open())
+        return {};
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    return buffer.str();
+}
+
+// Quoted includes only, resolved against the including file like shaderc does
+static void append_with_includes(const fs::path& path, string& out, vector<fs::path>& visited) {
+    fs::path normal = path.lexically_normal();
+    for (const fs::path& seen : visited) {
+        if (seen == normal)
+            return;
+    }
+    visited.push_back(normal);
+
+    string source = read_text(normal);
+    out += normal.filename().string();
+    out += source;
+
+    std::istringstream lines(source);
+    string line;
+    while (std::getline(lines, line)) {
+        uint64 start = line.find_first_not_of(" \t");
+        if (start == string::npos || line.compare(start, 8, "#include") != 0)
+            continue;
+        uint64 open  = line.find('"', start);
+        uint64 close = open == string::npos ? string::npos : line.find('"', open + 1);
+        if (close == string::npos)
+            continue;
+        append_with_includes(normal.parent_path() / line.substr(open + 1, close - open - 1), out, visited);
+    }
+}
+
+struct ShaderIncluder : shaderc::CompileOptions::IncluderInterface {
+    struct Include {
+        string name;
+        string content;
+        shaderc_include_result result;
+    };
+
+    shaderc_include_result* GetInclude(const char* requested_source, shaderc_include_type type, const char* requesting_source, size_t include_depth) override {
+        Include* include = new Include();
+        fs::path path    = (fs::path(requesting_source).parent_path() / requested_source).lexically_normal();
+        include->name    = path.string();
+        include->content = read_text(path);
+        if (include->content.empty())
+            include->name.clear(); // shaderc reports an empty name as a failed include
+        include->result = {include->name.c_str(), include->name.size(), include->content.c_str(), include->content.size(), include};
+        return &include->result;
+    }
+
+    void ReleaseInclude(shaderc_include_result* data) override {
+        delete (Include*) data->user_data;
+    }
+};
+
+static std::vector<uint32> compile_glsl(const FilePath& shader) {
+    ZoneScoped;
+    string source = read_text(shader.abs_path());
+    if (source.empty()) {
+        log_error(fmt_("Missing shader \"{}\"", shader.abs_string()), "renderer.shader");
+        return {};
+    }
+
+    shaderc::Compiler       compiler;
+    shaderc::CompileOptions options;
+    options.SetIncluder(std::make_unique<ShaderIncluder>());
+    options.SetTargetEnvironment(shaderc_target_env_vulkan, shaderc_env_version_vulkan_1_2);
+    shaderc::SpvCompilationResult result = compiler.CompileGlslToSpv(source, shaderc_glsl_infer_from_source, shader.abs_string().c_str(), options);
+    if (result.GetCompilationStatus() != shaderc_compilation_status_success) {
+        log_error(fmt_("Shader \"{}\" failed to compile:\n{}", shader.rel_string(), result.GetErrorMessage()), "renderer.shader");
+        return {};
+    }
+    return std::vector<uint32>(result.cbegin(), result.cend());
+}
+
+// Stages without the pragma, like the imgui shaders, are loaded prebuilt and never go through shaderc
+static bool is_shader_stage(const FilePath& path) {
+    string extension = path.extension();
+    if (extension != ".vert" && extension != ".frag" && extension != ".comp" && extension != ".geom")
+        return false;
+    return read_text(path.abs_path()).find("#pragma shader_stage") != string::npos;
+}
+
+// SPIR-V starts with its magic number, anything shorter or misaligned was cut off while being written
+static bool is_valid_spirv(const std::vector<uint32>& code) {
+    return !code.empty() && code[0] == 0x07230203;
+}
+
+static FilePath spirv_path(uint64 hash) {
+    return ShaderCache::folder() + fmt_("{:016x}.spv", hash);
+}
+
+FilePath ShaderCache::folder() {
+    return FilePath("shader_cache/");
+}
+
+uint64 ShaderCache::source_hash(const FilePath& shader) {
+    string           resolved = fmt_("v{}", version);
+    vector<fs::path> visited;
+    append_with_includes(shader.abs_path(), resolved, visited);
+    return hash_view(resolved);
+}
+
+std::vector<uint32> ShaderCache::get_spirv(const FilePath& shader) {
+    ZoneScoped;
+    uint64 hash = source_hash(shader);
+    {
+        std::scoped_lock _(mutex);
+        if (spirv.contains(hash)) {
+            stats.memory_hits++;
+            return spirv[hash];
+        }
+    }
+
+    std::vector<uint32> code;
+    FilePath cached = spirv_path(hash);
+    std::ifstream in(cached.abs_path(), std::ios::binary | std::ios::ate);
+    if (in.is_open() && in.tellg() > 0 && uint64(in.tellg()) % sizeof(uint32) == 0) {
+        code.resize(uint64(in.tellg()) / sizeof(uint32));
+        in.seekg(0);
+        in.read((char*) code.data(), code.size() * sizeof(uint32));
+        if (!in || !is_valid_spirv(code))
+            code.clear();
+    }
+    in.close();
+    if (!code.empty()) {
+        std::scoped_lock _(mutex);
+        stats.disk_hits++;
+    } else {
+        code = compile_glsl(shader);
+        std::scoped_lock _(mutex);
+        if (code.empty()) {
+            // Not cached, so the next call retries after the source is fixed
+            stats.failed++;
+            return code;
+        }
+        stats.compiled++;
+        // Written next to it and renamed over it, so a crash mid-write can't leave a truncated file behind
+        fs::create_directories(folder().abs_path());
+        fs::path temp = cached.abs_path();
+        temp += fmt_(".{:x}.tmp", std::hash<std::thread::id>()(std::this_thread::get_id()));
+        {
+            std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+            out.write((const char*) code.data(), code.size() * sizeof(uint32));
+        }
+        std::error_code error;
+        fs::rename(temp, cached.abs_path(), error);
+        if (error) {
+            log_error(fmt_("Couldn't cache SPIR-V for \"{}\": {}", shader.rel_string(), error.message()), "renderer.shader");
+            fs::remove(temp, error);
+        }
+    }
+
+    std::scoped_lock _(mutex);
+    spirv[hash] = code;
+    return code;
+}
+
+bool ShaderCache::add_shader(vuk::PipelineBaseCreateInfo& pci, string_view file) {
+    FilePath            path = shader_path(file);
+    std::vector<uint32> code = get_spirv(path);
+    assert_else(!code.empty()) {
+        log_error(fmt_("Pipeline stage \"{}\" has no SPIR-V, it wasn't added", path.rel_string()), "renderer.shader");
+        return false;
+    }
+    pci.add_spirv(std::move(code), path.abs_string());
+    return true;
+}
+
+vector<FilePath> ShaderCache::stage_shaders() {
+    vector<FilePath> shaders;
+    for (auto& entry : fs::recursive_directory_iterator(shader_path("").abs_path())) {
+        FilePath path = FilePath(entry.path());
+        if (is_shader_stage(path))
+            shaders.push_back(path);
+    }
+    return shaders;
+}
+
+void ShaderCache::precompile() {
+    ZoneScoped;
+    using clock = std::chrono::high_resolution_clock;
+    clock::time_point start = clock::now();
+
+    vector<FilePath> shaders = stage_shaders();
+    get_worker_pool().parallel_for(shaders.size(), [this, &shaders](uint32 i) {
+        get_spirv(shaders[i]);
+    });
+
+    stats.precompile_ms = std::chrono::duration<float, std::milli>(clock::now() - start).count();
+    log(BasicMessage{
+        .str = fmt_("Shaders ready in {:.2f}ms: {} from disk, {} compiled, {} failed",
+            stats.precompile_ms, stats.disk_hits, stats.compiled, stats.failed),
+        .group = "renderer.shader"
+    });
+}
+
+void ShaderCache::load_pipeline_cache(vuk::Context& context) {
+    FilePath path = folder() + "pipeline_cache.bin";
+    std::ifstream in(path.abs_path(), std::ios::binary | std::ios::ate);
+    if (!in.is_open() || in.tellg() <= 0)
+        return;
+    std::vector<std::byte> data(uint64(in.tellg()));
+    in.seekg(0);
+    in.read((char*) data.data(), data.size());
+    // The driver checks the header and ignores caches from another device or driver version
+    context.load_pipeline_cache(data);
+}
+
+void ShaderCache::save_pipeline_cache(vuk::Context& context) {
+    std::vector<std::byte> data = context.save_pipeline_cache();
+    if (data.empty())
+        return;
+    fs::create_directories(folder().abs_path());
+    std::ofstream out((folder() + "pipeline_cache.bin").abs_path(), std::ios::binary | std::ios::trunc);
+    out.write((const char*) data.data(), data.size());
+}
+
+void ShaderCache::benchmark() {
+    using clock = std::chrono::high_resolution_clock;
+    auto ms_since = [](clock::time_point start) { return std::chrono::duration<float, std::milli>(clock::now() - start).count(); };
+
+    vector<FilePath> shaders = stage_shaders();
+
+    // Cold is what a first launch pays, warm is a launch with nothing changed
+    std::atomic<uint64> words = 0;
+    clock::time_point cold_start = clock::now();
+    get_worker_pool().parallel_for(shaders.size(), [&shaders, &words](uint32 i) {
+        words += compile_glsl(shaders[i]).size();
+    });
+    float cold_ms = ms_since(cold_start);
+
+    {
+        std::scoped_lock _(mutex);
+        spirv.clear();
+    }
+    ShaderCacheStats kept = stats;
+    clock::time_point warm_start = clock::now();
+    get_worker_pool().parallel_for(shaders.size(), [this, &shaders, &words](uint32 i) {
+        words += get_spirv(shaders[i]).size();
+    });
+    float warm_ms = ms_since(warm_start);
+    stats = kept;
+
+    log(BasicMessage{
+        .str = fmt_("Shader cache benchmark: {} shaders over {} threads, cold {:.2f}ms, warm {:.2f}ms, {} words",
+            shaders.size(), get_worker_pool().thread_count() + 1, cold_ms, warm_ms, words.load()),
+        .group = "renderer.shader"
+    });
+}
+
+}
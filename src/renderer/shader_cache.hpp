@@ -0,0 +1,57 @@
+#pragma once
+
+#include <mutex>
+#include <vuk/vuk_fwd.hpp>
+
+#include "general/string.hpp"
+#include "general/umap.hpp"
+#include "general/vector.hpp"
+#include "general/file/file_path.hpp"
+
+namespace spellbook {
+
+struct ShaderCacheStats {
+    uint32 memory_hits = 0;
+    uint32 disk_hits   = 0;
+    uint32 compiled    = 0;
+    uint32 failed      = 0;
+    float  precompile_ms = 0.0f;
+};
+
+// SPIR-V for the GLSL in the shader folder, kept on disk under the hash of the source and everything it includes, so a
+// launch only runs shaderc on shaders that changed. The VkPipelineCache is persisted next to it.
+struct ShaderCache {
+    // Bump when compile options change so stale SPIR-V isn't picked up
+    constexpr static uint32 version = 1;
+
+    umap<uint64, std::vector<uint32>> spirv; // By source hash
+    std::mutex                        mutex;
+    ShaderCacheStats                  stats;
+
+    static FilePath folder();
+
+    // Source with every #include resolved, hashed, so an edit to include.glsli invalidates its users
+    uint64 source_hash(const FilePath& shader);
+    // From memory, then disk, then shaderc. Empty if it doesn't compile. Thread safe.
+    std::vector<uint32> get_spirv(const FilePath& shader);
+    // Logs and leaves pci alone if the shader doesn't compile
+    bool add_shader(vuk::PipelineBaseCreateInfo& pci, string_view file);
+    // Every file in the shader folder with a #pragma shader_stage, the ones compiled through the cache
+    vector<FilePath> stage_shaders();
+
+    // Fills the cache for every shader in the shader folder across the worker pool
+    void precompile();
+
+    void load_pipeline_cache(vuk::Context& context);
+    void save_pipeline_cache(vuk::Context& context);
+
+    // Times the shader folder compiled from source against loaded from the disk cache, and logs both
+    void benchmark();
+};
+
+inline ShaderCache& get_shader_cache() {
+    static ShaderCache shader_cache;
+    return shader_cache;
+}
+
+}
@@ -0,0 +1,117 @@
+#include "shadows.hpp"
+
+#include <cmath>
+#include <tracy/Tracy.hpp>
+
+#include "general/math/math.hpp"
+
+#include "renderer/camera.hpp"
+#include "renderer/aabb_tree.hpp"
+
+namespace spellbook {
+
+bool CascadedShadows::fit(const Camera& camera, const v3& new_sun_vec) {
+    ZoneScoped;
+    cascade_count = math::max(1u, math::min(cascade_count, max_shadow_cascades));
+    bool sun_turned = math::length(new_sun_vec - sun_vec) > 0.0001f;
+    if (sun_turned)
+        invalidate_all();
+    sun_vec = new_sun_vec;
+
+    // Light space, direction points away from the sun
+    v3 direction = -sun_vec;
+    v3 up_hint   = math::abs(direction.z) > 0.99f ? v3::X : v3::Z;
+    v3 right     = math::normalize(math::cross(up_hint, direction));
+    v3 up        = math::cross(direction, right);
+
+    v3    forward  = math::euler2vector(camera.heading);
+    float tan_y    = std::tan(camera.fov * 0.5f);
+    float tan_x    = tan_y * camera.aspect_xy;
+    // Squared distance off the view axis of a slice's corners, per unit along it
+    float corner_k = tan_x * tan_x + tan_y * tan_y;
+
+    float near_distance = camera.clip_plane;
+    float far_distance  = math::max(distance, near_distance + 0.01f);
+    float previous      = near_distance;
+    for (uint32 i = 0; i < cascade_count; i++) {
+        ShadowCascade& cascade = cascades[i];
+        float fraction    = float(i + 1) / float(cascade_count);
+        float even        = near_distance + (far_distance - near_distance) * fraction;
+        float logarithmic = near_distance * std::pow(far_distance / near_distance, fraction);
+        float split       = even + (logarithmic - even) * split_blend;
+
+        // Smallest sphere around the slice's corners is centered on the view axis, past the far plane it's the far
+        // plane's circle
+        float center_t = math::min(0.5f * (previous + split) * (1.0f + corner_k), split);
+        float radius   = std::sqrt((split - center_t) * (split - center_t) + corner_k * split * split);
+        previous = split;
+
+        float texel  = 2.0f * radius / float(resolution);
+        v3    center = camera.position + forward * center_t;
+        float x      = std::floor(math::dot(center, right) / texel) * texel;
+        float y      = std::floor(math::dot(center, up) / texel) * texel;
+        float z      = std::floor(math::dot(center, direction) / texel) * texel;
+
+        bool moved = x != cascade.snapped.x || y != cascade.snapped.y || z != cascade.snapped.z || radius != cascade.radius;
+        if (moved || !caching)
+            cascade.cached = false;
+        cascade.snapped = v3(x, y, z);
+        cascade.center  = right * x + up * y + direction * z;
+        cascade.radius  = radius;
+        cascade.split   = split;
+
+        // Sun side of the box is pushed back by caster_depth, reversed so that side is depth 1
+        float s_near = z - radius - caster_depth;
+        float s_far  = z + radius;
+        float range  = s_far - s_near;
+        cascade.depth_bias = bias_texels * texel / range;
+
+        float* m = (float*) &cascade.vp;
+        v4 rows[4] = {
+            v4(right / radius, -x / radius),
+            v4(up / radius, -y / radius),
+            v4(-direction / range, s_far / range),
+            v4(0.0f, 0.0f, 0.0f, 1.0f)
+        };
+        // m44GPU is column-major
+        for (int row = 0; row < 4; row++) {
+            for (int column = 0; column < 4; column++)
+                m[column * 4 + row] = rows[row][column];
+        }
+
+        cascade.casters.plane_count = 6;
+        cascade.casters.planes[0] = v4(right, radius - x);
+        cascade.casters.planes[1] = v4(-right, radius + x);
+        cascade.casters.planes[2] = v4(up, radius - y);
+        cascade.casters.planes[3] = v4(-up, radius + y);
+        cascade.casters.planes[4] = v4(direction, -s_near);
+        cascade.casters.planes[5] = v4(-direction, s_far);
+    }
+    return sun_turned;
+}
+
+uint32 CascadedShadows::schedule() {
+    rendered = 0;
+    for (uint32 i = 0; i < max_shadow_cascades; i++) {
+        ShadowCascade& cascade = cascades[i];
+        cascade.render = i < cascade_count && !cascade.cached;
+        cascade.cached = i < cascade_count;
+        if (cascade.render)
+            rendered++;
+    }
+    return rendered;
+}
+
+void CascadedShadows::invalidate(const BVHBounds& bounds) {
+    for (uint32 i = 0; i < cascade_count; i++) {
+        if (cascades[i].cached && frustum_overlaps(cascades[i].casters, bounds))
+            cascades[i].cached = false;
+    }
+}
+
+void CascadedShadows::invalidate_all() {
+    for (ShadowCascade& cascade : cascades)
+        cascade.cached = false;
+}
+
+}
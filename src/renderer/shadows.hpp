@@ -0,0 +1,59 @@
+#pragma once
+
+#include "general/math/geometry.hpp"
+#include "general/math/matrix.hpp"
+
+#include "renderer/bvh.hpp"
+#include "renderer/culling.hpp"
+
+namespace spellbook {
+
+struct Camera;
+
+constexpr uint32 max_shadow_cascades = 4;
+
+// One slice of the camera's view, shadowed from a tile of the atlas. The tile is a square around the slice's bounding
+// sphere so its size doesn't change as the camera turns, and its center is snapped to whole texels so shadow edges
+// don't swim as the camera moves. That also means a still camera leaves every cascade exactly where it was.
+struct ShadowCascade {
+    m44GPU  vp;
+    Frustum casters;            // The tile's box, stretched toward the sun to catch casters outside the view
+    v3      center;
+    v3      snapped;            // Center in light space, whole texels
+    float   radius     = 0.0f;
+    float   split      = 0.0f;  // Camera distance the slice ends at
+    float   depth_bias = 0.0f;  // In the tile's depth units
+    bool    cached     = false; // The tile still holds this box's casters
+    bool    render     = false; // Rendered this frame
+};
+
+// Cascades sit in a 2x2 atlas of resolution sized tiles, cascade i in column i % 2 and row i / 2. Depth is reversed,
+// 1 is toward the sun. Cached cascades are only rendered again when they move, when the sun turns or when a caster
+// inside them changes.
+struct CascadedShadows {
+    uint32 cascade_count = 4;
+    uint32 resolution    = 2048;
+    float  distance      = 40.0f;
+    float  split_blend   = 0.75f; // 0 splits distance evenly, 1 logarithmically
+    float  caster_depth  = 30.0f;
+    float  bias_texels   = 1.5f;
+    bool   caching       = true;
+
+    ShadowCascade cascades[max_shadow_cascades];
+    v3            sun_vec;
+    uint32        rendered = 0; // Cascades rendered this frame
+    CullStats     stats;        // Summed over the cascades rendered this frame
+
+    // Moves the cascades over the camera's view, the ones that moved or turned with the sun lose their cache. Returns
+    // whether the sun turned.
+    bool   fit(const Camera& camera, const v3& new_sun_vec);
+    // Picks the cascades to render this frame, after every change to casters this frame, returns how many
+    uint32 schedule();
+    // Casters inside bounds were added, moved or removed
+    void   invalidate(const BVHBounds& bounds);
+    void   invalidate_all();
+    v2i    tile_offset(uint32 cascade) const { return v2i(int32(cascade % 2 * resolution), int32(cascade / 2 * resolution)); }
+    uint32 atlas_size() const { return resolution * 2; }
+};
+
+}
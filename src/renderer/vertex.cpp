@@ -1,8 +1,21 @@
 ﻿#include "vertex.hpp"
 
+#include <bit>
+
+#include "general/math/math.hpp"
 
 namespace spellbook {
-vuk::Packed Vertex::get_format() {
+
+vuk::Packed Vertex::get_format(VertexEncoding encoding) {
+    if (encoding == VertexEncoding_Packed) {
+        return vuk::Packed {
+            vuk::Format::eR16G16B16A16Unorm, // position, tangent sign
+            vuk::Format::eR16G16Snorm,       // normal
+            vuk::Format::eR16G16Snorm,       // tangent
+            vuk::Format::eR8G8B8A8Unorm,     // color
+            vuk::Format::eR16G16Sfloat       // uv
+        };
+    }
     return vuk::Packed {
         vuk::Format::eR32G32B32Sfloat, // position
         vuk::Format::eR32G32B32Sfloat, // normal
@@ -21,4 +34,105 @@ vuk::Packed Vertex::get_widget_format() {
     };
 }
 
+uint16 float_to_half(float value) {
+    uint32 bits     = std::bit_cast<uint32>(value);
+    uint32 sign     = (bits >> 16) & 0x8000;
+    int32  exponent = int32((bits >> 23) & 0xff) - 127 + 15;
+    uint32 mantissa = bits & 0x7fffff;
+
+    if (exponent >= 31) // Overflow and inf/nan
+        return sign | 0x7c00 | (((bits & 0x7fffffff) > 0x7f800000) ? 0x200 : 0);
+    if (exponent <= 0) {
+        if (exponent < -10)
+            return sign;
+        // Denormal, the implicit leading one becomes explicit
+        mantissa |= 0x800000;
+        uint32 shift = 14 - exponent;
+        return sign | ((mantissa + (1u << (shift - 1))) >> shift);
+    }
+    // Round to nearest, a carry out of the mantissa correctly bumps the exponent
+    return sign | ((uint32(exponent) << 10) + ((mantissa + 0x1000) >> 13));
+}
+
+float half_to_float(uint16 value) {
+    uint32 sign     = uint32(value & 0x8000) << 16;
+    uint32 exponent = (value >> 10) & 0x1f;
+    uint32 mantissa = value & 0x3ff;
+
+    if (exponent == 0) {
+        float denormal = float(mantissa) / float(1 << 24);
+        return sign ? -denormal : denormal;
+    }
+    if (exponent == 31)
+        return std::bit_cast<float>(sign | 0x7f800000 | (mantissa << 13));
+    return std::bit_cast<float>(sign | ((exponent + 127 - 15) << 23) | (mantissa << 13));
+}
+
+static uint16 to_unorm16(float value) {
+    return uint16(math::clamp(value, 0.0f, 1.0f) * 65535.0f + 0.5f);
+}
+
+static int16 to_snorm16(float value) {
+    float scaled = math::clamp(value, -1.0f, 1.0f) * 32767.0f;
+    return int16(scaled >= 0.0f ? scaled + 0.5f : scaled - 0.5f);
+}
+
+// Folds the unit sphere onto the [-1, 1] square, the lower hemisphere is mirrored over the diagonals
+static v2 oct_encode(v3 n) {
+    float l1 = math::abs(n.x) + math::abs(n.y) + math::abs(n.z);
+    if (l1 < 0.000001f)
+        return v2(0.0f, 0.0f);
+    v2 p = v2(n.x, n.y) / l1;
+    if (n.z < 0.0f) {
+        p = v2(
+            (1.0f - math::abs(p.y)) * (p.x >= 0.0f ? 1.0f : -1.0f),
+            (1.0f - math::abs(p.x)) * (p.y >= 0.0f ? 1.0f : -1.0f)
+        );
+    }
+    return p;
+}
+
+static v3 oct_decode(v2 p) {
+    v3 n = v3(p.x, p.y, 1.0f - math::abs(p.x) - math::abs(p.y));
+    float t = math::max(-n.z, 0.0f);
+    n.x += n.x >= 0.0f ? -t : t;
+    n.y += n.y >= 0.0f ? -t : t;
+    return math::normalize(n);
+}
+
+PackedVertex pack_vertex(const Vertex& vertex, const VertexQuantization& quantization) {
+    PackedVertex packed;
+    for (int axis = 0; axis < 3; axis++) {
+        float size = quantization.size[axis];
+        packed.position[axis] = to_unorm16(size > 0.0f ? (vertex.position[axis] - quantization.low[axis]) / size : 0.0f);
+    }
+    // Vertex doesn't carry handedness, the bitangent is always cross(n, t)
+    packed.position[3] = 65535;
+
+    v2 normal  = oct_encode(vertex.normal);
+    v2 tangent = oct_encode(vertex.tangent);
+    packed.normal[0]  = to_snorm16(normal.x);
+    packed.normal[1]  = to_snorm16(normal.y);
+    packed.tangent[0] = to_snorm16(tangent.x);
+    packed.tangent[1] = to_snorm16(tangent.y);
+    for (int channel = 0; channel < 3; channel++)
+        packed.color[channel] = uint8(math::clamp(vertex.color[channel], 0.0f, 1.0f) * 255.0f + 0.5f);
+    packed.color[3] = 255;
+    packed.uv[0] = float_to_half(vertex.uv.x);
+    packed.uv[1] = float_to_half(vertex.uv.y);
+    return packed;
+}
+
+Vertex unpack_vertex(const PackedVertex& packed, const VertexQuantization& quantization) {
+    Vertex vertex;
+    for (int axis = 0; axis < 3; axis++)
+        vertex.position[axis] = quantization.low[axis] + float(packed.position[axis]) / 65535.0f * quantization.size[axis];
+    vertex.normal  = oct_decode(v2(math::max(packed.normal[0] / 32767.0f, -1.0f), math::max(packed.normal[1] / 32767.0f, -1.0f)));
+    vertex.tangent = oct_decode(v2(math::max(packed.tangent[0] / 32767.0f, -1.0f), math::max(packed.tangent[1] / 32767.0f, -1.0f)));
+    for (int channel = 0; channel < 3; channel++)
+        vertex.color[channel] = packed.color[channel] / 255.0f;
+    vertex.uv = v2(half_to_float(packed.uv[0]), half_to_float(packed.uv[1]));
+    return vertex;
+}
+
 }
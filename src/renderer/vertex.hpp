@@ -6,6 +6,12 @@
 
 namespace spellbook {
 
+// How a mesh's vertices are laid out on the GPU, picked per mesh when it's baked
+enum VertexEncoding : uint32 {
+    VertexEncoding_Full,  // Vertex as is
+    VertexEncoding_Packed // PackedVertex, positions relative to the mesh bounds
+};
+
 struct Vertex {
 	v3 position;
 	v3 normal = {};
@@ -13,8 +19,36 @@ struct Vertex {
 	v3 color = {};
 	v2 uv = {};
 
-    static vuk::Packed get_format();
+    static vuk::Packed get_format(VertexEncoding encoding = VertexEncoding_Full);
     static vuk::Packed get_widget_format();
 };
 
+// 24 bytes instead of 56. Attributes keep the locations of Vertex so the same shaders read both, the per-instance
+// dequantization tells them which one they got.
+struct PackedVertex {
+    uint16 position[4]; // unorm over the bounding box, w is the tangent sign
+    int16  normal[2];   // octahedral snorm
+    int16  tangent[2];  // octahedral snorm
+    uint8  color[4];
+    uint16 uv[2];       // half floats
+};
+static_assert(sizeof(PackedVertex) == 24);
+
+// Maps a mesh's vertices into the unit box for quantization, position = low + unorm * size
+struct VertexQuantization {
+    v3 low  = v3(0.0f);
+    v3 size = v3(1.0f);
+};
+
+// Per instance, matches VertexDequant in include.glsli. low.w is 1 for packed vertices, full ones use the identity.
+struct GPUVertexDequant {
+    v4 low  = v4(0.0f, 0.0f, 0.0f, 0.0f);
+    v4 size = v4(1.0f, 1.0f, 1.0f, 0.0f);
+};
+
+uint16       float_to_half(float value);
+float        half_to_float(uint16 value);
+PackedVertex pack_vertex(const Vertex& vertex, const VertexQuantization& quantization);
+Vertex       unpack_vertex(const PackedVertex& vertex, const VertexQuantization& quantization);
+
 }
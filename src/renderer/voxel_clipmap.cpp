@@ -0,0 +1,211 @@
+#include "voxel_clipmap.hpp"
+
+#include <cmath>
+#include <tracy/Tracy.hpp>
+
+#include "general/math/math.hpp"
+
+namespace spellbook {
+
+static int32 floor_to_step(int32 value, int32 step) {
+    return int32(std::floor(float(value) / float(step))) * step;
+}
+
+static uint64 union_volume(const VoxelRegion& lhs, const VoxelRegion& rhs) {
+    VoxelRegion merged = lhs;
+    for (int axis = 0; axis < 3; axis++) {
+        merged.low[axis]  = math::min(lhs.low[axis], rhs.low[axis]);
+        merged.high[axis] = math::max(lhs.high[axis], rhs.high[axis]);
+    }
+    return merged.volume();
+}
+
+VoxelRegion VoxelClipmap::level_region(uint32 level) const {
+    int32 size = int32(resolution);
+    return {level, origins[level], v3i(origins[level].x + size, origins[level].y + size, origins[level].z + size)};
+}
+
+VoxelRegion VoxelClipmap::clip(VoxelRegion region) const {
+    VoxelRegion bounds = level_region(region.level);
+    for (int axis = 0; axis < 3; axis++) {
+        region.low[axis]  = math::max(region.low[axis], bounds.low[axis]);
+        region.high[axis] = math::min(region.high[axis], bounds.high[axis]);
+    }
+    return region;
+}
+
+void VoxelClipmap::update(const v3& position) {
+    ZoneScoped;
+    level_count = math::max(1u, math::min(level_count, max_voxel_levels));
+    if (!caching)
+        invalidate_all();
+
+    int32 size = int32(resolution);
+    for (uint32 level = 0; level < level_count; level++) {
+        float voxel = level_voxel_size(level);
+        v3i   origin;
+        for (int axis = 0; axis < 3; axis++)
+            origin[axis] = floor_to_step(int32(std::floor(position[axis] / voxel)) - size / 2, scroll_step);
+
+        v3i old = origins[level];
+        origins[level] = origin;
+        if (!placed[level])
+            continue;
+
+        // Each axis queues the voxels it scrolled over, across what's left of the level after the axes before it
+        VoxelRegion remaining = level_region(level);
+        for (int axis = 0; axis < 3; axis++) {
+            int32 delta = origin[axis] - old[axis];
+            if (delta == 0)
+                continue;
+            if (math::abs(delta) >= size) {
+                placed[level] = false;
+                break;
+            }
+            VoxelRegion slab = remaining;
+            if (delta > 0) {
+                slab.low[axis]       = old[axis] + size;
+                remaining.high[axis] = old[axis] + size;
+            } else {
+                slab.high[axis]     = old[axis];
+                remaining.low[axis] = old[axis];
+            }
+            add_region(slab);
+        }
+    }
+}
+
+void VoxelClipmap::schedule() {
+    ZoneScoped;
+    // Levels that were never voxelized, or lost everything, go first as a whole
+    for (uint32 level = 0; level < level_count; level++) {
+        if (placed[level])
+            continue;
+        std::erase_if(pending, [level](const VoxelRegion& region) { return region.level == level; });
+        pending.insert(pending.begin(), level_region(level));
+        placed[level] = true;
+    }
+
+    regions.clear();
+    revoxelized = 0;
+    uint32 taken = 0;
+    while (taken < pending.size() && regions.size() < max_regions_per_frame) {
+        VoxelRegion region = pending[taken++];
+        if (region.level >= level_count)
+            continue;
+        // Pending boxes may have scrolled partly or fully out of their level since they were queued
+        region = clip(region);
+        if (region.empty())
+            continue;
+        regions.push_back(region);
+        revoxelized += region.volume();
+    }
+    pending.erase(pending.begin(), pending.begin() + taken);
+}
+
+void VoxelClipmap::invalidate(const BVHBounds& bounds) {
+    if (bounds.low.x > bounds.high.x)
+        return;
+    for (uint32 level = 0; level < level_count; level++) {
+        if (!placed[level])
+            continue;
+        // Padded by a voxel, fragments are written to the voxel their center falls in
+        float       voxel  = level_voxel_size(level);
+        VoxelRegion limits = level_region(level);
+        VoxelRegion region = {.level = level};
+        for (int axis = 0; axis < 3; axis++) {
+            float low  = math::max(std::floor(bounds.low[axis] / voxel) - 1.0f, float(limits.low[axis]));
+            float high = math::min(std::floor(bounds.high[axis] / voxel) + 2.0f, float(limits.high[axis]));
+            region.low[axis]  = int32(low);
+            region.high[axis] = int32(math::max(low, high));
+        }
+        add_region(region);
+    }
+}
+
+void VoxelClipmap::invalidate_all() {
+    for (bool& level_placed : placed)
+        level_placed = false;
+}
+
+void VoxelClipmap::add_region(const VoxelRegion& added) {
+    VoxelRegion region = clip(added);
+    if (region.empty())
+        return;
+
+    VoxelRegion* merge_into  = nullptr;
+    uint64       least_added = UINT64_MAX;
+    for (VoxelRegion& queued : pending) {
+        if (queued.level != region.level)
+            continue;
+        uint64 grown = union_volume(queued, region) - queued.volume();
+        if (grown == 0)
+            return;
+        if (grown < least_added) {
+            least_added = grown;
+            merge_into  = &queued;
+        }
+    }
+    if (pending.size() < max_pending || merge_into == nullptr) {
+        pending.push_back(region);
+        return;
+    }
+    for (int axis = 0; axis < 3; axis++) {
+        merge_into->low[axis]  = math::min(merge_into->low[axis], region.low[axis]);
+        merge_into->high[axis] = math::max(merge_into->high[axis], region.high[axis]);
+    }
+}
+
+GPUVoxelClipmap VoxelClipmap::gpu_data() const {
+    GPUVoxelClipmap data = {};
+    for (uint32 level = 0; level < level_count; level++) {
+        float voxel = level_voxel_size(level);
+        data.levels[level] = v4(origins[level].x * voxel, origins[level].y * voxel, origins[level].z * voxel, voxel);
+    }
+    data.level_count = level_count;
+    data.resolution  = resolution;
+    return data;
+}
+
+Frustum VoxelClipmap::region_frustum(const VoxelRegion& region) const {
+    float   voxel = level_voxel_size(region.level);
+    Frustum frustum;
+    frustum.plane_count = 6;
+    for (int axis = 0; axis < 3; axis++) {
+        v4 normal = v4(0.0f);
+        normal[axis] = 1.0f;
+        frustum.planes[axis * 2]     = v4(normal.x, normal.y, normal.z, -region.low[axis] * voxel);
+        frustum.planes[axis * 2 + 1] = v4(-normal.x, -normal.y, -normal.z, region.high[axis] * voxel);
+    }
+    return frustum;
+}
+
+m44GPU VoxelClipmap::axis_vp(uint32 level, uint32 axis) const {
+    float voxel  = level_voxel_size(level);
+    float extent = voxel * resolution;
+    float half   = extent * 0.5f;
+    v3    low    = v3(origins[level].x * voxel, origins[level].y * voxel, origins[level].z * voxel);
+    v3    center = low + v3(half);
+
+    // The other two axes span the viewport and axis is depth, fragments find their voxel from their world position
+    uint32 u = (axis + 1) % 3;
+    uint32 v = (axis + 2) % 3;
+    v4 rows[4] = {v4(0.0f), v4(0.0f), v4(0.0f), v4(0.0f, 0.0f, 0.0f, 1.0f)};
+    rows[0][u]    = 1.0f / half;
+    rows[0][3]    = -center[u] / half;
+    rows[1][v]    = 1.0f / half;
+    rows[1][3]    = -center[v] / half;
+    rows[2][axis] = 1.0f / extent;
+    rows[2][3]    = -low[axis] / extent;
+
+    m44GPU vp;
+    float* m = (float*) &vp;
+    // m44GPU is column-major
+    for (int row = 0; row < 4; row++) {
+        for (int column = 0; column < 4; column++)
+            m[column * 4 + row] = rows[row][column];
+    }
+    return vp;
+}
+
+}
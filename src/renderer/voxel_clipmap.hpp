@@ -0,0 +1,76 @@
+#pragma once
+
+#include "general/vector.hpp"
+#include "general/math/geometry.hpp"
+#include "general/math/matrix.hpp"
+
+#include "renderer/bvh.hpp"
+#include "renderer/culling.hpp"
+
+namespace spellbook {
+
+constexpr uint32 max_voxel_levels = 4;
+
+// A box of one level's voxels, counted in whole voxels from the world origin so it doesn't move as the level scrolls
+struct VoxelRegion {
+    uint32 level = 0;
+    v3i    low;
+    v3i    high; // Exclusive
+
+    bool   empty() const { return high.x <= low.x || high.y <= low.y || high.z <= low.z; }
+    uint64 volume() const { return empty() ? 0 : uint64(high.x - low.x) * uint64(high.y - low.y) * uint64(high.z - low.z); }
+};
+
+// Matches VoxelClipmap in voxel_clipmap.glsli
+struct GPUVoxelClipmap {
+    v4     levels[max_voxel_levels]; // World min corner, voxel size
+    int32  level_count;
+    int32  resolution;
+    int32  pad[2];
+};
+
+// Nested cubes of voxels around the camera, each level with twice the voxel size of the one before. Levels are
+// stacked along z in one 3D image and addressed toroidally, voxel v of a level lives at v mod resolution, so following
+// the camera only revoxelizes the slabs a level scrolled over. Everything else is kept until a renderable inside it
+// changes, dirty boxes queue up and at most max_regions_per_frame of them are revoxelized each frame.
+struct VoxelClipmap {
+    constexpr static uint32 mip_count   = 3;
+    constexpr static int32  scroll_step = 1 << (mip_count - 1); // Origins stay aligned to the coarsest mip
+    static_assert(mip_count == 3, "voxel_mips.comp writes mips 1 and 2");
+
+    uint32 level_count           = 4;
+    uint32 resolution            = 128;
+    float  voxel_size            = 10.0f / 128.0f; // Of level 0
+    uint32 max_regions_per_frame = 16;
+    uint32 max_pending           = 64; // Past this new boxes are merged into pending ones
+    bool   caching               = true;
+
+    v3i                 origins[max_voxel_levels]; // Min corner of each level, in its voxels
+    bool                placed[max_voxel_levels] = {};
+    vector<VoxelRegion> pending;
+    vector<VoxelRegion> regions; // Revoxelized this frame
+    uint64              revoxelized = 0; // Voxels this frame
+    CullStats           stats;           // Summed over this frame's regions
+
+    float level_voxel_size(uint32 level) const { return voxel_size * float(1 << level); }
+    float extent() const { return level_voxel_size(level_count - 1) * resolution; }
+
+    // Scrolls the levels to stay centered on position, queueing the slabs they moved over
+    void update(const v3& position);
+    // Picks this frame's regions, after every change this frame
+    void schedule();
+    void invalidate(const BVHBounds& bounds);
+    void invalidate_all();
+
+    GPUVoxelClipmap gpu_data() const;
+    Frustum         region_frustum(const VoxelRegion& region) const;
+    // Orthographic over a whole level looking down axis
+    m44GPU          axis_vp(uint32 level, uint32 axis) const;
+
+private:
+    VoxelRegion level_region(uint32 level) const;
+    VoxelRegion clip(VoxelRegion region) const;
+    void        add_region(const VoxelRegion& region);
+};
+
+}
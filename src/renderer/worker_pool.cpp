@@ -0,0 +1,94 @@
+#include "worker_pool.hpp"
+
+#include <atomic>
+#include <tracy/Tracy.hpp>
+
+#include "general/memory.hpp"
+#include "general/math/math.hpp"
+
+namespace spellbook {
+
+WorkerPool::WorkerPool() {
+    // Leave a core for the main thread, which also takes part in parallel_for
+    uint32 worker_count = math::max(std::thread::hardware_concurrency(), 2u) - 1;
+    for (uint32 i = 0; i < worker_count; i++)
+        threads.emplace_back([this] { worker_loop(); });
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        std::scoped_lock lock(mutex);
+        stopping = true;
+    }
+    condition.notify_all();
+    for (std::thread& thread : threads)
+        thread.join();
+}
+
+void WorkerPool::enqueue(std::function<void()>&& task) {
+    {
+        std::scoped_lock lock(mutex);
+        tasks.push_back(std::move(task));
+    }
+    condition.notify_one();
+}
+
+void WorkerPool::worker_loop() {
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock lock(mutex);
+            condition.wait(lock, [this] { return stopping || !tasks.empty(); });
+            if (stopping && tasks.empty())
+                return;
+            task = std::move(tasks.front());
+            tasks.pop_front();
+        }
+        task();
+    }
+}
+
+void WorkerPool::parallel_for(uint32 count, const std::function<void(uint32)>& func) {
+    ZoneScoped;
+    if (count == 0)
+        return;
+    if (count == 1 || threads.empty()) {
+        for (uint32 i = 0; i < count; i++)
+            func(i);
+        return;
+    }
+
+    // Helpers can start after the range is finished, so the shared state has to outlive this call
+    struct Range {
+        std::atomic<uint32>                next = 0;
+        std::atomic<uint32>                done = 0;
+        uint32                             count;
+        const std::function<void(uint32)>* func;
+        std::mutex                         mutex;
+        std::condition_variable            finished;
+    };
+    auto range   = make_shared<Range>();
+    range->count = count;
+    range->func  = &func;
+
+    auto work = [](Range& range) {
+        uint32 i;
+        while ((i = range.next.fetch_add(1)) < range.count) {
+            (*range.func)(i);
+            if (range.done.fetch_add(1) + 1 == range.count) {
+                std::scoped_lock lock(range.mutex);
+                range.finished.notify_all();
+            }
+        }
+    };
+
+    uint32 helper_count = math::min(count - 1, thread_count());
+    for (uint32 i = 0; i < helper_count; i++)
+        enqueue([range, work] { work(*range); });
+    work(*range);
+
+    std::unique_lock lock(range->mutex);
+    range->finished.wait(lock, [&range] { return range->done.load() == range->count; });
+}
+
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+#include "general/vector.hpp"
+
+namespace spellbook {
+
+// Fixed set of worker threads shared by the renderer and asset pipeline. parallel_for blocks, but the calling
+// thread works through the range too, so it is safe to nest.
+struct WorkerPool {
+    vector<std::thread>               threads;
+    std::deque<std::function<void()>> tasks;
+    std::mutex                        mutex;
+    std::condition_variable           condition;
+    bool                              stopping = false;
+
+    WorkerPool();
+    ~WorkerPool();
+
+    uint32 thread_count() const { return threads.size(); }
+
+    void enqueue(std::function<void()>&& task);
+    void parallel_for(uint32 count, const std::function<void(uint32)>& func);
+
+private:
+    void worker_loop();
+};
+
+inline WorkerPool& get_worker_pool() {
+    static WorkerPool worker_pool;
+    return worker_pool;
+}
+
+}
@@ -0,0 +1,83 @@
+#version 460
+#pragma shader_stage(vertex)
+
+#include "include.glsli"
+
+layout (binding = CAMERA_BINDING) uniform CameraData {
+    mat4 vp;
+    vec4 camera_normal;
+};
+
+// DebugLineVertex, position xyz, width, RGBA8 color
+layout (binding = SPARE_BINDING_1) buffer readonly DebugLines {
+    float lines[];
+};
+
+layout (push_constant) uniform PC {
+    vec4 camera_position;
+    uint first_vertex;
+    uint vertex_count;
+};
+
+out gl_PerVertex {
+    vec4 gl_Position;
+};
+
+layout(location = 0) out VS_OUT {
+    vec3 color;
+} vout;
+
+struct LineVertex {
+    vec3 position;
+    float width;
+    vec4 color;
+};
+
+LineVertex load_vertex(uint i) {
+    uint base = (first_vertex + i) * 5;
+    LineVertex vertex;
+    vertex.position = vec3(lines[base + 0], lines[base + 1], lines[base + 2]);
+    vertex.width    = lines[base + 3];
+    vertex.color    = unpackUnorm4x8(floatBitsToUint(lines[base + 4]));
+    return vertex;
+}
+
+vec3 line_right(vec3 camera_vec, vec3 line_vec) {
+    if (dot(line_vec, line_vec) == 0.0)
+        line_vec = vec3(1.0, 0.0, 0.0);
+    return normalize(cross(camera_vec, line_vec));
+}
+
+// Each segment is 6 vertices of a quad, joints take the middle of both segments' sides like generate_formatted_line
+void main() {
+    uint segment = gl_VertexIndex / 6;
+    uint corner  = gl_VertexIndex % 6;
+    LineVertex start = load_vertex(segment);
+    LineVertex end   = load_vertex(segment + 1);
+    // Touching a separator, collapse the whole quad
+    if (start.color.a == 0.0 || end.color.a == 0.0) {
+        gl_Position = vec4(0.0);
+        vout.color  = vec3(0.0);
+        return;
+    }
+
+    bool at_end = corner == 2 || corner == 4 || corner == 5;
+    bool left   = corner == 0 || corner == 3 || corner == 5;
+    LineVertex vertex = at_end ? end : start;
+    vec3 camera_vec = normalize(vertex.position - camera_position.xyz);
+    vec3 right = line_right(camera_vec, end.position - start.position);
+
+    if (!at_end && segment > 0) {
+        LineVertex before = load_vertex(segment - 1);
+        if (before.color.a > 0.0)
+            right = normalize(right + line_right(camera_vec, start.position - before.position));
+    } else if (at_end && segment + 2 < vertex_count) {
+        LineVertex after = load_vertex(segment + 2);
+        if (after.color.a > 0.0)
+            right = normalize(right + line_right(camera_vec, after.position - end.position));
+    }
+
+    vec3 position = vertex.position + (left ? right : -right) * vertex.width;
+    vout.color  = vertex.color.rgb;
+    gl_Position = vp * vec4(position, 1.0);
+}
@@ -3,22 +3,36 @@
 
 #include "include.glsli"
 
-layout (location = 0) in vec3 vin_position;
-layout (location = 1) in vec3 vin_normal;
-layout (location = 2) in vec3 vin_tangent;
+layout (location = 0) in vec4 vin_position;
+layout (location = 1) in vec4 vin_normal;
+layout (location = 2) in vec4 vin_tangent;
 layout (location = 3) in vec3 vin_color;
 layout (location = 4) in vec2 vin_uv;
 
-layout (binding = PARTICLES_BINDING) buffer Particles {
-    uint head;
+layout (binding = PARTICLES_BINDING) buffer readonly Particles {
     Particle particles[];
 };
 
+// The draw's live particles, gl_InstanceIndex starts at its segment
+layout (binding = INSTANCE_BINDING) buffer readonly Visible {
+    uint visible[];
+};
+
+layout (binding = ID_BINDING) buffer readonly SlotEmitters {
+    uint slot_emitters[];
+};
+
+layout (binding = SPARE_BINDING_1) buffer readonly Emitters {
+    Emitter emitters[];
+};
+
 layout (binding = CAMERA_BINDING) uniform CameraData {
     mat4 vp;
 };
 
-layout(binding = SPARE_BINDING_1) uniform sampler2D color_table;
+layout(push_constant) uniform uPushConstant {
+    VertexDequant dequant;
+} pc;
 
 out gl_PerVertex {
     vec4 gl_Position;
@@ -33,7 +47,7 @@ layout(location = 0) out VS_OUT {
 } vout;
 
 void main() {
-    uint index = gl_InstanceIndex;
+    uint index = visible[gl_InstanceIndex];
     Particle particle = particles[index];
 
     float scale = particle.position_scale.w * max(smoothstep(0.0, particle.falloff, particle.life / particle.life_total), 0.001);
@@ -55,17 +69,26 @@ void main() {
         mat3 rotation = mat3(basis_1, basis_2, basis_3);
         M = M * mat4(rotation);
     }
-    vec4 h_position = M * vec4(vin_position, 1.0);
+    vec3 position, normal, tangent;
+    float tangent_sign;
+    decode_vertex(pc.dequant, vin_position, vin_normal, vin_tangent, position, normal, tangent, tangent_sign);
+
+    vec4 h_position = M * vec4(position, 1.0);
     vout.position = h_position.xyz / h_position.w;
     
     mat3 N = inverse(transpose(mat3(M)));
-    vec3 n = normalize(N * vin_normal);
-    vec3 t = normalize(N * vin_tangent);
+    vec3 n = normalize(N * normal);
+    vec3 t = normalize(N * tangent);
     t = normalize(t - dot(t, n) * n);
-    vec3 b = cross(n, t);
+    vec3 b = cross(n, t) * tangent_sign;
     vout.TBN      = mat3(t, b, n);
 
     vout.uv = vin_uv;
-    vout.color = texture(color_table, vec2(particle.color_x, 1.0 - particle.life / particle.life_total)).rgb;
+    // Colors are stored as picked, in sRGB
+    Emitter emitter = emitters[slot_emitters[index]];
+    float age = clamp(1.0 - particle.life / particle.life_total, 0.0, 1.0);
+    vec3 color1 = mix(emitter.colors[0].rgb, emitter.colors[1].rgb, age);
+    vec3 color2 = mix(emitter.colors[2].rgb, emitter.colors[3].rgb, age);
+    vout.color = srgb_to_linear(mix(color1, color2, particle.color_x));
     gl_Position = vp * h_position;
 }
\ No newline at end of file
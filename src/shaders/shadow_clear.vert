@@ -0,0 +1,8 @@
+#version 450
+#pragma shader_stage(vertex)
+
+// One triangle over the viewport at the reverse-z far plane, clears a single tile of the shadow atlas
+void main() {
+    vec2 uv = vec2((gl_VertexIndex << 1) & 2, gl_VertexIndex & 2);
+    gl_Position = vec4(uv * 2.0 - vec2(1.0), 0.0, 1.0);
+}
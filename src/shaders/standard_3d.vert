@@ -3,9 +3,9 @@
 
 #include "include.glsli"
 
-layout (location = 0) in vec3 vin_position;
-layout (location = 1) in vec3 vin_normal;
-layout (location = 2) in vec3 vin_tangent;
+layout (location = 0) in vec4 vin_position;
+layout (location = 1) in vec4 vin_normal;
+layout (location = 2) in vec4 vin_tangent;
 layout (location = 3) in vec3 vin_color;
 layout (location = 4) in vec2 vin_uv;
 
@@ -22,6 +22,14 @@ layout (binding = ID_BINDING) buffer readonly SelectionIds {
 	int selection_id[];
 };
 
+layout (binding = INSTANCE_BINDING) buffer readonly InstanceSlots {
+	uint instance_slot[];
+};
+
+layout (binding = DEQUANT_BINDING) buffer readonly Dequants {
+	VertexDequant dequant[];
+};
+
 out gl_PerVertex {
     vec4 gl_Position;
 };
@@ -36,18 +44,23 @@ layout(location = 0) out VS_OUT {
 
 
 void main() {
-    vec4 h_position = model[gl_InstanceIndex] * vec4(vin_position, 1.0);
+    uint slot = instance_slot[gl_InstanceIndex];
+    vec3 position, normal, tangent;
+    float tangent_sign;
+    decode_vertex(dequant[slot], vin_position, vin_normal, vin_tangent, position, normal, tangent, tangent_sign);
+
+    vec4 h_position = model[slot] * vec4(position, 1.0);
 	vout.position = h_position.xyz / h_position.w;
 	
-    mat3 N = transpose(inverse(mat3(model[gl_InstanceIndex])));
-	vec3 n = normalize(N * vin_normal);
-	vec3 t = normalize(N * vin_tangent);
+    mat3 N = transpose(inverse(mat3(model[slot])));
+	vec3 n = normalize(N * normal);
+	vec3 t = normalize(N * tangent);
 	t = normalize(t - dot(t, n) * n);
-	vec3 b = cross(n, t);
+	vec3 b = cross(n, t) * tangent_sign;
 	vout.TBN      = mat3(t, b, n);
     
 	vout.uv = vin_uv;
 	vout.color = vin_color;
-	vout.id = selection_id[gl_InstanceIndex];
+	vout.id = selection_id[slot];
     gl_Position = vp * h_position;
 }
@@ -34,7 +34,11 @@ void main() {
     vec2 uv = calculate_uv();
 
     fout_color = texture(s_base_color, uv) * base_color_tint;
-    vec3 normal_input = texture(s_normal, uv).rgb * 2.0 - 1.0;
+    vec4 normal_sample = texture(s_normal, uv);
+    vec3 normal_input = normal_sample.rgb * 2.0 - 1.0;
+    // BC5 normal maps only store xy and sample 0 for blue, which no tangent space normal points to
+    if (normal_sample.b == 0.0)
+        normal_input.b = sqrt(max(1.0 - dot(normal_input.rg, normal_input.rg), 0.0));
     normal_input.b /= max(roughness_metallic_normals_scale.z, 0.00001);
     fout_normal = vec4(normalize(fin.TBN * normal_input), texture(s_metallic_roughness, uv).g * roughness_metallic_normals_scale.r);
 
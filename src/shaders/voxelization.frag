@@ -2,6 +2,8 @@
 #pragma shader_stage(fragment)
 
 #include "include.glsli"
+#include "shadows.glsli"
+#include "voxel_clipmap.glsli"
 
 layout (location = 0) in VS_OUT {
     vec3 position;
@@ -16,9 +18,11 @@ layout(binding = MATERIAL_BINDING) uniform MaterialData {
     vec4 roughness_metallic_normals_scale;
 };
 
-layout (binding = ID_BINDING) uniform CameraData {
-	mat4 light_vp;
+layout (binding = ID_BINDING) uniform ShadowData {
+    mat4 cascade_vps[MAX_SHADOW_CASCADES];
+    vec4 cascade_biases;
     vec4 light_normal;
+    int cascade_count;
 };
 
 layout(binding = BASE_COLOR_BINDING) uniform sampler2D s_base_color; 
@@ -31,54 +35,29 @@ layout(binding = 8, rgba16f) uniform writeonly image3D u_target;
 layout (location = 0) out vec4 fout_color;
 
 layout(push_constant) uniform uPushConstant {
-    ivec4 resolution;
+    ivec4 region_low;
+    ivec4 region_high;
+    uint resolution;
+    uint level;
     uint pass;
+    float voxel_size;
 } pc;
 
 vec2 calculate_uv() {
     return fin.uv * roughness_metallic_normals_scale.w;
 }
 
-ivec3 get_write_coord() {
-    ivec3 coord = ivec3(
-        floor(gl_FragCoord.x),
-        floor(gl_FragCoord.y),
-        floor(gl_FragCoord.z * pc.resolution.z)
-    );
-
-    if (pc.pass == 1)
-        coord = ivec3(coord.z, coord.y, pc.resolution.x-coord.x-1);
-    if (pc.pass == 2)
-        coord = ivec3(pc.resolution.x-coord.x-1, pc.resolution.z-coord.z-1, pc.resolution.y-coord.y-1);
-
-    return coord;
-}
 float shaded() {
-    vec4 h_position_lightspace = light_vp * vec4(fin.position, 1.0);
-    vec3 position_lightspace = h_position_lightspace.xyz / h_position_lightspace.w;
-    vec2 uv = position_lightspace.xy * 0.5 + vec2(0.5);
-
-    const float maxBias = 0.02;
-    float b = length(1.0 / textureSize(s_sun_depth, 0));
-    float bias = maxBias;
-
-    if (uv.x < 0.0 || uv.x >= 1.0 || uv.y < 0.0 || uv.y >= 1.0 || position_lightspace.z < 0.01)
-    return 1.0;
-
-    float world_read_depth = texture(s_sun_depth, uv).r;
-    bias = min(bias, maxBias) + 0.001f * (1.0f - world_read_depth);
-    float world_position_depth = position_lightspace.z + bias;
-
-    float shaded_amount = world_position_depth < world_read_depth ? 0.0 : 1.0;
-    return shaded_amount;
+    return sun_shadow(s_sun_depth, cascade_vps, cascade_biases, cascade_count, fin.position);
 }
 
 void main() {
     vec2 uv = calculate_uv();
 
-    ivec3 coord = get_write_coord();
-    if (all(greaterThan(coord, ivec3(-1))) && all(lessThan(coord, pc.resolution.xyz)))
-        imageStore(u_target, coord, shaded() * abs(dot(fin.normal, light_normal.xyz)) * texture(s_base_color, uv) * base_color_tint + texture(s_emissive, uv) * emissive_tint);
+    // Only the region being revoxelized is written, the rest of the level is kept from earlier frames
+    ivec3 voxel = ivec3(floor(fin.position / pc.voxel_size));
+    if (all(greaterThanEqual(voxel, pc.region_low.xyz)) && all(lessThan(voxel, pc.region_high.xyz)))
+        imageStore(u_target, voxel_texel(int(pc.level), int(pc.resolution), voxel), shaded() * abs(dot(fin.normal, light_normal.xyz)) * texture(s_base_color, uv) * base_color_tint + texture(s_emissive, uv) * emissive_tint);
 
     fout_color = vec4(1.0);
 }
\ No newline at end of file
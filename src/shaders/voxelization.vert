@@ -2,21 +2,30 @@
 #pragma shader_stage(vertex)
 
 #include "include.glsli"
+#include "voxel_clipmap.glsli"
 
-layout (location = 0) in vec3 vin_position;
-layout (location = 1) in vec3 vin_normal;
-layout (location = 2) in vec3 vin_tangent;
+layout (location = 0) in vec4 vin_position;
+layout (location = 1) in vec4 vin_normal;
+layout (location = 2) in vec4 vin_tangent;
 layout (location = 3) in vec3 vin_color;
 layout (location = 4) in vec2 vin_uv;
 
 layout (binding = CAMERA_BINDING) uniform CameraData {
-	mat4 vp[3];
+	mat4 vp[MAX_VOXEL_LEVELS * 3];
 };
 
 layout (binding = MODEL_BINDING) buffer readonly Model {
 	mat4 model[];
 };
 
+layout (binding = INSTANCE_BINDING) buffer readonly InstanceSlots {
+	uint instance_slot[];
+};
+
+layout (binding = DEQUANT_BINDING) buffer readonly Dequants {
+	VertexDequant dequant[];
+};
+
 out gl_PerVertex {
     vec4 gl_Position;
 };
@@ -29,17 +38,25 @@ layout(location = 0) out VS_OUT {
 } vout;
 
 layout(push_constant) uniform uPushConstant {
-    ivec4 resolution;
+    ivec4 region_low;
+    ivec4 region_high;
+    uint resolution;
+    uint level;
     uint pass;
+    float voxel_size;
 } pc;
 
 void main() {
-    mat3 N = transpose(inverse(mat3(model[gl_InstanceIndex])));
+    uint slot = instance_slot[gl_InstanceIndex];
+    mat3 N = transpose(inverse(mat3(model[slot])));
+    vec3 position, normal, tangent;
+    float tangent_sign;
+    decode_vertex(dequant[slot], vin_position, vin_normal, vin_tangent, position, normal, tangent, tangent_sign);
 
-    vec4 h_position = model[gl_InstanceIndex] * vec4(vin_position, 1.0);
+    vec4 h_position = model[slot] * vec4(position, 1.0);
 	vout.position = h_position.xyz / h_position.w;
-    vout.normal = normalize(N * vin_normal);
+    vout.normal = normalize(N * normal);
 	vout.color = vin_color;
     vout.uv = vin_uv;
-    gl_Position = vp[pc.pass] * h_position;
+    gl_Position = vp[pc.level * 3 + pc.pass] * h_position;
 }
@@ -0,0 +1,278 @@
+// Headless check that the GPU driven path draws the same instances as the CPU culled one. A small scene of batched
+// instances is culled both ways, the CPU path with cull_spheres and select_lod like RenderScene::cull_instances, the
+// GPU path with cull_instances.comp, and every batch and level's drawn instances are compared. Needs no window or
+// surface, so it runs on lavapipe:
+//   VK_ICD_FILENAMES=/usr/share/vulkan/icd.d/lvp_icd.x86_64.json ctest -R gpu_cull
+
+#include <algorithm>
+#include <cstdio>
+#include <vuk/Context.hpp>
+#include <vuk/RenderGraph.hpp>
+#include <vuk/Partials.hpp>
+#include <vuk/resources/DeviceFrameResource.hpp>
+#include <VkBootstrap.h>
+
+#include "extension/fmt.hpp"
+#include "general/math/math.hpp"
+#include "general/math/matrix_math.hpp"
+
+#include "renderer/culling.hpp"
+#include "renderer/shader_cache.hpp"
+#include "renderer/assets/mesh.hpp"
+
+using namespace spellbook;
+
+struct TestBatch {
+    uint32 begin;
+    uint32 end;
+    uint32 lod_count;
+};
+
+struct TestScene {
+    CullSpheres       spheres;
+    vector<uint32>    slots; // By batched index, like RenderScene::batched_slots
+    vector<TestBatch> batches;
+    Frustum           frustum;
+    LODSelector       lods;
+};
+
+// Sorted slots per batch and level
+using DrawnInstances = vector<vector<uint32>>;
+
+static TestScene make_scene(bool lod_selection) {
+    TestScene scene;
+    // A 24x24 grid of spheres around the origin seen from one side, so some are in view, some off to the sides and some
+    // behind. Slots are spread out so a mixup between slots and batched indices shows.
+    constexpr uint32 side  = 24;
+    constexpr uint32 count = side * side;
+    scene.spheres.resize(count);
+    scene.slots.resize(count);
+    for (uint32 i = 0; i < count; i++) {
+        float x = float(i % side) * 2.5f - 29.3f;
+        float y = float(i / side) * 2.5f - 28.7f;
+        float z = float(i % 7) * 0.6f - 1.1f;
+        scene.spheres.set(i, v4(x, y, z, 0.35f + float(i % 5) * 0.3f));
+        scene.slots[i] = i * 7 + 3;
+    }
+    // Meshes without levels repeat their only one on the GPU path
+    scene.batches = {{0, 200, 1}, {200, 411, max_mesh_lods}, {411, count, 2}};
+
+    v3    camera_position = v3(-33.1f, 2.3f, 6.2f);
+    float fov             = math::PI / 3.0f;
+    m44   proj            = math::perspective(fov / 2.0f, 16.0f / 9.0f, 0.1f);
+    m44   view            = math::look(camera_position, math::normalize(v3(1.0f, 0.35f, -0.2f)), v3(0, 0, 1));
+    scene.frustum = frustum_from_vp(proj * view);
+    scene.lods    = lod_selector(camera_position, fov, lod_selection ? 0.05f : 0.0f, 1.0f);
+    return scene;
+}
+
+static DrawnInstances cull_cpu(const TestScene& scene) {
+    DrawnInstances drawn(scene.batches.size() * max_mesh_lods);
+    vector<uint32> survivors(scene.slots.size());
+    for (uint32 b = 0; b < scene.batches.size(); b++) {
+        const TestBatch& batch = scene.batches[b];
+        uint32 count = cull_spheres(scene.frustum, scene.spheres, scene.slots.data(), batch.begin, batch.end, survivors.data());
+        for (uint32 i = 0; i < count; i++) {
+            uint32 batched = (survivors[i] - 3) / 7;
+            v4     sphere  = v4(scene.spheres.x[batched], scene.spheres.y[batched], scene.spheres.z[batched], scene.spheres.radius[batched]);
+            drawn[b * max_mesh_lods + select_lod(scene.lods, sphere, batch.lod_count)].push_back(survivors[i]);
+        }
+    }
+    for (vector<uint32>& level : drawn)
+        std::sort(level.begin(), level.end());
+    return drawn;
+}
+
+static DrawnInstances cull_gpu(vuk::Allocator& allocator, vuk::Compiler& compiler, const TestScene& scene) {
+    uint32 instance_count = scene.slots.size();
+    uint32 draw_count     = scene.batches.size() * max_mesh_lods;
+    vuk::Unique<vuk::Buffer> instances = *vuk::allocate_buffer(allocator, {vuk::MemoryUsage::eCPUtoGPU, sizeof(GPUCullInstance) * instance_count, 1});
+    vuk::Unique<vuk::Buffer> draws     = *vuk::allocate_buffer(allocator, {vuk::MemoryUsage::eCPUtoGPU, sizeof(vuk::DrawIndexedIndirectCommand) * draw_count, 1});
+    vuk::Unique<vuk::Buffer> survivors = *vuk::allocate_buffer(allocator, {vuk::MemoryUsage::eGPUtoCPU, sizeof(uint32) * (1 + max_mesh_lods) * instance_count, 1});
+
+    // Laid out like RenderScene::cull_instances lays out an indirect batch
+    GPUCullInstance*                 gpu_instances = (GPUCullInstance*) instances->mapped_ptr;
+    vuk::DrawIndexedIndirectCommand* commands      = (vuk::DrawIndexedIndirectCommand*) draws->mapped_ptr;
+    for (uint32 b = 0; b < scene.batches.size(); b++) {
+        const TestBatch& batch = scene.batches[b];
+        uint32 count = batch.end - batch.begin;
+        for (uint32 i = batch.begin; i < batch.end; i++) {
+            gpu_instances[i] = {
+                .sphere = v4(scene.spheres.x[i], scene.spheres.y[i], scene.spheres.z[i], scene.spheres.radius[i]),
+                .slot   = scene.slots[i],
+                .draw   = b
+            };
+        }
+        for (uint32 lod = 0; lod < max_mesh_lods; lod++) {
+            commands[b * max_mesh_lods + lod] = {
+                .indexCount    = 36,
+                .instanceCount = 0,
+                .firstIndex    = 0,
+                .vertexOffset  = 0,
+                .firstInstance = instance_count + batch.begin * max_mesh_lods + lod * count
+            };
+        }
+    }
+
+    auto rg = std::make_shared<vuk::RenderGraph>("gpu_cull_test");
+    rg->attach_buffer("instances", *instances, vuk::eNone);
+    rg->attach_buffer("draws", *draws, vuk::eNone);
+    rg->attach_buffer("survivors", *survivors, vuk::eNone);
+    rg->add_pass({
+        .name = "cull_instances",
+        .resources = {
+            "instances"_buffer >> vuk::eComputeRead,
+            "draws"_buffer >> vuk::eComputeRW >> "draws_culled",
+            "survivors"_buffer >> vuk::eComputeWrite >> "survivors_culled"
+        },
+        .execute = [&scene, &instances, &draws, &survivors, instance_count](vuk::CommandBuffer& command_buffer) {
+            struct PC {
+                v4     planes[6];
+                uint32 plane_count;
+                uint32 instance_count;
+                uint32 pad[2];
+                v4     lod_selector;
+            } pc;
+            memcpy(pc.planes, scene.frustum.planes, sizeof(pc.planes));
+            pc.plane_count    = scene.frustum.plane_count;
+            pc.instance_count = instance_count;
+            pc.lod_selector   = v4(scene.lods.position, scene.lods.factor);
+            command_buffer
+                .bind_compute_pipeline("cull_instances")
+                .bind_buffer(0, 0, *instances)
+                .bind_buffer(0, 1, *draws)
+                .bind_buffer(0, 2, *survivors)
+                .push_constants(vuk::ShaderStageFlagBits::eCompute, 0, pc)
+                .dispatch_invocations(instance_count);
+        }
+    });
+    rg->add_pass({
+        .name = "readback",
+        .resources = {
+            "draws_culled"_buffer >> vuk::eHostRead >> "draws_read",
+            "survivors_culled"_buffer >> vuk::eHostRead >> "survivors_read"
+        }
+    });
+    std::vector<vuk::Future> futures = {vuk::Future{rg, "draws_read"}, vuk::Future{rg, "survivors_read"}};
+    vuk::wait_for_futures_explicit(allocator, compiler, futures);
+
+    // Levels past the mesh's last draw the last, the CPU path counts them there
+    DrawnInstances drawn(draw_count);
+    const uint32*  gpu_survivors = (const uint32*) survivors->mapped_ptr;
+    for (uint32 b = 0; b < scene.batches.size(); b++) {
+        for (uint32 lod = 0; lod < max_mesh_lods; lod++) {
+            const vuk::DrawIndexedIndirectCommand& command = commands[b * max_mesh_lods + lod];
+            vector<uint32>& level = drawn[b * max_mesh_lods + math::min(lod, scene.batches[b].lod_count - 1)];
+            level.insert(level.end(), gpu_survivors + command.firstInstance, gpu_survivors + command.firstInstance + command.instanceCount);
+        }
+    }
+    for (vector<uint32>& level : drawn)
+        std::sort(level.begin(), level.end());
+    return drawn;
+}
+
+static bool compare(const char* name, const DrawnInstances& cpu, const DrawnInstances& gpu, uint32 instance_count) {
+    uint32 cpu_total = 0;
+    uint32 gpu_total = 0;
+    bool   matched   = true;
+    for (uint32 i = 0; i < cpu.size(); i++) {
+        cpu_total += cpu[i].size();
+        gpu_total += gpu[i].size();
+        if (cpu[i] != gpu[i]) {
+            std::printf("%s\n", fmt_("{}: batch {} LOD {} draws {} instances on the CPU path, {} on the GPU path",
+                name, i / max_mesh_lods, i % max_mesh_lods, cpu[i].size(), gpu[i].size()).c_str());
+            matched = false;
+        }
+    }
+    // A scene that's all in or all out of view wouldn't test the culling
+    if (cpu_total == 0 || cpu_total == instance_count) {
+        std::printf("%s\n", fmt_("{}: {} of {} instances in view, the scene doesn't exercise culling", name, cpu_total, instance_count).c_str());
+        matched = false;
+    }
+    std::printf("%s\n", fmt_("{}: {} of {} instances drawn on the CPU path, {} on the GPU path, {}",
+        name, cpu_total, instance_count, gpu_total, matched ? "passed" : "FAILED").c_str());
+    return matched;
+}
+
+int main() {
+    vkb::InstanceBuilder builder;
+    auto inst_ret = builder
+        .set_app_name("gpu_cull_test")
+        .set_engine_name("spellbook")
+        .require_api_version(1, 2, 0)
+        .set_headless()
+        .build();
+    if (!inst_ret.has_value()) {
+        std::printf("No Vulkan instance: %s\n", inst_ret.error().message().c_str());
+        return 1;
+    }
+    vkb::Instance vkbinstance = inst_ret.value();
+
+    // Same features the GPU driven path asks for in Renderer, software devices are preferred so lavapipe gets picked
+    VkPhysicalDeviceFeatures vkfeatures{
+        .multiDrawIndirect         = VK_TRUE,
+        .drawIndirectFirstInstance = VK_TRUE
+    };
+    vkb::PhysicalDeviceSelector selector{vkbinstance};
+    auto phys_ret = selector
+        .set_minimum_version(1, 2)
+        .prefer_gpu_device_type(vkb::PreferredDeviceType::cpu)
+        .set_required_features(vkfeatures)
+        .add_required_extension(VK_KHR_SYNCHRONIZATION_2_EXTENSION_NAME)
+        .select();
+    if (!phys_ret.has_value()) {
+        std::printf("No suitable Vulkan device: %s\n", phys_ret.error().message().c_str());
+        return 1;
+    }
+    vkb::PhysicalDevice vkbphysical_device = phys_ret.value();
+    std::printf("%s\n", fmt_("Running on {}", vkbphysical_device.properties.deviceName).c_str());
+
+    VkPhysicalDeviceVulkan12Features vk12features{.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES};
+    vk12features.timelineSemaphore   = true;
+    vk12features.hostQueryReset      = true;
+    vk12features.bufferDeviceAddress = true; // vuk requirement
+    VkPhysicalDeviceSynchronization2FeaturesKHR sync_feat{
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SYNCHRONIZATION_2_FEATURES_KHR, .synchronization2 = true};
+    vkb::DeviceBuilder device_builder{vkbphysical_device};
+    auto dev_ret = device_builder.add_pNext(&vk12features).add_pNext(&sync_feat).build();
+    if (!dev_ret.has_value()) {
+        std::printf("No Vulkan device: %s\n", dev_ret.error().message().c_str());
+        return 1;
+    }
+    vkb::Device vkbdevice = dev_ret.value();
+
+    vuk::ContextCreateParameters::FunctionPointers fps;
+    fps.vkGetInstanceProcAddr = vkbinstance.fp_vkGetInstanceProcAddr;
+    fps.vkGetDeviceProcAddr   = vkbinstance.fp_vkGetDeviceProcAddr;
+    bool passed = true;
+    {
+        vuk::Context context(vuk::ContextCreateParameters{vkbinstance.instance,
+            vkbdevice.device,
+            vkbphysical_device.physical_device,
+            vkbdevice.get_queue(vkb::QueueType::graphics).value(),
+            vkbdevice.get_queue_index(vkb::QueueType::graphics).value(),
+            VK_NULL_HANDLE,
+            VK_QUEUE_FAMILY_IGNORED,
+            VK_NULL_HANDLE,
+            VK_QUEUE_FAMILY_IGNORED,
+            fps
+        });
+        vuk::DeviceSuperFrameResource super_frame_resource(context, 1);
+        vuk::Allocator                allocator(super_frame_resource);
+        vuk::Compiler                 compiler;
+
+        vuk::PipelineBaseCreateInfo pci;
+        get_shader_cache().add_shader(pci, "cull_instances.comp");
+        context.create_named_pipeline("cull_instances", pci);
+
+        for (bool lod_selection : {false, true}) {
+            TestScene scene = make_scene(lod_selection);
+            passed &= compare(lod_selection ? "With LODs" : "Without LODs", cull_cpu(scene), cull_gpu(allocator, compiler, scene), scene.slots.size());
+        }
+        context.wait_idle();
+    }
+
+    vkb::destroy_device(vkbdevice);
+    vkb::destroy_instance(vkbinstance);
+    return passed ? 0 : 1;
+}
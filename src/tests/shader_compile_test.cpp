@@ -0,0 +1,37 @@
+// Compiles every stage in the shader folder through shaderc from source, the same path ShaderCache takes on a first
+// launch, so a shader that doesn't build fails CTest instead of the first frame that binds its pipeline.
+//   ctest -R shader_compile
+
+#include <cstdio>
+#include <filesystem>
+
+#include "extension/fmt.hpp"
+
+#include "renderer/renderer.hpp"
+#include "renderer/shader_cache.hpp"
+
+using namespace spellbook;
+namespace fs = std::filesystem;
+
+int main() {
+    ShaderCache& cache = get_shader_cache();
+    // Nothing left over from an earlier run, so every stage is compiled rather than loaded
+    std::error_code error;
+    fs::remove_all(ShaderCache::folder().abs_path(), error);
+
+    vector<FilePath> shaders = cache.stage_shaders();
+    if (shaders.empty()) {
+        std::printf("No shader stages found under %s\n", shader_path("").abs_string().c_str());
+        return 1;
+    }
+
+    uint32 failed = 0;
+    for (const FilePath& shader : shaders) {
+        bool compiled = !cache.get_spirv(shader).empty();
+        std::printf("%s\n", fmt_("{} {}", compiled ? "ok    " : "FAILED", shader.rel_string()).c_str());
+        if (!compiled)
+            failed++;
+    }
+    std::printf("%s\n", fmt_("{} of {} shader stages compiled, {} from source", shaders.size() - failed, shaders.size(), cache.stats.compiled).c_str());
+    return failed == 0 ? 0 : 1;
+}